@@ -0,0 +1,242 @@
+#include "AllocationSampler.hpp"
+
+#include <algorithm>
+#include <unordered_set>
+#include <vector>
+
+#include <boost/format.hpp>
+
+#include "clock.hpp"
+#include "common.hpp"
+#include "jvmti.hpp"
+#include "tags.hpp"
+
+#include "ClassRegistry.hpp"
+#include "StackRegistry.hpp"
+
+using namespace std;
+using namespace jeff;
+
+static const size_t EVENT_BUFFER_CAPACITY = 64 * 1024;
+static const size_t FREE_BUFFER_CAPACITY = 64 * 1024;
+static const size_t REPORT_TOP_ENTRIES = 10;
+static const jint REPORT_STACK_DEPTH = 8;
+
+AllocationSampler::AllocationSampler(ClassRegistry &classes, StackRegistry &stacks, jint sampling_interval)
+        : classes(classes),
+          stacks(stacks),
+          sampling_interval(sampling_interval),
+          events(EVENT_BUFFER_CAPACITY),
+          frees(FREE_BUFFER_CAPACITY),
+          sequence(0),
+          reconciled_frees(0),
+          last_report_ms(monotonic_millis()) {
+    // Empty
+}
+
+AllocationSampler::~AllocationSampler() {
+    // Empty
+}
+
+jvmtiError AllocationSampler::start(jvmtiEnv &jvmti) {
+#ifdef JEFF_HAVE_SAMPLED_OBJECT_ALLOC
+    jvmtiError error;
+
+    error = jvmti.SetHeapSamplingInterval(sampling_interval);
+    if (is_jvmti_error(jvmti, error, "Cannot set heap sampling interval")) return error;
+
+    error = jvmti.SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_OBJECT_FREE, (jthread) NULL);
+    if (is_jvmti_error(jvmti, error, "Cannot set event notification: JVMTI_EVENT_OBJECT_FREE")) return error;
+
+    error = jvmti.SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_SAMPLED_OBJECT_ALLOC, (jthread) NULL);
+    if (is_jvmti_error(jvmti, error, "Cannot set event notification: JVMTI_EVENT_SAMPLED_OBJECT_ALLOC")) return error;
+
+    return JVMTI_ERROR_NONE;
+#else
+    std::cerr << "Allocation sampling requires the JDK 11 (or newer) jvmti.h\n";
+    return JVMTI_ERROR_NOT_AVAILABLE;
+#endif
+}
+
+jvmtiError AllocationSampler::stop(jvmtiEnv &jvmti) {
+#ifdef JEFF_HAVE_SAMPLED_OBJECT_ALLOC
+    jvmtiError error;
+
+    error = jvmti.SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_SAMPLED_OBJECT_ALLOC, (jthread) NULL);
+    if (is_jvmti_error(jvmti, error, "Cannot disable event notification: JVMTI_EVENT_SAMPLED_OBJECT_ALLOC")) {
+        return error;
+    }
+
+    error = jvmti.SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_OBJECT_FREE, (jthread) NULL);
+    if (is_jvmti_error(jvmti, error, "Cannot disable event notification: JVMTI_EVENT_OBJECT_FREE")) return error;
+#endif
+    return JVMTI_ERROR_NONE;
+}
+
+void AllocationSampler::set_sampling_interval(jint value) {
+    sampling_interval = value;
+}
+
+void AllocationSampler::clear() {
+    Event event;
+    while (events.pop(event)) {
+        // Discard
+    }
+    jlong freed;
+    while (frees.pop(freed)) {
+        // Discard
+    }
+    reconciled_frees = frees.dropped();
+    live.clear();
+    stats.clear();
+    last_report_ms = monotonic_millis();
+}
+
+void AllocationSampler::object_allocated(jvmtiEnv &jvmti, jthread thread, jobject object, jclass type,
+                                         jlong size) {
+    Event event;
+    event.sequence = sequence.fetch_add(1, memory_order_relaxed) + 1;
+    event.class_id = classes.get_id(jvmti, type);
+    event.stack_id = stacks.get_id(jvmti, thread);
+    event.size = size;
+
+    if (events.push(event)) {
+        /* Only objects we know about are tagged, so every free has a matching sample */
+        jvmti.SetTag(object, make_tag(TagKind::Sample, event.sequence));
+    }
+}
+
+void AllocationSampler::object_freed(jlong tag) {
+    /* A dropped free is counted by the buffer and reconciled by the next report */
+    frees.push(get_tag_value(tag));
+}
+
+void AllocationSampler::drain() {
+    /*
+     * Take the frees first: the allocation of every one of them was pushed before the
+     * object was tagged, so it is in the events by now and gets drained below.
+     */
+    vector<jlong> freed;
+    jlong freed_sequence;
+    while (frees.pop(freed_sequence)) {
+        freed.push_back(freed_sequence);
+    }
+
+    Event event;
+    while (events.pop(event)) {
+        Key key = {event.class_id, event.stack_id};
+        Sample sample = {key, event.size};
+        live[event.sequence] = sample;
+
+        Stats &entry = stats[key];
+        entry.allocated_samples++;
+        entry.allocated_bytes += event.size;
+        entry.live_samples++;
+        entry.live_bytes += event.size;
+    }
+
+    for (jlong freed_sequence : freed) {
+        auto found = live.find(freed_sequence);
+        if (found == live.end()) {
+            /* Already dropped by reconcile() */
+            continue;
+        }
+        Stats &entry = stats[found->second.key];
+        entry.live_samples--;
+        entry.live_bytes -= found->second.size;
+        live.erase(found);
+    }
+}
+
+jint JNICALL AllocationSampler::visit_object(jlong class_tag, jlong size, jlong *tag_ptr, jint length,
+                                             void *user_data) {
+    unordered_set<jlong> &tagged = *static_cast<unordered_set<jlong> *>(user_data);
+
+    if (get_tag_kind(*tag_ptr) == TagKind::Sample) {
+        tagged.insert(get_tag_value(*tag_ptr));
+    }
+    return JVMTI_VISIT_OBJECTS;
+}
+
+void AllocationSampler::reconcile(jvmtiEnv &jvmti, size_t dropped_frees) {
+    unordered_set<jlong> tagged;
+    jvmtiHeapCallbacks callbacks = jvmtiHeapCallbacks();
+    callbacks.heap_iteration_callback = &AllocationSampler::visit_object;
+    jvmtiError error = jvmti.IterateThroughHeap(JVMTI_HEAP_FILTER_UNTAGGED, nullptr, &callbacks, &tagged);
+    if (is_jvmti_error(jvmti, error, "Unable to iterate through heap")) {
+        /* Try again on the next report */
+        return;
+    }
+
+    /*
+     * The samples drained so far were tagged before the walk started, the ones the
+     * walk did not find are gone. Their frees still in the buffer find nothing.
+     */
+    for (auto it = live.begin(); it != live.end();) {
+        if (tagged.count(it->first) != 0) {
+            ++it;
+            continue;
+        }
+        Stats &entry = stats[it->second.key];
+        entry.live_samples--;
+        entry.live_bytes -= it->second.size;
+        it = live.erase(it);
+    }
+    /* A free dropped during the walk may be of an object the walk still saw, it is left for the next one */
+    reconciled_frees = dropped_frees;
+}
+
+string AllocationSampler::report(jvmtiEnv &jvmti) {
+    drain();
+    size_t dropped_frees = frees.dropped();
+    if (dropped_frees != reconciled_frees) {
+        reconcile(jvmti, dropped_frees);
+    }
+
+    jlong now = monotonic_millis();
+    double seconds = max(now - last_report_ms, (jlong) 1) / 1000.0;
+    last_report_ms = now;
+
+    jlong samples = 0;
+    jlong sampled_bytes = 0;
+    jlong live_bytes = 0;
+    vector<pair<Key, Stats>> entries;
+    for (auto &entry : stats) {
+        samples += entry.second.allocated_samples;
+        sampled_bytes += entry.second.allocated_bytes;
+        live_bytes += entry.second.live_bytes;
+        entries.push_back(entry);
+    }
+
+    size_t top = min(entries.size(), REPORT_TOP_ENTRIES);
+    partial_sort(entries.begin(), entries.begin() + top, entries.end(),
+                 [](const pair<Key, Stats> &a, const pair<Key, Stats> &b) {
+                     return a.second.live_bytes > b.second.live_bytes;
+                 });
+
+    /* Every sample stands for sampling_interval allocated bytes on average */
+    string ret = (boost::format("Allocation profile: %s samples, ~%.0f bytes/s allocated, %.0f sampled bytes/s, "
+                                        "%s sampled bytes retained, %s samples dropped, %s frees dropped\n")
+                  % samples % (samples * (double) sampling_interval / seconds) % (sampled_bytes / seconds)
+                  % live_bytes % events.dropped() % dropped_frees).str();
+
+    auto join_lines = [](string a, string b) { return a + "\n\t\t" + b; };
+    for (size_t i = 0; i < top; i++) {
+        const Key &key = entries[i].first;
+        const Stats &entry = entries[i].second;
+        string stack_trace = join(stacks.get_stack_trace(jvmti, key.stack_id, REPORT_STACK_DEPTH), join_lines);
+
+        ret += (boost::format("\t%s: %s bytes retained in %s samples, %s bytes in %s samples allocated, "
+                                      "stack #%s%s\n")
+                % classes.get_signature(key.class_id) % entry.live_bytes % entry.live_samples
+                % entry.allocated_bytes % entry.allocated_samples % key.stack_id % stack_trace).str();
+    }
+
+    /* Start the next period, forget the allocation sites with nothing left on the heap */
+    for (auto it = stats.begin(); it != stats.end();) {
+        it->second.allocated_samples = 0;
+        it->second.allocated_bytes = 0;
+        it = (it->second.live_samples <= 0) ? stats.erase(it) : ++it;
+    }
+    return ret;
+}
@@ -0,0 +1,122 @@
+#ifndef JEFF_NATIVE_AGENT_ALLOCATIONSAMPLER_HPP
+#define JEFF_NATIVE_AGENT_ALLOCATIONSAMPLER_HPP
+
+#include <jni.h>
+#include <jvmti.h>
+
+#include <atomic>
+#include <string>
+#include <unordered_map>
+
+#include <boost/noncopyable.hpp>
+
+#include "RingBuffer.hpp"
+
+class ClassRegistry;
+
+class StackRegistry;
+
+//
+// Heap allocation profiler built on JVMTI_EVENT_SAMPLED_OBJECT_ALLOC (JDK 11+).
+//
+// The JVM picks on average one allocation per sampling interval (in bytes). The
+// callback resolves the class id and the stack id, tags the sampled object and
+// puts a record into a lock-free buffer. The object tag brings the sample back in
+// JVMTI_EVENT_OBJECT_FREE, so the sampled bytes that are still live can be told
+// apart from the ones already collected.
+//
+// The frees go into a buffer of their own, so a burst of allocations cannot crowd
+// them out. A free that is dropped anyway would leave its sample live forever; when
+// any were dropped since the last report, report() walks the heap for the objects
+// still tagged as samples and forgets the samples that are no longer there.
+//
+// The buffers are drained by report() on the reporter thread, which is the only one
+// touching the aggregated statistics.
+//
+class AllocationSampler : boost::noncopyable {
+public:
+    AllocationSampler(ClassRegistry &classes, StackRegistry &stacks, jint sampling_interval);
+
+    ~AllocationSampler();
+
+    // Sets the sampling interval and enables the sampling events, requires the live phase
+    jvmtiError start(jvmtiEnv &jvmti);
+
+    jvmtiError stop(jvmtiEnv &jvmti);
+
+    // Takes effect on the next start(), must be called on the reporter thread
+    void set_sampling_interval(jint value);
+
+    // Forgets the sampled objects once their tags are cleared, must not run concurrently with report()
+    void clear();
+
+    // Called from JVMTI_EVENT_SAMPLED_OBJECT_ALLOC
+    void object_allocated(jvmtiEnv &jvmti, jthread thread, jobject object, jclass type, jlong size);
+
+    // Called from JVMTI_EVENT_OBJECT_FREE, must not call JVMTI or JNI functions
+    void object_freed(jlong tag);
+
+    // Drains the buffer and returns the allocation profile for the period since the last report
+    std::string report(jvmtiEnv &jvmti);
+
+private:
+    struct Event {
+        jlong sequence;
+        jint class_id;
+        jlong stack_id;
+        jlong size;
+    };
+
+    struct Key {
+        jint class_id;
+        jlong stack_id;
+
+        bool operator==(const Key &other) const {
+            return class_id == other.class_id && stack_id == other.stack_id;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key &key) const {
+            return std::hash<jlong>()(key.stack_id * 31 + key.class_id);
+        }
+    };
+
+    struct Sample {
+        Key key;
+        jlong size;
+    };
+
+    struct Stats {
+        jlong allocated_samples;
+        jlong allocated_bytes;
+        jlong live_samples;
+        jlong live_bytes;
+    };
+
+    void drain();
+
+    // Drops the live samples whose objects are gone, after frees were dropped
+    void reconcile(jvmtiEnv &jvmti, size_t dropped_frees);
+
+    static jint JNICALL visit_object(jlong class_tag, jlong size, jlong *tag_ptr, jint length, void *user_data);
+
+    ClassRegistry &classes;
+    StackRegistry &stacks;
+    /* Owned by the reporter thread */
+    jint sampling_interval;
+
+    RingBuffer<Event> events;
+    /* Sequences of the freed samples */
+    RingBuffer<jlong> frees;
+    std::atomic<jlong> sequence;
+
+    /* Owned by the reporter thread */
+    std::unordered_map<jlong, Sample> live;
+    /* The dropped frees counted when the heap was last walked */
+    size_t reconciled_frees;
+    std::unordered_map<Key, Stats, KeyHash> stats;
+    jlong last_report_ms;
+};
+
+#endif //JEFF_NATIVE_AGENT_ALLOCATIONSAMPLER_HPP
@@ -0,0 +1,73 @@
+#include "ClassRegistry.hpp"
+
+#include "jvmti.hpp"
+#include "tags.hpp"
+
+using namespace jeff;
+
+ClassRegistry::ClassRegistry(jvmtiEnv &jvmti, size_t capacity)
+        : lock(nullptr),
+          signatures(capacity),
+          count(0) {
+    jvmtiError error = jvmti.CreateRawMonitor("class registry", &lock);
+    check_jvmti_error(jvmti, error, "Cannot create raw monitor");
+}
+
+ClassRegistry::~ClassRegistry() {
+    // The monitor is reclaimed together with the JVMTI environment
+}
+
+jint ClassRegistry::get_id(jvmtiEnv &jvmti, jclass type) {
+    jlong tag = 0;
+    jvmtiError error = jvmti.GetTag(type, &tag);
+    if (error != JVMTI_ERROR_NONE) {
+        return 0;
+    }
+    if (tag != 0) {
+        return get_id(tag);
+    }
+
+    jint id = 0;
+    jvmti.RawMonitorEnter(lock);
+    {
+        /* Somebody could have tagged the class while we were waiting for the monitor */
+        error = jvmti.GetTag(type, &tag);
+        if (error == JVMTI_ERROR_NONE && tag != 0) {
+            id = get_id(tag);
+        } else if (error == JVMTI_ERROR_NONE && count.load() < signatures.size()) {
+            size_t index = count.load();
+            signatures[index] = get_class_signature(jvmti, type);
+            id = (jint) index + 1;
+            jvmti.SetTag(type, make_tag(TagKind::Class, id));
+            count.store(index + 1, std::memory_order_release);
+        }
+    }
+    jvmti.RawMonitorExit(lock);
+    return id;
+}
+
+jint ClassRegistry::get_id(jlong class_tag) {
+    return get_tag_kind(class_tag) == TagKind::Class ? (jint) get_tag_value(class_tag) : 0;
+}
+
+std::string ClassRegistry::get_signature(jint id) const {
+    if (id <= 0 || (size_t) id > count.load(std::memory_order_acquire)) {
+        return "<unknown class>";
+    }
+    return signatures[id - 1];
+}
+
+const std::string *ClassRegistry::find_signature(jint id) const {
+    if (id <= 0 || (size_t) id > count.load(std::memory_order_acquire)) {
+        return nullptr;
+    }
+    return &signatures[id - 1];
+}
+
+size_t ClassRegistry::size() const {
+    return count.load(std::memory_order_acquire);
+}
+
+size_t ClassRegistry::capacity() const {
+    return signatures.size();
+}
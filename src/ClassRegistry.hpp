@@ -0,0 +1,49 @@
+#ifndef JEFF_NATIVE_AGENT_CLASSREGISTRY_HPP
+#define JEFF_NATIVE_AGENT_CLASSREGISTRY_HPP
+
+#include <jni.h>
+#include <jvmti.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+//
+// Assigns small, dense ids to classes by tagging the java.lang.Class objects.
+//
+// The fast path is a single GetTag() call, only the first sighting of a class
+// takes the registry monitor to assign the id and to remember the signature.
+// Id 0 means "unknown", e.g. when the registry is full.
+//
+class ClassRegistry : boost::noncopyable {
+public:
+    ClassRegistry(jvmtiEnv &jvmti, size_t capacity);
+
+    ~ClassRegistry();
+
+    // Returns the id of the class, tagging the class if it was not seen before
+    jint get_id(jvmtiEnv &jvmti, jclass type);
+
+    // Returns the class id stored in a class tag, 0 if the tag is not a class tag
+    static jint get_id(jlong class_tag);
+
+    std::string get_signature(jint id) const;
+
+    // Same without the copy, nullptr for an unknown id
+    const std::string *find_signature(jint id) const;
+
+    // Number of assigned ids, valid ids are in [1, size()]
+    size_t size() const;
+
+    // The most ids the registry assigns
+    size_t capacity() const;
+
+private:
+    jrawMonitorID lock;
+    std::vector<std::string> signatures;
+    std::atomic<size_t> count;
+};
+
+#endif //JEFF_NATIVE_AGENT_CLASSREGISTRY_HPP
@@ -0,0 +1,59 @@
+#include "CompositeSender.hpp"
+
+#include <thread>
+
+CompositeSender::CompositeSender(std::vector<std::unique_ptr<Sender>> sinks)
+        : sinks(std::move(sinks)) {
+    // Empty
+}
+
+CompositeSender::~CompositeSender() {
+    // Empty, the sinks stop themselves
+}
+
+void CompositeSender::start() {
+    for (auto &sink : sinks) {
+        sink->set_command_handler(command_handler);
+        sink->start();
+    }
+}
+
+void CompositeSender::stop() {
+    for (auto &sink : sinks) {
+        sink->stop();
+    }
+}
+
+void CompositeSender::flush() {
+    for (auto &sink : sinks) {
+        sink->flush();
+    }
+}
+
+void CompositeSender::send(Payload payload, MessageType type) {
+    for (auto &sink : sinks) {
+        sink->send(payload, type);
+    }
+}
+
+std::string CompositeSender::drain(std::chrono::steady_clock::time_point deadline) {
+    std::vector<std::string> results(sinks.size());
+    std::vector<std::thread> drains;
+    for (size_t i = 0; i < sinks.size(); i++) {
+        drains.emplace_back([this, i, deadline, &results]() { results[i] = sinks[i]->drain(deadline); });
+    }
+    std::string drained;
+    for (size_t i = 0; i < sinks.size(); i++) {
+        drains[i].join();
+        drained += results[i];
+    }
+    return drained;
+}
+
+std::string CompositeSender::get_statistics() {
+    std::string statistics;
+    for (auto &sink : sinks) {
+        statistics += sink->get_statistics();
+    }
+    return statistics;
+}
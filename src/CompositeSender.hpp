@@ -0,0 +1,42 @@
+#ifndef JEFF_NATIVE_AGENT_COMPOSITESENDER_HPP
+#define JEFF_NATIVE_AGENT_COMPOSITESENDER_HPP
+
+#include <memory>
+#include <vector>
+
+#include "Sender.hpp"
+
+//
+// Sends every message to several sinks, e.g. the daemon and a local file.
+//
+// The message is encoded once and the payload is shared by the sinks. Each sink
+// has its own queue and thread, so a stalled sink only fills (and drops from) its
+// own queue and never holds up the others or the Java threads.
+//
+class CompositeSender : public Sender {
+public:
+    explicit CompositeSender(std::vector<std::unique_ptr<Sender>> sinks);
+
+    ~CompositeSender();
+
+    // Starts the sinks, the command handler is passed to all of them
+    void start();
+
+    void stop();
+
+    void flush();
+
+    // The sinks are drained in parallel, a slow one does not take the time of the others
+    std::string drain(std::chrono::steady_clock::time_point deadline);
+
+    using Sender::send;
+
+    void send(Payload payload, MessageType type);
+
+    std::string get_statistics();
+
+private:
+    std::vector<std::unique_ptr<Sender>> sinks;
+};
+
+#endif //JEFF_NATIVE_AGENT_COMPOSITESENDER_HPP
@@ -0,0 +1,392 @@
+#include "EmergencyCapture.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "clock.hpp"
+#include "jni.hpp"
+#include "jvmti.hpp"
+#include "ClassRegistry.hpp"
+#include "TscClock.hpp"
+
+using namespace jeff;
+
+/* The arena takes a whole thread dump line and a few more */
+static const size_t MIN_RESERVE_BYTES = 64 * 1024;
+
+static const jint MAX_DEPTH = 128;
+
+/* How long the exhausted thread waits for the capture before the VM goes on */
+static const jlong CAPTURE_TIMEOUT_MS = 10000;
+
+static const jlong STOP_TIMEOUT_MS = 1000;
+
+/* The names of get_thread_state(), without a string */
+static const char *get_state_name(jint state) {
+    if (state & JVMTI_THREAD_STATE_TERMINATED) {
+        return "TERMINATED";
+    }
+    if (!(state & JVMTI_THREAD_STATE_ALIVE)) {
+        return "NEW";
+    }
+    if (state & JVMTI_THREAD_STATE_BLOCKED_ON_MONITOR_ENTER) {
+        return "BLOCKED";
+    } else if (state & JVMTI_THREAD_STATE_SLEEPING) {
+        return "SLEEPING";
+    } else if (state & JVMTI_THREAD_STATE_IN_OBJECT_WAIT) {
+        return "WAITING (on object monitor)";
+    } else if (state & JVMTI_THREAD_STATE_PARKED) {
+        return "WAITING (parking)";
+    } else if (state & JVMTI_THREAD_STATE_WAITING) {
+        return "WAITING";
+    }
+    return "RUNNABLE";
+}
+
+static const char *get_exhausted_name(jint flags) {
+    if (flags & JVMTI_RESOURCE_EXHAUSTED_THREADS) {
+        return "Exhausted threads";
+    } else if (flags & JVMTI_RESOURCE_EXHAUSTED_JAVA_HEAP) {
+        return "Exhausted Java Heap";
+    } else if (flags & JVMTI_RESOURCE_EXHAUSTED_OOM_ERROR) {
+        return "Out Of Memory Error";
+    }
+    return "Unknown";
+}
+
+EmergencyCapture::EmergencyCapture(const std::string path, size_t reserve_bytes, ClassRegistry &classes,
+                                   size_t top)
+        : path(path),
+          classes(classes),
+          top(top),
+          file(-1),
+          arena(std::max(reserve_bytes, MIN_RESERVE_BYTES), '\0'),
+          arena_used(0),
+          counts(classes.capacity() + 1, 0),
+          bytes(classes.capacity() + 1, 0),
+          order(classes.capacity() + 1, 0),
+          lock(nullptr),
+          triggered(false),
+          requested(false),
+          done(false),
+          stopped(false),
+          running(false),
+          flags(0) {
+    description[0] = '\0';
+}
+
+EmergencyCapture::~EmergencyCapture() {
+    if (file >= 0) {
+        close(file);
+    }
+}
+
+jvmtiError EmergencyCapture::start(jvmtiEnv &jvmti, JNIEnv &jni) {
+    jvmtiError error;
+    if (lock == nullptr) {
+        error = jvmti.CreateRawMonitor("emergency capture", &lock);
+        if (is_jvmti_error(jvmti, error, "Cannot create raw monitor")) return error;
+    }
+    if (file < 0) {
+        file = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (file < 0) {
+            std::cerr << "Cannot open the emergency capture file '" << path << "'\n";
+            return JVMTI_ERROR_INTERNAL;
+        }
+    }
+
+    jvmti.RawMonitorEnter(lock);
+    {
+        /* A thread that did not stop in time may be in a capture, a new one would run next to it */
+        jlong deadline_ms = monotonic_millis() + STOP_TIMEOUT_MS;
+        while (running && monotonic_millis() < deadline_ms) {
+            jvmti.RawMonitorWait(lock, std::max(deadline_ms - monotonic_millis(), (jlong) 1));
+        }
+        if (running) {
+            jvmti.RawMonitorExit(lock);
+            std::cerr << "Emergency capture thread is still running, it is not started again\n";
+            return JVMTI_ERROR_INVALID_THREAD;
+        }
+        stopped = false;
+        running = true;
+    }
+    jvmti.RawMonitorExit(lock);
+
+    jobject thread = new_thread(jni, "jeff-emergency");
+    error = jvmti.RunAgentThread(thread, &EmergencyCapture::run, this, JVMTI_THREAD_MAX_PRIORITY);
+    jni.DeleteLocalRef(thread);
+    if (is_jvmti_error(jvmti, error, "Cannot start emergency capture thread")) {
+        jvmti.RawMonitorEnter(lock);
+        running = false;
+        jvmti.RawMonitorExit(lock);
+        return error;
+    }
+
+    error = jvmti.SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_RESOURCE_EXHAUSTED, (jthread) NULL);
+    if (is_jvmti_error(jvmti, error, "Cannot set event notification: JVMTI_EVENT_RESOURCE_EXHAUSTED")) return error;
+    return JVMTI_ERROR_NONE;
+}
+
+void EmergencyCapture::stop(jvmtiEnv &jvmti) {
+    stop(jvmti, monotonic_millis() + STOP_TIMEOUT_MS);
+}
+
+void EmergencyCapture::stop(jvmtiEnv &jvmti, jlong deadline_ms) {
+    if (lock == nullptr) {
+        return;
+    }
+    jvmti.SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_RESOURCE_EXHAUSTED, (jthread) NULL);
+
+    /* A capture in progress is not waited for long, the VM is going away anyway */
+    jvmti.RawMonitorEnter(lock);
+    {
+        stopped = true;
+        jvmti.RawMonitorNotifyAll(lock);
+
+        while (running && monotonic_millis() < deadline_ms) {
+            jvmti.RawMonitorWait(lock, std::max(deadline_ms - monotonic_millis(), (jlong) 1));
+        }
+    }
+    jvmti.RawMonitorExit(lock);
+}
+
+bool EmergencyCapture::capture(jvmtiEnv &jvmti, jint flags, const char *description) {
+    if (lock == nullptr || triggered.exchange(true)) {
+        return false;
+    }
+
+    bool captured = false;
+    jvmti.RawMonitorEnter(lock);
+    if (running && !stopped) {
+        this->flags = flags;
+        std::snprintf(this->description, sizeof(this->description), "%s", description != nullptr ? description : "");
+        requested = true;
+        jvmti.RawMonitorNotifyAll(lock);
+
+        jlong deadline = monotonic_millis() + CAPTURE_TIMEOUT_MS;
+        while (!done && running && monotonic_millis() < deadline) {
+            jvmti.RawMonitorWait(lock, deadline - monotonic_millis());
+        }
+        captured = done;
+    }
+    jvmti.RawMonitorExit(lock);
+    return captured;
+}
+
+void JNICALL EmergencyCapture::run(jvmtiEnv *jvmti, JNIEnv *jni, void *arg) {
+    static_cast<EmergencyCapture *>(arg)->loop(*jvmti, *jni);
+}
+
+void EmergencyCapture::loop(jvmtiEnv &jvmti, JNIEnv &jni) {
+    jvmti.RawMonitorEnter(lock);
+    while (!stopped) {
+        if (!requested || done) {
+            jvmti.RawMonitorWait(lock, 0);
+            continue;
+        }
+
+        jvmti.RawMonitorExit(lock);
+        write_capture(jvmti, jni);
+        jvmti.RawMonitorEnter(lock);
+        done = true;
+        jvmti.RawMonitorNotifyAll(lock);
+    }
+    running = false;
+    jvmti.RawMonitorNotifyAll(lock);
+    jvmti.RawMonitorExit(lock);
+}
+
+void EmergencyCapture::write_capture(jvmtiEnv &jvmti, JNIEnv &jni) {
+    append_format("Emergency capture: %s, %s\n\tTime: %lld\n",
+                  get_exhausted_name(flags), description, (long long) TscClock::nanos());
+    /* The stacks first, they are on the disk even when the heap walk does not finish */
+    write_threads(jvmti, jni);
+    write_arena();
+    write_histogram(jvmti, jni);
+    append("\n");
+    write_arena();
+}
+
+void EmergencyCapture::write_threads(jvmtiEnv &jvmti, JNIEnv &jni) {
+    jint count = 0;
+    jthread *threads = nullptr;
+    jvmtiError error = jvmti.GetAllThreads(&count, &threads);
+    if (error != JVMTI_ERROR_NONE) {
+        append_format("\tThread dump: unable to get all threads, JVMTI error %d\n", (int) error);
+        return;
+    }
+
+    jvmtiStackInfo *stacks = nullptr;
+    error = jvmti.GetThreadListStackTraces(count, threads, MAX_DEPTH, &stacks);
+    if (error != JVMTI_ERROR_NONE) {
+        append_format("\tThread dump: unable to get the stack traces of %d threads, JVMTI error %d\n",
+                      (int) count, (int) error);
+    } else {
+        append_format("\tThread dump: %d threads\n", (int) count);
+        for (jint i = 0; i < count; i++) {
+            const jvmtiStackInfo &stack = stacks[i];
+            jvmtiThreadInfo info = jvmtiThreadInfo();
+            bool named = jvmti.GetThreadInfo(stack.thread, &info) == JVMTI_ERROR_NONE && info.name != nullptr;
+            append_format("\t\"%s\" %s%s%s\n", named ? info.name : "<unknown>", get_state_name(stack.state),
+                          (stack.state & JVMTI_THREAD_STATE_SUSPENDED) ? ", suspended" : "",
+                          (stack.state & JVMTI_THREAD_STATE_IN_NATIVE) ? ", in native" : "");
+            if (named) {
+                jvmti.Deallocate((unsigned char *) info.name);
+            }
+            if (info.thread_group != nullptr) {
+                jni.DeleteLocalRef(info.thread_group);
+            }
+            if (info.context_class_loader != nullptr) {
+                jni.DeleteLocalRef(info.context_class_loader);
+            }
+            for (jint j = 0; j < stack.frame_count; j++) {
+                write_frame(jvmti, stack.frame_buffer[j]);
+            }
+        }
+        jvmti.Deallocate((unsigned char *) stacks);
+    }
+
+    for (jint i = 0; i < count; i++) {
+        jni.DeleteLocalRef(threads[i]);
+    }
+    jvmti.Deallocate((unsigned char *) threads);
+}
+
+void EmergencyCapture::write_frame(jvmtiEnv &jvmti, const jvmtiFrameInfo &frame) {
+    char *name = nullptr;
+    char *signature = nullptr;
+    char *class_signature = nullptr;
+    jclass type = nullptr;
+    if (jvmti.GetMethodName(frame.method, &name, &signature, nullptr) == JVMTI_ERROR_NONE
+        && jvmti.GetMethodDeclaringClass(frame.method, &type) == JVMTI_ERROR_NONE) {
+        jvmti.GetClassSignature(type, &class_signature, nullptr);
+    }
+
+    /* The location is the bytecode index, the line number table would take more memory */
+    if (name != nullptr && signature != nullptr && class_signature != nullptr) {
+        if (frame.location < 0) {
+            append_format("\t\tat %s#%s%s [native]\n", class_signature, name, signature);
+        } else {
+            append_format("\t\tat %s#%s%s [bci %lld]\n", class_signature, name, signature, (long long) frame.location);
+        }
+    } else {
+        append_format("\t\tat <method %p> [%lld]\n", (void *) frame.method, (long long) frame.location);
+    }
+
+    jvmti.Deallocate((unsigned char *) name);
+    jvmti.Deallocate((unsigned char *) signature);
+    jvmti.Deallocate((unsigned char *) class_signature);
+}
+
+jint JNICALL EmergencyCapture::count_object(jlong class_tag, jlong size, jlong *tag_ptr, jint length,
+                                            void *user_data) {
+    EmergencyCapture &capture = *static_cast<EmergencyCapture *>(user_data);
+    size_t id = (size_t) ClassRegistry::get_id(class_tag);
+    if (id >= capture.counts.size()) {
+        /* Tagged after the tables were sized, accounted to the untagged classes */
+        id = 0;
+    }
+    capture.counts[id]++;
+    capture.bytes[id] += size;
+    return JVMTI_VISIT_OBJECTS;
+}
+
+void EmergencyCapture::write_histogram(jvmtiEnv &jvmti, JNIEnv &jni) {
+    jlong started = TscClock::nanos();
+
+    /* The registry allocates the signatures, which the native memory may not have */
+    if (flags & JVMTI_RESOURCE_EXHAUSTED_JAVA_HEAP) {
+        jint class_count = 0;
+        jclass *loaded_classes = nullptr;
+        if (jvmti.GetLoadedClasses(&class_count, &loaded_classes) == JVMTI_ERROR_NONE) {
+            for (jint i = 0; i < class_count; i++) {
+                classes.get_id(jvmti, loaded_classes[i]);
+                jni.DeleteLocalRef(loaded_classes[i]);
+            }
+            jvmti.Deallocate((unsigned char *) loaded_classes);
+        }
+    }
+
+    std::fill(counts.begin(), counts.end(), 0);
+    std::fill(bytes.begin(), bytes.end(), 0);
+    jvmtiHeapCallbacks callbacks = jvmtiHeapCallbacks();
+    callbacks.heap_iteration_callback = &EmergencyCapture::count_object;
+    jvmtiError error = jvmti.IterateThroughHeap(0, nullptr, &callbacks, this);
+    if (error != JVMTI_ERROR_NONE) {
+        append_format("\tHeap histogram: unable to iterate through heap, JVMTI error %d\n", (int) error);
+        return;
+    }
+
+    size_t used = 0;
+    jlong total_count = 0;
+    jlong total_bytes = 0;
+    for (size_t id = 0; id < counts.size(); id++) {
+        if (counts[id] > 0) {
+            order[used++] = (jint) id;
+            total_count += counts[id];
+            total_bytes += bytes[id];
+        }
+    }
+    size_t n = std::min(top, used);
+    std::partial_sort(order.begin(), order.begin() + n, order.begin() + used,
+                      [this](jint a, jint b) { return bytes[a] > bytes[b]; });
+
+    append_format("\tHeap histogram: %lld objects, %lld bytes, %d classes, took %.3f ms\n\t\ttop by bytes:\n",
+                  (long long) total_count, (long long) total_bytes, (int) used,
+                  (TscClock::nanos() - started) / 1e6);
+    for (size_t i = 0; i < n; i++) {
+        jint id = order[i];
+        const std::string *signature = classes.find_signature(id);
+        append_format("\t\t%12lld bytes %10lld objects  %s\n", (long long) bytes[id], (long long) counts[id],
+                      signature != nullptr ? signature->c_str() : "<untagged classes>");
+    }
+}
+
+void EmergencyCapture::append(const char *text) {
+    append_format("%s", text);
+}
+
+void EmergencyCapture::append_format(const char *format, ...) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        size_t available = arena.size() - arena_used;
+        va_list args;
+        va_start(args, format);
+        int length = std::vsnprintf(&arena[arena_used], available, format, args);
+        va_end(args);
+        if (length < 0) {
+            return;
+        }
+        if ((size_t) length < available) {
+            arena_used += (size_t) length;
+            return;
+        }
+        /* A line longer than the whole arena is cut */
+        if (arena_used == 0) {
+            arena_used = available - 1;
+            return;
+        }
+        write_arena();
+    }
+}
+
+void EmergencyCapture::write_arena() {
+    size_t written = 0;
+    while (file >= 0 && written < arena_used) {
+        auto result = write(file, &arena[written], (unsigned int) (arena_used - written));
+        if (result <= 0) {
+            break;
+        }
+        written += (size_t) result;
+    }
+    arena_used = 0;
+}
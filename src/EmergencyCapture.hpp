@@ -0,0 +1,106 @@
+#ifndef JEFF_NATIVE_AGENT_EMERGENCYCAPTURE_HPP
+#define JEFF_NATIVE_AGENT_EMERGENCYCAPTURE_HPP
+
+#include <jni.h>
+#include <jvmti.h>
+
+#include <atomic>
+#include <cstdarg>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+class ClassRegistry;
+
+//
+// Captures the stacks of all threads and a heap class histogram when the VM runs out of
+// Java heap, native memory or threads (JVMTI_EVENT_RESOURCE_EXHAUSTED), the diagnostics
+// that are otherwise lost with the VM.
+//
+// Nothing the capture needs is allocated then: the arena the records are formatted in,
+// the histogram tables and the file are set up front, and the capture runs on an agent
+// thread started with the agent, as a new thread may not be available. The callback wakes
+// it up and waits a while for it, so the capture is on the disk before the OutOfMemoryError
+// is thrown. The stacks of all threads come from one GetThreadListStackTraces call, the
+// records are formatted into the arena with snprintf and appended to the file with plain
+// writes, the arena is written out whenever it is full. The memory JVMTI allocates for
+// its results is the only one the capture asks for, what it fails to get is left out.
+//
+// The histogram reports the classes by their ClassRegistry ids; when the Java heap is
+// exhausted (the native memory is not) the loaded classes are tagged first, otherwise
+// the classes the agent did not see yet are counted together as untagged.
+//
+// Only the first exhaustion is captured.
+//
+class EmergencyCapture : boost::noncopyable {
+public:
+    // The arena and the tables are allocated (and touched) here
+    EmergencyCapture(const std::string path, size_t reserve_bytes, ClassRegistry &classes, size_t top);
+
+    ~EmergencyCapture();
+
+    // Opens the file, starts the agent thread and enables the exhaustion events, requires the live phase; waits
+    // a while for the thread of a previous start that did not stop in time, an error if it is still running
+    jvmtiError start(jvmtiEnv &jvmti, JNIEnv &jni);
+
+    void stop(jvmtiEnv &jvmti);
+
+    // Same, waiting at most until the deadline (monotonic_millis()) for a capture in progress
+    void stop(jvmtiEnv &jvmti, jlong deadline_ms);
+
+    // Called from JVMTI_EVENT_RESOURCE_EXHAUSTED, waits a while for the capture; false when it did not
+    // run (e.g. it was done before) or did not finish in time
+    bool capture(jvmtiEnv &jvmti, jint flags, const char *description);
+
+    const std::string &get_path() const {
+        return path;
+    }
+
+private:
+    static void JNICALL run(jvmtiEnv *jvmti, JNIEnv *jni, void *arg);
+
+    void loop(jvmtiEnv &jvmti, JNIEnv &jni);
+
+    void write_capture(jvmtiEnv &jvmti, JNIEnv &jni);
+
+    void write_threads(jvmtiEnv &jvmti, JNIEnv &jni);
+
+    void write_frame(jvmtiEnv &jvmti, const jvmtiFrameInfo &frame);
+
+    void write_histogram(jvmtiEnv &jvmti, JNIEnv &jni);
+
+    static jint JNICALL count_object(jlong class_tag, jlong size, jlong *tag_ptr, jint length, void *user_data);
+
+    /* The records are formatted into the arena, a line that does not fit writes it out first */
+
+    void append(const char *text);
+
+    void append_format(const char *format, ...);
+
+    void write_arena();
+
+    const std::string path;
+    ClassRegistry &classes;
+    const size_t top;
+    int file;
+
+    std::vector<char> arena;
+    size_t arena_used;
+    /* Indexed by class id, 0 counts the classes without one */
+    std::vector<jlong> counts;
+    std::vector<jlong> bytes;
+    std::vector<jint> order;
+
+    jrawMonitorID lock;
+    std::atomic<bool> triggered;
+    /* Guarded by the lock */
+    bool requested;
+    bool done;
+    bool stopped;
+    bool running;
+    jint flags;
+    char description[256];
+};
+
+#endif //JEFF_NATIVE_AGENT_EMERGENCYCAPTURE_HPP
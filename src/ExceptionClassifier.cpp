@@ -0,0 +1,167 @@
+#include "ExceptionClassifier.hpp"
+
+#include <algorithm>
+
+#include <boost/format.hpp>
+
+#include "common.hpp"
+#include "ClassRegistry.hpp"
+
+using namespace std;
+using namespace jeff;
+
+/* Classes in the report */
+static const size_t REPORT_TOP = 20;
+
+/* The catch frames are looked up in one GetStackTrace call */
+static const jint MAX_CATCH_FRAMES = 64;
+
+const char *get_catch_site_name(CatchSite site) {
+    switch (site) {
+        case CatchSite::UNCAUGHT:
+            return "uncaught";
+        case CatchSite::LOCAL:
+            return "local";
+        case CatchSite::NEAR:
+            return "near";
+        case CatchSite::FAR:
+            return "far";
+    }
+    return "unknown";
+}
+
+ExceptionClassifier::ExceptionClassifier(ClassRegistry &classes, size_t capacity, jint catch_frames,
+                                         jint near_depth, std::vector<Rule> rules)
+        : classes(classes),
+          capacity(capacity),
+          catch_frames(std::min(std::max(catch_frames, (jint) 1), MAX_CATCH_FRAMES)),
+          near_depth(near_depth),
+          rules(std::move(rules)),
+          counts(new std::atomic<uint64_t>[(capacity + 1) * CATCH_SITE_COUNT]),
+          rule_depths(new std::atomic<jint>[capacity + 1]) {
+    for (size_t i = 0; i < (capacity + 1) * CATCH_SITE_COUNT; i++) {
+        counts[i].store(0, std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i <= capacity; i++) {
+        rule_depths[i].store(UNRESOLVED, std::memory_order_relaxed);
+    }
+}
+
+ExceptionClassifier::~ExceptionClassifier() {
+    // Empty
+}
+
+CatchSite ExceptionClassifier::classify(jvmtiEnv &jvmti, jthread thread, jmethodID method, jmethodID catch_method) {
+    if (catch_method == nullptr) {
+        return CatchSite::UNCAUGHT;
+    }
+
+    /*
+     * The event tells the method of the handler but not its frame: a recursive method may be caught by one
+     * of its callers and still count as local. Telling them apart takes a stack walk on the most common
+     * path, and within the catch frames it would only move the exception to near, captured at the same depth.
+     */
+    if (catch_method == method) {
+        return CatchSite::LOCAL;
+    }
+
+    /* The frame 0 is the throwing method, the handler is in one of its callers */
+    jvmtiFrameInfo frames[MAX_CATCH_FRAMES + 1];
+    jint count = 0;
+    jvmtiError error = jvmti.GetStackTrace(thread, 0, catch_frames + 1, frames, &count);
+    if (error == JVMTI_ERROR_NONE) {
+        for (jint i = 1; i < count; i++) {
+            if (frames[i].method == catch_method) {
+                return CatchSite::NEAR;
+            }
+        }
+    }
+    return CatchSite::FAR;
+}
+
+jint ExceptionClassifier::count(jint class_id, CatchSite site) {
+    size_t index = (class_id > 0 && (size_t) class_id <= capacity) ? (size_t) class_id : 0;
+    counts[index * CATCH_SITE_COUNT + (size_t) site].fetch_add(1, std::memory_order_relaxed);
+
+    jint depth = get_rule_depth((jint) index);
+    if (depth != NO_RULE) {
+        return depth;
+    }
+    return (site == CatchSite::LOCAL || site == CatchSite::NEAR) ? near_depth : FULL_DEPTH;
+}
+
+jint ExceptionClassifier::get_catch_frames() const {
+    return catch_frames;
+}
+
+jint ExceptionClassifier::get_rule_depth(jint class_id) {
+    jint depth = rule_depths[class_id].load(std::memory_order_relaxed);
+    if (depth != UNRESOLVED) {
+        return depth;
+    }
+
+    /* Resolved by any thread that sees the class first, they all get the same result */
+    depth = NO_RULE;
+    if (class_id > 0) {
+        string signature = classes.get_signature(class_id);
+        for (const Rule &rule : rules) {
+            if (matches_signature_pattern(signature, rule.pattern)) {
+                depth = rule.depth;
+                break;
+            }
+        }
+    }
+    rule_depths[class_id].store(depth, std::memory_order_relaxed);
+    return depth;
+}
+
+std::string ExceptionClassifier::report() {
+    typedef std::array<uint64_t, CATCH_SITE_COUNT> Counts;
+
+    size_t size = std::min(classes.size(), capacity) + 1;
+    reported.resize(std::max(reported.size(), size), Counts());
+
+    std::vector<std::pair<jint, Counts>> deltas;
+    uint64_t total = 0;
+    for (size_t id = 0; id < size; id++) {
+        Counts delta = Counts();
+        uint64_t sum = 0;
+        for (size_t site = 0; site < CATCH_SITE_COUNT; site++) {
+            uint64_t value = counts[id * CATCH_SITE_COUNT + site].load(std::memory_order_relaxed);
+            delta[site] = value - reported[id][site];
+            reported[id][site] = value;
+            sum += delta[site];
+        }
+        if (sum > 0) {
+            deltas.emplace_back((jint) id, delta);
+            total += sum;
+        }
+    }
+    if (total == 0) {
+        return "";
+    }
+
+    auto sum = [](const Counts &counts) {
+        uint64_t value = 0;
+        for (uint64_t count : counts) {
+            value += count;
+        }
+        return value;
+    };
+    std::sort(deltas.begin(), deltas.end(), [&sum](const std::pair<jint, Counts> &a,
+                                                   const std::pair<jint, Counts> &b) {
+        return sum(a.second) > sum(b.second);
+    });
+
+    string result = (boost::format("Exception counts: %d exceptions of %d classes\n") % total % deltas.size()).str();
+    for (size_t i = 0; i < std::min(deltas.size(), REPORT_TOP); i++) {
+        const std::pair<jint, Counts> &entry = deltas[i];
+        string signature = (entry.first > 0) ? classes.get_signature(entry.first) : "unknown";
+        result += (boost::format("\t%s: %d %s, %d %s, %d %s, %d %s\n") % signature
+                   % entry.second[0] % get_catch_site_name(CatchSite::UNCAUGHT)
+                   % entry.second[1] % get_catch_site_name(CatchSite::LOCAL)
+                   % entry.second[2] % get_catch_site_name(CatchSite::NEAR)
+                   % entry.second[3] % get_catch_site_name(CatchSite::FAR)).str();
+    }
+    return result;
+}
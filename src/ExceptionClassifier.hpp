@@ -0,0 +1,98 @@
+#ifndef JEFF_NATIVE_AGENT_EXCEPTIONCLASSIFIER_HPP
+#define JEFF_NATIVE_AGENT_EXCEPTIONCLASSIFIER_HPP
+
+#include <jni.h>
+#include <jvmti.h>
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+class ClassRegistry;
+
+// Where a thrown exception is going to be caught
+enum class CatchSite {
+    /* No handler, the thread dies */
+    UNCAUGHT = 0,
+    /* By the throwing method, or by a recursive caller of it (the event does not tell the frame) */
+    LOCAL = 1,
+    /* By one of the callers within the catch frames */
+    NEAR = 2,
+    /* Further up, e.g. by a framework handler */
+    FAR = 3
+};
+
+static const size_t CATCH_SITE_COUNT = 4;
+
+const char *get_catch_site_name(CatchSite site);
+
+//
+// Classifies the exceptions by their catch site before any other work is done, and
+// decides how much of an exception is captured.
+//
+// JVMTI_EVENT_EXCEPTION already tells the catch method, so an uncaught or a locally
+// caught exception costs nothing to classify, the other ones a GetStackTrace of the
+// catch frames. The event does not tell the frame of the handler: a recursive method
+// caught by one of its callers counts as local, and is captured at the near depth.
+// Every exception is counted per class and catch site with an atomic increment, the
+// counts are reported periodically.
+//
+// The capture depth comes from the first rule that matches the class, then from the
+// near depth for the exceptions caught locally or near, else the whole stack is
+// captured. Depth 0 means the exception is only counted, which is meant for the
+// common exceptions that are thrown and swallowed right away. The rules are matched
+// once per class, the result is cached by the class id.
+//
+class ExceptionClassifier : boost::noncopyable {
+public:
+    /* The whole stack trace */
+    static const jint FULL_DEPTH = -1;
+
+    // A signature pattern (see to_signature_pattern) and its capture depth
+    struct Rule {
+        std::string pattern;
+        jint depth;
+    };
+
+    ExceptionClassifier(ClassRegistry &classes, size_t capacity, jint catch_frames, jint near_depth,
+                        std::vector<Rule> rules);
+
+    ~ExceptionClassifier();
+
+    // Called from JVMTI_EVENT_EXCEPTION
+    CatchSite classify(jvmtiEnv &jvmti, jthread thread, jmethodID method, jmethodID catch_method);
+
+    // Counts the exception and returns the stack depth to capture, 0 means none
+    jint count(jint class_id, CatchSite site);
+
+    jint get_catch_frames() const;
+
+    // The counts per class since the last report, empty when there were no exceptions
+    std::string report();
+
+private:
+    /* Not resolved yet, and no rule for the class */
+    static const jint UNRESOLVED = -3;
+    static const jint NO_RULE = -2;
+
+    jint get_rule_depth(jint class_id);
+
+    ClassRegistry &classes;
+    const size_t capacity;
+    const jint catch_frames;
+    const jint near_depth;
+    const std::vector<Rule> rules;
+
+    /* Indexed by the class id, 0 is for the unknown classes */
+    std::unique_ptr<std::atomic<uint64_t>[]> counts;
+    std::unique_ptr<std::atomic<jint>[]> rule_depths;
+
+    /* Owned by the reporter thread */
+    std::vector<std::array<uint64_t, CATCH_SITE_COUNT>> reported;
+};
+
+#endif //JEFF_NATIVE_AGENT_EXCEPTIONCLASSIFIER_HPP
@@ -0,0 +1,147 @@
+#include "FileSender.hpp"
+
+#include <chrono>
+
+#include <boost/format.hpp>
+
+static const long FLUSH_TIMEOUT_MS = 5000;
+
+FileSender::FileSender(const std::string path, const SenderConfig &config)
+        : path(path),
+          buffer_bytes(config.buffer_bytes),
+          queued_bytes(0),
+          writing_bytes(0),
+          stopped(false),
+          abandoned(false),
+          written_bytes(0),
+          failed_bytes(0),
+          written_messages(0),
+          failed_messages(0) {
+    for (size_t i = 0; i < MESSAGE_TYPE_COUNT; i++) {
+        dropped_messages[i] = 0;
+        dropped_bytes[i] = 0;
+    }
+}
+
+FileSender::~FileSender() {
+    stop();
+}
+
+void FileSender::start() {
+    file.open(path.c_str(), std::ios::out | std::ios::app | std::ios::binary);
+    if (!file) {
+        std::cerr << boost::format("Cannot open the file '%s'\n") % path;
+    }
+    writer = std::thread([this]() { run(); });
+}
+
+void FileSender::stop() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopped = true;
+    }
+    queued.notify_all();
+    if (writer.joinable()) {
+        writer.join();
+    }
+    file.close();
+}
+
+void FileSender::flush() {
+    std::unique_lock<std::mutex> guard(lock);
+    bool flushed = written.wait_for(guard, std::chrono::milliseconds(FLUSH_TIMEOUT_MS), [this]() {
+        return queue.empty() && writing_bytes == 0;
+    });
+    if (!flushed) {
+        std::cerr << boost::format("Could not flush in %s ms, %s bytes queued for '%s'\n")
+                     % FLUSH_TIMEOUT_MS % queued_bytes % path;
+    }
+}
+
+std::string FileSender::drain(std::chrono::steady_clock::time_point deadline) {
+    uint64_t start_written;
+    uint64_t start_failed;
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        start_written = written_messages;
+        start_failed = failed_messages;
+        written.wait_until(guard, deadline, [this]() {
+            return queue.empty() && writing_bytes == 0;
+        });
+        abandoned = true;
+    }
+    stop();
+
+    std::lock_guard<std::mutex> guard(lock);
+    return (boost::format("File sender '%s' drained: %s messages flushed, %s lost\n")
+            % path % (written_messages - start_written)
+            % (failed_messages - start_failed + queue.size())).str();
+}
+
+void FileSender::send(Payload payload, MessageType type) {
+    if (payload->empty()) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (queued_bytes + payload->size() > buffer_bytes && type != MessageType::FATAL) {
+            dropped_messages[(size_t) type]++;
+            dropped_bytes[(size_t) type] += payload->size();
+            return;
+        }
+        queued_bytes += payload->size();
+        queue.push_back(std::move(payload));
+    }
+    queued.notify_one();
+}
+
+void FileSender::run() {
+    std::deque<Payload> batch;
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        queued.wait(guard, [this]() { return stopped || !queue.empty(); });
+        if (queue.empty() || abandoned) { // Stopped and everything was written, or the drain is over
+            break;
+        }
+
+        batch.swap(queue);
+        writing_bytes = queued_bytes;
+        queued_bytes = 0;
+        guard.unlock();
+
+        size_t batch_bytes = 0;
+        for (const Payload &payload : batch) {
+            file.write(payload->data(), payload->size());
+            batch_bytes += payload->size();
+        }
+        file.flush();
+        size_t batch_messages = batch.size();
+        batch.clear();
+
+        guard.lock();
+        if (file) {
+            written_bytes += batch_bytes;
+            written_messages += batch_messages;
+        } else {
+            file.clear();
+            failed_bytes += batch_bytes;
+            failed_messages += batch_messages;
+        }
+        writing_bytes = 0;
+        written.notify_all();
+    }
+}
+
+std::string FileSender::get_statistics() {
+    std::lock_guard<std::mutex> guard(lock);
+    std::string statistics = (boost::format("File sender '%s': %s bytes written, %s bytes queued, "
+                                                    "%s bytes failed to be written\n\tdropped:")
+                              % path % written_bytes % queued_bytes % failed_bytes).str();
+    for (size_t i = 0; i < MESSAGE_TYPE_COUNT; i++) {
+        statistics += (boost::format(" %s %s (%s bytes)%s")
+                       % get_message_type_name((MessageType) i) % dropped_messages[i] % dropped_bytes[i]
+                       % ((i + 1 < MESSAGE_TYPE_COUNT) ? "," : "\n")).str();
+    }
+    return statistics;
+}
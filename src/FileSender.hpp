@@ -0,0 +1,70 @@
+#ifndef JEFF_NATIVE_AGENT_FILESENDER_HPP
+#define JEFF_NATIVE_AGENT_FILESENDER_HPP
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <thread>
+
+#include "Sender.hpp"
+
+//
+// Appends the messages to a local file, on its own writer thread.
+//
+// The messages are queued in memory up to the buffer size, the writer takes the whole
+// queue at once and writes it as one batch, so a slow disk costs one flush per batch.
+// Past the buffer the events and reports are dropped (and counted), the fatal messages
+// are always kept. The queue is written out on stop.
+//
+class FileSender : public Sender {
+public:
+    FileSender(const std::string path, const SenderConfig &config);
+
+    ~FileSender();
+
+    void start();
+
+    void stop();
+
+    // Waits a while for the queued messages to be written
+    void flush();
+
+    // Past the deadline the writer does not take the rest of the queue, it is lost
+    std::string drain(std::chrono::steady_clock::time_point deadline);
+
+    using Sender::send;
+
+    void send(Payload payload, MessageType type);
+
+    std::string get_statistics();
+
+private:
+    void run();
+
+    const std::string path;
+    const size_t buffer_bytes;
+    std::ofstream file;
+    std::thread writer;
+
+    /* The queue and the counters are guarded by the lock */
+    std::mutex lock;
+    std::condition_variable queued;
+    std::condition_variable written;
+    std::deque<Payload> queue;
+    size_t queued_bytes;
+    /* Taken by the writer and not written yet */
+    size_t writing_bytes;
+    bool stopped;
+    /* Stopped by a drain past its deadline, the queue is left */
+    bool abandoned;
+    uint64_t written_bytes;
+    uint64_t failed_bytes;
+    uint64_t written_messages;
+    uint64_t failed_messages;
+    uint64_t dropped_messages[MESSAGE_TYPE_COUNT];
+    uint64_t dropped_bytes[MESSAGE_TYPE_COUNT];
+};
+
+#endif //JEFF_NATIVE_AGENT_FILESENDER_HPP
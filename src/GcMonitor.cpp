@@ -0,0 +1,217 @@
+#include "GcMonitor.hpp"
+
+#include <algorithm>
+
+#include <boost/format.hpp>
+
+#include "clock.hpp"
+#include "jni.hpp"
+#include "jvmti.hpp"
+
+using namespace std;
+using namespace jeff;
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "The GC callbacks require lock-free 64 bit atomics");
+
+static const jlong NANOS_PER_MILLI = 1000000;
+
+/* Upper bounds of the pause histogram buckets, the last bucket is unbounded */
+static const jlong HISTOGRAM_BOUNDS_MS[] = {1, 2, 5, 10, 20, 50, 100, 200, 500, 1000};
+static const size_t HISTOGRAM_SIZE = sizeof(HISTOGRAM_BOUNDS_MS) / sizeof(HISTOGRAM_BOUNDS_MS[0]) + 1;
+
+/* Window sizes of the minimum mutator utilization */
+static const jlong MMU_WINDOWS_MS[] = {10, 100, 1000, 10000};
+
+/**
+ * Minimum mutator utilization: the smallest fraction of any window of the given size
+ * (within [from, to]) that was not spent in a pause. The worst window either starts
+ * at the start of a pause or ends at the end of one, so only those are checked.
+ */
+static double minimum_mutator_utilization(const vector<pair<jlong, jlong>> &pauses, jlong from, jlong to,
+                                          jlong window) {
+    if (to - from < window) {
+        return -1;
+    }
+
+    auto overlap = [](const pair<jlong, jlong> &pause, jlong start, jlong end) {
+        return max(min(end, pause.second) - max(start, pause.first), (jlong) 0);
+    };
+
+    jlong max_paused = 0;
+    for (size_t i = 0; i < pauses.size(); i++) {
+        /* The window starting with this pause */
+        jlong start = min(max(pauses[i].first, from), to - window);
+        size_t j = i;
+        while (j > 0 && pauses[j - 1].second > start) {
+            j--;
+        }
+        jlong paused = 0;
+        for (; j < pauses.size() && pauses[j].first < start + window; j++) {
+            paused += overlap(pauses[j], start, start + window);
+        }
+        max_paused = max(max_paused, paused);
+
+        /* The window ending with this pause */
+        jlong end = max(min(pauses[i].second, to), from + window);
+        paused = 0;
+        j = i;
+        while (j + 1 < pauses.size() && pauses[j + 1].first < end) {
+            j++;
+        }
+        for (j++; j-- > 0 && pauses[j].second > end - window;) {
+            paused += overlap(pauses[j], end - window, end);
+        }
+        max_paused = max(max_paused, paused);
+    }
+    return 1.0 - (double) max_paused / window;
+}
+
+GcMonitor::GcMonitor()
+        : start_ns(0),
+          last_end_ns(0),
+          finished(0),
+          reported(0),
+          last_report_ns(monotonic_nanos()) {
+    // Empty
+}
+
+GcMonitor::~GcMonitor() {
+    // Empty
+}
+
+jvmtiError GcMonitor::start(jvmtiEnv &jvmti) {
+    jvmtiError error;
+
+    error = jvmti.SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_GARBAGE_COLLECTION_START, (jthread) NULL);
+    if (is_jvmti_error(jvmti, error, "Cannot set event notification: JVMTI_EVENT_GARBAGE_COLLECTION_START")) {
+        return error;
+    }
+
+    error = jvmti.SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_GARBAGE_COLLECTION_FINISH, (jthread) NULL);
+    if (is_jvmti_error(jvmti, error, "Cannot set event notification: JVMTI_EVENT_GARBAGE_COLLECTION_FINISH")) {
+        return error;
+    }
+    return JVMTI_ERROR_NONE;
+}
+
+jvmtiError GcMonitor::stop(jvmtiEnv &jvmti) {
+    jvmtiError error;
+
+    error = jvmti.SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_GARBAGE_COLLECTION_START, (jthread) NULL);
+    if (is_jvmti_error(jvmti, error, "Cannot disable event notification: JVMTI_EVENT_GARBAGE_COLLECTION_START")) {
+        return error;
+    }
+
+    error = jvmti.SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_GARBAGE_COLLECTION_FINISH, (jthread) NULL);
+    if (is_jvmti_error(jvmti, error, "Cannot disable event notification: JVMTI_EVENT_GARBAGE_COLLECTION_FINISH")) {
+        return error;
+    }
+    return JVMTI_ERROR_NONE;
+}
+
+void GcMonitor::gc_started() {
+    start_ns.store(monotonic_nanos(), memory_order_relaxed);
+}
+
+void GcMonitor::gc_finished() {
+    jlong end = monotonic_nanos();
+    jlong start = start_ns.load(memory_order_relaxed);
+    if (start == 0) {
+        /* The events were enabled in the middle of a collection */
+        return;
+    }
+
+    jlong position = finished.load(memory_order_relaxed);
+    Pause &pause = pauses[position % CAPACITY];
+    pause.start_ns = start;
+    pause.end_ns = end;
+    finished.store(position + 1, memory_order_release);
+
+    last_end_ns.store(end, memory_order_relaxed);
+    start_ns.store(0, memory_order_relaxed);
+}
+
+jlong GcMonitor::get_millis_since_last_gc() const {
+    jlong end = last_end_ns.load(memory_order_relaxed);
+    return (end == 0) ? -1 : (monotonic_nanos() - end) / NANOS_PER_MILLI;
+}
+
+string GcMonitor::report(JNIEnv &jni) {
+    jlong now = monotonic_nanos();
+    jlong from = last_report_ns;
+    last_report_ns = now;
+
+    /* Copy the pauses out first, the collector may be overwriting the oldest ones */
+    jlong available = finished.load(memory_order_acquire);
+    jlong first = max(reported, available - (jlong) CAPACITY);
+    jlong lost = first - reported;
+
+    vector<pair<jlong, jlong>> period;
+    for (jlong i = first; i < available; i++) {
+        const Pause &pause = pauses[i % CAPACITY];
+        period.push_back(make_pair(pause.start_ns, pause.end_ns));
+    }
+    reported = available;
+
+    /* Drop whatever was overwritten while we were copying */
+    jlong overwritten = min(finished.load(memory_order_acquire) - (jlong) CAPACITY - first, (jlong) period.size());
+    if (overwritten > 0) {
+        period.erase(period.begin(), period.begin() + overwritten);
+        lost += overwritten;
+    }
+
+    jlong histogram[HISTOGRAM_SIZE] = {0};
+    jlong total_ns = 0;
+    jlong max_ns = 0;
+    for (auto &pause : period) {
+        jlong duration = pause.second - pause.first;
+        total_ns += duration;
+        max_ns = max(max_ns, duration);
+
+        size_t bucket = 0;
+        while (bucket < HISTOGRAM_SIZE - 1 && duration >= HISTOGRAM_BOUNDS_MS[bucket] * NANOS_PER_MILLI) {
+            bucket++;
+        }
+        histogram[bucket]++;
+    }
+
+    double seconds = max(now - from, (jlong) 1) / 1e9;
+    string ret = (boost::format("GC: %s pauses (%.2f/s, %s lost), total %.3f ms, max %.3f ms, "
+                                        "mutator utilization %.2f%%\n")
+                  % period.size() % (period.size() / seconds) % lost
+                  % (total_ns / 1e6) % (max_ns / 1e6) % (100.0 * (1.0 - total_ns / 1e9 / seconds))).str();
+
+    ret += "\tpause histogram:";
+    for (size_t i = 0; i < HISTOGRAM_SIZE; i++) {
+        if (i < HISTOGRAM_SIZE - 1) {
+            ret += (boost::format(" <%sms: %s") % HISTOGRAM_BOUNDS_MS[i] % histogram[i]).str();
+        } else {
+            ret += (boost::format(" >=%sms: %s") % HISTOGRAM_BOUNDS_MS[i - 1] % histogram[i]).str();
+        }
+    }
+    ret += "\n\tminimum mutator utilization:";
+    for (jlong window : MMU_WINDOWS_MS) {
+        double mmu = minimum_mutator_utilization(period, from, now, window * NANOS_PER_MILLI);
+        if (mmu >= 0) {
+            ret += (boost::format(" %sms: %.2f%%") % window % (100.0 * mmu)).str();
+        }
+    }
+
+    /* The heap occupancy as seen by java.lang.Runtime, this thread can use JNI freely */
+    jclass type = find_class(jni, "java/lang/Runtime");
+    jmethodID get_runtime = jni.GetStaticMethodID(type, "getRuntime", "()Ljava/lang/Runtime;");
+    jobject runtime = (get_runtime == nullptr) ? nullptr : jni.CallStaticObjectMethod(type, get_runtime);
+    if (runtime != nullptr && !jni.ExceptionCheck()) {
+        jlong total = jni.CallLongMethod(runtime, get_method_id(jni, type, "totalMemory", "()J"));
+        jlong free = jni.CallLongMethod(runtime, get_method_id(jni, type, "freeMemory", "()J"));
+        jlong max = jni.CallLongMethod(runtime, get_method_id(jni, type, "maxMemory", "()J"));
+        if (!jni.ExceptionCheck()) {
+            ret += (boost::format("\n\theap: %s bytes used, %s bytes committed, %s bytes max")
+                    % (total - free) % total % max).str();
+        }
+        jni.DeleteLocalRef(runtime);
+    }
+    delete_local_ref(jni, type);
+
+    return ret + "\n";
+}
@@ -0,0 +1,66 @@
+#ifndef JEFF_NATIVE_AGENT_GCMONITOR_HPP
+#define JEFF_NATIVE_AGENT_GCMONITOR_HPP
+
+#include <jni.h>
+#include <jvmti.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+//
+// Garbage collection pause monitor.
+//
+// JVMTI_EVENT_GARBAGE_COLLECTION_START/FINISH are sent while the VM is stopped,
+// no JNI nor JVMTI calls are allowed there, so the callbacks only read the
+// monotonic clock and store the pause into a preallocated array. There is at
+// most one collection in progress, so there is a single writer.
+//
+// The reporter thread turns the pauses into a pause-duration histogram, GC
+// frequency and minimum mutator utilization (MMU) for a few window sizes.
+//
+class GcMonitor : boost::noncopyable {
+public:
+    GcMonitor();
+
+    ~GcMonitor();
+
+    // Enables the garbage collection events, requires the live phase
+    jvmtiError start(jvmtiEnv &jvmti);
+
+    jvmtiError stop(jvmtiEnv &jvmti);
+
+    // Called from JVMTI_EVENT_GARBAGE_COLLECTION_START, async-signal-safe
+    void gc_started();
+
+    // Called from JVMTI_EVENT_GARBAGE_COLLECTION_FINISH, async-signal-safe
+    void gc_finished();
+
+    // Milliseconds since the end of the last collection, -1 if there was none yet
+    jlong get_millis_since_last_gc() const;
+
+    // Drains the recorded pauses and returns the statistics for the period since the last report
+    std::string report(JNIEnv &jni);
+
+private:
+    struct Pause {
+        jlong start_ns;
+        jlong end_ns;
+    };
+
+    static const size_t CAPACITY = 4096;
+
+    Pause pauses[CAPACITY];
+    std::atomic<jlong> start_ns;
+    std::atomic<jlong> last_end_ns;
+    /* Number of finished pauses, the writer position */
+    std::atomic<jlong> finished;
+
+    /* Owned by the reporter thread */
+    jlong reported;
+    jlong last_report_ns;
+};
+
+#endif //JEFF_NATIVE_AGENT_GCMONITOR_HPP
@@ -4,10 +4,26 @@
 #include <jni.h>
 #include <jvmti.h>
 
+#include <list>
 #include <string>
 #include <memory>
+#include <vector>
 
+#include "AllocationSampler.hpp"
+#include "ClassRegistry.hpp"
+#include "EmergencyCapture.hpp"
+#include "ExceptionClassifier.hpp"
+#include "GcMonitor.hpp"
+#include "HeapHistogram.hpp"
+#include "InstanceTracker.hpp"
+#include "MonitorProfiler.hpp"
+#include "PerfMap.hpp"
+#include "RateLimiter.hpp"
+#include "Reporter.hpp"
 #include "Sender.hpp"
+#include "StackRegistry.hpp"
+#include "ThreadRegistry.hpp"
+#include "TraceRecorder.hpp"
 
 namespace jeff {
 
@@ -18,13 +34,78 @@ namespace jeff {
         jboolean vm_is_dead;
         jboolean vm_is_initialized;
         jboolean vm_is_started;
+        /* False before the VM init (or the attach) and after a detach */
+        bool agent_is_active;
+        /* The reporter thread outlived the detach, its state is cleared by the next attach once it exits */
+        bool detach_is_pending;
+        /* Capabilities added by the agent, relinquished on detach */
+        jvmtiCapabilities capabilities;
         /* Data access Lock */
         jrawMonitorID lock;
         /* Networking */
         bool enable_daemon_connection;
         std::string daemon_host;
         std::string daemon_port;
+        /* tcp, unix, unixpacket or udp */
+        std::string daemon_transport;
+        /* Local copy of the messages, none when empty */
+        std::string log_file;
+        SenderConfig sender_config;
         std::unique_ptr<Sender> sender;
+        /* How long the VM death waits for the queued messages to be delivered */
+        jlong shutdown_timeout_ms;
+        /* Exceptions, the filter holds signature patterns and is replaced as a whole, empty means all */
+        bool enable_exceptions;
+        jlong exception_budget;
+        std::unique_ptr<RateLimiter> exception_limiter;
+        std::shared_ptr<const std::vector<std::string>> exception_filter;
+        /* Catch site classification and the captured stack depth per site and class */
+        jint exception_catch_frames;
+        jint exception_near_depth;
+        std::vector<ExceptionClassifier::Rule> exception_depths;
+        std::unique_ptr<ExceptionClassifier> exception_classifier;
+        /* The exceptions carry the id of their stack, the stacks are sent as call tree nodes */
+        bool enable_stack_ids;
+        /* Reporting */
+        jlong report_interval_ms;
+        std::unique_ptr<Reporter> reporter;
+        /* Class and stack trace ids, the stacks are a call tree */
+        std::unique_ptr<ClassRegistry> classes;
+        std::unique_ptr<StackRegistry> stacks;
+        /* Allocation profiling, disabled when the interval is 0 */
+        jint alloc_sampling_interval;
+        std::unique_ptr<AllocationSampler> allocation_sampler;
+        /* Garbage collection monitoring */
+        bool enable_gc_monitor;
+        std::unique_ptr<GcMonitor> gc_monitor;
+        /* Heap histogram, on demand only when the interval is 0 */
+        jlong heap_histogram_interval_ms;
+        jint heap_histogram_top;
+        std::unique_ptr<HeapHistogram> heap_histogram;
+        /* Live-instance tracking, disabled when there are no classes to track */
+        std::list<std::string> tracked_classes;
+        jlong track_interval_ms;
+        std::unique_ptr<InstanceTracker> instance_tracker;
+        /* Monitor contention profiling */
+        bool enable_monitor_profiler;
+        bool enable_monitor_owners;
+        std::unique_ptr<MonitorProfiler> monitor_profiler;
+        /* Thread lifecycle and CPU accounting */
+        bool enable_thread_registry;
+        std::unique_ptr<ThreadRegistry> thread_registry;
+        /* JIT code map for Linux perf */
+        bool enable_perf_map;
+        bool enable_perf_map_inlining;
+        std::unique_ptr<PerfMap> perf_map;
+        /* Trace of the exception callback inputs for jeff-replay, none when empty */
+        std::string record_file;
+        std::unique_ptr<TraceRecorder> trace_recorder;
+        /* Thread stacks and a heap histogram on the resource exhaustion, from a reserve set aside up front */
+        bool enable_emergency_capture;
+        size_t emergency_reserve_bytes;
+        /* A file of its own, the default one when empty */
+        std::string emergency_file;
+        std::unique_ptr<EmergencyCapture> emergency_capture;
     } GlobalAgentData;
 
     extern GlobalAgentData gdata;
@@ -0,0 +1,106 @@
+#include "HeapHistogram.hpp"
+
+#include <algorithm>
+#include <numeric>
+
+#include <boost/format.hpp>
+
+#include "clock.hpp"
+#include "jni.hpp"
+#include "jvmti.hpp"
+
+#include "ClassRegistry.hpp"
+
+using namespace std;
+using namespace jeff;
+
+HeapHistogram::HeapHistogram(ClassRegistry &classes, size_t top)
+        : classes(classes),
+          top(top) {
+    // Empty
+}
+
+HeapHistogram::~HeapHistogram() {
+    // Empty
+}
+
+jint JNICALL HeapHistogram::count_object(jlong class_tag, jlong size, jlong *tag_ptr, jint length,
+                                         void *user_data) {
+    HeapHistogram &histogram = *static_cast<HeapHistogram *>(user_data);
+    size_t id = (size_t) ClassRegistry::get_id(class_tag);
+    if (id >= histogram.counts.size()) {
+        /* Not tagged (e.g. the registry is full), accounted to the unknown class */
+        id = 0;
+    }
+    histogram.counts[id]++;
+    histogram.bytes[id] += size;
+    return JVMTI_VISIT_OBJECTS;
+}
+
+void HeapHistogram::set_top(size_t value) {
+    top = value;
+}
+
+string HeapHistogram::capture(jvmtiEnv &jvmti, JNIEnv &jni) {
+    jvmtiError error;
+    jlong started = monotonic_nanos();
+
+    /* Make sure every class has an id, the class tags are what the heap walk reports */
+    jint class_count;
+    jclass *loaded_classes;
+    error = jvmti.GetLoadedClasses(&class_count, &loaded_classes);
+    if (is_jvmti_error(jvmti, error, "Unable to get loaded classes")) {
+        return "Heap histogram: unable to get loaded classes\n";
+    }
+    for (jint i = 0; i < class_count; i++) {
+        classes.get_id(jvmti, loaded_classes[i]);
+        jni.DeleteLocalRef(loaded_classes[i]);
+    }
+    deallocate(jvmti, loaded_classes);
+    jlong tagged = monotonic_nanos();
+
+    counts.assign(classes.size() + 1, 0);
+    bytes.assign(classes.size() + 1, 0);
+
+    jvmtiHeapCallbacks callbacks = jvmtiHeapCallbacks();
+    callbacks.heap_iteration_callback = &HeapHistogram::count_object;
+    error = jvmti.IterateThroughHeap(0, nullptr, &callbacks, this);
+    if (is_jvmti_error(jvmti, error, "Unable to iterate through heap")) {
+        return "Heap histogram: unable to iterate through heap\n";
+    }
+    jlong walked = monotonic_nanos();
+
+    vector<size_t> by_bytes;
+    for (size_t id = 0; id < counts.size(); id++) {
+        if (counts[id] > 0) {
+            by_bytes.push_back(id);
+        }
+    }
+    vector<size_t> by_count = by_bytes;
+
+    size_t n = min(top, by_bytes.size());
+    partial_sort(by_bytes.begin(), by_bytes.begin() + n, by_bytes.end(),
+                 [this](size_t a, size_t b) { return bytes[a] > bytes[b]; });
+    partial_sort(by_count.begin(), by_count.begin() + n, by_count.end(),
+                 [this](size_t a, size_t b) { return counts[a] > counts[b]; });
+
+    string ret = (boost::format("Heap histogram: %s objects, %s bytes, %s classes, "
+                                        "heap walk took %.3f ms (tagging classes %.3f ms)\n")
+                  % accumulate(counts.begin(), counts.end(), (jlong) 0)
+                  % accumulate(bytes.begin(), bytes.end(), (jlong) 0)
+                  % by_bytes.size() % ((walked - tagged) / 1e6) % ((tagged - started) / 1e6)).str();
+
+    ret += "\ttop by bytes:\n";
+    for (size_t i = 0; i < n; i++) {
+        size_t id = by_bytes[i];
+        ret += (boost::format("\t\t%12s bytes %10s objects  %s\n")
+                % bytes[id] % counts[id] % classes.get_signature((jint) id)).str();
+    }
+    ret += "\ttop by count:\n";
+    for (size_t i = 0; i < n; i++) {
+        size_t id = by_count[i];
+        ret += (boost::format("\t\t%10s objects %12s bytes  %s\n")
+                % counts[id] % bytes[id] % classes.get_signature((jint) id)).str();
+    }
+    return ret;
+}
@@ -0,0 +1,46 @@
+#ifndef JEFF_NATIVE_AGENT_HEAPHISTOGRAM_HPP
+#define JEFF_NATIVE_AGENT_HEAPHISTOGRAM_HPP
+
+#include <jni.h>
+#include <jvmti.h>
+
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+class ClassRegistry;
+
+//
+// Class histogram of the heap, a cheap alternative to a heap dump.
+//
+// All loaded classes are tagged with their ClassRegistry id first, so the
+// IterateThroughHeap callback gets the id as the class tag and only has to bump
+// two counters in flat arrays indexed by it, no lookups during the heap walk.
+//
+class HeapHistogram : boost::noncopyable {
+public:
+    HeapHistogram(ClassRegistry &classes, size_t top);
+
+    ~HeapHistogram();
+
+    // Number of classes in the next histograms, must be called on the reporter thread
+    void set_top(size_t value);
+
+    // Walks the heap and returns the top classes by bytes and by instance count,
+    // together with the time the walk took
+    std::string capture(jvmtiEnv &jvmti, JNIEnv &jni);
+
+private:
+    static jint JNICALL count_object(jlong class_tag, jlong size, jlong *tag_ptr, jint length, void *user_data);
+
+    ClassRegistry &classes;
+    /* Owned by the reporter thread */
+    size_t top;
+
+    /* Indexed by class id, reused between the walks */
+    std::vector<jlong> counts;
+    std::vector<jlong> bytes;
+};
+
+#endif //JEFF_NATIVE_AGENT_HEAPHISTOGRAM_HPP
@@ -0,0 +1,254 @@
+#include "InstanceTracker.hpp"
+
+#include <algorithm>
+#include <iostream>
+
+#include <boost/format.hpp>
+
+#include "clock.hpp"
+#include "common.hpp"
+#include "jvmti.hpp"
+#include "tags.hpp"
+
+#include "ClassRegistry.hpp"
+
+using namespace std;
+using namespace jeff;
+
+/* The tag value is the tracked class index and the number of the walk that found the instance */
+static const int INDEX_SHIFT = 52;
+static const jlong WALK_MASK = (((jlong) 1) << INDEX_SHIFT) - 1;
+
+/* Up to that many loaded tracked classes are walked one by one, the JVM skips the other objects itself */
+static const size_t MAX_CLASS_WALKS = 4;
+
+/* Upper bounds of the age buckets, the last bucket is unbounded */
+static const jlong AGE_BOUNDS_MS[] = {1000, 10 * 1000, 60 * 1000, 10 * 60 * 1000, 60 * 60 * 1000};
+static const char *const AGE_NAMES[] = {"<1s", "<10s", "<1m", "<10m", "<1h", ">=1h"};
+
+const size_t InstanceTracker::MAX_CLASSES;
+
+InstanceTracker::InstanceTracker(ClassRegistry &classes, list<string> class_names)
+        : classes(classes),
+          walk(0),
+          walk_slot(0) {
+    for (string name : class_names) {
+        if (patterns.size() == MAX_CLASSES) {
+            cerr << boost::format("Only %s classes can be tracked, ignoring '%s'\n") % MAX_CLASSES % name;
+            continue;
+        }
+        /* Match the JVM signatures */
+        patterns.push_back(to_signature_pattern(name));
+    }
+    clear();
+}
+
+InstanceTracker::~InstanceTracker() {
+    // Empty
+}
+
+jvmtiError InstanceTracker::start(jvmtiEnv &jvmti) {
+    jvmtiError error = jvmti.SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_OBJECT_FREE, (jthread) NULL);
+    if (is_jvmti_error(jvmti, error, "Cannot set event notification: JVMTI_EVENT_OBJECT_FREE")) return error;
+    return JVMTI_ERROR_NONE;
+}
+
+jvmtiError InstanceTracker::stop(jvmtiEnv &jvmti) {
+    jvmtiError error = jvmti.SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_OBJECT_FREE, (jthread) NULL);
+    if (is_jvmti_error(jvmti, error, "Cannot disable event notification: JVMTI_EVENT_OBJECT_FREE")) return error;
+    return JVMTI_ERROR_NONE;
+}
+
+void InstanceTracker::clear() {
+    for (Counters &counter : counters) {
+        counter.tagged.store(0);
+        counter.freed.store(0);
+        for (auto &age : counter.freed_ages) {
+            age.store(0);
+        }
+        for (auto &live : counter.live) {
+            live.store(0);
+        }
+        counter.live_retired.store(0);
+    }
+    /* The walk numbers go on, a tag of an old walk can not be taken for a new one */
+    for (size_t slot = 0; slot < WALK_SLOTS; slot++) {
+        slot_walks[slot].store(0);
+        slot_ms[slot].store(0);
+    }
+    retired_walk.store(walk);
+    retired_ms.store(monotonic_millis());
+}
+
+void InstanceTracker::object_freed(jlong tag) {
+    jlong value = get_tag_value(tag);
+    size_t index = (size_t) (value >> INDEX_SHIFT);
+    if (index == 0 || index > patterns.size()) {
+        return;
+    }
+
+    jlong tag_walk = value & WALK_MASK;
+    Counters &counter = counters[index - 1];
+    counter.freed.fetch_add(1, memory_order_relaxed);
+    counter.freed_ages[get_age_bucket(monotonic_millis() - get_walk_ms(tag_walk))].fetch_add(1, memory_order_relaxed);
+    /*
+     * A free racing with the reuse of the slot may still land in the slot, after its count was
+     * moved; it is then moved with the count of the next walk there, so the total stays exact.
+     */
+    if (tag_walk > retired_walk.load()) {
+        counter.live[tag_walk % WALK_SLOTS].fetch_sub(1);
+    } else {
+        counter.live_retired.fetch_sub(1);
+    }
+}
+
+jlong InstanceTracker::get_walk_ms(jlong tag_walk) const {
+    /* The slot is emptied before its time changes, the time read between two matches is of this walk */
+    size_t slot = (size_t) (tag_walk % WALK_SLOTS);
+    if (slot_walks[slot].load() == tag_walk) {
+        jlong ms = slot_ms[slot].load();
+        if (slot_walks[slot].load() == tag_walk) {
+            return ms;
+        }
+    }
+    return retired_ms.load();
+}
+
+size_t InstanceTracker::start_walk(jlong now_ms) {
+    walk++;
+    size_t slot = (size_t) (walk % WALK_SLOTS);
+    jlong previous = slot_walks[slot].load();
+    if (previous != 0) {
+        /* The frees of the previous walk go to the retired counts from now on */
+        retired_ms.store(slot_ms[slot].load());
+        retired_walk.store(previous);
+        for (Counters &counter : counters) {
+            counter.live_retired.fetch_add(counter.live[slot].exchange(0));
+        }
+    }
+    slot_walks[slot].store(0);
+    slot_ms[slot].store(now_ms);
+    slot_walks[slot].store(walk);
+    return slot;
+}
+
+jint JNICALL InstanceTracker::visit_object(jlong class_tag, jlong size, jlong *tag_ptr, jint length,
+                                           void *user_data) {
+    InstanceTracker &tracker = *static_cast<InstanceTracker *>(user_data);
+
+    /* The tagged objects are filtered out, this is a guard */
+    if (*tag_ptr != 0) {
+        return JVMTI_VISIT_OBJECTS;
+    }
+
+    size_t class_id = (size_t) ClassRegistry::get_id(class_tag);
+    if (class_id == 0 || class_id >= tracker.tracked_by_class_id.size()) {
+        return JVMTI_VISIT_OBJECTS;
+    }
+    jint index = tracker.tracked_by_class_id[class_id];
+    if (index > 0) {
+        *tag_ptr = make_tag(TagKind::Instance, (((jlong) index) << INDEX_SHIFT) | (tracker.walk & WALK_MASK));
+        Counters &counter = tracker.counters[index - 1];
+        counter.tagged.fetch_add(1, memory_order_relaxed);
+        counter.live[tracker.walk_slot].fetch_add(1);
+    }
+    return JVMTI_VISIT_OBJECTS;
+}
+
+size_t InstanceTracker::get_age_bucket(jlong age_ms) {
+    size_t bucket = 0;
+    while (bucket < AGE_BUCKETS - 1 && age_ms >= AGE_BOUNDS_MS[bucket]) {
+        bucket++;
+    }
+    return bucket;
+}
+
+jint InstanceTracker::get_tracked_index(const string &signature) const {
+    for (size_t i = 0; i < patterns.size(); i++) {
+        const string &pattern = patterns[i];
+        if (matches_signature_pattern(signature, pattern)) {
+            return (jint) i + 1;
+        }
+    }
+    return 0;
+}
+
+string InstanceTracker::report(jvmtiEnv &jvmti, JNIEnv &jni) {
+    jvmtiError error;
+    jlong started = monotonic_nanos();
+
+    /* Find the tracked classes among the loaded ones, new classes get ids on the way */
+    jint class_count;
+    jclass *loaded_classes;
+    error = jvmti.GetLoadedClasses(&class_count, &loaded_classes);
+    if (is_jvmti_error(jvmti, error, "Unable to get loaded classes")) {
+        return "Tracked instances: unable to get loaded classes\n";
+    }
+    vector<jclass> tracked_classes;
+    for (jint i = 0; i < class_count; i++) {
+        size_t id = (size_t) classes.get_id(jvmti, loaded_classes[i]);
+        for (size_t next = tracked_by_class_id.size(); next <= id; next++) {
+            tracked_by_class_id.push_back(next == 0 ? 0 : get_tracked_index(classes.get_signature((jint) next)));
+        }
+        if (id != 0 && tracked_by_class_id[id] > 0) {
+            tracked_classes.push_back(loaded_classes[i]);
+        } else {
+            jni.DeleteLocalRef(loaded_classes[i]);
+        }
+    }
+    deallocate(jvmti, loaded_classes);
+
+    /* Only the untagged instances of the tracked classes are visited, the live counts come from the frees */
+    if (!tracked_classes.empty()) {
+        walk_slot = start_walk(monotonic_millis());
+        jvmtiHeapCallbacks callbacks = jvmtiHeapCallbacks();
+        callbacks.heap_iteration_callback = &InstanceTracker::visit_object;
+        if (tracked_classes.size() <= MAX_CLASS_WALKS) {
+            for (jclass type : tracked_classes) {
+                error = jvmti.IterateThroughHeap(JVMTI_HEAP_FILTER_TAGGED, type, &callbacks, this);
+                if (error != JVMTI_ERROR_NONE) {
+                    break;
+                }
+            }
+        } else {
+            error = jvmti.IterateThroughHeap(JVMTI_HEAP_FILTER_TAGGED, nullptr, &callbacks, this);
+        }
+        for (jclass type : tracked_classes) {
+            jni.DeleteLocalRef(type);
+        }
+        if (is_jvmti_error(jvmti, error, "Unable to iterate through heap")) {
+            return "Tracked instances: unable to iterate through heap\n";
+        }
+    }
+
+    jlong now_ms = monotonic_millis();
+    jlong retired_age_ms = now_ms - retired_ms.load();
+    string ret = (boost::format("Tracked instances (heap walk took %.3f ms):\n")
+                  % ((monotonic_nanos() - started) / 1e6)).str();
+    for (size_t i = 0; i < patterns.size(); i++) {
+        Counters &counter = counters[i];
+        jlong live_ages[AGE_BUCKETS] = {0};
+        jlong live = counter.live_retired.load();
+        live_ages[get_age_bucket(retired_age_ms)] += live;
+        for (size_t slot = 0; slot < WALK_SLOTS; slot++) {
+            jlong slot_walk = slot_walks[slot].load();
+            jlong slot_live = counter.live[slot].load();
+            if (slot_walk != 0 && slot_live != 0) {
+                live += slot_live;
+                live_ages[get_age_bucket(now_ms - get_walk_ms(slot_walk))] += slot_live;
+            }
+        }
+
+        ret += (boost::format("\t%s: %s live, %s tracked, %s freed\n\t\tlive ages:")
+                % patterns[i] % live % counter.tagged.load() % counter.freed.load()).str();
+        for (size_t bucket = 0; bucket < AGE_BUCKETS; bucket++) {
+            ret += (boost::format(" %s: %s") % AGE_NAMES[bucket] % live_ages[bucket]).str();
+        }
+        ret += "\n\t\tfreed ages:";
+        for (size_t bucket = 0; bucket < AGE_BUCKETS; bucket++) {
+            ret += (boost::format(" %s: %s") % AGE_NAMES[bucket] % counter.freed_ages[bucket].load()).str();
+        }
+        ret += "\n";
+    }
+    return ret;
+}
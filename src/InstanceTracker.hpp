@@ -0,0 +1,100 @@
+#ifndef JEFF_NATIVE_AGENT_INSTANCETRACKER_HPP
+#define JEFF_NATIVE_AGENT_INSTANCETRACKER_HPP
+
+#include <jni.h>
+#include <jvmti.h>
+
+#include <atomic>
+#include <list>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+class ClassRegistry;
+
+//
+// Live-instance tracking for a configured set of classes, e.g. connections or sessions.
+//
+// A periodic heap walk tags every new instance of a tracked class with a compact
+// id: the index of the tracked class and the number of the walk. The walk only
+// visits the untagged instances of the loaded tracked classes (the JVM filters out
+// the rest), so its cost does not grow with the instances tracked so far.
+// JVMTI_EVENT_OBJECT_FREE then brings the tag back, and the live counts per class
+// and per walk are kept up to date with a few atomic operations; the age of an
+// instance is the time since the walk that found it. The walks reuse a fixed set of
+// slots, the instances of a walk whose slot is reused are counted together, with
+// the age of the newest such walk (a lower bound).
+//
+// The allocation sampler tags objects too, an object carries a single tag, so the
+// two are not enabled together.
+//
+// Classes are matched by name ("com.example.Session") or by package prefix
+// ("com.example.pool.*"); subclasses have to be listed explicitly.
+//
+class InstanceTracker : boost::noncopyable {
+public:
+    static const size_t MAX_CLASSES = 64;
+
+    static const size_t AGE_BUCKETS = 6;
+
+    static const size_t WALK_SLOTS = 64;
+
+    InstanceTracker(ClassRegistry &classes, std::list<std::string> class_names);
+
+    ~InstanceTracker();
+
+    // Enables the object free events, requires the live phase
+    jvmtiError start(jvmtiEnv &jvmti);
+
+    jvmtiError stop(jvmtiEnv &jvmti);
+
+    // Forgets the tracked instances once their tags are cleared, must not run concurrently with report()
+    void clear();
+
+    // Called from JVMTI_EVENT_OBJECT_FREE, must not call JVMTI or JNI functions
+    void object_freed(jlong tag);
+
+    // Tags the new instances and returns the live counts and age distributions
+    std::string report(jvmtiEnv &jvmti, JNIEnv &jni);
+
+private:
+    struct Counters {
+        std::atomic<jlong> tagged;
+        std::atomic<jlong> freed;
+        std::atomic<jlong> freed_ages[AGE_BUCKETS];
+        /* Live instances by the slot of the walk that tagged them */
+        std::atomic<jlong> live[WALK_SLOTS];
+        /* Live instances of the walks whose slots were reused */
+        std::atomic<jlong> live_retired;
+    };
+
+    static jint JNICALL visit_object(jlong class_tag, jlong size, jlong *tag_ptr, jint length, void *user_data);
+
+    static size_t get_age_bucket(jlong age_ms);
+
+    jint get_tracked_index(const std::string &signature) const;
+
+    // The time of a walk, the time of the newest retired walk when its slot was reused
+    jlong get_walk_ms(jlong walk) const;
+
+    // Takes the next slot for a new walk, moving the live counts of the walk that had it to the retired ones
+    size_t start_walk(jlong now_ms);
+
+    ClassRegistry &classes;
+    std::vector<std::string> patterns;
+    Counters counters[MAX_CLASSES];
+    /* The walk in each slot (0 while the slot is being reused) and its time */
+    std::atomic<jlong> slot_walks[WALK_SLOTS];
+    std::atomic<jlong> slot_ms[WALK_SLOTS];
+    /* The newest walk whose slot was reused and its time */
+    std::atomic<jlong> retired_walk;
+    std::atomic<jlong> retired_ms;
+
+    /* Owned by the reporter thread */
+    std::vector<jint> tracked_by_class_id;
+    jlong walk;
+    size_t walk_slot;
+};
+
+#endif //JEFF_NATIVE_AGENT_INSTANCETRACKER_HPP
@@ -0,0 +1,251 @@
+#include "MonitorProfiler.hpp"
+
+#include <algorithm>
+#include <thread>
+
+#include <boost/format.hpp>
+
+#include "clock.hpp"
+#include "common.hpp"
+#include "jvmti.hpp"
+
+#include "ClassRegistry.hpp"
+#include "StackRegistry.hpp"
+
+using namespace std;
+using namespace jeff;
+
+static const jint REPORT_STACK_DEPTH = 8;
+
+MonitorProfiler::ThreadBuffer::ThreadBuffer()
+        : pending(),
+          started_ns(0),
+          tables(),
+          active(0),
+          updates(0),
+          dropped(0),
+          released(false) {
+    // Empty
+}
+
+MonitorProfiler::MonitorProfiler(ClassRegistry &classes, StackRegistry &stacks, bool capture_owners, size_t top)
+        : classes(classes),
+          stacks(stacks),
+          capture_owners(capture_owners),
+          top(top) {
+    // Empty
+}
+
+MonitorProfiler::~MonitorProfiler() {
+    for (ThreadBuffer *buffer : buffers) {
+        delete buffer;
+    }
+    for (ThreadBuffer *buffer : free_buffers) {
+        delete buffer;
+    }
+}
+
+static const jvmtiEvent MONITOR_EVENTS[] = {
+        JVMTI_EVENT_MONITOR_CONTENDED_ENTER, JVMTI_EVENT_MONITOR_CONTENDED_ENTERED,
+        JVMTI_EVENT_MONITOR_WAIT, JVMTI_EVENT_MONITOR_WAITED
+};
+
+jvmtiError MonitorProfiler::start(jvmtiEnv &jvmti) {
+    for (jvmtiEvent event : MONITOR_EVENTS) {
+        jvmtiError error = jvmti.SetEventNotificationMode(JVMTI_ENABLE, event, (jthread) NULL);
+        if (is_jvmti_error(jvmti, error, (boost::format("Cannot set event notification: %s") % event).str())) {
+            return error;
+        }
+    }
+    return JVMTI_ERROR_NONE;
+}
+
+jvmtiError MonitorProfiler::stop(jvmtiEnv &jvmti) {
+    for (jvmtiEvent event : MONITOR_EVENTS) {
+        jvmtiError error = jvmti.SetEventNotificationMode(JVMTI_DISABLE, event, (jthread) NULL);
+        if (is_jvmti_error(jvmti, error, (boost::format("Cannot disable event notification: %s") % event).str())) {
+            return error;
+        }
+    }
+    return JVMTI_ERROR_NONE;
+}
+
+MonitorProfiler::ThreadBuffer &MonitorProfiler::get_thread_buffer() {
+    /* Hands the buffer back for recycling when the thread exits */
+    struct Holder {
+        ThreadBuffer *buffer;
+
+        ~Holder() {
+            if (buffer != nullptr) {
+                buffer->released.store(true, memory_order_release);
+            }
+        }
+    };
+    static thread_local Holder holder = {nullptr};
+
+    if (holder.buffer == nullptr) {
+        lock_guard<mutex> guard(buffers_lock);
+        if (free_buffers.empty()) {
+            holder.buffer = new ThreadBuffer();
+        } else {
+            holder.buffer = free_buffers.back();
+            free_buffers.pop_back();
+        }
+        buffers.push_back(holder.buffer);
+    }
+    return *holder.buffer;
+}
+
+void MonitorProfiler::blocking(jvmtiEnv &jvmti, JNIEnv &jni, jthread thread, jobject object, bool wait) {
+    ThreadBuffer &buffer = get_thread_buffer();
+
+    jclass type = jni.GetObjectClass(object);
+    buffer.pending.wait = wait;
+    buffer.pending.class_id = classes.get_id(jvmti, type);
+    buffer.pending.stack_id = stacks.get_id(jvmti, thread);
+    buffer.pending.owner_stack_id = 0;
+    jni.DeleteLocalRef(type);
+
+    /* GetObjectMonitorUsage is expensive, but this thread is going to block anyway */
+    if (!wait && capture_owners) {
+        jvmtiMonitorUsage usage;
+        if (jvmti.GetObjectMonitorUsage(object, &usage) == JVMTI_ERROR_NONE) {
+            if (usage.owner != nullptr) {
+                buffer.pending.owner_stack_id = stacks.get_id(jvmti, usage.owner);
+                jni.DeleteLocalRef(usage.owner);
+            }
+            for (jint i = 0; i < usage.waiter_count; i++) {
+                jni.DeleteLocalRef(usage.waiters[i]);
+            }
+            for (jint i = 0; i < usage.notify_waiter_count; i++) {
+                jni.DeleteLocalRef(usage.notify_waiters[i]);
+            }
+            deallocate(jvmti, usage.waiters);
+            deallocate(jvmti, usage.notify_waiters);
+        }
+    }
+
+    /* Taken last, so the time spent above is not counted as blocked */
+    buffer.started_ns = monotonic_nanos();
+}
+
+void MonitorProfiler::unblocked(bool wait) {
+    ThreadBuffer &buffer = get_thread_buffer();
+    if (buffer.started_ns == 0 || buffer.pending.wait != wait) {
+        /* The events were enabled while this thread was already blocked */
+        return;
+    }
+
+    const Record &record = buffer.pending;
+    jlong blocked_ns = monotonic_nanos() - buffer.started_ns;
+    buffer.started_ns = 0;
+
+    Key key = {record.wait, record.class_id, record.stack_id, record.owner_stack_id};
+    buffer.updates.fetch_add(1);
+    Slot *table = buffer.tables[buffer.active.load()];
+    size_t index = KeyHash()(key) % TABLE_SLOTS;
+    for (size_t probe = 0; probe < TABLE_SLOTS; probe++) {
+        Slot &slot = table[(index + probe) % TABLE_SLOTS];
+        if (!slot.used) {
+            slot.used = true;
+            slot.key = key;
+            slot.stats = {1, blocked_ns, blocked_ns};
+            break;
+        }
+        if (slot.key == key) {
+            slot.stats.count++;
+            slot.stats.total_ns += blocked_ns;
+            slot.stats.max_ns = max(slot.stats.max_ns, blocked_ns);
+            break;
+        }
+        if (probe + 1 == TABLE_SLOTS) {
+            buffer.dropped.fetch_add(1, memory_order_relaxed);
+        }
+    }
+    buffer.updates.fetch_add(1, memory_order_release);
+}
+
+void MonitorProfiler::merge(Slot *table) {
+    for (size_t i = 0; i < TABLE_SLOTS; i++) {
+        Slot &slot = table[i];
+        if (!slot.used) {
+            continue;
+        }
+        Stats &entry = stats[slot.key];
+        entry.count += slot.stats.count;
+        entry.total_ns += slot.stats.total_ns;
+        entry.max_ns = max(entry.max_ns, slot.stats.max_ns);
+        slot.used = false;
+    }
+}
+
+string MonitorProfiler::report(jvmtiEnv &jvmti) {
+    size_t dropped = 0;
+    {
+        lock_guard<mutex> guard(buffers_lock);
+        for (auto it = buffers.begin(); it != buffers.end();) {
+            ThreadBuffer *buffer = *it;
+            bool released = buffer->released.load(memory_order_acquire);
+
+            /* An update that saw the old table is waited for, the next ones see the other table */
+            unsigned int old = buffer->active.load(memory_order_relaxed);
+            buffer->active.store(1 - old);
+            while ((buffer->updates.load(memory_order_acquire) & 1) != 0) {
+                this_thread::yield();
+            }
+            merge(buffer->tables[old]);
+
+            if (released) {
+                /* The thread is gone, its buffer can serve a new one */
+                merge(buffer->tables[1 - old]);
+                buffer->released.store(false, memory_order_relaxed);
+                buffer->started_ns = 0;
+                free_buffers.push_back(buffer);
+                it = buffers.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        for (ThreadBuffer *buffer : buffers) {
+            dropped += buffer->dropped.load(memory_order_relaxed);
+        }
+        for (ThreadBuffer *buffer : free_buffers) {
+            dropped += buffer->dropped.load(memory_order_relaxed);
+        }
+    }
+
+    vector<pair<Key, Stats>> entries(stats.begin(), stats.end());
+    stats.clear();
+
+    jlong contended_ns = 0;
+    jlong waited_ns = 0;
+    for (auto &entry : entries) {
+        (entry.first.wait ? waited_ns : contended_ns) += entry.second.total_ns;
+    }
+
+    size_t n = min(top, entries.size());
+    partial_sort(entries.begin(), entries.begin() + n, entries.end(),
+                 [](const pair<Key, Stats> &a, const pair<Key, Stats> &b) {
+                     return a.second.total_ns > b.second.total_ns;
+                 });
+
+    string ret = (boost::format("Monitor contention: %.3f ms blocked on enter, %.3f ms in wait, "
+                                        "%s records dropped (since start)\n")
+                  % (contended_ns / 1e6) % (waited_ns / 1e6) % dropped).str();
+
+    auto join_lines = [](string a, string b) { return a + "\n\t\t\t" + b; };
+    for (size_t i = 0; i < n; i++) {
+        const Key &key = entries[i].first;
+        const Stats &entry = entries[i].second;
+        ret += (boost::format("\t%s %s: %s times, total %.3f ms, max %.3f ms\n\t\tblocked at #%s%s\n")
+                % (key.wait ? "wait" : "enter") % classes.get_signature(key.class_id) % entry.count
+                % (entry.total_ns / 1e6) % (entry.max_ns / 1e6) % key.stack_id
+                % join(stacks.get_stack_trace(jvmti, key.stack_id, REPORT_STACK_DEPTH), join_lines)).str();
+        if (!key.wait && key.owner_stack_id != 0) {
+            ret += (boost::format("\t\towner at #%s%s\n")
+                    % key.owner_stack_id
+                    % join(stacks.get_stack_trace(jvmti, key.owner_stack_id, REPORT_STACK_DEPTH), join_lines)).str();
+        }
+    }
+    return ret;
+}
@@ -0,0 +1,131 @@
+#ifndef JEFF_NATIVE_AGENT_MONITORPROFILER_HPP
+#define JEFF_NATIVE_AGENT_MONITORPROFILER_HPP
+
+#include <jni.h>
+#include <jvmti.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+class ClassRegistry;
+
+class StackRegistry;
+
+//
+// Monitor contention profiler.
+//
+// JVMTI_EVENT_MONITOR_CONTENDED_ENTER/ENTERED measure how long a thread was blocked
+// on a monitor owned by another thread, JVMTI_EVENT_MONITOR_WAIT/WAITED how long it
+// spent in Object.wait(). The blocked time is keyed by the monitor class, the stack
+// of the blocked thread and (for contention) the stack of the owner at that time.
+//
+// Every thread aggregates into its own small table (count, total and maximum per
+// key), so the Java threads never share a cache line or a lock, and a hot lock
+// takes one slot however often it is contended. A thread has two tables: the
+// reporter switches it to the other one, waits until an update in progress is
+// done and merges the old one, then reports the top contended locks with the
+// total and maximum blocked time. A key that finds its table full is dropped
+// and counted.
+//
+class MonitorProfiler : boost::noncopyable {
+public:
+    MonitorProfiler(ClassRegistry &classes, StackRegistry &stacks, bool capture_owners, size_t top);
+
+    ~MonitorProfiler();
+
+    // Enables the monitor events, requires the live phase
+    jvmtiError start(jvmtiEnv &jvmti);
+
+    jvmtiError stop(jvmtiEnv &jvmti);
+
+    // Called from JVMTI_EVENT_MONITOR_CONTENDED_ENTER and JVMTI_EVENT_MONITOR_WAIT
+    void blocking(jvmtiEnv &jvmti, JNIEnv &jni, jthread thread, jobject object, bool wait);
+
+    // Called from JVMTI_EVENT_MONITOR_CONTENDED_ENTERED and JVMTI_EVENT_MONITOR_WAITED
+    void unblocked(bool wait);
+
+    // Drains the per-thread buffers and returns the top contended monitors for the period
+    std::string report(jvmtiEnv &jvmti);
+
+private:
+    struct Record {
+        bool wait;
+        jint class_id;
+        jlong stack_id;
+        jlong owner_stack_id;
+    };
+
+    struct Key {
+        bool wait;
+        jint class_id;
+        jlong stack_id;
+        jlong owner_stack_id;
+
+        bool operator==(const Key &other) const {
+            return wait == other.wait && class_id == other.class_id && stack_id == other.stack_id &&
+                   owner_stack_id == other.owner_stack_id;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key &key) const {
+            return std::hash<jlong>()((key.stack_id * 31 + key.owner_stack_id) * 31 + key.class_id) ^ key.wait;
+        }
+    };
+
+    struct Stats {
+        jlong count;
+        jlong total_ns;
+        jlong max_ns;
+    };
+
+    struct Slot {
+        bool used;
+        Key key;
+        Stats stats;
+    };
+
+    static const size_t TABLE_SLOTS = 64;
+
+    // Owned by a single Java thread while it is alive, recycled afterwards
+    struct ThreadBuffer {
+        ThreadBuffer();
+
+        Record pending;
+        jlong started_ns;
+        /* The thread updates tables[active], the reporter merges and clears the other one */
+        Slot tables[2][TABLE_SLOTS];
+        std::atomic<unsigned int> active;
+        /* Odd while the thread updates its table */
+        std::atomic<unsigned int> updates;
+        std::atomic<uint64_t> dropped;
+        std::atomic<bool> released;
+    };
+
+    ThreadBuffer &get_thread_buffer();
+
+    // Adds the slots to the stats of the period and clears them, on the reporter thread
+    void merge(Slot *table);
+
+    ClassRegistry &classes;
+    StackRegistry &stacks;
+    const bool capture_owners;
+    const size_t top;
+
+    /* Guards the buffer lists, taken once per thread and by the reporter */
+    std::mutex buffers_lock;
+    std::vector<ThreadBuffer *> buffers;
+    std::vector<ThreadBuffer *> free_buffers;
+
+    /* Owned by the reporter thread */
+    std::unordered_map<Key, Stats, KeyHash> stats;
+};
+
+#endif //JEFF_NATIVE_AGENT_MONITORPROFILER_HPP
@@ -0,0 +1,268 @@
+#include "PerfMap.hpp"
+
+#include <jvmticmlr.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+
+#include <boost/format.hpp>
+
+#include "jvmti.hpp"
+
+using namespace std;
+using namespace jeff;
+
+/* Entries waiting for the writer, past it the new ones are dropped (and counted) */
+static const size_t MAX_QUEUED = 64 * 1024;
+
+/* Longer inline chains are cut, the innermost methods are kept */
+static const jint MAX_INLINE_DEPTH = 8;
+
+PerfMap::PerfMap(const std::string path, bool inlining)
+        : path(path),
+          inlining(inlining),
+          stopped(false),
+          methods(0),
+          inlined_ranges(0),
+          stubs(0),
+          unloaded(0),
+          dropped(0),
+          written_bytes(0) {
+    // Empty
+}
+
+PerfMap::~PerfMap() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopped = true;
+    }
+    queued.notify_all();
+    if (writer.joinable()) {
+        writer.join();
+    }
+}
+
+jvmtiError PerfMap::start(jvmtiEnv &jvmti) {
+    if (!writer.joinable()) {
+        /* A new map for the process, perf reads the whole file */
+        file.open(path.c_str(), std::ios::out | std::ios::trunc);
+        if (!file) {
+            std::cerr << boost::format("Cannot open the perf map '%s'\n") % path;
+        }
+        writer = std::thread([this]() { run(); });
+    }
+
+    jvmtiError error;
+
+    error = jvmti.SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_COMPILED_METHOD_LOAD, (jthread) NULL);
+    if (is_jvmti_error(jvmti, error, "Cannot set event notification: JVMTI_EVENT_COMPILED_METHOD_LOAD")) {
+        return error;
+    }
+
+    error = jvmti.SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_COMPILED_METHOD_UNLOAD, (jthread) NULL);
+    if (is_jvmti_error(jvmti, error, "Cannot set event notification: JVMTI_EVENT_COMPILED_METHOD_UNLOAD")) {
+        return error;
+    }
+
+    error = jvmti.SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_DYNAMIC_CODE_GENERATED, (jthread) NULL);
+    if (is_jvmti_error(jvmti, error, "Cannot set event notification: JVMTI_EVENT_DYNAMIC_CODE_GENERATED")) {
+        return error;
+    }
+    return JVMTI_ERROR_NONE;
+}
+
+jvmtiError PerfMap::stop(jvmtiEnv &jvmti) {
+    jvmtiError error;
+
+    error = jvmti.SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_COMPILED_METHOD_LOAD, (jthread) NULL);
+    if (is_jvmti_error(jvmti, error, "Cannot disable event notification: JVMTI_EVENT_COMPILED_METHOD_LOAD")) {
+        return error;
+    }
+
+    error = jvmti.SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_COMPILED_METHOD_UNLOAD, (jthread) NULL);
+    if (is_jvmti_error(jvmti, error, "Cannot disable event notification: JVMTI_EVENT_COMPILED_METHOD_UNLOAD")) {
+        return error;
+    }
+
+    error = jvmti.SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_DYNAMIC_CODE_GENERATED, (jthread) NULL);
+    if (is_jvmti_error(jvmti, error, "Cannot disable event notification: JVMTI_EVENT_DYNAMIC_CODE_GENERATED")) {
+        return error;
+    }
+    return JVMTI_ERROR_NONE;
+}
+
+jvmtiError PerfMap::generate_events(jvmtiEnv &jvmti) {
+    jvmtiError error;
+
+    error = jvmti.GenerateEvents(JVMTI_EVENT_DYNAMIC_CODE_GENERATED);
+    if (is_jvmti_error(jvmti, error, "Cannot generate the events: JVMTI_EVENT_DYNAMIC_CODE_GENERATED")) {
+        return error;
+    }
+
+    error = jvmti.GenerateEvents(JVMTI_EVENT_COMPILED_METHOD_LOAD);
+    if (is_jvmti_error(jvmti, error, "Cannot generate the events: JVMTI_EVENT_COMPILED_METHOD_LOAD")) {
+        return error;
+    }
+    return JVMTI_ERROR_NONE;
+}
+
+void PerfMap::method_loaded(jvmtiEnv &jvmti, jmethodID method, jint code_size, const void *code_address,
+                            const void *compile_info) {
+    uintptr_t start = reinterpret_cast<uintptr_t>(code_address);
+    uintptr_t end = start + (size_t) code_size;
+
+    std::vector<Entry> entries;
+    if (inlining && compile_info != nullptr) {
+        get_inlined_ranges(jvmti, method, start, end, compile_info, entries);
+    }
+    if (entries.empty()) {
+        Entry entry = {start, (size_t) code_size, get_name(jvmti, method)};
+        entries.push_back(std::move(entry));
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    methods++;
+    inlined_ranges += entries.size() - 1;
+    enqueue(entries);
+}
+
+void PerfMap::method_unloaded() {
+    std::lock_guard<std::mutex> guard(lock);
+    unloaded++;
+}
+
+void PerfMap::code_generated(const char *name, const void *address, jint length) {
+    std::vector<Entry> entries(1);
+    entries[0].address = reinterpret_cast<uintptr_t>(address);
+    entries[0].size = (size_t) length;
+    entries[0].name = (name != nullptr) ? name : "stub";
+
+    std::lock_guard<std::mutex> guard(lock);
+    stubs++;
+    enqueue(entries);
+}
+
+void PerfMap::enqueue(std::vector<Entry> &entries) {
+    if (stopped || queue.size() + entries.size() > MAX_QUEUED) {
+        dropped += entries.size();
+        return;
+    }
+    bool was_empty = queue.empty();
+    for (Entry &entry : entries) {
+        queue.push_back(std::move(entry));
+    }
+    if (was_empty) {
+        queued.notify_one();
+    }
+}
+
+const std::string &PerfMap::get_name(jvmtiEnv &jvmti, jmethodID method) {
+    {
+        std::lock_guard<std::mutex> guard(names_lock);
+        auto name = names.find(method);
+        if (name != names.end()) {
+            return name->second;
+        }
+    }
+
+    /* Resolved without the lock, another thread may do the same, the first one wins */
+    std::string name;
+    try {
+        name = get_method_name(jvmti, method);
+    } catch (std::exception &e) {
+        name = (boost::format("method@%p") % method).str();
+    }
+    std::lock_guard<std::mutex> guard(names_lock);
+    return names.emplace(method, std::move(name)).first->second;
+}
+
+void PerfMap::get_inlined_ranges(jvmtiEnv &jvmti, jmethodID method, uintptr_t start, uintptr_t end,
+                                 const void *compile_info, std::vector<Entry> &entries) {
+    const jvmtiCompiledMethodLoadRecordHeader *header =
+            static_cast<const jvmtiCompiledMethodLoadRecordHeader *>(compile_info);
+    for (; header != nullptr; header = header->next) {
+        if (header->kind != JVMTI_CMLR_INLINE_INFO) {
+            continue;
+        }
+        const jvmtiCompiledMethodLoadInlineRecord *record =
+                reinterpret_cast<const jvmtiCompiledMethodLoadInlineRecord *>(header);
+
+        /* A range starts at a pc whose inline chain differs from the one before, up to the next such pc */
+        std::string name = get_name(jvmti, method);
+        uintptr_t range_start = start;
+        const PCStackInfo *previous = nullptr;
+        for (jint i = 0; i < record->numpcs; i++) {
+            const PCStackInfo &info = record->pcinfo[i];
+            uintptr_t pc = reinterpret_cast<uintptr_t>(info.pc);
+            if (pc < range_start || pc >= end) {
+                continue;
+            }
+            if (previous != nullptr && previous->numstackframes == info.numstackframes
+                && std::equal(info.methods, info.methods + info.numstackframes, previous->methods)) {
+                continue;
+            }
+            if (pc > range_start) {
+                Entry entry = {range_start, pc - range_start, name};
+                entries.push_back(std::move(entry));
+            }
+
+            /* The methods go from the innermost to the compiled one (the last), the name the other way */
+            name = get_name(jvmti, method);
+            jint inlined = std::min(info.numstackframes - 1, MAX_INLINE_DEPTH);
+            for (jint frame = inlined - 1; frame >= 0; frame--) {
+                name += "->";
+                name += get_name(jvmti, info.methods[frame]);
+            }
+            range_start = pc;
+            previous = &info;
+        }
+        if (range_start < end) {
+            Entry entry = {range_start, end - range_start, name};
+            entries.push_back(std::move(entry));
+        }
+        return;
+    }
+}
+
+void PerfMap::run() {
+    std::vector<Entry> batch;
+    std::string buffer;
+    char line[64];
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        queued.wait(guard, [this]() { return stopped || !queue.empty(); });
+        if (queue.empty()) { // Stopped and everything was written
+            break;
+        }
+        batch.swap(queue);
+        guard.unlock();
+
+        /* "<start> <size> <name>", both numbers in hex */
+        buffer.clear();
+        for (const Entry &entry : batch) {
+            int length = std::snprintf(line, sizeof(line), "%llx %llx ",
+                                       (unsigned long long) entry.address, (unsigned long long) entry.size);
+            buffer.append(line, (size_t) length);
+            buffer.append(entry.name);
+            buffer.push_back('\n');
+        }
+        file.write(buffer.data(), buffer.size());
+        file.flush();
+        batch.clear();
+
+        guard.lock();
+        if (file) {
+            written_bytes += buffer.size();
+        } else {
+            file.clear();
+        }
+    }
+}
+
+std::string PerfMap::report() {
+    std::lock_guard<std::mutex> guard(lock);
+    return (boost::format("Perf map '%s': %s methods, %s inlined ranges, %s stubs, %s unloaded, %s dropped, "
+                                  "%s bytes written\n")
+            % path % methods % inlined_ranges % stubs % unloaded % dropped % written_bytes).str();
+}
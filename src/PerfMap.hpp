@@ -0,0 +1,100 @@
+#ifndef JEFF_NATIVE_AGENT_PERFMAP_HPP
+#define JEFF_NATIVE_AGENT_PERFMAP_HPP
+
+#include <jni.h>
+#include <jvmti.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+//
+// Writes the JIT-compiled code of the VM to /tmp/perf-<pid>.map, so Linux perf can
+// name the compiled Java frames.
+//
+// JVMTI_EVENT_COMPILED_METHOD_LOAD and JVMTI_EVENT_DYNAMIC_CODE_GENERATED (the
+// interpreter, the stubs) come on the compiler threads, where the callbacks only
+// resolve the method names, cached per jmethodID, and queue the entries. The
+// writer thread formats and appends them in batches, one write and flush per
+// batch. With the inlining detail, the code of a method is split into the ranges
+// of its inlined methods, e.g. "LFoo;#a()V->LBar;#b()V", by the inline records
+// of the compile info.
+//
+// The map is append-only, JVMTI_EVENT_COMPILED_METHOD_UNLOAD is only counted; a
+// later method at the same address is appended after the unloaded one.
+//
+class PerfMap : boost::noncopyable {
+public:
+    PerfMap(const std::string path, bool inlining);
+
+    // Writes what is queued
+    ~PerfMap();
+
+    // Starts the writer and enables the code events, from the OnLoad phase on
+    jvmtiError start(jvmtiEnv &jvmti);
+
+    jvmtiError stop(jvmtiEnv &jvmti);
+
+    // Replays the code that was generated before start(), requires the live phase
+    jvmtiError generate_events(jvmtiEnv &jvmti);
+
+    // Called from JVMTI_EVENT_COMPILED_METHOD_LOAD
+    void method_loaded(jvmtiEnv &jvmti, jmethodID method, jint code_size, const void *code_address,
+                       const void *compile_info);
+
+    // Called from JVMTI_EVENT_COMPILED_METHOD_UNLOAD
+    void method_unloaded();
+
+    // Called from JVMTI_EVENT_DYNAMIC_CODE_GENERATED, also in the primordial phase
+    void code_generated(const char *name, const void *address, jint length);
+
+    std::string report();
+
+private:
+    struct Entry {
+        uintptr_t address;
+        size_t size;
+        std::string name;
+    };
+
+    void run();
+
+    void enqueue(std::vector<Entry> &entries);
+
+    // Cached, unknown methods (e.g. of an unloaded class) are named by their id
+    const std::string &get_name(jvmtiEnv &jvmti, jmethodID method);
+
+    // The ranges of the inlined methods of the code, empty without the inline records
+    void get_inlined_ranges(jvmtiEnv &jvmti, jmethodID method, uintptr_t start, uintptr_t end,
+                            const void *compile_info, std::vector<Entry> &entries);
+
+    const std::string path;
+    const bool inlining;
+
+    std::mutex names_lock;
+    std::unordered_map<jmethodID, std::string> names;
+
+    /* The queue and the counters are guarded by the lock */
+    std::mutex lock;
+    std::condition_variable queued;
+    std::vector<Entry> queue;
+    bool stopped;
+    uint64_t methods;
+    uint64_t inlined_ranges;
+    uint64_t stubs;
+    uint64_t unloaded;
+    uint64_t dropped;
+    uint64_t written_bytes;
+
+    std::ofstream file;
+    std::thread writer;
+};
+
+#endif //JEFF_NATIVE_AGENT_PERFMAP_HPP
@@ -0,0 +1,69 @@
+#ifndef JEFF_NATIVE_AGENT_RATELIMITER_HPP
+#define JEFF_NATIVE_AGENT_RATELIMITER_HPP
+
+#include <jni.h>
+
+#include <atomic>
+
+#include <boost/noncopyable.hpp>
+
+#include "clock.hpp"
+
+//
+// Caps how many events per second are captured, e.g. the expensive exception stack traces.
+//
+// A fixed one second window with an atomic counter: a few relaxed atomic operations per
+// event and no locks, at the price of up to twice the rate around the window boundary.
+//
+class RateLimiter : boost::noncopyable {
+public:
+    // 0 means no limit
+    explicit RateLimiter(jlong per_second)
+            : per_second(per_second),
+              window(0),
+              count(0),
+              rejected(0) {
+        // Empty
+    }
+
+    void set_rate(jlong value) {
+        per_second.store(value, std::memory_order_relaxed);
+    }
+
+    jlong get_rate() const {
+        return per_second.load(std::memory_order_relaxed);
+    }
+
+    // True if the event fits into the budget of the current second
+    bool try_acquire() {
+        jlong limit = per_second.load(std::memory_order_relaxed);
+        if (limit <= 0) {
+            return true;
+        }
+
+        jlong now = jeff::monotonic_millis() / 1000;
+        jlong current = window.load(std::memory_order_relaxed);
+        if (current != now && window.compare_exchange_strong(current, now, std::memory_order_relaxed)) {
+            count.store(0, std::memory_order_relaxed);
+        }
+        if (count.fetch_add(1, std::memory_order_relaxed) < limit) {
+            return true;
+        }
+        rejected.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // Events over the budget since the start
+    jlong get_rejected() const {
+        return rejected.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<jlong> per_second;
+    /* Monotonic second of the current window */
+    std::atomic<jlong> window;
+    std::atomic<jlong> count;
+    std::atomic<jlong> rejected;
+};
+
+#endif //JEFF_NATIVE_AGENT_RATELIMITER_HPP
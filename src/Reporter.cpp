@@ -0,0 +1,248 @@
+#include "Reporter.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <iostream>
+
+#include "clock.hpp"
+#include "jni.hpp"
+#include "jvmti.hpp"
+
+#include "GlobalAgentData.hpp"
+
+using namespace jeff;
+
+/* How long stop() waits for the task in progress */
+static const jlong STOP_TIMEOUT_MS = 5000;
+
+Reporter::Reporter()
+        : lock(nullptr),
+          stopped(false),
+          running(false) {
+    // Empty
+}
+
+Reporter::~Reporter() {
+    // Empty
+}
+
+void Reporter::schedule(const std::string name, jlong interval_ms, Task task) {
+    Entry entry = {name, interval_ms, get_next_run_ms(monotonic_millis(), interval_ms), task};
+    if (lock == nullptr) {
+        tasks.push_back(entry);
+        return;
+    }
+
+    jvmtiEnv &jvmti = *gdata.jvmti;
+    jvmti.RawMonitorEnter(lock);
+    {
+        tasks.push_back(entry);
+        jvmti.RawMonitorNotifyAll(lock);
+    }
+    jvmti.RawMonitorExit(lock);
+}
+
+bool Reporter::run_now(jvmtiEnv &jvmti, const std::string name) {
+    if (lock == nullptr) {
+        return false;
+    }
+
+    bool found = false;
+    jvmti.RawMonitorEnter(lock);
+    {
+        for (Entry &entry : tasks) {
+            if (entry.name == name) {
+                entry.next_run_ms = 0;
+                found = true;
+            }
+        }
+        jvmti.RawMonitorNotifyAll(lock);
+    }
+    jvmti.RawMonitorExit(lock);
+    return found;
+}
+
+bool Reporter::submit(jvmtiEnv &jvmti, const std::string name, Task task) {
+    if (lock == nullptr) {
+        return false;
+    }
+
+    bool accepted = false;
+    jvmti.RawMonitorEnter(lock);
+    {
+        if (running && !stopped) {
+            Entry entry = {name, 0, 0, task};
+            submitted.push_back(entry);
+            accepted = true;
+            jvmti.RawMonitorNotifyAll(lock);
+        }
+    }
+    jvmti.RawMonitorExit(lock);
+    return accepted;
+}
+
+bool Reporter::reschedule(jvmtiEnv &jvmti, const std::string name, jlong interval_ms) {
+    if (lock == nullptr) {
+        for (Entry &entry : tasks) {
+            if (entry.name == name) {
+                entry.interval_ms = interval_ms;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool found = false;
+    jvmti.RawMonitorEnter(lock);
+    {
+        for (Entry &entry : tasks) {
+            if (entry.name == name) {
+                entry.interval_ms = interval_ms;
+                entry.next_run_ms = get_next_run_ms(monotonic_millis(), interval_ms);
+                found = true;
+            }
+        }
+        jvmti.RawMonitorNotifyAll(lock);
+    }
+    jvmti.RawMonitorExit(lock);
+    return found;
+}
+
+jvmtiError Reporter::start(jvmtiEnv &jvmti, JNIEnv &jni) {
+    jvmtiError error;
+    if (lock == nullptr) {
+        error = jvmti.CreateRawMonitor("reporter", &lock);
+        if (is_jvmti_error(jvmti, error, "Cannot create raw monitor")) return error;
+    }
+
+    jvmti.RawMonitorEnter(lock);
+    {
+        /* A thread that did not stop in time is still in its task, a new one would run next to it */
+        jlong deadline_ms = monotonic_millis() + STOP_TIMEOUT_MS;
+        while (running && monotonic_millis() < deadline_ms) {
+            jvmti.RawMonitorWait(lock, std::max(deadline_ms - monotonic_millis(), (jlong) 1));
+        }
+        if (running) {
+            jvmti.RawMonitorExit(lock);
+            std::cerr << "Reporter thread is still running, it is not started again\n";
+            return JVMTI_ERROR_INVALID_THREAD;
+        }
+
+        jlong now = monotonic_millis();
+        for (Entry &entry : tasks) {
+            entry.next_run_ms = get_next_run_ms(now, entry.interval_ms);
+        }
+        stopped = false;
+        running = true;
+    }
+    jvmti.RawMonitorExit(lock);
+
+    jobject thread = new_thread(jni, "jeff-reporter");
+    error = jvmti.RunAgentThread(thread, &Reporter::run, this, JVMTI_THREAD_MIN_PRIORITY);
+    jni.DeleteLocalRef(thread);
+    if (is_jvmti_error(jvmti, error, "Cannot start reporter thread")) {
+        jvmti.RawMonitorEnter(lock);
+        running = false;
+        jvmti.RawMonitorExit(lock);
+        return error;
+    }
+    return JVMTI_ERROR_NONE;
+}
+
+bool Reporter::stop(jvmtiEnv &jvmti) {
+    return stop(jvmti, monotonic_millis() + STOP_TIMEOUT_MS);
+}
+
+bool Reporter::stop(jvmtiEnv &jvmti, jlong deadline_ms) {
+    if (lock == nullptr) {
+        return true;
+    }
+
+    bool exited;
+    jvmti.RawMonitorEnter(lock);
+    {
+        stopped = true;
+        jvmti.RawMonitorNotifyAll(lock);
+
+        while (running && monotonic_millis() < deadline_ms) {
+            jvmti.RawMonitorWait(lock, std::max(deadline_ms - monotonic_millis(), (jlong) 1));
+        }
+        exited = !running;
+        if (!exited) {
+            std::cerr << "Reporter thread did not finish the task in progress in time\n";
+        }
+    }
+    jvmti.RawMonitorExit(lock);
+    return exited;
+}
+
+bool Reporter::is_running(jvmtiEnv &jvmti) {
+    if (lock == nullptr) {
+        return false;
+    }
+    jvmti.RawMonitorEnter(lock);
+    bool result = running;
+    jvmti.RawMonitorExit(lock);
+    return result;
+}
+
+void JNICALL Reporter::run(jvmtiEnv *jvmti, JNIEnv *jni, void *arg) {
+    static_cast<Reporter *>(arg)->loop(*jvmti, *jni);
+}
+
+void Reporter::loop(jvmtiEnv &jvmti, JNIEnv &jni) {
+    jvmti.RawMonitorEnter(lock);
+    while (!stopped) {
+        jlong now = monotonic_millis();
+        jlong next_run_ms = now + STOP_TIMEOUT_MS;
+
+        /* Submitted tasks go first, in the order they came */
+        std::vector<Entry> due;
+        due.swap(submitted);
+        for (Entry &entry : tasks) {
+            if (entry.next_run_ms <= now) {
+                due.push_back(entry);
+                entry.next_run_ms = get_next_run_ms(now, entry.interval_ms);
+            }
+            next_run_ms = std::min(next_run_ms, entry.next_run_ms);
+        }
+
+        if (due.empty()) {
+            jvmti.RawMonitorWait(lock, std::max(next_run_ms - now, (jlong) 1));
+            continue;
+        }
+
+        /* Tasks run outside of the monitor, so they can not delay stop() or schedule() */
+        jvmti.RawMonitorExit(lock);
+        for (Entry &entry : due) {
+            run_task(jvmti, jni, entry);
+        }
+        jvmti.RawMonitorEnter(lock);
+    }
+    running = false;
+    jvmti.RawMonitorNotifyAll(lock);
+    jvmti.RawMonitorExit(lock);
+}
+
+void Reporter::flush(jvmtiEnv &jvmti, JNIEnv &jni) {
+    for (Entry &entry : tasks) {
+        if (entry.interval_ms > 0) {
+            run_task(jvmti, jni, entry);
+        }
+    }
+}
+
+void Reporter::run_task(jvmtiEnv &jvmti, JNIEnv &jni, Entry &entry) {
+    try {
+        entry.task(jvmti, jni);
+    } catch (std::exception &e) {
+        std::cerr << "Reporter task '" << entry.name << "' failed: " << e.what() << "\n";
+    }
+    if (jni.ExceptionCheck()) {
+        jni.ExceptionClear();
+    }
+}
+
+jlong Reporter::get_next_run_ms(jlong now, jlong interval_ms) {
+    return (interval_ms > 0) ? now + interval_ms : std::numeric_limits<jlong>::max();
+}
@@ -0,0 +1,81 @@
+#ifndef JEFF_NATIVE_AGENT_REPORTER_HPP
+#define JEFF_NATIVE_AGENT_REPORTER_HPP
+
+#include <jni.h>
+#include <jvmti.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+//
+// Runs periodic agent work (aggregation, reporting) on a dedicated JVMTI agent thread,
+// so none of it is done on the Java threads that triggered the events.
+//
+// The thread sleeps on a raw monitor, which is also used to wake it up when the
+// reporter is stopped.
+//
+class Reporter : boost::noncopyable {
+public:
+    typedef std::function<void(jvmtiEnv &, JNIEnv &)> Task;
+
+    Reporter();
+
+    ~Reporter();
+
+    // Registers a task that runs every interval_ms milliseconds, the first run is after one interval.
+    // Tasks with no positive interval only run on demand.
+    void schedule(const std::string name, jlong interval_ms, Task task);
+
+    // Wakes up the reporter thread to run the task as soon as possible, false if there is no such task
+    bool run_now(jvmtiEnv &jvmti, const std::string name);
+
+    // Runs the task once on the reporter thread as soon as possible, false if the reporter is not running
+    bool submit(jvmtiEnv &jvmti, const std::string name, Task task);
+
+    // Changes the interval of a task, counted from now, false if there is no such task
+    bool reschedule(jvmtiEnv &jvmti, const std::string name, jlong interval_ms);
+
+    // Starts the reporter thread, must be called in the live phase. A stopped reporter can be started again,
+    // once its thread has finished; a thread still in its task after a while is an error.
+    jvmtiError start(jvmtiEnv &jvmti, JNIEnv &jni);
+
+    // Wakes up the reporter thread and waits until it finishes the task in progress, false when it did not
+    // exit in time and may still run the task
+    bool stop(jvmtiEnv &jvmti);
+
+    // Same, waiting at most until the deadline (monotonic_millis())
+    bool stop(jvmtiEnv &jvmti, jlong deadline_ms);
+
+    // The thread has not exited yet, also after a stop() that timed out
+    bool is_running(jvmtiEnv &jvmti);
+
+    // Runs every periodic task once on the calling thread, used to report what is still buffered after stop()
+    void flush(jvmtiEnv &jvmti, JNIEnv &jni);
+
+private:
+    struct Entry {
+        std::string name;
+        jlong interval_ms;
+        jlong next_run_ms;
+        Task task;
+    };
+
+    static void JNICALL run(jvmtiEnv *jvmti, JNIEnv *jni, void *arg);
+
+    void loop(jvmtiEnv &jvmti, JNIEnv &jni);
+
+    static void run_task(jvmtiEnv &jvmti, JNIEnv &jni, Entry &entry);
+
+    static jlong get_next_run_ms(jlong now, jlong interval_ms);
+
+    jrawMonitorID lock;
+    std::vector<Entry> tasks;
+    std::vector<Entry> submitted;
+    bool stopped;
+    bool running;
+};
+
+#endif //JEFF_NATIVE_AGENT_REPORTER_HPP
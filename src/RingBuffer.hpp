@@ -0,0 +1,115 @@
+#ifndef JEFF_NATIVE_AGENT_RINGBUFFER_HPP
+#define JEFF_NATIVE_AGENT_RINGBUFFER_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include <boost/noncopyable.hpp>
+
+//
+// Bounded multi-producer multi-consumer queue (D. Vyukov's design).
+//
+// All memory is allocated up-front, so push() and pop() never allocate and never
+// block, which makes the buffer safe to use from JVMTI event callbacks. When the
+// buffer is full push() fails and the element is counted as dropped.
+//
+template<typename T>
+class RingBuffer : boost::noncopyable {
+public:
+    // The capacity is rounded up to the next power of two.
+    explicit RingBuffer(size_t capacity)
+            : mask(round_up(capacity) - 1),
+              cells(new Cell[mask + 1]),
+              enqueue_pos(0),
+              dequeue_pos(0),
+              dropped_(0) {
+        for (size_t i = 0; i <= mask; i++) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool push(const T &value) {
+        Cell *cell;
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &cells[pos & mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t) sequence - (intptr_t) pos;
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = value;
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &value) {
+        Cell *cell;
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &cells[pos & mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t) sequence - (intptr_t) (pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        value = cell->value;
+        cell->sequence.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t capacity() const {
+        return mask + 1;
+    }
+
+    // Number of elements rejected because the buffer was full
+    size_t dropped() const {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    static size_t round_up(size_t capacity) {
+        size_t ret = 2;
+        while (ret < capacity) {
+            ret <<= 1;
+        }
+        return ret;
+    }
+
+    /* Keeps the producer and consumer positions on separate cache lines */
+    typedef char Padding[64];
+
+    const size_t mask;
+    std::unique_ptr<Cell[]> cells;
+
+    Padding padding0;
+    std::atomic<size_t> enqueue_pos;
+    Padding padding1;
+    std::atomic<size_t> dequeue_pos;
+    Padding padding2;
+    std::atomic<size_t> dropped_;
+};
+
+#endif //JEFF_NATIVE_AGENT_RINGBUFFER_HPP
@@ -1,22 +1,77 @@
 #include "Sender.hpp"
 
+#include <cstdio>
+#include <stdexcept>
+
 #include <boost/throw_exception.hpp>
 #include <boost/asio/ip/tcp.hpp>
 
+#include "CompositeSender.hpp"
+#include "FileSender.hpp"
+#include "SocketSender.hpp"
 #include "StdSender.hpp"
 #include "TcpSender.hpp"
+#include "TscClock.hpp"
+
+const char *get_message_type_name(MessageType type) {
+    switch (type) {
+        case MessageType::EVENT:
+            return "events";
+        case MessageType::REPORT:
+            return "reports";
+        case MessageType::FATAL:
+            return "fatal";
+    }
+    return "unknown";
+}
+
+void Sender::send(std::string value, MessageType type) {
+    if (value.empty()) {
+        return;
+    }
+    /* A record without its newline would run into the next one */
+    size_t header = value.find('\n');
+    if (header == std::string::npos) {
+        value.push_back('\n');
+        header = value.size() - 1;
+    }
+    char stamp[32];
+    int length = snprintf(stamp, sizeof(stamp), "\tTime: %lld\n", (long long) TscClock::nanos());
+    value.insert(header + 1, stamp, (size_t) length);
+    send(std::make_shared<const std::string>(std::move(value)), type);
+}
 
 std::unique_ptr<Sender> Sender::create() {
     Sender *ret = new StdSender();
     return std::unique_ptr<Sender>(ret);
 }
 
-std::unique_ptr<Sender> Sender::create(std::string host, std::string port) {
+std::unique_ptr<Sender> Sender::create(std::string host, std::string port, const SenderConfig &config) {
     try {
         auto query = boost::asio::ip::tcp::resolver::query(host, port);
-        Sender *client = new TcpSender(query);
+        Sender *client = new TcpSender(query, config);
         return std::unique_ptr<Sender>(client);
     } catch (std::exception &e) {
         BOOST_THROW_EXCEPTION(e);
     }
-}
\ No newline at end of file
+}
+
+std::unique_ptr<Sender> Sender::create(SocketTransport transport, std::string address, std::string port,
+                                       const SenderConfig &config) {
+#if defined(_WIN32)
+    BOOST_THROW_EXCEPTION(std::runtime_error("Only the TCP connection to the daemon is supported on Windows"));
+#else
+    return std::unique_ptr<Sender>(new SocketSender(transport, address, port, config));
+#endif
+}
+
+std::unique_ptr<Sender> Sender::create_file(std::string path, const SenderConfig &config) {
+    return std::unique_ptr<Sender>(new FileSender(path, config));
+}
+
+std::unique_ptr<Sender> Sender::create(std::vector<std::unique_ptr<Sender>> sinks) {
+    if (sinks.size() == 1) {
+        return std::move(sinks.front());
+    }
+    return std::unique_ptr<Sender>(new CompositeSender(std::move(sinks)));
+}
@@ -1,15 +1,77 @@
 #ifndef JEFF_NATIVE_AGENT_SENDER_H
 #define JEFF_NATIVE_AGENT_SENDER_H
 
+#include <chrono>
+#include <functional>
 #include <string>
 #include <iostream>
 #include <memory>
+#include <vector>
+
+// An encoded message, written once and shared by all the sinks it is sent to
+typedef std::shared_ptr<const std::string> Payload;
+
+// Kinds of messages, in the order of priority, each with its own share of the sender buffer
+enum class MessageType {
+    /* Detail events, e.g. the exceptions */
+    EVENT = 0,
+    /* Periodic summaries, command responses and the agent lifecycle */
+    REPORT = 1,
+    /* The VM is about to die */
+    FATAL = 2
+};
+
+static const size_t MESSAGE_TYPE_COUNT = 3;
+
+const char *get_message_type_name(MessageType type);
+
+// What a sender does with a message that fits neither the buffer nor the spill log
+enum class OverflowPolicy {
+    DROP_NEWEST,
+    DROP_OLDEST,
+    /* Keeps one of every overflow_sample_every messages (as DROP_OLDEST) and drops the rest */
+    SAMPLE,
+    /* Waits up to overflow_timeout_ms for room, stalls the JVM threads so meant for debugging only */
+    BLOCK
+};
+
+// Node-local and connection-less transports to the daemon, besides TCP
+enum class SocketTransport {
+    UNIX_STREAM,
+    UNIX_SEQPACKET,
+    UDP
+};
+
+// Buffering of the senders that can not deliver right away
+struct SenderConfig {
+    /* Messages kept in memory while the daemon is not reachable */
+    size_t buffer_bytes;
+    /* Share of the buffer the detail events can take, the rest is kept for the reports */
+    unsigned int event_quota_percent;
+    /* Directory of the on-disk overflow of the buffer, empty disables it */
+    std::string spill_directory;
+    size_t spill_bytes;
+    OverflowPolicy overflow_policy;
+    unsigned int overflow_sample_every;
+    long overflow_timeout_ms;
+    /* Maximum size of the datagrams the messages are packed into, 0 means the default of the transport */
+    size_t datagram_bytes;
+    /* Written first on every connection (not with UDP), "JVM <pid>@<host>\n" tells the daemon who is connected */
+    std::string greeting;
+};
 
 class Sender {
 public:
+    // Receives the command lines sent back by the daemon, on the sender's own thread
+    typedef std::function<void(const std::string &)> CommandHandler;
+
     virtual ~Sender() { };
 
-    virtual void send(std::string value) = 0;
+    // Thread-safe, a message that can not be delivered is dropped (and counted) and never blocks for long
+    virtual void send(Payload payload, MessageType type) = 0;
+
+    // Stamps the record with a "\tTime: <ns>" line after its header, see TscClock; a header gets its missing newline
+    void send(std::string value, MessageType type);
 
     virtual void start() = 0;
 
@@ -17,9 +79,34 @@ public:
 
     virtual void flush() = 0;
 
+    // Delivers the queued messages until the deadline and stops, what is left is written to the spill log where
+    // there is one; returns how many messages were flushed, persisted and lost, empty when there is nothing to tell
+    virtual std::string drain(std::chrono::steady_clock::time_point deadline) = 0;
+
+    // Delivery counters for the periodic report, empty when there is nothing to report
+    virtual std::string get_statistics() = 0;
+
+    // Must be set before start()
+    void set_command_handler(CommandHandler handler) {
+        command_handler = handler;
+    }
+
     static std::unique_ptr<Sender> create();
 
-    static std::unique_ptr<Sender> create(std::string host, std::string port);
+    static std::unique_ptr<Sender> create(std::string host, std::string port, const SenderConfig &config);
+
+    // The address is the socket path for the AF_UNIX transports, the host for UDP
+    static std::unique_ptr<Sender> create(SocketTransport transport, std::string address, std::string port,
+                                          const SenderConfig &config);
+
+    // Appends the messages to a local file
+    static std::unique_ptr<Sender> create_file(std::string path, const SenderConfig &config);
+
+    // Sends every message to all the sinks, each one on its own thread
+    static std::unique_ptr<Sender> create(std::vector<std::unique_ptr<Sender>> sinks);
+
+protected:
+    CommandHandler command_handler;
 };
 
 #endif //JEFF_NATIVE_AGENT_SENDER_H
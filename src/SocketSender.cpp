@@ -0,0 +1,463 @@
+#include "SocketSender.hpp"
+
+#if !defined(_WIN32)
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <vector>
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <boost/format.hpp>
+
+#ifndef MSG_NOSIGNAL
+/* SO_NOSIGPIPE is set on the socket instead */
+#define MSG_NOSIGNAL 0
+#endif
+
+static const long FLUSH_TIMEOUT_MS = 5000;
+
+/* How long stop() lets the writer send the rest of the queue, then the send in progress is given up */
+static const long STOP_TIMEOUT_MS = 1000;
+
+/* A blocked send or connect returns after this long, to see whether the drain is over */
+static const long SEND_TIMEOUT_MS = 250;
+
+/* Reconnect backoff, doubled after every failed attempt */
+static const long INITIAL_BACKOFF_MS = 100;
+static const long MAX_BACKOFF_MS = 10 * 1000;
+
+/* Fits an Ethernet frame with the IPv4 and UDP headers */
+static const size_t UDP_DATAGRAM_BYTES = 1472;
+static const size_t SEQPACKET_DATAGRAM_BYTES = 64 * 1024;
+
+/* Datagrams per sendmmsg, and messages per datagram or per stream write */
+static const size_t DATAGRAMS_PER_CALL = 64;
+static const size_t MESSAGES_PER_CALL = 64;
+
+static size_t get_size(const std::vector<iovec> &iov, size_t begin, size_t end) {
+    size_t size = 0;
+    for (size_t i = begin; i < end; i++) {
+        size += iov[i].iov_len;
+    }
+    return size;
+}
+
+SocketSender::SocketSender(SocketTransport transport, const std::string address, const std::string port,
+                           const SenderConfig &config)
+        : transport(transport),
+          address(address),
+          port(port),
+          buffer_bytes(config.buffer_bytes),
+          datagram_bytes((config.datagram_bytes > 0) ? config.datagram_bytes
+                                                     : (transport == SocketTransport::UDP) ? UDP_DATAGRAM_BYTES
+                                                                                           : SEQPACKET_DATAGRAM_BYTES),
+          greeting(config.greeting),
+          socket_fd(-1),
+          backoff_ms(INITIAL_BACKOFF_MS),
+          queued_bytes(0),
+          writing_bytes(0),
+          stopped(false),
+          abandoned(false),
+          running(false),
+          sent_bytes(0),
+          sent_messages(0),
+          unsent_messages(0),
+          requeued_messages(0),
+          sent_datagrams(0),
+          send_calls(0),
+          failed_bytes(0),
+          connections(0) {
+    for (size_t i = 0; i < MESSAGE_TYPE_COUNT; i++) {
+        dropped_messages[i] = 0;
+        dropped_bytes[i] = 0;
+    }
+}
+
+SocketSender::~SocketSender() {
+    stop();
+}
+
+void SocketSender::start() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        running = true;
+    }
+    writer = std::thread([this]() { run(); });
+}
+
+void SocketSender::stop() {
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        stopped = true;
+        queued.notify_all();
+        /* A daemon that stopped reading would hold the writer forever, the rest is lost then */
+        if (!written.wait_for(guard, std::chrono::milliseconds(STOP_TIMEOUT_MS), [this]() { return !running; })) {
+            std::cerr << boost::format("Could not send the rest in %s ms, %s bytes queued for '%s' are lost\n")
+                         % STOP_TIMEOUT_MS % (queued_bytes + writing_bytes) % address;
+            abandoned = true;
+        }
+    }
+    if (writer.joinable()) {
+        writer.join();
+    }
+}
+
+void SocketSender::flush() {
+    std::unique_lock<std::mutex> guard(lock);
+    bool flushed = written.wait_for(guard, std::chrono::milliseconds(FLUSH_TIMEOUT_MS), [this]() {
+        return queue.empty() && writing_bytes == 0;
+    });
+    if (!flushed) {
+        std::cerr << boost::format("Could not flush in %s ms, %s bytes queued for '%s'\n")
+                     % FLUSH_TIMEOUT_MS % queued_bytes % address;
+    }
+}
+
+std::string SocketSender::drain(std::chrono::steady_clock::time_point deadline) {
+    uint64_t start_sent;
+    uint64_t start_unsent;
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        start_sent = sent_messages;
+        start_unsent = unsent_messages;
+        written.wait_until(guard, deadline, [this]() {
+            return queue.empty() && writing_bytes == 0;
+        });
+        abandoned = true;
+    }
+    stop();
+
+    std::lock_guard<std::mutex> guard(lock);
+    return (boost::format("Socket sender '%s' drained: %s messages flushed, %s lost\n")
+            % address % (sent_messages - start_sent) % (unsent_messages - start_unsent)).str();
+}
+
+void SocketSender::send(Payload payload, MessageType type) {
+    if (payload->empty()) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (queued_bytes + payload->size() > buffer_bytes && type != MessageType::FATAL) {
+            dropped_messages[(size_t) type]++;
+            dropped_bytes[(size_t) type] += payload->size();
+            return;
+        }
+        queued_bytes += payload->size();
+        queue.push_back(std::move(payload));
+    }
+    queued.notify_one();
+}
+
+void SocketSender::run() {
+    std::deque<Payload> batch;
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        queued.wait(guard, [this]() { return stopped || !queue.empty(); });
+        if (queue.empty() || abandoned) { // Stopped and everything was sent, or the drain is over
+            break;
+        }
+
+        if (socket_fd < 0) {
+            guard.unlock();
+            bool connected = connect();
+            guard.lock();
+            if (!connected) {
+                if (stopped) {
+                    break;
+                }
+                queued.wait_for(guard, std::chrono::milliseconds(backoff_ms), [this]() { return stopped; });
+                backoff_ms = std::min(MAX_BACKOFF_MS, backoff_ms * 2);
+                continue;
+            }
+        }
+
+        batch.swap(queue);
+        writing_bytes = queued_bytes;
+        queued_bytes = 0;
+        guard.unlock();
+
+        size_t written_messages = 0;
+        bool sent = (transport == SocketTransport::UNIX_STREAM) ? send_stream(batch, written_messages)
+                                                                : send_datagrams(batch);
+        if (!sent) {
+            disconnect();
+        }
+
+        guard.lock();
+        if (sent) {
+            sent_messages += batch.size();
+        } else if (transport == SocketTransport::UNIX_STREAM && !abandoned) {
+            /* Sent again ahead of the newer messages on the next connection, a message cut by the error whole */
+            sent_messages += written_messages;
+            requeued_messages += batch.size() - written_messages;
+            for (size_t i = written_messages; i < batch.size(); i++) {
+                queued_bytes += batch[i]->size();
+            }
+            queue.insert(queue.begin(), batch.begin() + written_messages, batch.end());
+        } else if (transport == SocketTransport::UNIX_STREAM) {
+            sent_messages += written_messages;
+            for (size_t i = written_messages; i < batch.size(); i++) {
+                failed_bytes += batch[i]->size();
+            }
+            unsent_messages += batch.size() - written_messages;
+        } else {
+            unsent_messages += batch.size();
+        }
+        batch.clear();
+        writing_bytes = 0;
+        written.notify_all();
+    }
+
+    /* Stopped while the daemon was not reachable, or past the deadline */
+    for (const Payload &payload : queue) {
+        failed_bytes += payload->size();
+    }
+    unsent_messages += queue.size();
+    queue.clear();
+    queued_bytes = 0;
+    running = false;
+    written.notify_all();
+    guard.unlock();
+    disconnect();
+}
+
+bool SocketSender::connect() {
+    if (transport == SocketTransport::UDP) {
+        addrinfo hints = addrinfo();
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        addrinfo *addresses = nullptr;
+        int error = getaddrinfo(address.c_str(), port.c_str(), &hints, &addresses);
+        if (error != 0) {
+            std::cerr << boost::format("Cannot resolve '%s:%s': %s\n") % address % port % gai_strerror(error);
+            return false;
+        }
+        /* Connected, so the datagrams need no address and the refusals are reported */
+        for (addrinfo *it = addresses; it != nullptr && socket_fd < 0; it = it->ai_next) {
+            int fd = socket(it->ai_family, it->ai_socktype, it->ai_protocol);
+            if (fd >= 0 && ::connect(fd, it->ai_addr, it->ai_addrlen) == 0) {
+                socket_fd = fd;
+            } else if (fd >= 0) {
+                close(fd);
+            }
+        }
+        freeaddrinfo(addresses);
+    } else {
+        sockaddr_un endpoint = sockaddr_un();
+        endpoint.sun_family = AF_UNIX;
+        if (address.size() >= sizeof(endpoint.sun_path)) {
+            std::cerr << boost::format("The socket path '%s' is too long\n") % address;
+            return false;
+        }
+        std::memcpy(endpoint.sun_path, address.c_str(), address.size() + 1);
+
+        int fd = socket(AF_UNIX, (transport == SocketTransport::UNIX_STREAM) ? SOCK_STREAM : SOCK_SEQPACKET, 0);
+        /* Bounds the connect too, when the backlog of the daemon is full */
+        if (fd >= 0) {
+            timeval timeout = {SEND_TIMEOUT_MS / 1000, (SEND_TIMEOUT_MS % 1000) * 1000};
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        }
+        if (fd >= 0 && ::connect(fd, reinterpret_cast<sockaddr *>(&endpoint), sizeof(endpoint)) == 0) {
+            socket_fd = fd;
+        } else if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    if (socket_fd < 0) {
+        std::cerr << boost::format("Cannot connect to '%s': %s\n") % address % std::strerror(errno);
+        return false;
+    }
+#ifdef SO_NOSIGPIPE
+    int enabled = 1;
+    setsockopt(socket_fd, SOL_SOCKET, SO_NOSIGPIPE, &enabled, sizeof(enabled));
+#endif
+
+    /* The first packet of a seqpacket connection, the daemon reads it as a stream */
+    if (transport != SocketTransport::UDP && !greeting.empty()) {
+        std::deque<Payload> batch = {std::make_shared<const std::string>(greeting)};
+        size_t written_messages = 0;
+        if (!send_stream(batch, written_messages)) {
+            disconnect();
+            return false;
+        }
+    }
+
+    std::cout << boost::format("Connected to '%s'\n") % address;
+    backoff_ms = INITIAL_BACKOFF_MS;
+    std::lock_guard<std::mutex> guard(lock);
+    connections++;
+    return true;
+}
+
+void SocketSender::disconnect() {
+    if (socket_fd >= 0) {
+        close(socket_fd);
+        socket_fd = -1;
+    }
+}
+
+bool SocketSender::send_stream(const std::deque<Payload> &batch, size_t &written_messages) {
+    uint64_t sent = 0;
+    uint64_t calls = 0;
+    bool failed = false;
+    std::vector<iovec> iov;
+    written_messages = 0;
+
+    size_t next = 0;
+    while (next < batch.size() && !failed) {
+        iov.clear();
+        for (; next < batch.size() && iov.size() < MESSAGES_PER_CALL; next++) {
+            iov.push_back({const_cast<char *>(batch[next]->data()), batch[next]->size()});
+        }
+
+        size_t first = 0;
+        while (first < iov.size()) {
+            msghdr header = msghdr();
+            header.msg_iov = &iov[first];
+            header.msg_iovlen = iov.size() - first;
+            ssize_t written_bytes = sendmsg(socket_fd, &header, MSG_NOSIGNAL);
+            calls++;
+            if (written_bytes < 0) {
+                if (errno == EINTR || ((errno == EAGAIN || errno == EWOULDBLOCK) && !is_abandoned())) {
+                    continue;
+                }
+                std::cerr << boost::format("Error on send to '%s': %s\n") % address % std::strerror(errno);
+                failed = true;
+                break;
+            }
+
+            /* Skips what was written, a message may be written in parts */
+            sent += written_bytes;
+            size_t remaining = (size_t) written_bytes;
+            while (first < iov.size() && remaining >= iov[first].iov_len) {
+                remaining -= iov[first].iov_len;
+                first++;
+                written_messages++;
+            }
+            if (remaining > 0) {
+                iov[first].iov_base = static_cast<char *>(iov[first].iov_base) + remaining;
+                iov[first].iov_len -= remaining;
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    sent_bytes += sent;
+    send_calls += calls;
+    return !failed;
+}
+
+bool SocketSender::send_datagrams(const std::deque<Payload> &batch) {
+    /* The messages of a datagram are consecutive in iov */
+    std::vector<iovec> iov;
+    std::vector<std::pair<size_t, size_t>> datagrams;
+    size_t datagram_size = 0;
+    iov.reserve(batch.size());
+    for (const Payload &payload : batch) {
+        bool full = datagrams.empty() || datagrams.back().second == MESSAGES_PER_CALL
+                    || datagram_size + payload->size() > datagram_bytes;
+        if (full) {
+            datagrams.push_back(std::make_pair(iov.size(), 0));
+            datagram_size = 0;
+        }
+        iov.push_back({const_cast<char *>(payload->data()), payload->size()});
+        datagrams.back().second++;
+        datagram_size += payload->size();
+    }
+
+    uint64_t sent = 0;
+    uint64_t sent_count = 0;
+    uint64_t calls = 0;
+    uint64_t failed = 0;
+    bool connected = true;
+
+    size_t first = 0;
+    while (first < datagrams.size() && connected) {
+        size_t count = std::min(DATAGRAMS_PER_CALL, datagrams.size() - first);
+#if defined(__linux__)
+        mmsghdr headers[DATAGRAMS_PER_CALL];
+        for (size_t i = 0; i < count; i++) {
+            headers[i] = mmsghdr();
+            headers[i].msg_hdr.msg_iov = &iov[datagrams[first + i].first];
+            headers[i].msg_hdr.msg_iovlen = datagrams[first + i].second;
+        }
+        int result = sendmmsg(socket_fd, headers, (unsigned int) count, MSG_NOSIGNAL);
+        calls++;
+        if (result > 0) {
+            for (int i = 0; i < result; i++) {
+                sent += headers[i].msg_len;
+            }
+        }
+#else
+        msghdr header = msghdr();
+        header.msg_iov = &iov[datagrams[first].first];
+        header.msg_iovlen = datagrams[first].second;
+        ssize_t written_bytes = sendmsg(socket_fd, &header, MSG_NOSIGNAL);
+        calls++;
+        int result = (written_bytes < 0) ? -1 : 1;
+        if (result > 0) {
+            sent += written_bytes;
+        }
+#endif
+        if (result > 0) {
+            sent_count += result;
+            first += result;
+            continue;
+        }
+        if (errno == EINTR || ((errno == EAGAIN || errno == EWOULDBLOCK) && !is_abandoned())) {
+            continue;
+        }
+
+        /* The first datagram failed, a refusal (nobody listens) or a too large one is skipped */
+        failed += get_size(iov, datagrams[first].first, datagrams[first].first + datagrams[first].second);
+        first++;
+        if (errno != EMSGSIZE && transport != SocketTransport::UDP) {
+            std::cerr << boost::format("Error on send to '%s': %s\n") % address % std::strerror(errno);
+            if (first < datagrams.size()) {
+                failed += get_size(iov, datagrams[first].first, iov.size());
+            }
+            connected = false;
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    sent_bytes += sent;
+    sent_datagrams += sent_count;
+    send_calls += calls;
+    failed_bytes += failed;
+    return connected;
+}
+
+bool SocketSender::is_abandoned() {
+    std::lock_guard<std::mutex> guard(lock);
+    return abandoned;
+}
+
+std::string SocketSender::get_statistics() {
+    std::lock_guard<std::mutex> guard(lock);
+    std::string statistics = (boost::format("Socket sender '%s': %s connections, %s bytes sent in %s datagrams "
+                                                    "with %s calls, %s bytes queued, %s messages (%s bytes) failed "
+                                                    "to be sent, %s sent again\n\tdropped:")
+                              % address % connections % sent_bytes % sent_datagrams % send_calls % queued_bytes
+                              % unsent_messages % failed_bytes % requeued_messages).str();
+    for (size_t i = 0; i < MESSAGE_TYPE_COUNT; i++) {
+        statistics += (boost::format(" %s %s (%s bytes)%s")
+                       % get_message_type_name((MessageType) i) % dropped_messages[i] % dropped_bytes[i]
+                       % ((i + 1 < MESSAGE_TYPE_COUNT) ? "," : "\n")).str();
+    }
+    return statistics;
+}
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef JEFF_NATIVE_AGENT_SOCKETSENDER_HPP
+#define JEFF_NATIVE_AGENT_SOCKETSENDER_HPP
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "Sender.hpp"
+
+//
+// Sends the messages over an AF_UNIX stream or seqpacket socket, or over UDP, to a
+// daemon on the same node. Plain blocking sockets on one writer thread, without the
+// heartbeats of the TcpSender, as the cheap path for hosts packed with JVMs. POSIX only.
+// A send or a connect gives up after SEND_TIMEOUT_MS and is retried, so a daemon that
+// stopped reading holds up the writer, but not a drain past its deadline nor a stop()
+// past STOP_TIMEOUT_MS; what is left then is counted as failed.
+//
+// The writer takes the whole queue at once. On a stream the batch goes out with as
+// few writev-like calls as the socket takes. On the datagram transports consecutive
+// messages are packed into datagrams of up to datagram_bytes (the payloads are not
+// copied, each datagram is a list of them) and the datagrams are sent with sendmmsg,
+// many per system call. A message larger than a datagram goes alone; UDP is
+// fire-and-forget, what the socket refuses is counted as failed.
+//
+// The messages are queued in memory up to the buffer size, past it the events and
+// reports are dropped (and counted), the fatal messages are always kept. A lost
+// AF_UNIX connection is retried with a backoff, the queue waits meanwhile; on a stream
+// the messages of the failed batch that were not written whole go back to the head of
+// the queue, a lost seqpacket batch is counted as failed. An AF_UNIX
+// connection starts with the greeting line. There is no command channel, the
+// commands need the TCP connection.
+//
+class SocketSender : public Sender {
+public:
+    SocketSender(SocketTransport transport, const std::string address, const std::string port,
+                 const SenderConfig &config);
+
+    ~SocketSender();
+
+    void start();
+
+    // Sends the rest of the queue, gives it up after a while
+    void stop();
+
+    // Waits a while for the queued messages to be sent
+    void flush();
+
+    // Past the deadline the writer does not take the rest of the queue, it is lost
+    std::string drain(std::chrono::steady_clock::time_point deadline);
+
+    using Sender::send;
+
+    void send(Payload payload, MessageType type);
+
+    std::string get_statistics();
+
+private:
+    void run();
+
+    bool connect();
+
+    void disconnect();
+
+    // Both return false when the connection was lost; called without the lock. The messages written whole are
+    // the first written_messages of the batch
+    bool send_stream(const std::deque<Payload> &batch, size_t &written_messages);
+
+    bool send_datagrams(const std::deque<Payload> &batch);
+
+    // A send that timed out is retried unless the drain or the stop is over
+    bool is_abandoned();
+
+    const SocketTransport transport;
+    const std::string address;
+    const std::string port;
+    const size_t buffer_bytes;
+    const size_t datagram_bytes;
+    const std::string greeting;
+
+    /* Owned by the writer thread */
+    int socket_fd;
+    long backoff_ms;
+    std::thread writer;
+
+    /* The queue and the counters are guarded by the lock */
+    std::mutex lock;
+    std::condition_variable queued;
+    std::condition_variable written;
+    std::deque<Payload> queue;
+    size_t queued_bytes;
+    /* Taken by the writer and not sent yet */
+    size_t writing_bytes;
+    bool stopped;
+    /* Stopped by a drain or a stop() past its deadline, the queue is left */
+    bool abandoned;
+    /* The writer thread has not finished */
+    bool running;
+    uint64_t sent_bytes;
+    uint64_t sent_messages;
+    /* In a batch that failed to be sent, or left in the queue when stopped */
+    uint64_t unsent_messages;
+    /* Put back into the queue after a failed stream write */
+    uint64_t requeued_messages;
+    uint64_t sent_datagrams;
+    uint64_t send_calls;
+    uint64_t failed_bytes;
+    uint64_t connections;
+    uint64_t dropped_messages[MESSAGE_TYPE_COUNT];
+    uint64_t dropped_bytes[MESSAGE_TYPE_COUNT];
+};
+
+#endif //JEFF_NATIVE_AGENT_SOCKETSENDER_HPP
@@ -0,0 +1,465 @@
+#include "SpillLog.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <iostream>
+#include <vector>
+
+#if defined(_WIN32)
+#include <direct.h>
+#include <process.h>
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <boost/format.hpp>
+
+/* Each record starts with its length */
+typedef uint32_t length_type;
+
+static const uint64_t MIN_SEGMENT_BYTES = 64 * 1024;
+
+/* A limit is kept by dropping whole segments, so it is split into a few of them */
+static const uint64_t SEGMENTS_PER_LIMIT = 8;
+
+static int get_pid() {
+#if defined(_WIN32)
+    return _getpid();
+#else
+    return getpid();
+#endif
+}
+
+/* A directory (not a link to one) of the effective user that nobody else can read or write */
+static bool is_private_directory(const std::string &path) {
+#if defined(_WIN32)
+    return true;
+#else
+    struct stat status;
+    return lstat(path.c_str(), &status) == 0 && S_ISDIR(status.st_mode) && status.st_uid == geteuid()
+           && (status.st_mode & (S_IRWXG | S_IRWXO)) == 0;
+#endif
+}
+
+static bool make_directory(const std::string &path) {
+#if defined(_WIN32)
+    int result = _mkdir(path.c_str());
+#else
+    int result = mkdir(path.c_str(), 0700);
+#endif
+    if (result != 0 && errno != EEXIST) {
+        std::cerr << boost::format("Cannot create the spill directory '%s'\n") % path;
+        return false;
+    }
+    /* Created by somebody else, e.g. to read the spilled events or to plant segments to be replayed */
+    if (!is_private_directory(path)) {
+        std::cerr << boost::format("The spill directory '%s' is not private to this user\n") % path;
+        return false;
+    }
+    return true;
+}
+
+/* The directory of the effective user under the configured one, which may be shared like /tmp/jeff-spill */
+static std::string get_user_directory(const std::string &directory) {
+#if defined(_WIN32)
+    return directory;
+#else
+    return (boost::format("%s-%d") % directory % geteuid()).str();
+#endif
+}
+
+static std::vector<std::string> list_directory(const std::string &directory) {
+    std::vector<std::string> names;
+#if defined(_WIN32)
+    WIN32_FIND_DATAA entry;
+    HANDLE find = FindFirstFileA((directory + "\\*").c_str(), &entry);
+    if (find != INVALID_HANDLE_VALUE) {
+        do {
+            names.push_back(entry.cFileName);
+        } while (FindNextFileA(find, &entry));
+        FindClose(find);
+    }
+#else
+    DIR *dir = opendir(directory.c_str());
+    if (dir != nullptr) {
+        while (struct dirent *entry = readdir(dir)) {
+            names.push_back(entry->d_name);
+        }
+        closedir(dir);
+    }
+#endif
+    return names;
+}
+
+/* The number in the name, 0 when it is not all digits */
+static uint64_t parse_number(const std::string &name, size_t begin, size_t end) {
+    if (begin >= end || end > name.size()) {
+        return 0;
+    }
+    uint64_t number = 0;
+    for (size_t i = begin; i < end; i++) {
+        if (name[i] < '0' || name[i] > '9') {
+            return 0;
+        }
+        number = number * 10 + (uint64_t) (name[i] - '0');
+    }
+    return number;
+}
+
+/* The sequences of the segment-<sequence>.log files, in order */
+static std::vector<uint64_t> list_segments(const std::string &directory) {
+    static const std::string prefix = "segment-";
+    static const std::string suffix = ".log";
+    std::vector<uint64_t> sequences;
+    for (const std::string &name : list_directory(directory)) {
+        if (name.size() > prefix.size() + suffix.size() && name.compare(0, prefix.size(), prefix) == 0
+            && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0) {
+            uint64_t sequence = parse_number(name, prefix.size(), name.size() - suffix.size());
+            if (sequence > 0) {
+                sequences.push_back(sequence);
+            }
+        }
+    }
+    std::sort(sequences.begin(), sequences.end());
+    return sequences;
+}
+
+static bool is_process_gone(int pid) {
+#if defined(_WIN32)
+    HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, (DWORD) pid);
+    if (process == NULL) {
+        return GetLastError() == ERROR_INVALID_PARAMETER;
+    }
+    bool gone = WaitForSingleObject(process, 0) == WAIT_OBJECT_0;
+    CloseHandle(process);
+    return gone;
+#else
+    return kill(pid, 0) != 0 && errno == ESRCH;
+#endif
+}
+
+SpillLog::SpillLog(const std::string directory, uint64_t limit_bytes)
+        : directory((boost::format("%s/%d") % get_user_directory(directory) % get_pid()).str()),
+          limit_bytes(limit_bytes),
+          segment_bytes(std::max(limit_bytes / SEGMENTS_PER_LIMIT, MIN_SEGMENT_BYTES)),
+          next_sequence(1),
+          bytes(0),
+          dropped_bytes(0),
+          dropped_records(0),
+          reader_sequence(0),
+          enabled(false) {
+    std::string parent = get_user_directory(directory);
+    enabled = make_directory(parent) && make_directory(this->directory);
+    if (enabled) {
+        load(parent);
+    } else {
+        std::cerr << boost::format("Spilling to '%s' is disabled\n") % this->directory;
+    }
+}
+
+SpillLog::~SpillLog() {
+    /* The segments not read yet are left on the disk, for the next process; an empty directory is not */
+    writer.close();
+    reader.close();
+    if (!enabled) {
+        return;
+    }
+#if defined(_WIN32)
+    _rmdir(directory.c_str());
+#else
+    rmdir(directory.c_str());
+#endif
+}
+
+bool SpillLog::append(const std::string &record) {
+    uint64_t record_bytes = sizeof(length_type) + record.size();
+    if (!enabled || record_bytes > segment_bytes) {
+        return false;
+    }
+
+    /* The segments left by the other processes are only read */
+    if (segments.empty() || !writer.is_open() || segments.back().file_bytes + record_bytes > segment_bytes) {
+        if (!open_segment()) {
+            return false;
+        }
+    }
+    while (bytes + record.size() > limit_bytes && segments.size() > 1) {
+        drop_oldest_segment();
+    }
+
+    length_type length = (length_type) record.size();
+    writer.write(reinterpret_cast<const char *>(&length), sizeof(length));
+    writer.write(record.data(), record.size());
+    if (!writer) {
+        std::cerr << boost::format("Cannot write to the spill segment '%s'\n") % get_path(segments.back().sequence);
+        writer.clear();
+        return false;
+    }
+
+    Segment &segment = segments.back();
+    segment.bytes += record.size();
+    segment.records++;
+    segment.file_bytes += record_bytes;
+    bytes += record.size();
+    return true;
+}
+
+bool SpillLog::read(std::string &record) {
+    while (!segments.empty()) {
+        Segment &segment = segments.front();
+        if (segment.records == 0) {
+            if (segments.size() == 1) {
+                /* Everything was read, start over with an empty directory */
+                remove_all();
+                return false;
+            }
+            reader.close();
+            reader_sequence = 0;
+            std::remove(get_path(segment.sequence).c_str());
+            segments.pop_front();
+            continue;
+        }
+
+        if (reader_sequence != segment.sequence) {
+            reader.close();
+            reader.clear();
+            reader.open(get_path(segment.sequence).c_str(), std::ios::in | std::ios::binary);
+            reader_sequence = segment.sequence;
+        }
+        if (segments.size() == 1) {
+            /* Reading the segment that is being written */
+            writer.flush();
+        }
+
+        length_type length = 0;
+        reader.read(reinterpret_cast<char *>(&length), sizeof(length));
+        if (reader) {
+            record.resize(length);
+            reader.read(&record[0], length);
+        }
+        if (!reader || length > segment.bytes) {
+            std::cerr << boost::format("Cannot read the spill segment '%s'\n") % get_path(segment.sequence);
+            dropped_bytes += segment.bytes;
+            dropped_records += segment.records;
+            bytes -= segment.bytes;
+            segment.bytes = 0;
+            segment.records = 0;
+            continue;
+        }
+
+        segment.bytes -= length;
+        segment.records--;
+        bytes -= length;
+        return true;
+    }
+    return false;
+}
+
+bool SpillLog::prepend(const std::vector<std::string> &records) {
+    if (records.empty()) {
+        return true;
+    }
+    if (segments.empty()) {
+        for (const std::string &record : records) {
+            if (!append(record)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    if (!enabled) {
+        return false;
+    }
+
+    /* The oldest segment is rewritten with the records and what was not read from it, renamed over it at once */
+    Segment &segment = segments.front();
+    std::string path = get_path(segment.sequence);
+    std::string temporary = path + ".tmp";
+    uint64_t unread_bytes = segment.bytes + segment.records * sizeof(length_type);
+    if (segments.size() == 1) {
+        writer.close();
+    }
+    reader.close();
+    reader_sequence = 0;
+
+    std::ofstream file(temporary.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    Segment prepended = {segment.sequence, segment.bytes, segment.records, 0};
+    for (const std::string &record : records) {
+        length_type length = (length_type) record.size();
+        file.write(reinterpret_cast<const char *>(&length), sizeof(length));
+        file.write(record.data(), record.size());
+        prepended.bytes += record.size();
+        prepended.records++;
+        prepended.file_bytes += sizeof(length) + record.size();
+    }
+    /* Up to the last complete record, a record cut by a crash is left out */
+    std::ifstream unread(path.c_str(), std::ios::in | std::ios::binary);
+    unread.seekg((std::streamoff) (segment.file_bytes - unread_bytes));
+    std::vector<char> buffer(64 * 1024);
+    uint64_t copied = 0;
+    while (copied < unread_bytes && unread && file) {
+        unread.read(buffer.data(), (std::streamsize) std::min(unread_bytes - copied, (uint64_t) buffer.size()));
+        file.write(buffer.data(), unread.gcount());
+        copied += (uint64_t) unread.gcount();
+    }
+    prepended.file_bytes += copied;
+    unread.close();
+    file.close();
+    if (!file || copied != unread_bytes) {
+        std::cerr << boost::format("Cannot write to the spill segment '%s'\n") % temporary;
+        std::remove(temporary.c_str());
+        return false;
+    }
+#if defined(_WIN32)
+    std::remove(path.c_str());
+#endif
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+        std::cerr << boost::format("Cannot replace the spill segment '%s'\n") % path;
+        std::remove(temporary.c_str());
+        return false;
+    }
+    bytes += prepended.bytes - segment.bytes;
+    segment = prepended;
+    return true;
+}
+
+bool SpillLog::empty() const {
+    for (const Segment &segment : segments) {
+        if (segment.records > 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint64_t SpillLog::size() const {
+    return bytes;
+}
+
+uint64_t SpillLog::count() const {
+    uint64_t records = 0;
+    for (const Segment &segment : segments) {
+        records += segment.records;
+    }
+    return records;
+}
+
+uint64_t SpillLog::dropped() const {
+    return dropped_bytes;
+}
+
+uint64_t SpillLog::dropped_count() const {
+    return dropped_records;
+}
+
+const std::string &SpillLog::get_directory() const {
+    return directory;
+}
+
+bool SpillLog::is_enabled() const {
+    return enabled;
+}
+
+std::string SpillLog::get_path(uint64_t sequence) const {
+    return (boost::format("%s/segment-%08d.log") % directory % sequence).str();
+}
+
+void SpillLog::load(const std::string &parent) {
+    for (uint64_t sequence : list_segments(directory)) {
+        next_sequence = sequence;
+        load_segment(next_sequence++);
+    }
+
+    int own_pid = get_pid();
+    for (const std::string &name : list_directory(parent)) {
+        int pid = (int) parse_number(name, 0, name.size());
+        if (pid <= 0 || pid == own_pid || !is_process_gone(pid)) {
+            continue;
+        }
+        std::string orphan = parent + "/" + name;
+        if (!is_private_directory(orphan)) {
+            std::cerr << boost::format("The spill directory '%s' is not private to this user, it is not replayed\n")
+                         % orphan;
+            continue;
+        }
+        for (uint64_t sequence : list_segments(orphan)) {
+            /* Another process taking over the same directory renames the segment first */
+            std::string path = (boost::format("%s/segment-%08d.log") % orphan % sequence).str();
+            if (std::rename(path.c_str(), get_path(next_sequence).c_str()) == 0) {
+                load_segment(next_sequence++);
+            }
+        }
+#if defined(_WIN32)
+        _rmdir(orphan.c_str());
+#else
+        rmdir(orphan.c_str());
+#endif
+    }
+
+    if (!segments.empty()) {
+        std::cout << boost::format("Spill log '%s': %s records (%s bytes) left on the disk to be replayed\n")
+                     % directory % count() % bytes;
+    }
+}
+
+void SpillLog::load_segment(uint64_t sequence) {
+    std::ifstream file(get_path(sequence).c_str(), std::ios::in | std::ios::binary | std::ios::ate);
+    uint64_t file_size = file ? (uint64_t) file.tellg() : 0;
+    file.seekg(0);
+
+    /* Up to the last complete record */
+    Segment segment = {sequence, 0, 0, 0};
+    length_type length = 0;
+    while (segment.file_bytes + sizeof(length) <= file_size
+           && file.read(reinterpret_cast<char *>(&length), sizeof(length))
+           && segment.file_bytes + sizeof(length) + length <= file_size) {
+        segment.bytes += length;
+        segment.records++;
+        segment.file_bytes += sizeof(length) + length;
+        file.seekg(length, std::ios::cur);
+    }
+    segments.push_back(segment);
+    bytes += segment.bytes;
+}
+
+bool SpillLog::open_segment() {
+    Segment segment = {next_sequence++, 0, 0, 0};
+    writer.close();
+    writer.clear();
+    writer.open(get_path(segment.sequence).c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!writer) {
+        std::cerr << boost::format("Cannot create the spill segment '%s'\n") % get_path(segment.sequence);
+        return false;
+    }
+    segments.push_back(segment);
+    return true;
+}
+
+void SpillLog::drop_oldest_segment() {
+    Segment &segment = segments.front();
+    dropped_bytes += segment.bytes;
+    dropped_records += segment.records;
+    bytes -= segment.bytes;
+    if (reader_sequence == segment.sequence) {
+        reader.close();
+        reader_sequence = 0;
+    }
+    std::remove(get_path(segment.sequence).c_str());
+    segments.pop_front();
+}
+
+void SpillLog::remove_all() {
+    writer.close();
+    reader.close();
+    reader_sequence = 0;
+    for (Segment &segment : segments) {
+        std::remove(get_path(segment.sequence).c_str());
+    }
+    segments.clear();
+    bytes = 0;
+}
@@ -0,0 +1,108 @@
+#ifndef JEFF_NATIVE_AGENT_SPILLLOG_HPP
+#define JEFF_NATIVE_AGENT_SPILLLOG_HPP
+
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+//
+// Capped on-disk FIFO of messages, used by the senders when the in-memory buffer is full.
+//
+// Records (a 4 byte length and the bytes) are appended to segment files of a fixed
+// size in a directory of the process, <directory>-<uid>/<pid>. Both directories must
+// be private to the effective user (owned by it, mode 0700, not a symbolic link),
+// as the configured one may be shared (e.g. in /tmp); otherwise the log is disabled.
+// Reading goes from the oldest segment, which is deleted once it is read to the end.
+// When the log is over its limit, whole oldest segments are dropped, so the newest
+// data survives a long outage.
+//
+// What is left on the disk is replayed by a later process: the log starts with the
+// segments of its own directory (left by a process with the same pid) and takes over
+// those of the processes that are gone (in a private directory too), moving them to
+// its directory one by one, so two processes never take the same segment. A record
+// cut by a crash is not read.
+//
+// Not thread-safe, the owner serializes the calls.
+//
+class SpillLog : boost::noncopyable {
+public:
+    // The directory is shared by the processes, the segments of the ones that are gone are taken over
+    SpillLog(const std::string directory, uint64_t limit_bytes);
+
+    ~SpillLog();
+
+    // Appends a record, dropping the oldest segments when over the limit; false if it could not be written
+    bool append(const std::string &record);
+
+    // Reads the oldest record, false when the log is empty
+    bool read(std::string &record);
+
+    // Puts records ahead of the ones not read yet, e.g. the ones read but not delivered, in place of
+    // what was read from the oldest segment; false if they could not be written
+    bool prepend(const std::vector<std::string> &records);
+
+    bool empty() const;
+
+    // Bytes of the records not read yet
+    uint64_t size() const;
+
+    // Number of the records not read yet
+    uint64_t count() const;
+
+    // Bytes of the records lost with the dropped segments
+    uint64_t dropped() const;
+
+    // Number of the records lost with the dropped segments
+    uint64_t dropped_count() const;
+
+    const std::string &get_directory() const;
+
+    // False when the directories are not private to this user, nothing is written then
+    bool is_enabled() const;
+
+private:
+    struct Segment {
+        uint64_t sequence;
+        /* Of the records not read yet */
+        uint64_t bytes;
+        uint64_t records;
+        /* Bytes written to the file, including the lengths */
+        uint64_t file_bytes;
+    };
+
+    std::string get_path(uint64_t sequence) const;
+
+    // Adds the segments left on the disk, in this directory and in those of the processes that are gone
+    void load(const std::string &parent);
+
+    // Counts the complete records of a segment file and adds it to the log
+    void load_segment(uint64_t sequence);
+
+    bool open_segment();
+
+    void drop_oldest_segment();
+
+    void remove_all();
+
+    const std::string directory;
+    const uint64_t limit_bytes;
+    const uint64_t segment_bytes;
+
+    std::deque<Segment> segments;
+    uint64_t next_sequence;
+    uint64_t bytes;
+    uint64_t dropped_bytes;
+    uint64_t dropped_records;
+
+    std::ofstream writer;
+    std::ifstream reader;
+    /* Sequence of the segment the reader has open, 0 when none */
+    uint64_t reader_sequence;
+    bool enabled;
+};
+
+#endif //JEFF_NATIVE_AGENT_SPILLLOG_HPP
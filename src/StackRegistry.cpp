@@ -0,0 +1,148 @@
+#include "StackRegistry.hpp"
+
+#include <algorithm>
+#include <cstdint>
+
+#include <boost/format.hpp>
+
+#include "jvmti.hpp"
+
+using namespace jeff;
+
+/* Give up after this many collisions instead of scanning the whole table */
+static const size_t MAX_PROBES = 64;
+
+const jint StackRegistry::MAX_DEPTH;
+
+StackRegistry::StackRegistry(size_t capacity)
+        : mask(capacity - 1),
+          nodes(new Node[capacity]),
+          count(0),
+          overflows(0),
+          created(new std::atomic<jlong>[capacity]),
+          streamed(0) {
+    BOOST_ASSERT_MSG((capacity & mask) == 0, "Expected the capacity to be a power of two");
+    for (size_t i = 0; i < capacity; i++) {
+        nodes[i].hash.store(0, std::memory_order_relaxed);
+        nodes[i].ready.store(false, std::memory_order_relaxed);
+        nodes[i].parent = 0;
+        nodes[i].method = nullptr;
+        nodes[i].location = 0;
+        created[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+StackRegistry::~StackRegistry() {
+    // Empty
+}
+
+jlong StackRegistry::get_id(const jvmtiFrameInfo *frames, jint count) {
+    count = std::min(count, MAX_DEPTH);
+
+    /* From the outermost frame, so the stacks share the nodes of their callers */
+    jlong id = 0;
+    for (jint i = count - 1; i >= 0; i--) {
+        id = get_node(id, frames[i]);
+        if (id == 0) {
+            overflows.fetch_add(1, std::memory_order_relaxed);
+            return 0;
+        }
+    }
+    return id;
+}
+
+jlong StackRegistry::get_id(jvmtiEnv &jvmti, jthread thread, jint depth) {
+    jvmtiFrameInfo frames[MAX_DEPTH];
+    jint count = 0;
+
+    jvmtiError error = jvmti.GetStackTrace(thread, 0, std::min(depth, MAX_DEPTH), frames, &count);
+    if (error != JVMTI_ERROR_NONE) {
+        return 0;
+    }
+    return get_id(frames, count);
+}
+
+jlong StackRegistry::get_node(jlong parent, const jvmtiFrameInfo &frame) {
+    uint64_t h = hash(parent, frame);
+
+    for (size_t probe = 0; probe < MAX_PROBES; probe++) {
+        size_t index = (h + probe) & mask;
+        Node &node = nodes[index];
+
+        uint64_t current = node.hash.load(std::memory_order_acquire);
+        if (current == 0) {
+            if (node.hash.compare_exchange_strong(current, h, std::memory_order_acq_rel)) {
+                /* We own the node now, publish it */
+                node.parent = parent;
+                node.method = frame.method;
+                node.location = frame.location;
+                size_t position = this->count.fetch_add(1, std::memory_order_relaxed);
+                created[position].store((jlong) index + 1, std::memory_order_release);
+                node.ready.store(true, std::memory_order_release);
+                return (jlong) index + 1;
+            }
+        }
+        if (current == h) {
+            /* Another thread may still be filling the node in */
+            while (!node.ready.load(std::memory_order_acquire)) {
+                // Spin
+            }
+            if (node.parent == parent && node.method == frame.method && node.location == frame.location) {
+                return (jlong) index + 1;
+            }
+        }
+    }
+    return 0;
+}
+
+std::list<std::string> StackRegistry::get_stack_trace(jvmtiEnv &jvmti, jlong id, jint limit) const {
+    std::list<std::string> lines;
+    for (jint i = 0; i < limit && id > 0 && (size_t) id <= mask + 1; i++) {
+        const Node &node = nodes[id - 1];
+        if (!node.ready.load(std::memory_order_acquire)) {
+            break;
+        }
+        /* Native frames have no line number table */
+        std::string location = node.location < 0 ? "native" : get_location(jvmti, node.method, node.location);
+        lines.push_back((boost::format("%s [%s]") % get_method_name(jvmti, node.method) % location).str());
+        id = node.parent;
+    }
+    return lines;
+}
+
+std::string StackRegistry::get_new_nodes(jvmtiEnv &jvmti) {
+    std::lock_guard<std::mutex> guard(streamed_lock);
+    std::string lines;
+    size_t total = std::min(count.load(std::memory_order_relaxed), mask + 1);
+    for (; streamed < total; streamed++) {
+        jlong id = created[streamed].load(std::memory_order_acquire);
+        if (id == 0) { // Not published yet, its children come after it
+            break;
+        }
+        const Node &node = nodes[id - 1];
+        std::string location = node.location < 0 ? "native" : get_location(jvmti, node.method, node.location);
+        lines += (boost::format("\t%d %d %s [%s]\n") % id % node.parent % get_method_name(jvmti, node.method)
+                  % location).str();
+    }
+    return lines;
+}
+
+size_t StackRegistry::size() const {
+    return std::min(count.load(std::memory_order_relaxed), mask + 1);
+}
+
+std::string StackRegistry::get_statistics() const {
+    return (boost::format("Stack registry: %s nodes of %s, %s stacks did not fit (since start)\n")
+            % size() % (mask + 1) % overflows.load(std::memory_order_relaxed)).str();
+}
+
+uint64_t StackRegistry::hash(jlong parent, const jvmtiFrameInfo &frame) {
+    /* A 64 bit mix of the key, 0 is reserved for empty nodes */
+    uint64_t h = (uint64_t) parent * 0x9e3779b97f4a7c15ULL;
+    h ^= (uint64_t) reinterpret_cast<uintptr_t>(frame.method) + 0x632be59bd9b4e019ULL + (h << 6) + (h >> 2);
+    h ^= (uint64_t) frame.location + 0x85ebca77c2b2ae63ULL + (h << 6) + (h >> 2);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h == 0 ? 1 : h;
+}
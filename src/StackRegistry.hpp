@@ -0,0 +1,84 @@
+#ifndef JEFF_NATIVE_AGENT_STACKREGISTRY_HPP
+#define JEFF_NATIVE_AGENT_STACKREGISTRY_HPP
+
+#include <jni.h>
+#include <jvmti.h>
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <boost/noncopyable.hpp>
+
+//
+// Deduplicates stack traces captured as (jmethodID, jlocation) frames.
+//
+// The stacks are kept as a prefix trie (a call tree): a node is a frame under its
+// caller's node, starting from the outermost frame, and the id of a stack is the
+// id of the node of its innermost frame. The stacks of a framework share the nodes
+// of their common frames, so a new stack usually costs a few nodes, and the events
+// only need to carry the id. The stack is rendered once, when somebody asks for it.
+//
+// The nodes live in an open addressing hash table with a fixed capacity, keyed by
+// (parent id, method, location); inserts are lock-free. Id 0 means "unknown", e.g.
+// when the table is full, which is counted; there is no eviction, so the callers
+// fall back to rendering such a stack. A stack keeps its innermost MAX_DEPTH
+// frames. Every new node is also appended to a log in the order of creation, a
+// parent before its children, so the nodes can be streamed to the daemon as they
+// appear, see get_new_nodes().
+//
+class StackRegistry : boost::noncopyable {
+public:
+    static const jint MAX_DEPTH = 64;
+
+    // The capacity is the number of nodes
+    explicit StackRegistry(size_t capacity);
+
+    ~StackRegistry();
+
+    jlong get_id(const jvmtiFrameInfo *frames, jint count);
+
+    // Captures the current stack of a thread and returns its id
+    jlong get_id(jvmtiEnv &jvmti, jthread thread, jint depth = MAX_DEPTH);
+
+    // Renders at most limit frames of a stack, the innermost first
+    std::list<std::string> get_stack_trace(jvmtiEnv &jvmti, jlong id, jint limit = MAX_DEPTH) const;
+
+    // The nodes created since the last call, one "<id> <parent id> <method> [<location>]" line each,
+    // empty when there are none; thread-safe
+    std::string get_new_nodes(jvmtiEnv &jvmti);
+
+    // Number of nodes
+    size_t size() const;
+
+    // The nodes used and the stacks that did not fit since the start
+    std::string get_statistics() const;
+
+private:
+    struct Node {
+        std::atomic<uint64_t> hash;
+        std::atomic<bool> ready;
+        jlong parent;
+        jmethodID method;
+        jlocation location;
+    };
+
+    jlong get_node(jlong parent, const jvmtiFrameInfo &frame);
+
+    static uint64_t hash(jlong parent, const jvmtiFrameInfo &frame);
+
+    const size_t mask;
+    std::unique_ptr<Node[]> nodes;
+    std::atomic<size_t> count;
+    /* Stacks that got id 0 because the table was full around their nodes */
+    std::atomic<uint64_t> overflows;
+    /* The node ids in the order of creation, 0 while the creator did not publish it yet */
+    std::unique_ptr<std::atomic<jlong>[]> created;
+
+    std::mutex streamed_lock;
+    size_t streamed;
+};
+
+#endif //JEFF_NATIVE_AGENT_STACKREGISTRY_HPP
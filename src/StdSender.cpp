@@ -6,8 +6,8 @@ StdSender::~StdSender() {
     // Empty
 }
 
-void StdSender::send(std::string message) {
-    std::cout << message << std::endl;
+void StdSender::send(Payload payload, MessageType type) {
+    std::cout << *payload << std::endl;
 }
 
 void StdSender::start() {
@@ -21,3 +21,11 @@ void StdSender::stop() {
 void StdSender::flush() {
     // Empty
 }
+
+std::string StdSender::drain(std::chrono::steady_clock::time_point deadline) {
+    return "";
+}
+
+std::string StdSender::get_statistics() {
+    return "";
+}
@@ -16,7 +16,13 @@ public:
 
     virtual void flush();
 
-    virtual void send(std::string value);
+    virtual std::string drain(std::chrono::steady_clock::time_point deadline);
+
+    using Sender::send;
+
+    virtual void send(Payload payload, MessageType type);
+
+    virtual std::string get_statistics();
 };
 
 
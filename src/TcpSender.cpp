@@ -1,18 +1,70 @@
 #include "TcpSender.hpp"
 
+#include <algorithm>
+#include <chrono>
+
 #include <boost/asio.hpp>
+#include <boost/format.hpp>
+
+#include "clock.hpp"
 
 using boost::asio::deadline_timer;
 using boost::asio::ip::tcp;
 
-TcpSender::TcpSender(boost::asio::ip::tcp::resolver::query endpoint)
+/* Reconnect backoff, doubled after every failed attempt */
+static const long INITIAL_BACKOFF_MS = 100;
+static const long MAX_BACKOFF_MS = 60 * 1000;
+
+static const long CONNECT_TIMEOUT_SECONDS = 60;
+static const long HEARTBEAT_SECONDS = 10;
+static const long FLUSH_TIMEOUT_MS = 5000;
+
+static const Payload HEARTBEAT = std::make_shared<const std::string>("\n");
+
+/* Replayed from the disk log into the memory queue at once */
+static const size_t REPLAY_BATCH_BYTES = 1024 * 1024;
+
+/* Waiting for the sender thread to append them to the disk log, at most */
+static const size_t SPILL_QUEUE_BYTES = 1024 * 1024;
+
+TcpSender::TcpSender(boost::asio::ip::tcp::resolver::query endpoint, const SenderConfig &config)
         : Sender(),
           stopped_(false),
+          connected(false),
+          writing(false),
+          reconnect_attempts(0),
+          random((unsigned int) jeff::monotonic_nanos()),
+          queued_bytes(0),
+          in_flight_type(MessageType::EVENT),
+          config(config),
+          sent_bytes(0),
+          sent_messages(0),
+          spilled_bytes(0),
+          replayed_bytes(0),
+          unspilled_messages(0),
+          unspilled_bytes(0),
+          spill_log_messages(0),
+          spill_log_bytes(0),
+          spill_dropped_messages(0),
+          spill_dropped_bytes(0),
+          spill_enabled(!config.spill_directory.empty() && config.spill_bytes > 0),
+          connections(0),
+          write_scheduled(false),
           endpoint(endpoint),
+          resolver(io_service),
           socket(io_service),
           deadline(io_service),
-          heartbeat_timer(io_service) {
-    // Empty
+          heartbeat_timer(io_service),
+          reconnect_timer(io_service) {
+    for (size_t i = 0; i < MESSAGE_TYPE_COUNT; i++) {
+        queued_type_bytes[i] = 0;
+        quota_bytes[i] = config.buffer_bytes;
+        dropped_messages[i] = 0;
+        dropped_bytes[i] = 0;
+        overflows[i] = 0;
+    }
+    unsigned int event_quota_percent = std::min(config.event_quota_percent, 100u);
+    quota_bytes[(size_t) MessageType::EVENT] = config.buffer_bytes / 100 * event_quota_percent;
 };
 
 TcpSender::~TcpSender() {
@@ -20,17 +72,19 @@ TcpSender::~TcpSender() {
 }
 
 // Initiate the connection process.
-// The endpoint iterator will have been obtained using a tcp::resolver.
 void TcpSender::start() {
-    tcp::resolver resolver(io_service);
-    tcp::resolver::iterator endpoint_iter = resolver.resolve(endpoint);
+    // Keeps the service loop running while there is nothing to do between reconnects.
+    work.reset(new boost::asio::io_service::work(io_service));
 
-    // Start the connect actor.
-    start_connect(endpoint_iter);
+    // The log left by the previous processes is scanned on the sender thread, not on the caller's.
+    io_service.post([this]() { open_spill_log(); });
+
+    // Start the resolve and connect actors.
+    io_service.post([this]() { start_resolve(); });
 
     // Start the deadline actor. You will note that we're not setting any
-    // particular deadline here. Instead, the connect and input actors will
-    // update the deadline prior to each asynchronous operation.
+    // particular deadline here. Instead, the connect actor will update the
+    // deadline prior to each connect attempt.
     deadline.async_wait(boost::bind(&TcpSender::check_deadline, this));
 
     // Run the service loop on a thread pool
@@ -40,29 +94,60 @@ void TcpSender::start() {
 }
 
 // Terminate all the actors to shut down the connection.
-// It may be called by the user of the client class, or by the class itself in
-// response to graceful termination or an unrecoverable error.
+// The messages still queued are not written.
 void TcpSender::stop() {
-    stopped_ = true;
-    boost::system::error_code ignored_ec;
-    socket.close(ignored_ec);
-    deadline.cancel();
-    heartbeat_timer.cancel();
+    if (stopped_.exchange(true)) {
+        return;
+    }
+    io_service.post([this]() {
+        boost::system::error_code ignored_ec;
+        resolver.cancel();
+        socket.close(ignored_ec);
+        deadline.cancel();
+        heartbeat_timer.cancel();
+        reconnect_timer.cancel();
+        // A resolve stuck in the DNS would keep the loop running, the cancelled handlers are not waited for
+        io_service.stop();
+    });
+    work.reset();
     worker_threads.join_all();
 }
 
+void TcpSender::start_resolve() {
+    if (stopped_) {
+        return;
+    }
+
+    resolver.async_resolve(endpoint, [this](const boost::system::error_code &error, tcp::resolver::iterator iter) {
+        handle_resolve(error, iter);
+    });
+}
+
+void TcpSender::handle_resolve(const boost::system::error_code &error, tcp::resolver::iterator endpoint_iter) {
+    if (stopped_) {
+        return;
+    }
+
+    if (error) {
+        std::cout << "Resolve error: " << error.message() << "\n";
+        schedule_reconnect();
+    } else {
+        start_connect(endpoint_iter);
+    }
+}
+
 void TcpSender::start_connect(tcp::resolver::iterator endpoint) {
     if (endpoint != tcp::resolver::iterator()) {
         std::cout << "Trying " << endpoint->endpoint() << "...\n";
 
         // Set a deadline for the connect operation.
-        deadline.expires_from_now(boost::posix_time::seconds(60));
+        deadline.expires_from_now(boost::posix_time::seconds(CONNECT_TIMEOUT_SECONDS));
 
         // Start the asynchronous connect operation.
         socket.async_connect(endpoint->endpoint(),
                              boost::bind(&TcpSender::handle_connect, this, _1, endpoint));
-    } else { // There are no more endpoints to try. Shut down the client.
-        stop();
+    } else { // There are no more endpoints to try. Try again later.
+        schedule_reconnect();
     }
 }
 
@@ -77,7 +162,8 @@ void TcpSender::check_deadline() {
     if (deadline.expires_at() <= deadline_timer::traits_type::now()) {
         // The deadline has passed. The socket is closed so that any outstanding
         // asynchronous operations are cancelled.
-        socket.close();
+        boost::system::error_code ignored_ec;
+        socket.close(ignored_ec);
 
         // There is no longer an active deadline. The expiry is set to positive
         // infinity so that the actor takes no action until a new deadline is set.
@@ -106,26 +192,90 @@ void TcpSender::handle_connect(const boost::system::error_code &error, tcp::reso
 
         // We need to close the socket used in the previous connection attempt
         // before starting a new one.
-        socket.close();
+        boost::system::error_code ignored_ec;
+        socket.close(ignored_ec);
 
         // Try the next available endpoint.
         start_connect(++endpoint_iter);
     } else {  // Otherwise we have successfully established a connection.
         std::cout << "Connected to " << endpoint_iter->endpoint() << "\n";
+        deadline.expires_at(boost::posix_time::pos_infin);
+        connected = true;
+        reconnect_attempts = 0;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            connections++;
+        }
 
         // Start the input actor.
         start_read();
 
-        // Start the heartbeat actor.
+        // Start the output actor, with what was queued while disconnected.
+        write_greeting();
+    }
+}
+
+void TcpSender::write_greeting() {
+    if (config.greeting.empty()) {
         start_write();
+        start_heartbeat();
+        return;
     }
+
+    // Tells the daemon which JVM the connection is from, before any message.
+    writing = true;
+    boost::asio::async_write(socket, boost::asio::buffer(config.greeting),
+                             [this](boost::system::error_code error, std::size_t /*length*/) {
+                                 writing = false;
+                                 if (stopped_) {
+                                     return;
+                                 }
+                                 if (error) {
+                                     disconnect("Error on send: " + error.message());
+                                     return;
+                                 }
+                                 start_write();
+                                 start_heartbeat();
+                             });
 }
 
-void TcpSender::start_read() {
-    // Set a deadline for the read operation.
-    deadline.expires_from_now(boost::posix_time::seconds(30));
+void TcpSender::schedule_reconnect() {
+    if (stopped_) {
+        return;
+    }
+
+    /* Full jitter over the upper half of the backoff */
+    long backoff_ms = std::min(MAX_BACKOFF_MS, INITIAL_BACKOFF_MS << std::min(reconnect_attempts, 10u));
+    std::uniform_int_distribution<long> jitter(backoff_ms / 2, backoff_ms);
+    long delay_ms = jitter(random);
+    reconnect_attempts++;
+
+    std::cout << "Reconnecting in " << delay_ms << " ms\n";
+    reconnect_timer.expires_from_now(boost::posix_time::milliseconds(delay_ms));
+    reconnect_timer.async_wait([this](const boost::system::error_code &error) {
+        if (!error) {
+            start_resolve();
+        }
+    });
+}
+
+void TcpSender::disconnect(const std::string reason) {
+    // Both actors fail when the connection is lost, only the first one reconnects.
+    if (stopped_ || !connected) {
+        return;
+    }
+
+    std::cout << reason << "\n";
+    connected = false;
+    boost::system::error_code ignored_ec;
+    socket.close(ignored_ec);
+    heartbeat_timer.cancel();
+    schedule_reconnect();
+}
 
-    // Start an asynchronous operation to read a newline-delimited message.
+void TcpSender::start_read() {
+    // Start an asynchronous operation to read a newline-delimited command.
+    // There is no deadline, the daemon does not have to send anything.
     boost::asio::async_read_until(socket, input_buffer, '\n',
                                   [this](boost::system::error_code error, std::size_t /*length*/) {
                                       handle_read(error);
@@ -133,7 +283,7 @@ void TcpSender::start_read() {
 }
 
 void TcpSender::handle_read(const boost::system::error_code &error) {
-    if (stopped_) {
+    if (stopped_ || !connected) {
         return;
     }
 
@@ -143,68 +293,417 @@ void TcpSender::handle_read(const boost::system::error_code &error) {
         std::istream is(&input_buffer);
         std::getline(is, line);
 
-        // Empty messages are heartbeats and so ignored.
+        // Empty messages are heartbeats and so ignored, the rest are commands.
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
         if (!line.empty()) {
             std::cout << "Received: " << line << "\n";
+            if (command_handler) {
+                command_handler(line);
+            }
         }
 
         start_read();
     } else {
-        std::cout << "Error on receive: " << error.message() << "\n";
-        stop();
+        disconnect("Error on receive: " + error.message());
     }
 }
 
 void TcpSender::start_write() {
-    if (stopped_) {
+    if (stopped_ || !connected || writing) {
         return;
     }
 
-    std::string &message = queue.front();
-    queue.pop();
+    replay();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        // A message that failed to be written is sent again first
+        if (in_flight == nullptr && !next_message()) {
+            return;
+        }
+    }
+    write_in_flight();
+}
+
+void TcpSender::write_in_flight() {
+    writing = true;
 
-    // Start an asynchronous operation to send a heartbeat message.
-    boost::asio::async_write(socket, boost::asio::buffer(message.c_str(), message.size()),
+    // The message is not touched by the other threads until handle_write clears it.
+    boost::asio::async_write(socket, boost::asio::buffer(in_flight->data(), in_flight->size()),
                              [this](boost::system::error_code error, std::size_t /*length*/) {
                                  handle_write(error);
                              });
-
-    std::cout << "Message was sent\n";
 }
 
-void TcpSender::handle_write(const boost::system::error_code &error, long delay_in_seconds) {
+void TcpSender::handle_write(const boost::system::error_code &error) {
+    writing = false;
     if (stopped_) {
         return;
     }
 
-    if (!queue.empty()) {
-        start_write();
-    } else {
-        std::cout << "Message queue is empty\n";
+    if (error) {
+        disconnect("Error on send: " + error.message());
+        return;
     }
 
-    if (!error) {
-        // Wait 10 seconds before sending the next messages.
-        heartbeat_timer.expires_from_now(boost::posix_time::seconds(delay_in_seconds));
-        heartbeat_timer.async_wait(boost::bind(&TcpSender::start_write, this));
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        sent_bytes += in_flight->size();
+        if (in_flight != HEARTBEAT) {
+            sent_messages++;
+        }
+        in_flight.reset();
+    }
+    written.notify_all();
+
+    start_heartbeat();
+    start_write();
+}
+
+void TcpSender::start_heartbeat() {
+    // Restarted after every write, so it only fires when the connection is idle.
+    heartbeat_timer.expires_from_now(boost::posix_time::seconds(HEARTBEAT_SECONDS));
+    heartbeat_timer.async_wait([this](const boost::system::error_code &error) {
+        if (error || stopped_ || !connected || writing) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (in_flight != nullptr || !queue.empty()) {
+                return;
+            }
+            in_flight = HEARTBEAT;
+        }
+        write_in_flight();
+    });
+}
+
+bool TcpSender::next_message() {
+    if (queue.empty()) {
+        return false;
+    }
+
+    Message &message = queue.front();
+    queued_bytes -= message.data->size();
+    queued_type_bytes[(size_t) message.type] -= message.data->size();
+    in_flight = std::move(message.data);
+    in_flight_type = message.type;
+    queue.pop_front();
+    return true;
+}
+
+void TcpSender::open_spill_log() {
+    if (spill_log != nullptr || !spill_enabled) {
+        return;
+    }
+    /* Loaded without the lock, the messages handed over meanwhile wait in to_spill */
+    std::unique_ptr<SpillLog> log(new SpillLog(config.spill_directory, config.spill_bytes));
+
+    std::unique_lock<std::mutex> guard(lock);
+    if (log->is_enabled()) {
+        spill_log = std::move(log);
+        update_spill_counters();
     } else {
-        std::cout << "Error on send: " << error.message() << "\n";
-        stop();
+        spill_enabled = false;
+    }
+    guard.unlock();
+    written.notify_all();
+}
+
+void TcpSender::replay() {
+    if (spill_log == nullptr || spill_log->empty()) {
+        return;
+    }
+    {
+        /* The memory queue is drained first, the log is older than anything queued from now on */
+        std::lock_guard<std::mutex> guard(lock);
+        if (!queue.empty()) {
+            return;
+        }
+    }
+
+    /* Read without the lock, the senders do not wait for the disk */
+    size_t batch_bytes = std::min(REPLAY_BATCH_BYTES, std::max(config.buffer_bytes, (size_t) 1));
+    size_t read_bytes = 0;
+    std::vector<Message> batch;
+    std::string record;
+    while (read_bytes < batch_bytes && spill_log->read(record)) {
+        if (record.empty()) {
+            continue;
+        }
+        /* The records start with the message type */
+        size_t type = (size_t) (unsigned char) record[0];
+        Message message = {std::make_shared<const std::string>(record, 1),
+                           (type < MESSAGE_TYPE_COUNT) ? (MessageType) type : MessageType::EVENT};
+        read_bytes += message.data->size();
+        batch.push_back(std::move(message));
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    for (Message &message : batch) {
+        replayed_bytes += message.data->size();
+        enqueue(std::move(message));
+    }
+    update_spill_counters();
+}
+
+void TcpSender::spill_queued() {
+    std::deque<Message> batch;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        batch.swap(to_spill);
+    }
+    if (batch.empty()) {
+        return;
+    }
+
+    /* Written without the lock, the unspilled counters keep the new events behind these meanwhile */
+    size_t batch_bytes = 0;
+    uint64_t spilled = 0;
+    std::vector<const Message *> failed;
+    for (const Message &message : batch) {
+        batch_bytes += message.data->size();
+        if (spill(message)) {
+            spilled += message.data->size();
+        } else {
+            failed.push_back(&message);
+        }
+    }
+
+    std::unique_lock<std::mutex> guard(lock);
+    for (const Message *message : failed) {
+        drop(message->type, message->data->size());
+    }
+    spilled_bytes += spilled;
+    unspilled_messages -= batch.size();
+    unspilled_bytes -= batch_bytes;
+    update_spill_counters();
+    guard.unlock();
+    written.notify_all();
+}
+
+void TcpSender::update_spill_counters() {
+    if (spill_log != nullptr) {
+        spill_log_messages = spill_log->count();
+        spill_log_bytes = spill_log->size();
+        spill_dropped_messages = spill_log->dropped_count();
+        spill_dropped_bytes = spill_log->dropped();
+    }
+}
+
+bool TcpSender::is_flushed() const {
+    /* What the previous processes left is not known until the log is open */
+    return queue.empty() && in_flight == nullptr && unspilled_messages == 0 && spill_log_messages == 0
+           && (spill_log != nullptr || !spill_enabled);
+}
+
+bool TcpSender::fits(MessageType type, size_t size) const {
+    return queued_bytes + size <= config.buffer_bytes
+           && queued_type_bytes[(size_t) type] + size <= quota_bytes[(size_t) type];
+}
+
+void TcpSender::enqueue(Message message) {
+    queued_bytes += message.data->size();
+    queued_type_bytes[(size_t) message.type] += message.data->size();
+    queue.push_back(std::move(message));
+}
+
+bool TcpSender::make_room(MessageType type, size_t size, MessageType max_dropped) {
+    size_t index = (size_t) type;
+    size_t droppable_bytes = 0;
+    for (size_t i = 0; i <= (size_t) max_dropped; i++) {
+        droppable_bytes += queued_type_bytes[i];
+    }
+    if (size > quota_bytes[index] || queued_bytes - droppable_bytes + size > config.buffer_bytes) {
+        return false;
     }
+    if (type > max_dropped && queued_type_bytes[index] + size > quota_bytes[index]) {
+        return false;
+    }
+
+    /* Only what is needed goes, the oldest first */
+    for (auto it = queue.begin(); it != queue.end() && !fits(type, size);) {
+        bool over_buffer = queued_bytes + size > config.buffer_bytes;
+        bool over_quota = it->type == type && queued_type_bytes[index] + size > quota_bytes[index];
+        if (it->type <= max_dropped && (over_buffer || over_quota)) {
+            queued_bytes -= it->data->size();
+            queued_type_bytes[(size_t) it->type] -= it->data->size();
+            drop(it->type, it->data->size());
+            it = queue.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    return fits(type, size);
+}
+
+std::string TcpSender::to_record(const Message &message) {
+    std::string record;
+    record.reserve(message.data->size() + 1);
+    record.push_back((char) message.type);
+    record.append(*message.data);
+    return record;
+}
+
+bool TcpSender::spill(const Message &message) {
+    return spill_log != nullptr && spill_log->append(to_record(message));
+}
+
+void TcpSender::overflow(std::unique_lock<std::mutex> &guard, Message message) {
+    MessageType type = message.type;
+    size_t size = message.data->size();
+    switch (config.overflow_policy) {
+        case OverflowPolicy::DROP_NEWEST:
+            break;
+        case OverflowPolicy::SAMPLE:
+            if (overflows[(size_t) type]++ % std::max(config.overflow_sample_every, 1u) != 0) {
+                break;
+            }
+            // The sampled message takes the place of the oldest ones
+        case OverflowPolicy::DROP_OLDEST:
+            if (make_room(type, size, type)) {
+                enqueue(std::move(message));
+                return;
+            }
+            break;
+        case OverflowPolicy::BLOCK: {
+            bool room = written.wait_for(guard, std::chrono::milliseconds(config.overflow_timeout_ms), [&]() {
+                return stopped_ || fits(type, size);
+            });
+            if (room && !stopped_) {
+                enqueue(std::move(message));
+                return;
+            }
+            break;
+        }
+    }
+    drop(type, size);
 }
 
-void TcpSender::send(std::string value) {
-    queue.push(value);
-    std::cout << "Message added, queue has " << queue.size() << " messages\n";
+void TcpSender::drop(MessageType type, size_t size) {
+    dropped_messages[(size_t) type]++;
+    dropped_bytes[(size_t) type] += size;
+}
+
+void TcpSender::send(Payload payload, MessageType type) {
+    if (payload->empty()) {
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        Message message = {std::move(payload), type};
+        size_t size = message.data->size();
+        /* Once spilling, the events go to the log until it is replayed, to keep their order */
+        bool spilling = spill_log_messages > 0 || unspilled_messages > 0;
+        if (fits(type, size) && (type != MessageType::EVENT || !spilling)) {
+            enqueue(std::move(message));
+        } else if (type == MessageType::FATAL && make_room(type, size, MessageType::REPORT)) {
+            enqueue(std::move(message));
+        } else if (spill_enabled && unspilled_bytes + size <= SPILL_QUEUE_BYTES) {
+            /* The sender thread writes it to the disk, never the caller */
+            unspilled_messages++;
+            unspilled_bytes += size;
+            to_spill.push_back(std::move(message));
+        } else {
+            overflow(guard, std::move(message));
+        }
+    }
+
+    // One pending wake-up of the sender thread is enough, it spills (connected or not) and writes
+    if (!write_scheduled.exchange(true)) {
+        io_service.post([this]() {
+            write_scheduled.store(false);
+            spill_queued();
+            start_write();
+        });
+    }
 }
 
 void TcpSender::flush() {
-    const boost::system::error_code error;
-    while (!queue.empty()) {
-        handle_write(error, 0);
+    std::unique_lock<std::mutex> guard(lock);
+    bool flushed = written.wait_for(guard, std::chrono::milliseconds(FLUSH_TIMEOUT_MS), [this]() {
+        return is_flushed();
+    });
+    if (flushed) {
+        std::cout << "Messages flushed\n";
+    } else {
+        std::cerr << boost::format("Could not flush in %s ms, %s bytes queued, %s bytes in the spill log\n")
+                     % FLUSH_TIMEOUT_MS % queued_bytes % (unspilled_bytes + spill_log_bytes);
     }
-    std::cout << "Messages flushed, queue has " << queue.size() << " messages\n";
-    if (error) {
-        std::cerr << "could not flush: " << boost::system::system_error(error).what() << std::endl;
+}
+
+std::string TcpSender::drain(std::chrono::steady_clock::time_point deadline) {
+    uint64_t start_sent;
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        start_sent = sent_messages;
+        written.wait_until(guard, deadline, [this]() {
+            return is_flushed();
+        });
+    }
+    stop();
+    /* The sender thread may have been stopped before it got to it */
+    open_spill_log();
+
+    /* The sender thread is gone, a message cut by the close is sent again whole after a replay */
+    std::lock_guard<std::mutex> guard(lock);
+    uint64_t lost = 0;
+    if (in_flight != nullptr && in_flight != HEARTBEAT) {
+        queue.push_front({in_flight, in_flight_type});
+    }
+    /*
+     * The queued messages are older than what the log still holds: they were queued before the
+     * spilling started, or replayed from it. They go back ahead of it, the handed over ones after.
+     */
+    std::vector<std::string> records;
+    for (const Message &message : queue) {
+        records.push_back(to_record(message));
+    }
+    if (spill_log == nullptr || !spill_log->prepend(records)) {
+        for (const Message &message : queue) {
+            drop(message.type, message.data->size());
+            lost++;
+        }
     }
-}
\ No newline at end of file
+    for (const Message &message : to_spill) {
+        if (!spill(message)) {
+            drop(message.type, message.data->size());
+            lost++;
+        }
+    }
+    to_spill.clear();
+    unspilled_messages = 0;
+    unspilled_bytes = 0;
+    update_spill_counters();
+    queue.clear();
+    queued_bytes = 0;
+    for (size_t i = 0; i < MESSAGE_TYPE_COUNT; i++) {
+        queued_type_bytes[i] = 0;
+    }
+
+    if (spill_log == nullptr) {
+        return (boost::format("Sender drained: %s messages flushed, %s lost\n")
+                % (sent_messages - start_sent) % lost).str();
+    }
+    return (boost::format("Sender drained: %s messages flushed, %s persisted in '%s', %s lost\n")
+            % (sent_messages - start_sent) % spill_log->count() % spill_log->get_directory() % lost).str();
+}
+
+std::string TcpSender::get_statistics() {
+    std::lock_guard<std::mutex> guard(lock);
+    std::string statistics = (boost::format("Sender: %s connections, %s bytes sent, %s bytes queued, "
+                                                    "%s bytes spilled to disk, %s bytes replayed, %s bytes in the spill log\n")
+                              % connections % sent_bytes % queued_bytes % spilled_bytes % replayed_bytes
+                              % spill_log_bytes).str();
+
+    /* Exact totals since the start, so the daemon knows what it did not get */
+    statistics += "\tdropped:";
+    for (size_t i = 0; i < MESSAGE_TYPE_COUNT; i++) {
+        statistics += (boost::format(" %s %s (%s bytes),")
+                       % get_message_type_name((MessageType) i) % dropped_messages[i] % dropped_bytes[i]).str();
+    }
+    statistics += (boost::format(" spilled %s (%s bytes)\n") % spill_dropped_messages % spill_dropped_bytes).str();
+    return statistics;
+}
@@ -1,12 +1,19 @@
 #ifndef JEFF_NATIVE_AGENT_TCPSENDER_H
 #define JEFF_NATIVE_AGENT_TCPSENDER_H
 
-#include <queue>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/streambuf.hpp>
 #include <boost/thread/thread.hpp>
 
 #include "Sender.hpp"
+#include "SpillLog.hpp"
 
 //
 // This class manages socket timeouts by applying the concept of a deadline.
@@ -25,35 +32,38 @@
 // If the deadline actor determines that the deadline has expired, the socket
 // is closed and any outstanding operations are consequently cancelled.
 //
-// Connection establishment involves trying each endpoint in turn until a
-// connection is successful, or the available endpoints are exhausted. If the
-// deadline actor closes the socket, the connect actor is woken up and moves to
-// the next endpoint.
+// Connection establishment resolves the endpoint and tries each address in turn
+// until a connection is successful. When the addresses are exhausted, or an
+// established connection fails, the reconnect actor waits with an exponential
+// backoff and a random jitter (so a restarted daemon is not hit by all agents at
+// once) and starts over with a new resolve:
 //
-//  +---------------+
-//  |               |
-//  | start_connect |<---+
-//  |               |    |
-//  +---------------+    |
-//           |           |
-//  async_-  |    +----------------+
-// connect() |    |                |
-//           +--->| handle_connect |
-//                |                |
-//                +----------------+
-//                          :
-// Once a connection is     :
-// made, the connect        :
-// actor forks in two -     :
-//                          :
-// an actor for reading     :       and an actor for
-// inbound messages:        :       sending heartbeats:
-//                          :
-//  +------------+          :          +-------------+
-//  |            |<- - - - -+- - - - ->|             |
+//  +---------------+   async_resolve()   +----------------+
+//  |               |-------------------->|                |
+//  | start_resolve |                     | handle_resolve |
+//  |               |                     |                |
+//  +---------------+                     +----------------+
+//          ^                                     |
+//          | async_wait()                        v
+//  +--------------------+   exhausted    +---------------+
+//  |                    |<---------------|               |
+//  | schedule_reconnect |                | start_connect |<---+
+//  |                    |                |               |    |
+//  +--------------------+                +---------------+    |
+//          ^                      async_-  |    +----------------+
+//          | connection lost     connect() |    |                |
+//          |                               +--->| handle_connect |
+//   handle_read, handle_write                   |                |
+//                                               +----------------+
+//
+// Once a connection is made, the connect actor forks in two -
+// an actor for reading inbound commands and an actor for writing the queue:
+//
+//  +------------+                     +-------------+
+//  |            |                     |             |
 //  | start_read |                     | start_write |<---+
 //  |            |<---+                |             |    |
-//  +------------+    |                +-------------+    | async_wait()
+//  +------------+    |                +-------------+    |
 //          |         |                        |          |
 //  async_- |    +-------------+       async_- |    +--------------+
 //   read_- |    |             |       write() |    |              |
@@ -61,62 +71,177 @@
 //               |             |                    |              |
 //               +-------------+                    +--------------+
 //
-// The input actor reads messages from the socket, where messages are delimited
-// by the newline character. The deadline for a complete message is 30 seconds.
+// The input actor reads commands from the socket, where commands are delimited
+// by the newline character.
+//
+// Messages are queued in memory up to a limit, past it (and until the disk log is
+// replayed) they are appended to a capped on-disk log. The log is written and read
+// by the sender thread only, send() just hands the message over (or, when the sender
+// thread is that far behind, applies the overflow policy), so a JVM thread never
+// waits for the disk. The log is opened by the sender thread too, as it scans what
+// the previous processes left; the messages queued in memory meanwhile go ahead of
+// that. After a reconnect the memory queue is sent first, then the log is replayed
+// into it, so the order is kept. A message leaves the queue only after it was
+// written, a failed write is retried on the next connection. A heartbeat (a single
+// newline character) is written after 10 seconds without messages.
+//
+// The detail events can take only a quota of the memory queue, so the reports always
+// have room; they do not wait behind the spilled events either. A fatal message makes
+// room for itself by dropping the oldest events and reports. What does not fit the
+// queue nor the log is handled by the overflow policy, each dropped message is counted
+// by its type and the counters are sent with the statistics.
 //
-// The heartbeat actor sends a heartbeat (a message that consists of a single
-// newline character) every 10 seconds. In this example, no deadline is applied
-// message sending.
+// At the VM death the queue is drained until a deadline, then the connection is
+// closed and what was not written (the message in flight too) is put back ahead of
+// the records left in the spill log, as it is older, and what was handed over for
+// spilling after them; the log is left on the disk.
 //
 class TcpSender : public Sender {
 public:
-    TcpSender(boost::asio::ip::tcp::resolver::query query);
+    TcpSender(boost::asio::ip::tcp::resolver::query query, const SenderConfig &config);
 
     ~TcpSender();
 
-    // Initiate the connection process.
-    // The endpoint iterator will have been obtained using a tcp::resolver.
+    // Initiate the connection process, the resolve and the connect run on the sender thread.
     void start();
 
     // Terminate all the actors to shut down the connection.
-    // It may be called by the user of the client class, or by the class itself in
-    // response to graceful termination or an unrecoverable error.
     void stop();
 
-    // Flushes all unsent messages
+    // Waits a while for the queued messages to be written
     void flush();
 
-    // Queues a message to be send
-    void send(std::string value);
+    std::string drain(std::chrono::steady_clock::time_point deadline);
 
-    // Create the client and run the event loop
-//    static std::unique_ptr<TcpSender> create(std::string host, std::string port);
+    // Queues a message to be send, can be called from any thread
+    using Sender::send;
+
+    void send(Payload payload, MessageType type);
+
+    std::string get_statistics();
 
 private:
+    void start_resolve();
+
+    void handle_resolve(const boost::system::error_code &error, boost::asio::ip::tcp::resolver::iterator endpoint_iter);
+
     void start_connect(boost::asio::ip::tcp::resolver::iterator endpoint);
 
     void check_deadline();
 
     void handle_connect(const boost::system::error_code &error, boost::asio::ip::tcp::resolver::iterator endpoint_iter);
 
+    void schedule_reconnect();
+
+    void disconnect(const std::string reason);
+
+    void write_greeting();
+
     void start_read();
 
+    void handle_read(const boost::system::error_code &error);
+
     void start_write();
 
-    void handle_read(const boost::system::error_code &error);
+    void handle_write(const boost::system::error_code &error);
+
+    void start_heartbeat();
+
+    void write_in_flight();
+
+    struct Message {
+        Payload data;
+        MessageType type;
+    };
+
+    // Opens the log and takes over what is left on the disk, on the sender thread without the lock
+    void open_spill_log();
+
+    // Moves a batch of the log into the empty queue, on the sender thread without the lock
+    void replay();
+
+    // Appends the messages handed over by send() to the log, on the sender thread without the lock
+    void spill_queued();
+
+    // Appends a message to the log, false if it could not be written
+    bool spill(const Message &message);
+
+    // The message type followed by the message
+    static std::string to_record(const Message &message);
+
+    /* The queue methods are called with the lock held */
+
+    // Takes the next message to write from the queue
+    bool next_message();
+
+    // Copies the counters of the log for the other threads
+    void update_spill_counters();
+
+    // Nothing is left to write, in memory or on the disk
+    bool is_flushed() const;
+
+    bool fits(MessageType type, size_t size) const;
+
+    void enqueue(Message message);
+
+    // Drops the oldest messages of at most the given priority until the message fits, false if it can not
+    bool make_room(MessageType type, size_t size, MessageType max_dropped);
+
+    // Applies the overflow policy to a message that fits neither the queue nor the log
+    void overflow(std::unique_lock<std::mutex> &guard, Message message);
 
-    void handle_write(const boost::system::error_code &error, long delay_in_seconds = 10);
+    void drop(MessageType type, size_t size);
 
 private:
-    bool stopped_;
-    std::queue<std::string, std::list<std::string>> queue;
+    std::atomic<bool> stopped_;
+    /* Owned by the sender thread */
+    bool connected;
+    bool writing;
+    unsigned int reconnect_attempts;
+    std::minstd_rand random;
+
+    /* The queue, the message being written and the counters are guarded by the lock */
+    std::mutex lock;
+    std::condition_variable written;
+    std::deque<Message> queue;
+    size_t queued_bytes;
+    size_t queued_type_bytes[MESSAGE_TYPE_COUNT];
+    size_t quota_bytes[MESSAGE_TYPE_COUNT];
+    Payload in_flight;
+    MessageType in_flight_type;
+    const SenderConfig config;
+    /* Owned by the sender thread, and by drain() once it is stopped */
+    std::unique_ptr<SpillLog> spill_log;
+    /* To be appended to the log by the sender thread, counted until they are */
+    std::deque<Message> to_spill;
+    uint64_t sent_bytes;
+    uint64_t sent_messages;
+    uint64_t spilled_bytes;
+    uint64_t replayed_bytes;
+    uint64_t unspilled_messages;
+    size_t unspilled_bytes;
+    /* Of the log, as of its last change */
+    uint64_t spill_log_messages;
+    uint64_t spill_log_bytes;
+    uint64_t spill_dropped_messages;
+    uint64_t spill_dropped_bytes;
+    /* Until the log turns out to be disabled, the messages handed over before it is open are appended once it is */
+    bool spill_enabled;
+    uint64_t dropped_messages[MESSAGE_TYPE_COUNT];
+    uint64_t dropped_bytes[MESSAGE_TYPE_COUNT];
+    uint64_t overflows[MESSAGE_TYPE_COUNT];
+    uint64_t connections;
+    std::atomic<bool> write_scheduled;
 
     boost::asio::ip::tcp::resolver::query endpoint;
     boost::asio::io_service io_service;
+    std::unique_ptr<boost::asio::io_service::work> work;
+    boost::asio::ip::tcp::resolver resolver;
     boost::asio::ip::tcp::socket socket;
     boost::asio::streambuf input_buffer;
     boost::asio::deadline_timer deadline;
     boost::asio::deadline_timer heartbeat_timer;
+    boost::asio::deadline_timer reconnect_timer;
 
     boost::thread_group worker_threads;
 };
@@ -0,0 +1,445 @@
+#include "ThreadRegistry.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <vector>
+
+#include <boost/format.hpp>
+
+#include "clock.hpp"
+#include "jvmti.hpp"
+
+using namespace std;
+using namespace jeff;
+
+/* Threads living shorter than this are reported as churn */
+static const jlong SHORT_LIVED_NS = 1000000000;
+
+/* Distinct names interned per entry of the table, the threads of the pools that churn get new names */
+static const size_t NAMES_PER_ENTRY = 16;
+
+/* The thread local storage of an ended thread, a late event of the thread does not register it again */
+static char ended_marker;
+static void *const ENDED_THREAD = &ended_marker;
+
+ThreadRegistry::ThreadRegistry(size_t capacity, size_t top)
+        : capacity(capacity),
+          top(top),
+          entries(new Entry[capacity]),
+          used(0),
+          free_entries(capacity),
+          overflows(0),
+          next_id(1),
+          fields_resolved(false),
+          name_field(nullptr),
+          id_field(nullptr),
+          names_dropped(0),
+          last_report_ns(monotonic_nanos()) {
+    for (size_t i = 0; i < capacity; i++) {
+        entries[i].state.store(FREE, memory_order_relaxed);
+        entries[i].name_object = nullptr;
+    }
+}
+
+ThreadRegistry::~ThreadRegistry() {
+    // Empty
+}
+
+jvmtiError ThreadRegistry::start(jvmtiEnv &jvmti, JNIEnv &jni) {
+    jvmtiError error;
+
+    /* The threads starting now get the event and are in the list too, they register under the lock */
+    lock_guard<mutex> guard(registration_lock);
+
+    error = jvmti.SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_THREAD_START, (jthread) NULL);
+    if (!is_jvmti_error(jvmti, error, "Cannot set event notification: JVMTI_EVENT_THREAD_START")) {
+        error = jvmti.SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_THREAD_END, (jthread) NULL);
+        is_jvmti_error(jvmti, error, "Cannot set event notification: JVMTI_EVENT_THREAD_END");
+    }
+
+    jint thread_count = 0;
+    jthread *threads = nullptr;
+    if (error == JVMTI_ERROR_NONE && jvmti.GetAllThreads(&thread_count, &threads) == JVMTI_ERROR_NONE) {
+        for (jint i = 0; i < thread_count; i++) {
+            void *local = nullptr;
+            jvmti.GetThreadLocalStorage(threads[i], &local);
+            if (local == nullptr) {
+                /* Started before the thread events were enabled, the start time is unknown */
+                register_thread(jvmti, jni, threads[i], 0);
+            }
+            jni.DeleteLocalRef(threads[i]);
+        }
+        deallocate(jvmti, threads);
+    }
+    return error;
+}
+
+jvmtiError ThreadRegistry::stop(jvmtiEnv &jvmti) {
+    jvmtiError error;
+
+    error = jvmti.SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_THREAD_START, (jthread) NULL);
+    if (is_jvmti_error(jvmti, error, "Cannot disable event notification: JVMTI_EVENT_THREAD_START")) return error;
+
+    error = jvmti.SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_THREAD_END, (jthread) NULL);
+    if (is_jvmti_error(jvmti, error, "Cannot disable event notification: JVMTI_EVENT_THREAD_END")) return error;
+
+    return JVMTI_ERROR_NONE;
+}
+
+void ThreadRegistry::clear(jvmtiEnv &jvmti, JNIEnv &jni) {
+    jint thread_count = 0;
+    jthread *threads = nullptr;
+    if (jvmti.GetAllThreads(&thread_count, &threads) == JVMTI_ERROR_NONE) {
+        for (jint i = 0; i < thread_count; i++) {
+            jvmti.SetThreadLocalStorage(threads[i], nullptr);
+            jni.DeleteLocalRef(threads[i]);
+        }
+        deallocate(jvmti, threads);
+    }
+
+    size_t index;
+    while (free_entries.pop(index)) {
+        // Discard
+    }
+    for (size_t i = 0; i < capacity; i++) {
+        release(jni, entries[i]);
+        entries[i].state.store(FREE, memory_order_relaxed);
+    }
+    used.store(0, memory_order_release);
+    last_report_ns = monotonic_nanos();
+}
+
+void ThreadRegistry::thread_started(jvmtiEnv &jvmti, JNIEnv &jni, jthread thread) {
+    register_current(jvmti, jni, thread, monotonic_nanos());
+}
+
+void ThreadRegistry::thread_ended(jvmtiEnv &jvmti, jthread thread) {
+    Entry *entry = nullptr;
+    if (jvmti.GetThreadLocalStorage(thread, (void **) &entry) != JVMTI_ERROR_NONE || entry == nullptr
+        || entry == ENDED_THREAD) {
+        return;
+    }
+
+    /* ThreadEnd is sent on the ending thread itself */
+    jlong cpu_ns = 0;
+    jvmti.GetCurrentThreadCpuTime(&cpu_ns);
+    entry->final_cpu_ns = cpu_ns;
+    entry->ended_ns = monotonic_nanos();
+    jvmti.SetThreadLocalStorage(thread, ENDED_THREAD);
+    entry->state.store(ENDED, memory_order_release);
+}
+
+ThreadRegistry::Entry *ThreadRegistry::register_current(jvmtiEnv &jvmti, JNIEnv &jni, jthread thread,
+                                                        jlong started_ns) {
+    lock_guard<mutex> guard(registration_lock);
+    /* Registered by start() meanwhile, or ended */
+    void *local = nullptr;
+    jvmti.GetThreadLocalStorage(nullptr, &local);
+    if (local != nullptr) {
+        return (local != ENDED_THREAD) ? static_cast<Entry *>(local) : nullptr;
+    }
+    return register_thread(jvmti, jni, thread, started_ns);
+}
+
+ThreadRegistry::Entry *ThreadRegistry::register_thread(jvmtiEnv &jvmti, JNIEnv &jni, jthread thread,
+                                                       jlong started_ns) {
+    size_t index;
+    if (!free_entries.pop(index)) {
+        index = used.fetch_add(1, memory_order_relaxed);
+        if (index >= capacity) {
+            used.store(capacity, memory_order_relaxed);
+            overflows.fetch_add(1, memory_order_relaxed);
+            return nullptr;
+        }
+    }
+
+    resolve_fields(jni);
+
+    Entry &entry = entries[index];
+    entry.started_ns = started_ns;
+    entry.ended_ns = 0;
+    entry.final_cpu_ns = 0;
+    entry.sampled_cpu_ns = 0;
+    entry.reported_cpu_ns = 0;
+    jfieldID field = id_field.load(memory_order_relaxed);
+    entry.id = (field != nullptr) ? jni.GetLongField(thread, field) : next_id.fetch_add(1, memory_order_relaxed);
+    read_thread_info(jvmti, jni, thread, entry);
+
+    entry.state.store(ALIVE, memory_order_release);
+    jvmti.SetThreadLocalStorage(thread, &entry);
+    return &entry;
+}
+
+void ThreadRegistry::read_thread_info(jvmtiEnv &jvmti, JNIEnv &jni, jthread thread, Entry &entry) {
+    mark_name(jni, thread, entry);
+    entry.group[0] = '\0';
+    entry.daemon = false;
+
+    jvmtiThreadInfo info = {0};
+    if (jvmti.GetThreadInfo(thread, &info) != JVMTI_ERROR_NONE) {
+        set_name(entry, "Unknown");
+        return;
+    }
+    set_name(entry, (info.name != nullptr) ? info.name : "Unknown");
+    if (info.name != nullptr) {
+        deallocate(jvmti, info.name);
+    }
+    entry.daemon = (info.is_daemon == JNI_TRUE);
+    if (info.thread_group != nullptr) {
+        jvmtiThreadGroupInfo group_info = {0};
+        if (jvmti.GetThreadGroupInfo(info.thread_group, &group_info) == JVMTI_ERROR_NONE) {
+            if (group_info.name != nullptr) {
+                strncpy(entry.group, group_info.name, GROUP_LENGTH - 1);
+                entry.group[GROUP_LENGTH - 1] = '\0';
+                deallocate(jvmti, group_info.name);
+            }
+            jni.DeleteLocalRef(group_info.parent);
+        }
+    }
+    jni.DeleteLocalRef(info.thread_group);
+    jni.DeleteLocalRef(info.context_class_loader);
+}
+
+void ThreadRegistry::mark_name(JNIEnv &jni, jthread thread, Entry &entry) {
+    /* The field first, a rename in between is then noticed by the next check */
+    release(jni, entry);
+    jfieldID field = name_field.load(memory_order_relaxed);
+    if (field != nullptr) {
+        jobject name = jni.GetObjectField(thread, field);
+        entry.name_object = jni.NewWeakGlobalRef(name);
+        jni.DeleteLocalRef(name);
+    }
+    entry.name_checked_ns = monotonic_nanos();
+}
+
+void ThreadRegistry::set_name(Entry &entry, const char *name) {
+    strncpy(entry.name, name, NAME_LENGTH - 1);
+    entry.name[NAME_LENGTH - 1] = '\0';
+    entry.name_id.store(intern_name(entry.name), memory_order_release);
+}
+
+void ThreadRegistry::check_name(jvmtiEnv &jvmti, JNIEnv &jni, jthread thread, Entry &entry) {
+    jlong now = monotonic_nanos();
+    if (now - entry.name_checked_ns < NAME_CHECK_NS) {
+        return;
+    }
+    entry.name_checked_ns = now;
+
+    jfieldID field = name_field.load(memory_order_relaxed);
+    if (field == nullptr) {
+        return;
+    }
+    /* Thread.setName() assigns a new value to the field, the old one is not modified */
+    jobject name = jni.GetObjectField(thread, field);
+    bool renamed = !jni.IsSameObject(name, entry.name_object);
+    jni.DeleteLocalRef(name);
+    if (!renamed) {
+        return;
+    }
+
+    /* Only the name changes, the group and the daemon flag the reporter reads stay as they are */
+    mark_name(jni, thread, entry);
+    jvmtiThreadInfo info = {0};
+    if (jvmti.GetThreadInfo(thread, &info) == JVMTI_ERROR_NONE) {
+        set_name(entry, (info.name != nullptr) ? info.name : "Unknown");
+        if (info.name != nullptr) {
+            deallocate(jvmti, info.name);
+        }
+        jni.DeleteLocalRef(info.thread_group);
+        jni.DeleteLocalRef(info.context_class_loader);
+    }
+}
+
+void ThreadRegistry::resolve_fields(JNIEnv &jni) {
+    if (fields_resolved.load(memory_order_acquire)) {
+        return;
+    }
+    jclass type = jni.FindClass("java/lang/Thread");
+    if (type == nullptr) {
+        jni.ExceptionClear();
+        return;
+    }
+    jfieldID name = jni.GetFieldID(type, "name", "Ljava/lang/String;");
+    if (name == nullptr) {
+        jni.ExceptionClear();
+        name = jni.GetFieldID(type, "name", "[C");
+    }
+    if (name == nullptr) {
+        jni.ExceptionClear();
+    }
+    jfieldID id = jni.GetFieldID(type, "tid", "J");
+    if (id == nullptr) {
+        jni.ExceptionClear();
+    }
+    jni.DeleteLocalRef(type);
+
+    name_field.store(name, memory_order_relaxed);
+    id_field.store(id, memory_order_relaxed);
+    fields_resolved.store(true, memory_order_release);
+}
+
+jint ThreadRegistry::intern_name(const char *name) {
+    lock_guard<mutex> guard(names_lock);
+    string key(name);
+    auto interned = name_ids.find(key);
+    if (interned != name_ids.end()) {
+        return interned->second;
+    }
+    if (names.size() >= capacity * NAMES_PER_ENTRY) {
+        names_dropped++;
+        return NO_NAME_ID;
+    }
+    jint id = (jint) names.size();
+    names.push_back(key);
+    name_ids.emplace(key, id);
+    return id;
+}
+
+void ThreadRegistry::release(JNIEnv &jni, Entry &entry) {
+    if (entry.name_object != nullptr) {
+        jni.DeleteWeakGlobalRef(entry.name_object);
+        entry.name_object = nullptr;
+    }
+}
+
+bool ThreadRegistry::get_current(jvmtiEnv &jvmti, JNIEnv &jni, jthread thread, Metadata &metadata) {
+    /* The current thread, a plain read of the thread state without a VM transition */
+    Entry *entry = nullptr;
+    jvmti.GetThreadLocalStorage(nullptr, (void **) &entry);
+    if (entry == ENDED_THREAD) {
+        return false;
+    } else if (entry == nullptr) {
+        entry = register_current(jvmti, jni, thread, 0);
+        if (entry == nullptr) {
+            return false;
+        }
+    } else {
+        check_name(jvmti, jni, thread, *entry);
+    }
+
+    metadata.id = entry->id;
+    metadata.name_id = entry->name_id.load(memory_order_relaxed);
+    metadata.name = entry->name;
+    metadata.group = entry->group;
+    metadata.daemon = entry->daemon;
+    return true;
+}
+
+string ThreadRegistry::get_pool_name(const string &thread_name) {
+    /* "pool-1-thread-7" and "http-nio-8080-exec-3" are pools "pool-1-thread-" and "http-nio-8080-exec-" */
+    size_t end = thread_name.size();
+    while (end > 0 && isdigit((unsigned char) thread_name[end - 1])) {
+        end--;
+    }
+    return (end == 0) ? thread_name : thread_name.substr(0, end);
+}
+
+string ThreadRegistry::report(jvmtiEnv &jvmti, JNIEnv &jni) {
+    jvmtiError error;
+    jlong now = monotonic_nanos();
+    jlong period_ns = max(now - last_report_ns, (jlong) 1);
+
+    jint thread_count = 0;
+    jthread *threads = nullptr;
+    error = jvmti.GetAllThreads(&thread_count, &threads);
+    if (is_jvmti_error(jvmti, error, "Unable to get all threads")) {
+        return "Threads: unable to get all threads\n";
+    }
+    for (jint i = 0; i < thread_count; i++) {
+        /* Only the threads' own entries, a thread without one was not registered (registry full) yet */
+        Entry *entry = nullptr;
+        jvmti.GetThreadLocalStorage(threads[i], (void **) &entry);
+        jlong cpu_ns = 0;
+        if (entry != nullptr && entry != ENDED_THREAD && jvmti.GetThreadCpuTime(threads[i], &cpu_ns) == JVMTI_ERROR_NONE) {
+            entry->sampled_cpu_ns = cpu_ns;
+        }
+        jni.DeleteLocalRef(threads[i]);
+    }
+    deallocate(jvmti, threads);
+
+    struct Pool {
+        jlong threads;
+        jlong started;
+        jlong ended;
+        jlong short_lived;
+        jlong lifetime_ns;
+        jlong cpu_ns;
+    };
+    map<string, Pool> pools;
+    vector<pair<jlong, string>> by_cpu;
+
+    jlong daemons = 0;
+    size_t count = min(used.load(memory_order_relaxed), capacity);
+    unique_lock<mutex> names_guard(names_lock);
+    for (size_t i = 0; i < count; i++) {
+        Entry &entry = entries[i];
+        int state = entry.state.load(memory_order_acquire);
+        if (state == FREE) {
+            continue;
+        }
+
+        /* The name array is rewritten by the thread on a rename, only the interned names are read */
+        jint name_id = entry.name_id.load(memory_order_acquire);
+        const string name = (name_id != NO_NAME_ID) ? names[name_id] : string("(name not interned)");
+        Pool &pool = pools[get_pool_name(name)];
+        if (entry.started_ns >= last_report_ns) {
+            pool.started++;
+        }
+
+        jlong cpu_ns;
+        if (state == ALIVE) {
+            cpu_ns = entry.sampled_cpu_ns - entry.reported_cpu_ns;
+            entry.reported_cpu_ns = entry.sampled_cpu_ns;
+            pool.threads++;
+            daemons += entry.daemon ? 1 : 0;
+        } else {
+            cpu_ns = max(entry.final_cpu_ns - entry.reported_cpu_ns, (jlong) 0);
+            pool.ended++;
+            if (entry.started_ns > 0) {
+                jlong lifetime_ns = entry.ended_ns - entry.started_ns;
+                pool.lifetime_ns += lifetime_ns;
+                pool.short_lived += (lifetime_ns < SHORT_LIVED_NS) ? 1 : 0;
+            }
+        }
+        pool.cpu_ns += cpu_ns;
+        by_cpu.push_back(make_pair(cpu_ns, (boost::format("%s [%s]%s")
+                                            % name % entry.group % (state == ENDED ? " (ended)" : "")).str()));
+
+        if (state == ENDED) {
+            release(jni, entry);
+            entry.state.store(FREE, memory_order_relaxed);
+            free_entries.push(i);
+        }
+    }
+    jlong interned = (jlong) names.size();
+    jlong not_interned = names_dropped;
+    names_guard.unlock();
+    last_report_ns = now;
+
+    size_t n = min(top, by_cpu.size());
+    partial_sort(by_cpu.begin(), by_cpu.begin() + n, by_cpu.end(),
+                 [](const pair<jlong, string> &a, const pair<jlong, string> &b) { return a.first > b.first; });
+
+    string ret = (boost::format("Threads: %s live (%s daemon), %s not registered (registry full), %s names (%s not "
+                                        "interned)\n\ttop threads by CPU:\n")
+                  % thread_count % daemons % overflows.load() % interned % not_interned).str();
+    for (size_t i = 0; i < n; i++) {
+        ret += (boost::format("\t\t%.3f ms (%.1f%%) %s\n")
+                % (by_cpu[i].first / 1e6) % (100.0 * by_cpu[i].first / period_ns) % by_cpu[i].second).str();
+    }
+
+    vector<pair<string, Pool>> by_pool(pools.begin(), pools.end());
+    sort(by_pool.begin(), by_pool.end(), [](const pair<string, Pool> &a, const pair<string, Pool> &b) {
+        return a.second.cpu_ns > b.second.cpu_ns;
+    });
+    ret += "\tthread pools by CPU:\n";
+    for (auto &pool : by_pool) {
+        const Pool &p = pool.second;
+        ret += (boost::format("\t\t%s: %.3f ms (%.1f%%), %s live, %s started, %s ended (%s shorter than 1s, "
+                                      "average lifetime %.3f ms)\n")
+                % pool.first % (p.cpu_ns / 1e6) % (100.0 * p.cpu_ns / period_ns) % p.threads % p.started
+                % p.ended % p.short_lived % (p.ended > 0 ? p.lifetime_ns / 1e6 / p.ended : 0.0)).str();
+    }
+    return ret;
+}
@@ -0,0 +1,168 @@
+#ifndef JEFF_NATIVE_AGENT_THREADREGISTRY_HPP
+#define JEFF_NATIVE_AGENT_THREADREGISTRY_HPP
+
+#include <jni.h>
+#include <jvmti.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+#include "RingBuffer.hpp"
+
+//
+// Thread lifecycle registry and per-thread CPU accounting.
+//
+// JVMTI_EVENT_THREAD_START claims an entry in a fixed table, fills in the start
+// time, the name and the thread group, and hangs it on the thread with
+// SetThreadLocalStorage. This takes a lock once per thread, as start() registers
+// the running threads under it too, and interns the name in a bounded table under
+// another lock, which allocates the first time a name is seen; the events of a
+// registered thread take neither. JVMTI_EVENT_THREAD_END stores the
+// end time and the final CPU time of the thread, and leaves a marker in place of
+// the entry, so the thread is never registered again. Threads started before the
+// events were enabled are registered once, when the events are enabled; a thread
+// only ever registers itself after that, on its start or lazily on its first event.
+//
+// The entry caches the identity of the thread for the events: the Java thread id,
+// the name and its interned id, the group and the daemon flag, so an event reads it
+// with GetThreadLocalStorage of the current thread only. A renamed thread is noticed
+// by comparing the name field of the Thread with the one the name was read from, at
+// most once per NAME_CHECK_NS, and only then the name is read again. The thread
+// rewrites only its own name, the reporter reads the name by the interned id, which
+// is published atomically; the group and the daemon flag are set on registration.
+//
+// The reporter samples GetThreadCpuTime for all live threads, reports the CPU used
+// per thread and per thread pool (threads grouped by name without the trailing
+// number) and the lifetimes of the threads that ended, then recycles their entries.
+//
+class ThreadRegistry : boost::noncopyable {
+public:
+    static const size_t NAME_LENGTH = 64;
+
+    static const size_t GROUP_LENGTH = 32;
+
+    /* Renames are checked at most this often per thread */
+    static const jlong NAME_CHECK_NS = 1000000000;
+
+    /* The id of a name that did not fit the name table */
+    static const jint NO_NAME_ID = -1;
+
+    // Identity of a thread, the strings are valid on the thread itself until its next event
+    struct Metadata {
+        jlong id;
+        jint name_id;
+        const char *name;
+        const char *group;
+        bool daemon;
+    };
+
+    ThreadRegistry(size_t capacity, size_t top);
+
+    ~ThreadRegistry();
+
+    // Enables the thread events and registers the threads already running, requires the live phase
+    jvmtiError start(jvmtiEnv &jvmti, JNIEnv &jni);
+
+    jvmtiError stop(jvmtiEnv &jvmti);
+
+    // Detaches the entries from the threads and empties the table, must not run concurrently with report()
+    void clear(jvmtiEnv &jvmti, JNIEnv &jni);
+
+    // Called from JVMTI_EVENT_THREAD_START
+    void thread_started(jvmtiEnv &jvmti, JNIEnv &jni, jthread thread);
+
+    // Called from JVMTI_EVENT_THREAD_END
+    void thread_ended(jvmtiEnv &jvmti, jthread thread);
+
+    // Metadata of the current thread, the one the event is sent on; false when the registry is full
+    bool get_current(jvmtiEnv &jvmti, JNIEnv &jni, jthread thread, Metadata &metadata);
+
+    // Samples the CPU time of all threads and returns the per-thread and per-pool usage for the period
+    std::string report(jvmtiEnv &jvmti, JNIEnv &jni);
+
+private:
+    enum State {
+        FREE = 0,
+        ALIVE = 1,
+        ENDED = 2
+    };
+
+    struct Entry {
+        std::atomic<int> state;
+        jlong started_ns;
+        jlong ended_ns;
+        jlong final_cpu_ns;
+        jlong id;
+        bool daemon;
+        char group[GROUP_LENGTH];
+        /* The name is rewritten by the thread itself on a rename, the reporter reads it by the id */
+        char name[NAME_LENGTH];
+        std::atomic<jint> name_id;
+        /* Weak reference to the value of the name field the name was read from */
+        jweak name_object;
+        jlong name_checked_ns;
+
+        /* Owned by the reporter thread */
+        jlong sampled_cpu_ns;
+        jlong reported_cpu_ns;
+    };
+
+    Entry *register_thread(jvmtiEnv &jvmti, JNIEnv &jni, jthread thread, jlong started_ns);
+
+    // Registers the current thread unless it has an entry, or had one and ended
+    Entry *register_current(jvmtiEnv &jvmti, JNIEnv &jni, jthread thread, jlong started_ns);
+
+    // Reads the name, the group and the daemon flag of a thread that registers
+    void read_thread_info(jvmtiEnv &jvmti, JNIEnv &jni, jthread thread, Entry &entry);
+
+    // Remembers the value of the name field, before the name is read from it
+    void mark_name(JNIEnv &jni, jthread thread, Entry &entry);
+
+    // Copies the name for the events and publishes its interned id for the reporter
+    void set_name(Entry &entry, const char *name);
+
+    // Re-reads the name if the name field of the thread changed since the name was read
+    void check_name(jvmtiEnv &jvmti, JNIEnv &jni, jthread thread, Entry &entry);
+
+    // Looks up the fields of java.lang.Thread once, the name field is a char[] before JDK 9
+    void resolve_fields(JNIEnv &jni);
+
+    jint intern_name(const char *name);
+
+    // Drops the weak reference of an entry that is no longer used
+    void release(JNIEnv &jni, Entry &entry);
+
+    static std::string get_pool_name(const std::string &thread_name);
+
+    const size_t capacity;
+    const size_t top;
+    std::unique_ptr<Entry[]> entries;
+    std::atomic<size_t> used;
+    RingBuffer<size_t> free_entries;
+    std::atomic<jlong> overflows;
+    std::atomic<jlong> next_id;
+
+    /* Taken once per thread, start() registers the running threads while they may register themselves */
+    std::mutex registration_lock;
+
+    std::atomic<bool> fields_resolved;
+    std::atomic<jfieldID> name_field;
+    std::atomic<jfieldID> id_field;
+
+    /* Interned names, appended on the thread start and rename only, bounded */
+    std::mutex names_lock;
+    std::unordered_map<std::string, jint> name_ids;
+    std::vector<std::string> names;
+    jlong names_dropped;
+
+    /* Owned by the reporter thread */
+    jlong last_report_ns;
+};
+
+#endif //JEFF_NATIVE_AGENT_THREADREGISTRY_HPP
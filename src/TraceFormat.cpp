@@ -0,0 +1,57 @@
+#include "TraceFormat.hpp"
+
+#include <cstring>
+#include <stdexcept>
+
+using namespace trace;
+
+void Writer::put_varint(uint64_t value) {
+    while (value >= 0x80) {
+        buffer.push_back((char) ((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    buffer.push_back((char) value);
+}
+
+void Writer::put_string(const char *value) {
+    if (value == nullptr) {
+        put_varint(0);
+        return;
+    }
+    size_t length = std::strlen(value);
+    put_varint(length + 1);
+    buffer.append(value, length);
+}
+
+uint8_t Reader::get_byte() {
+    if (position >= end) {
+        throw std::runtime_error("truncated trace");
+    }
+    return (uint8_t) *position++;
+}
+
+uint64_t Reader::get_varint() {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        uint8_t byte = get_byte();
+        value |= (uint64_t) (byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return value;
+        }
+    }
+    throw std::runtime_error("invalid varint in the trace");
+}
+
+bool Reader::get_string(std::string &value) {
+    uint64_t length = get_varint();
+    if (length == 0) {
+        value.clear();
+        return false;
+    }
+    if ((uint64_t) (end - position) < length - 1) {
+        throw std::runtime_error("truncated trace");
+    }
+    value.assign(position, (size_t) (length - 1));
+    position += length - 1;
+    return true;
+}
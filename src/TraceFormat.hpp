@@ -0,0 +1,96 @@
+#ifndef JEFF_NATIVE_AGENT_TRACEFORMAT_HPP
+#define JEFF_NATIVE_AGENT_TRACEFORMAT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+//
+// The trace of the inputs of the exception callbacks, written by the agent with the record option
+// and fed back to the agent by jeff-replay, so the capture, the formatting and the sending can be
+// benchmarked offline on the exceptions of a real application.
+//
+// The file starts with the magic and the jlocation format, followed by records of a tag byte and
+// fields; the numbers are LEB128 varints (zigzag for the signed ones), a string is its length + 1
+// and its bytes, 0 meaning null:
+//
+//   CLASS   id, signature
+//   METHOD  id, declaring class id, name, signature, generic signature,
+//           line number table error, count, (start location, line number)...,
+//           arguments size error, size, local variable table error, count, (name, signature, slot)...
+//   THREAD  id, name, thread group name, daemon, Java thread id
+//   EVENT   thread id, method id, location, catch method id (0 for none), catch location,
+//           the exception, its getMessage(), frame count, (method id, location, values...)...
+//
+// The counts and the sizes after an error (other than JVMTI_ERROR_NONE) are left out. The classes,
+// methods and threads are written before the first event that uses them, a thread is written again
+// when it was renamed. The values of a frame are those of the arguments of its method,
+// the first min(arguments size, local variable count) entries of the local variable table, each the
+// error of GetLocal*() followed (without an error) by the value: a number for the primitives, the bits
+// for float and double, an object for the rest. An object is its class id (0 for null) followed by
+// its toString() for the objects and by the elements for the boolean arrays.
+//
+namespace trace {
+
+    static const char MAGIC[] = "JEFFTRC1";
+
+    static const size_t MAGIC_LENGTH = 8;
+
+    enum Tag {
+        CLASS = 'C',
+        METHOD = 'M',
+        THREAD = 'T',
+        EVENT = 'E'
+    };
+
+    // Appends the fields to a buffer
+    class Writer {
+    public:
+        void put_byte(uint8_t value) {
+            buffer.push_back((char) value);
+        }
+
+        void put_varint(uint64_t value);
+
+        void put_signed(int64_t value) {
+            put_varint(((uint64_t) value << 1) ^ (uint64_t) (value >> 63));
+        }
+
+        void put_string(const char *value);
+
+        void put_string(const std::string &value) {
+            put_varint(value.size() + 1);
+            buffer.append(value);
+        }
+
+        std::string buffer;
+    };
+
+    // Reads the fields of a buffer, throws std::runtime_error past its end
+    class Reader {
+    public:
+        Reader(const char *begin, const char *end) : position(begin), end(end) { }
+
+        bool at_end() const {
+            return position >= end;
+        }
+
+        uint8_t get_byte();
+
+        uint64_t get_varint();
+
+        int64_t get_signed() {
+            uint64_t value = get_varint();
+            return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+        }
+
+        // False for a null string
+        bool get_string(std::string &value);
+
+    private:
+        const char *position;
+        const char *end;
+    };
+}
+
+#endif //JEFF_NATIVE_AGENT_TRACEFORMAT_HPP
@@ -0,0 +1,490 @@
+#include "TraceRecorder.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+#include <boost/format.hpp>
+
+#include "jvmti.hpp"
+
+using namespace std;
+using namespace jeff;
+
+/* The records are written to the file in chunks of about this size */
+static const size_t FLUSH_BYTES = 64 * 1024;
+
+/* Set while a thread reads its event, the exceptions of the Java calls come back to the callback */
+static thread_local bool recording = false;
+
+TraceRecorder::TraceRecorder(const std::string path)
+        : path(path),
+          started(false),
+          thread_id_field(nullptr),
+          events(0),
+          written_bytes(0) {
+    // Empty
+}
+
+TraceRecorder::~TraceRecorder() {
+    stop();
+}
+
+bool TraceRecorder::start(jvmtiEnv &jvmti) {
+    lock_guard<mutex> guard(lock);
+    file.open(path.c_str(), ios::out | ios::trunc | ios::binary);
+    if (!file) {
+        std::cerr << boost::format("Cannot open the trace '%s'\n") % path;
+        return false;
+    }
+
+    jvmtiJlocationFormat format = JVMTI_JLOCATION_OTHER;
+    jvmtiError error = jvmti.GetJLocationFormat(&format);
+    if (is_jvmti_error(jvmti, error, "Cannot get location format")) {
+        return false;
+    }
+    writer.buffer.append(trace::MAGIC, trace::MAGIC_LENGTH);
+    writer.put_varint((uint64_t) format);
+    started = true;
+    return true;
+}
+
+void TraceRecorder::stop() {
+    lock_guard<mutex> guard(lock);
+    if (started) {
+        flush();
+        file.close();
+        started = false;
+    }
+}
+
+bool TraceRecorder::is_recording() {
+    return recording;
+}
+
+void TraceRecorder::record(jvmtiEnv &jvmti, JNIEnv &jni, jthread thread, jmethodID method, jlocation location,
+                           jobject exception, jmethodID catch_method, jlocation catch_location) {
+    /* An exception thrown by toString() or by a class loaded for it, not one of the workload */
+    if (recording) {
+        return;
+    }
+    {
+        lock_guard<mutex> guard(lock);
+        if (!started) {
+            return;
+        }
+    }
+    recording = true;
+
+    ThreadDefinition thread_definition = read_thread(jvmti, jni, thread);
+
+    jint count = 0;
+    std::vector<jvmtiFrameInfo> frames;
+    if (jvmti.GetFrameCount(thread, &count) == JVMTI_ERROR_NONE && count > 0) {
+        frames.resize((size_t) count);
+        if (jvmti.GetStackTrace(thread, 0, count, frames.data(), &count) != JVMTI_ERROR_NONE) {
+            count = 0;
+        }
+    }
+
+    /* The methods seen before only need their arguments, they are never changed once defined */
+    std::vector<const std::vector<Argument> *> frame_arguments((size_t) count, nullptr);
+    std::vector<jmethodID> unknown;
+    {
+        lock_guard<mutex> guard(lock);
+        for (jint depth = 0; depth < count; depth++) {
+            auto found = methods.find(frames[depth].method);
+            if (found != methods.end()) {
+                frame_arguments[depth] = &found->second.arguments;
+            } else {
+                unknown.push_back(frames[depth].method);
+            }
+        }
+        for (jmethodID other : {method, catch_method}) {
+            if (other != nullptr && methods.find(other) == methods.end()) {
+                unknown.push_back(other);
+            }
+        }
+    }
+    std::unordered_map<jmethodID, MethodDefinition> definitions;
+    for (jmethodID other : unknown) {
+        if (definitions.find(other) == definitions.end()) {
+            definitions.emplace(other, read_method(jvmti, other));
+        }
+    }
+    for (jint depth = 0; depth < count; depth++) {
+        if (frame_arguments[depth] == nullptr) {
+            frame_arguments[depth] = &definitions[frames[depth].method].arguments;
+        }
+    }
+
+    Pending event;
+    event.put_method(method);
+    event.writer.put_signed(location);
+    if (catch_method == nullptr) {
+        event.writer.put_varint(0);
+    } else {
+        event.put_method(catch_method);
+    }
+    event.writer.put_signed(catch_location);
+
+    write_object(jvmti, jni, exception, "Ljava/lang/Throwable;", event);
+    string message;
+    if (call_string_method(jni, exception, "getMessage", message)) {
+        event.writer.put_string(message);
+    } else {
+        event.writer.put_string(nullptr);
+    }
+
+    event.writer.put_varint((uint64_t) count);
+    for (jint depth = 0; depth < count; depth++) {
+        event.put_method(frames[depth].method);
+        event.writer.put_signed(frames[depth].location);
+        for (const Argument &argument : *frame_arguments[depth]) {
+            write_value(jvmti, jni, thread, depth, argument, event);
+        }
+    }
+
+    {
+        lock_guard<mutex> guard(lock);
+        if (started) {
+            /* The definitions go to the trace while the ids are put in, ahead of the event */
+            trace::Writer record;
+            record.put_byte(trace::EVENT);
+            record.put_varint((uint64_t) get_thread_id(thread_definition));
+            for (auto &definition : definitions) {
+                define_method(definition.first, definition.second);
+            }
+            fill_holes(event, record);
+
+            writer.buffer.append(record.buffer);
+            events++;
+            if (writer.buffer.size() >= FLUSH_BYTES) {
+                flush();
+            }
+        }
+    }
+    recording = false;
+}
+
+/* Unlike jeff::get_class_signature() it does not abort on an error */
+static string read_class_signature(jvmtiEnv &jvmti, jclass type) {
+    char *signature = nullptr;
+    jvmtiError error = jvmti.GetClassSignature(type, &signature, nullptr);
+    string key = (error == JVMTI_ERROR_NONE) ? string(signature) : "<invalid class>";
+    if (error == JVMTI_ERROR_NONE) {
+        deallocate(jvmti, signature);
+    }
+    return key;
+}
+
+TraceRecorder::MethodDefinition TraceRecorder::read_method(jvmtiEnv &jvmti, jmethodID method) {
+    jvmtiError error;
+    MethodDefinition definition = {false, string(), string(), {}};
+
+    jclass type = nullptr;
+    if (jvmti.GetMethodDeclaringClass(method, &type) == JVMTI_ERROR_NONE) {
+        definition.has_class = true;
+        definition.class_signature = read_class_signature(jvmti, type);
+    }
+
+    trace::Writer fields;
+    char *name = nullptr;
+    char *signature = nullptr;
+    char *generic = nullptr;
+    error = jvmti.GetMethodName(method, &name, &signature, &generic);
+    fields.put_string((error == JVMTI_ERROR_NONE) ? name : nullptr);
+    fields.put_string((error == JVMTI_ERROR_NONE) ? signature : nullptr);
+    fields.put_string((error == JVMTI_ERROR_NONE) ? generic : nullptr);
+    if (error == JVMTI_ERROR_NONE) {
+        deallocate(jvmti, generic);
+        deallocate(jvmti, signature);
+        deallocate(jvmti, name);
+    }
+
+    jint line_count = 0;
+    jvmtiLineNumberEntry *lines = nullptr;
+    error = jvmti.GetLineNumberTable(method, &line_count, &lines);
+    fields.put_varint((uint64_t) error);
+    if (error == JVMTI_ERROR_NONE) {
+        fields.put_varint((uint64_t) line_count);
+        for (jint i = 0; i < line_count; i++) {
+            fields.put_signed(lines[i].start_location);
+            fields.put_signed(lines[i].line_number);
+        }
+        deallocate(jvmti, lines);
+    }
+
+    jint arguments_size = 0;
+    error = jvmti.GetArgumentsSize(method, &arguments_size);
+    fields.put_varint((uint64_t) error);
+    bool has_arguments = (error == JVMTI_ERROR_NONE);
+    if (has_arguments) {
+        fields.put_varint((uint64_t) arguments_size);
+    }
+
+    jint variable_count = 0;
+    jvmtiLocalVariableEntry *variables = nullptr;
+    error = jvmti.GetLocalVariableTable(method, &variable_count, &variables);
+    fields.put_varint((uint64_t) error);
+    if (error == JVMTI_ERROR_NONE) {
+        fields.put_varint((uint64_t) variable_count);
+        for (jint i = 0; i < variable_count; i++) {
+            const jvmtiLocalVariableEntry &variable = variables[i];
+            fields.put_string(variable.name);
+            fields.put_string(variable.signature);
+            fields.put_varint((uint64_t) variable.slot);
+            if (has_arguments && i < arguments_size) {
+                definition.arguments.push_back(Argument{variable.signature, variable.slot});
+            }
+            deallocate(jvmti, variable.generic_signature);
+            deallocate(jvmti, variable.signature);
+            deallocate(jvmti, variable.name);
+        }
+        deallocate(jvmti, variables);
+    }
+    definition.fields.swap(fields.buffer);
+    return definition;
+}
+
+TraceRecorder::ThreadDefinition TraceRecorder::read_thread(jvmtiEnv &jvmti, JNIEnv &jni, jthread thread) {
+    std::call_once(fields_resolved, [this, &jni]() {
+        jclass type = jni.FindClass("java/lang/Thread");
+        if (type != nullptr) {
+            thread_id_field = jni.GetFieldID(type, "tid", "J");
+            jni.DeleteLocalRef(type);
+        }
+        if (jni.ExceptionCheck()) {
+            jni.ExceptionClear();
+        }
+    });
+    /* Without the field all the threads are one */
+    jlong java_id = (thread_id_field != nullptr) ? jni.GetLongField(thread, thread_id_field) : 0;
+
+    jvmtiThreadInfo info = {0};
+    if (jvmti.GetThreadInfo(thread, &info) != JVMTI_ERROR_NONE) {
+        info = jvmtiThreadInfo();
+    }
+    /* A terminated thread has no group */
+    bool has_group = false;
+    string group;
+    if (info.thread_group != nullptr) {
+        jvmtiThreadGroupInfo group_info = {0};
+        if (jvmti.GetThreadGroupInfo(info.thread_group, &group_info) == JVMTI_ERROR_NONE) {
+            has_group = true;
+            group = (group_info.name != nullptr) ? group_info.name : "";
+            deallocate(jvmti, group_info.name);
+            jni.DeleteLocalRef(group_info.parent);
+        }
+    }
+
+    trace::Writer fields;
+    fields.put_string((info.name != nullptr) ? info.name : nullptr);
+    fields.put_string(has_group ? group.c_str() : nullptr);
+    fields.put_byte(info.is_daemon == JNI_TRUE ? 1 : 0);
+    fields.put_signed(java_id);
+    ThreadDefinition definition = {java_id, (info.name != nullptr) ? info.name : "", string()};
+    definition.fields.swap(fields.buffer);
+
+    deallocate(jvmti, info.name);
+    jni.DeleteLocalRef(info.thread_group);
+    jni.DeleteLocalRef(info.context_class_loader);
+    return definition;
+}
+
+jint TraceRecorder::get_class_id(const std::string &signature) {
+    auto found = classes.find(signature);
+    if (found != classes.end()) {
+        return found->second;
+    }
+    jint id = (jint) classes.size() + 1;
+    classes.emplace(signature, id);
+    writer.put_byte(trace::CLASS);
+    writer.put_varint((uint64_t) id);
+    writer.put_string(signature);
+    return id;
+}
+
+void TraceRecorder::define_method(jmethodID method, const MethodDefinition &definition) {
+    /* Another thread may have defined it meanwhile */
+    if (methods.find(method) != methods.end()) {
+        return;
+    }
+    /* The declaring class first, its record must come before the method */
+    jint class_id = definition.has_class ? get_class_id(definition.class_signature) : 0;
+
+    Method &entry = methods[method];
+    entry.id = (jint) methods.size();
+    entry.arguments = definition.arguments;
+    writer.put_byte(trace::METHOD);
+    writer.put_varint((uint64_t) entry.id);
+    writer.put_varint((uint64_t) class_id);
+    writer.buffer.append(definition.fields);
+}
+
+jint TraceRecorder::get_thread_id(const ThreadDefinition &definition) {
+    auto found = threads.find(definition.java_id);
+    bool renamed = (found != threads.end() && found->second.name != definition.name);
+    jint id = (found != threads.end()) ? found->second.id : (jint) threads.size() + 1;
+    if (found == threads.end() || renamed) {
+        threads[definition.java_id] = Thread{id, definition.name};
+        writer.put_byte(trace::THREAD);
+        writer.put_varint((uint64_t) id);
+        writer.buffer.append(definition.fields);
+    }
+    return id;
+}
+
+void TraceRecorder::fill_holes(const Pending &pending, trace::Writer &event) {
+    const string &buffer = pending.writer.buffer;
+    size_t offset = 0;
+    for (const Hole &hole : pending.holes) {
+        event.buffer.append(buffer, offset, hole.offset - offset);
+        offset = hole.offset;
+        if (hole.method != nullptr) {
+            /* Defined before the holes are filled */
+            event.put_varint((uint64_t) methods[hole.method].id);
+        } else {
+            event.put_varint((uint64_t) get_class_id(hole.class_signature));
+        }
+    }
+    event.buffer.append(buffer, offset, string::npos);
+}
+
+void TraceRecorder::write_object(jvmtiEnv &jvmti, JNIEnv &jni, jobject object, const std::string &signature,
+                                 Pending &event) {
+    if (object == nullptr) {
+        event.writer.put_varint(0);
+        return;
+    }
+    jclass type = jni.GetObjectClass(object);
+    event.put_class(read_class_signature(jvmti, type));
+    jni.DeleteLocalRef(type);
+
+    if (signature == "[Z") {
+        jsize length = jni.GetArrayLength((jarray) object);
+        jboolean *elements = jni.GetBooleanArrayElements((jbooleanArray) object, nullptr);
+        if (elements == nullptr) {
+            jni.ExceptionClear();
+            length = 0;
+        }
+        event.writer.put_varint((uint64_t) length);
+        for (jsize i = 0; i < length; i++) {
+            event.writer.put_byte(elements[i]);
+        }
+        if (elements != nullptr) {
+            jni.ReleaseBooleanArrayElements((jbooleanArray) object, elements, JNI_ABORT);
+        }
+    } else if (signature[0] != '[') {
+        string value;
+        if (call_string_method(jni, object, "toString", value)) {
+            event.writer.put_string(value);
+        } else {
+            event.writer.put_string(nullptr);
+        }
+    }
+}
+
+void TraceRecorder::write_value(jvmtiEnv &jvmti, JNIEnv &jni, jthread thread, jint depth, const Argument &argument,
+                                Pending &event) {
+    jvmtiError error;
+    switch (argument.signature[0]) {
+        case 'Z':
+        case 'C':
+        case 'B':
+        case 'S':
+        case 'I': {
+            jint value = 0;
+            error = jvmti.GetLocalInt(thread, depth, argument.slot, &value);
+            event.writer.put_varint((uint64_t) error);
+            if (error == JVMTI_ERROR_NONE) {
+                event.writer.put_signed(value);
+            }
+            break;
+        }
+        case 'J': {
+            jlong value = 0;
+            error = jvmti.GetLocalLong(thread, depth, argument.slot, &value);
+            event.writer.put_varint((uint64_t) error);
+            if (error == JVMTI_ERROR_NONE) {
+                event.writer.put_signed(value);
+            }
+            break;
+        }
+        case 'F': {
+            jfloat value = 0;
+            error = jvmti.GetLocalFloat(thread, depth, argument.slot, &value);
+            event.writer.put_varint((uint64_t) error);
+            if (error == JVMTI_ERROR_NONE) {
+                uint32_t bits;
+                memcpy(&bits, &value, sizeof(bits));
+                event.writer.put_varint(bits);
+            }
+            break;
+        }
+        case 'D': {
+            jdouble value = 0;
+            error = jvmti.GetLocalDouble(thread, depth, argument.slot, &value);
+            event.writer.put_varint((uint64_t) error);
+            if (error == JVMTI_ERROR_NONE) {
+                uint64_t bits;
+                memcpy(&bits, &value, sizeof(bits));
+                event.writer.put_varint(bits);
+            }
+            break;
+        }
+        case 'L':
+        case '[': {
+            jobject value = nullptr;
+            error = jvmti.GetLocalObject(thread, depth, argument.slot, &value);
+            event.writer.put_varint((uint64_t) error);
+            if (error == JVMTI_ERROR_NONE) {
+                write_object(jvmti, jni, value, argument.signature, event);
+                jni.DeleteLocalRef(value);
+            }
+            break;
+        }
+        default: {
+            /* The agent reads nothing for them either */
+            break;
+        }
+    }
+}
+
+bool TraceRecorder::call_string_method(JNIEnv &jni, jobject object, const char *name, std::string &value) {
+    jclass type = jni.GetObjectClass(object);
+    jmethodID method = jni.GetMethodID(type, name, "()Ljava/lang/String;");
+    jni.DeleteLocalRef(type);
+    if (method == nullptr) {
+        jni.ExceptionClear();
+        return false;
+    }
+    jstring result = (jstring) jni.CallObjectMethod(object, method);
+    if (jni.ExceptionCheck()) {
+        jni.ExceptionClear();
+        return false;
+    }
+    if (result == nullptr) {
+        return false;
+    }
+    const char *chars = jni.GetStringUTFChars(result, nullptr);
+    if (chars != nullptr) {
+        value.assign(chars);
+        jni.ReleaseStringUTFChars(result, chars);
+    }
+    jni.DeleteLocalRef(result);
+    return chars != nullptr;
+}
+
+void TraceRecorder::flush() {
+    file.write(writer.buffer.data(), writer.buffer.size());
+    file.flush();
+    written_bytes += writer.buffer.size();
+    writer.buffer.clear();
+}
+
+std::string TraceRecorder::report() {
+    lock_guard<mutex> guard(lock);
+    return (boost::format("Trace: %d events, %d classes, %d methods, %d threads, %d bytes written to %s\n")
+            % events % classes.size() % methods.size() % threads.size() % written_bytes % path).str();
+}
@@ -0,0 +1,150 @@
+#ifndef JEFF_NATIVE_AGENT_TRACERECORDER_HPP
+#define JEFF_NATIVE_AGENT_TRACERECORDER_HPP
+
+#include <jni.h>
+#include <jvmti.h>
+
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+#include "TraceFormat.hpp"
+
+//
+// Records what the exception callbacks read from the VM - the methods, the frames, the line
+// number and local variable tables, the values of the arguments and the names of the threads -
+// to a trace file (see TraceFormat.hpp), which jeff-replay feeds back to the agent.
+//
+// Everything the callback may read is captured, the whole stack with the arguments of every
+// frame, whatever the depth the callback takes later, and the objects are converted with
+// toString(); it is meant for capturing a sample of a workload, not to be left on.
+//
+// The VM is read and the Java methods are called outside the lock, the exceptions they throw
+// come back to the callback on the same thread and are not recorded. The lock is only taken to
+// assign the ids - the methods, classes and threads are written once, when seen first - and to
+// append the finished record.
+//
+class TraceRecorder : boost::noncopyable {
+public:
+    TraceRecorder(const std::string path);
+
+    // Writes the buffered records
+    ~TraceRecorder();
+
+    // Opens the trace and writes its header
+    bool start(jvmtiEnv &jvmti);
+
+    void stop();
+
+    // Called from JVMTI_EVENT_EXCEPTION, before the agent reads anything
+    void record(jvmtiEnv &jvmti, JNIEnv &jni, jthread thread, jmethodID method, jlocation location,
+                jobject exception, jmethodID catch_method, jlocation catch_location);
+
+    // True on a thread inside record(), for the exceptions thrown by the methods it calls
+    static bool is_recording();
+
+    std::string report();
+
+private:
+    /* The local variables the agent reads as the arguments of a method */
+    struct Argument {
+        std::string signature;
+        jint slot;
+    };
+
+    struct Method {
+        jint id;
+        std::vector<Argument> arguments;
+    };
+
+    struct Thread {
+        jint id;
+        std::string name;
+    };
+
+    /* A method read from the VM, its record without the ids */
+    struct MethodDefinition {
+        bool has_class;
+        std::string class_signature;
+        std::string fields;
+        std::vector<Argument> arguments;
+    };
+
+    /* A thread read from the VM, its record without the id */
+    struct ThreadDefinition {
+        jlong java_id;
+        std::string name;
+        std::string fields;
+    };
+
+    /* A record read from the VM, the ids of its classes and methods are put in the holes under the lock */
+    struct Hole {
+        size_t offset;
+        /* nullptr for a class */
+        jmethodID method;
+        std::string class_signature;
+    };
+
+    struct Pending {
+        trace::Writer writer;
+        std::vector<Hole> holes;
+
+        void put_class(const std::string &signature) {
+            holes.push_back(Hole{writer.buffer.size(), nullptr, signature});
+        }
+
+        void put_method(jmethodID method) {
+            holes.push_back(Hole{writer.buffer.size(), method, std::string()});
+        }
+    };
+
+    /* Read outside the lock */
+
+    MethodDefinition read_method(jvmtiEnv &jvmti, jmethodID method);
+
+    ThreadDefinition read_thread(jvmtiEnv &jvmti, JNIEnv &jni, jthread thread);
+
+    void write_object(jvmtiEnv &jvmti, JNIEnv &jni, jobject object, const std::string &signature, Pending &event);
+
+    void write_value(jvmtiEnv &jvmti, JNIEnv &jni, jthread thread, jint depth, const Argument &argument,
+                     Pending &event);
+
+    // The result of a String method without arguments, false for null or when it threw
+    bool call_string_method(JNIEnv &jni, jobject object, const char *name, std::string &value);
+
+    /* Under the lock, the classes, methods and threads are written to the trace when they are seen first */
+
+    jint get_class_id(const std::string &signature);
+
+    void define_method(jmethodID method, const MethodDefinition &definition);
+
+    jint get_thread_id(const ThreadDefinition &definition);
+
+    void fill_holes(const Pending &pending, trace::Writer &event);
+
+    void flush();
+
+    const std::string path;
+
+    /* Everything below is guarded by the lock */
+    std::mutex lock;
+    trace::Writer writer;
+    std::ofstream file;
+    bool started;
+    std::unordered_map<std::string, jint> classes;
+    std::unordered_map<jmethodID, Method> methods;
+    /* By the Java thread id, a thread is written again when its name changes */
+    std::unordered_map<jlong, Thread> threads;
+    /* Resolved once, outside the lock */
+    std::once_flag fields_resolved;
+    jfieldID thread_id_field;
+    uint64_t events;
+    uint64_t written_bytes;
+};
+
+#endif //JEFF_NATIVE_AGENT_TRACERECORDER_HPP
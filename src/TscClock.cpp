@@ -0,0 +1,142 @@
+#include "TscClock.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <limits>
+
+#include <boost/format.hpp>
+
+#if defined(JEFF_HAS_TSC) && !defined(_MSC_VER)
+#include <cpuid.h>
+#endif
+
+using namespace jeff;
+
+/* How long the TSC is measured against CLOCK_MONOTONIC at the start */
+static const jlong CALIBRATION_NS = 10000000;
+
+std::atomic<bool> TscClock::enabled(false);
+std::atomic<int> TscClock::current(0);
+TscClock::Anchor TscClock::anchors[2];
+uint64_t TscClock::calibrated_ticks = 0;
+jlong TscClock::calibrated_nanos = 0;
+
+static jlong get_wall_nanos() {
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+}
+
+#if defined(JEFF_HAS_TSC)
+
+/* The TSC ticks at a constant rate in all the power states, CPUID.80000007H:EDX[8] */
+static bool is_invariant_tsc() {
+#if defined(_MSC_VER)
+    int registers[4];
+    __cpuid(registers, 0x80000000);
+    if ((unsigned int) registers[0] < 0x80000007) {
+        return false;
+    }
+    __cpuid(registers, 0x80000007);
+    return (registers[3] & (1 << 8)) != 0;
+#else
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+    if (__get_cpuid_max(0x80000000, nullptr) < 0x80000007) {
+        return false;
+    }
+    if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) == 0) {
+        return false;
+    }
+    return (edx & (1 << 8)) != 0;
+#endif
+}
+
+/* The kernel stops using the TSC when it finds it unstable, e.g. not in sync between the sockets or in a VM */
+static bool is_kernel_tsc() {
+#if defined(__linux__)
+    std::ifstream source("/sys/devices/system/clocksource/clocksource0/current_clocksource");
+    std::string name;
+    return !(source >> name) || name == "tsc";
+#else
+    return true;
+#endif
+}
+
+/* A TSC reading and the monotonic time taken together, the middle of the two readings */
+static void sample(uint64_t &ticks, jlong &nanos) {
+    uint64_t before = __rdtsc();
+    nanos = monotonic_nanos();
+    uint64_t after = __rdtsc();
+    ticks = before + (after - before) / 2;
+}
+
+#endif
+
+void TscClock::calibrate() {
+    Anchor &anchor = anchors[0];
+    anchor.nanos = monotonic_nanos();
+    anchor.wall_nanos = get_wall_nanos();
+
+#if defined(JEFF_HAS_TSC)
+    if (!is_invariant_tsc() || !is_kernel_tsc()) {
+        return;
+    }
+
+    sample(calibrated_ticks, calibrated_nanos);
+    uint64_t ticks;
+    jlong nanos;
+    do {
+        sample(ticks, nanos);
+    } while (nanos - calibrated_nanos < CALIBRATION_NS);
+    if (ticks <= calibrated_ticks) {
+        return;
+    }
+
+    anchor.ticks = ticks;
+    anchor.nanos = nanos;
+    anchor.multiplier = (uint64_t) ((double) (nanos - calibrated_nanos) / (ticks - calibrated_ticks) * (1 << SHIFT));
+    anchor.max_ticks = std::numeric_limits<uint64_t>::max() / std::max(anchor.multiplier, (uint64_t) 1);
+    anchor.wall_nanos = get_wall_nanos();
+    current.store(0, std::memory_order_release);
+    enabled.store(anchor.multiplier > 0, std::memory_order_release);
+#endif
+}
+
+void TscClock::anchor() {
+    if (!enabled.load(std::memory_order_relaxed)) {
+        Anchor &anchor = anchors[0];
+        anchor.nanos = monotonic_nanos();
+        anchor.wall_nanos = get_wall_nanos();
+        return;
+    }
+
+#if defined(JEFF_HAS_TSC)
+    int next = 1 - current.load(std::memory_order_relaxed);
+    const Anchor &previous = anchors[1 - next];
+    Anchor &anchor = anchors[next];
+
+    uint64_t ticks;
+    jlong nanos;
+    sample(ticks, nanos);
+    anchor.ticks = ticks;
+    anchor.multiplier = (uint64_t) ((double) (nanos - calibrated_nanos) / (ticks - calibrated_ticks) * (1 << SHIFT));
+    anchor.max_ticks = std::numeric_limits<uint64_t>::max() / std::max(anchor.multiplier, (uint64_t) 1);
+    /* The previous scale may have run ahead of CLOCK_MONOTONIC, the time must not go back */
+    uint64_t elapsed = ticks - previous.ticks;
+    if (elapsed < previous.max_ticks) {
+        nanos = std::max(nanos, previous.nanos + (jlong) ((elapsed * previous.multiplier) >> SHIFT));
+    }
+    anchor.nanos = nanos;
+    anchor.wall_nanos = get_wall_nanos();
+    current.store(next, std::memory_order_release);
+#endif
+}
+
+std::string TscClock::get_record() {
+    const Anchor &anchor = anchors[current.load(std::memory_order_acquire)];
+    if (enabled.load(std::memory_order_relaxed)) {
+        return (boost::format("Clock: tsc %.3f GHz, monotonic %d at %d\n")
+                % ((double) (1 << SHIFT) / anchor.multiplier) % anchor.nanos % anchor.wall_nanos).str();
+    }
+    return (boost::format("Clock: monotonic, monotonic %d at %d\n") % anchor.nanos % anchor.wall_nanos).str();
+}
@@ -0,0 +1,88 @@
+#ifndef JEFF_NATIVE_AGENT_TSCCLOCK_HPP
+#define JEFF_NATIVE_AGENT_TSCCLOCK_HPP
+
+#include <jni.h>
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define JEFF_HAS_TSC 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define JEFF_HAS_TSC 1
+#endif
+
+#include "clock.hpp"
+
+//
+// Cheap monotonic timestamps of the records.
+//
+// With an invariant TSC (and, on Linux, the kernel using it as its clock source) the time is
+// rdtsc scaled to nanoseconds, relative to an anchor - a TSC reading and the CLOCK_MONOTONIC
+// time it was taken at. The scale is measured at calibrate() and refined by every anchor()
+// over the whole time since, anchor() is called every few seconds so the error of the scale
+// never adds up. Of the two anchors one is read while the other is written, a reader would
+// only see a half-written anchor if it was preempted for two anchor periods. A new anchor
+// never moves the time backwards.
+//
+// Otherwise (and before the calibration) it is the vDSO clock_gettime(CLOCK_MONOTONIC)
+// of monotonic_nanos().
+//
+// The anchor also keeps the wall clock time it was taken at, sent as a Clock record, so the
+// collector can convert the timestamps of the records to the time of day.
+//
+class TscClock {
+public:
+    // Measures the TSC frequency for a few milliseconds, if the TSC can be used at all
+    static void calibrate();
+
+    // Takes a new anchor and refines the scale, called periodically
+    static void anchor();
+
+    // Nanoseconds on the CLOCK_MONOTONIC time line
+    static inline jlong nanos() {
+#if defined(JEFF_HAS_TSC)
+        if (enabled.load(std::memory_order_relaxed)) {
+            const Anchor &anchor = anchors[current.load(std::memory_order_acquire)];
+            uint64_t ticks = __rdtsc() - anchor.ticks;
+            /* Past the range of the multiplication (or read on a CPU behind the anchor) */
+            if (ticks < anchor.max_ticks) {
+                return anchor.nanos + (jlong) ((ticks * anchor.multiplier) >> SHIFT);
+            }
+        }
+#endif
+        return jeff::monotonic_nanos();
+    }
+
+    static bool is_tsc() {
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    // "Clock: tsc 2.893 GHz, monotonic <ns> at <ns since the epoch>\n"
+    static std::string get_record();
+
+private:
+    /* The multiplier is the nanoseconds per tick in 40.24 fixed point */
+    static const int SHIFT = 24;
+
+    struct Anchor {
+        uint64_t ticks;
+        jlong nanos;
+        uint64_t multiplier;
+        uint64_t max_ticks;
+        /* Nanoseconds since the epoch at the anchor */
+        jlong wall_nanos;
+    };
+
+    static std::atomic<bool> enabled;
+    static std::atomic<int> current;
+    static Anchor anchors[2];
+    /* The calibration, the scale is refined over the time since */
+    static uint64_t calibrated_ticks;
+    static jlong calibrated_nanos;
+};
+
+#endif //JEFF_NATIVE_AGENT_TSCCLOCK_HPP
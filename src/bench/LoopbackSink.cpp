@@ -0,0 +1,140 @@
+#include "LoopbackSink.hpp"
+
+#include <cstring>
+#include <iostream>
+
+#include <boost/asio.hpp>
+
+#include "../TscClock.hpp"
+
+using boost::asio::ip::tcp;
+
+static const size_t READ_BUFFER_SIZE = 64 * 1024;
+
+static const char TIME_PREFIX[] = "\tTime: ";
+
+LoopbackSink::LoopbackSink()
+        : acceptor(io_service),
+          socket(io_service),
+          buffer(READ_BUFFER_SIZE),
+          records(0),
+          bytes(0),
+          last_read(0) {
+    // Empty
+}
+
+LoopbackSink::~LoopbackSink() {
+    stop();
+}
+
+void LoopbackSink::start() {
+    tcp::endpoint endpoint(boost::asio::ip::address_v4::loopback(), 0);
+    acceptor.open(endpoint.protocol());
+    acceptor.bind(endpoint);
+    acceptor.listen();
+
+    work.reset(new boost::asio::io_service::work(io_service));
+    start_accept();
+    worker_threads.create_thread([this]() { io_service.run(); });
+}
+
+void LoopbackSink::stop() {
+    if (work == nullptr) {
+        return;
+    }
+    work.reset();
+    io_service.stop();
+    worker_threads.join_all();
+
+    boost::system::error_code ignored_ec;
+    socket.close(ignored_ec);
+    acceptor.close(ignored_ec);
+}
+
+unsigned short LoopbackSink::get_port() const {
+    boost::system::error_code ignored_ec;
+    return acceptor.local_endpoint(ignored_ec).port();
+}
+
+std::vector<jlong> LoopbackSink::take_latencies() {
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<jlong> taken;
+    taken.swap(latencies);
+    return taken;
+}
+
+void LoopbackSink::start_accept() {
+    acceptor.async_accept(socket, [this](const boost::system::error_code &error) {
+        if (error == boost::asio::error::operation_aborted) {
+            return;
+        }
+        if (error) {
+            std::cerr << "Accept error: " << error.message() << "\n";
+            start_accept();
+            return;
+        }
+        partial.clear();
+        start_read();
+    });
+}
+
+void LoopbackSink::start_read() {
+    socket.async_read_some(boost::asio::buffer(buffer), [this](const boost::system::error_code &error,
+                                                               std::size_t size) {
+        if (error) {
+            /* The sender reconnects after a lost connection */
+            boost::system::error_code ignored_ec;
+            socket.close(ignored_ec);
+            if (error != boost::asio::error::operation_aborted) {
+                start_accept();
+            }
+            return;
+        }
+        decode(buffer.data(), size);
+        start_read();
+    });
+}
+
+void LoopbackSink::decode(const char *data, size_t size) {
+    jlong now = TscClock::nanos();
+    const char *end = data + size;
+    const char *begin = data;
+    while (begin < end) {
+        const char *newline = (const char *) memchr(begin, '\n', (size_t) (end - begin));
+        if (newline == nullptr) {
+            partial.append(begin, end);
+            break;
+        }
+        if (!partial.empty()) {
+            partial.append(begin, newline);
+            decode_line(partial.data(), partial.data() + partial.size(), now);
+            partial.clear();
+        } else {
+            decode_line(begin, newline, now);
+        }
+        begin = newline + 1;
+    }
+    bytes.fetch_add(size, std::memory_order_relaxed);
+    last_read.store(now, std::memory_order_relaxed);
+}
+
+void LoopbackSink::decode_line(const char *begin, const char *end, jlong now) {
+    /* An empty line is a heartbeat */
+    if (begin == end) {
+        return;
+    }
+    if (*begin != '\t') {
+        records.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    size_t prefix = sizeof(TIME_PREFIX) - 1;
+    if ((size_t) (end - begin) > prefix && memcmp(begin, TIME_PREFIX, prefix) == 0) {
+        jlong sent = 0;
+        for (const char *digit = begin + prefix; digit < end && *digit >= '0' && *digit <= '9'; digit++) {
+            sent = sent * 10 + (*digit - '0');
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        latencies.push_back(now - sent);
+    }
+}
@@ -0,0 +1,83 @@
+#ifndef JEFF_NATIVE_AGENT_LOOPBACKSINK_HPP
+#define JEFF_NATIVE_AGENT_LOOPBACKSINK_HPP
+
+#include <jni.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/thread.hpp>
+
+//
+// The daemon end of a TcpSender in the benchmark: accepts on a free loopback port, reads
+// the stream as fast as it comes and counts the records, a header line and the indented
+// lines that follow it. The "\tTime: <ns>" line the sender stamps every record with (see
+// TscClock) gives the delivery latency of the record, from the send to its arrival here.
+//
+// One connection at a time on a thread of its own, the reconnects of the sender are
+// accepted again. Unlike the Collector it does not aggregate anything, so it does not
+// stand between the sender and the socket.
+//
+class LoopbackSink : boost::noncopyable {
+public:
+    LoopbackSink();
+
+    ~LoopbackSink();
+
+    // Binds 127.0.0.1 on a free port and starts accepting
+    void start();
+
+    void stop();
+
+    unsigned short get_port() const;
+
+    uint64_t get_records() const {
+        return records.load();
+    }
+
+    uint64_t get_bytes() const {
+        return bytes.load();
+    }
+
+    // TscClock time of the last chunk read
+    jlong get_last_read() const {
+        return last_read.load();
+    }
+
+    // The delivery latencies in nanoseconds since the last call
+    std::vector<jlong> take_latencies();
+
+private:
+    void start_accept();
+
+    void start_read();
+
+    void decode(const char *data, size_t size);
+
+    void decode_line(const char *begin, const char *end, jlong now);
+
+    boost::asio::io_service io_service;
+    std::unique_ptr<boost::asio::io_service::work> work;
+    boost::asio::ip::tcp::acceptor acceptor;
+    boost::asio::ip::tcp::socket socket;
+    boost::thread_group worker_threads;
+    std::vector<char> buffer;
+    /* A line cut by the end of the last chunk */
+    std::string partial;
+
+    std::atomic<uint64_t> records;
+    std::atomic<uint64_t> bytes;
+    std::atomic<jlong> last_read;
+
+    std::mutex lock;
+    std::vector<jlong> latencies;
+};
+
+#endif //JEFF_NATIVE_AGENT_LOOPBACKSINK_HPP
@@ -0,0 +1,305 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/format.hpp>
+
+#include "../Sender.hpp"
+#include "../TscClock.hpp"
+#include "LoopbackSink.hpp"
+
+/* How long the delivery may stall before the rest is counted as lost */
+static const long DELIVERY_TIMEOUT_MS = 2000;
+
+struct Run {
+    size_t threads;
+    std::string sizes;
+    size_t buffer_bytes;
+    /* Messages per second of every producer, 0 is as fast as it goes */
+    uint64_t rate;
+};
+
+struct Percentiles {
+    jlong p50;
+    jlong p90;
+    jlong p99;
+    jlong p999;
+    jlong max;
+};
+
+static void usage() {
+    std::cerr << "Usage: jeff-bench [--threads 1,2,4,8] [--sizes small,mixed,large] [--buffer bytes,...]"
+            " [--rate n,...] [--messages n] [--output file]\n";
+}
+
+template<typename T, typename Parse>
+static std::vector<T> parse_list(const std::string &value, Parse parse) {
+    std::vector<T> list;
+    size_t begin = 0;
+    while (begin <= value.size()) {
+        size_t end = value.find(',', begin);
+        if (end == std::string::npos) {
+            end = value.size();
+        }
+        list.push_back(parse(value.substr(begin, end - begin)));
+        begin = end + 1;
+    }
+    return list;
+}
+
+static bool is_size_mix(const std::string &sizes) {
+    return sizes == "small" || sizes == "mixed" || sizes == "large";
+}
+
+/**
+ * The size of the next message of a mix: small are the reports and the lifecycle events, large the heap
+ * histograms and the thread dumps, mixed is mostly the former with the exceptions and their stack traces.
+ */
+static size_t next_size(const std::string &sizes, std::minstd_rand &random) {
+    std::uniform_int_distribution<size_t> small(80, 400);
+    std::uniform_int_distribution<size_t> medium(1024, 8 * 1024);
+    std::uniform_int_distribution<size_t> large(16 * 1024, 64 * 1024);
+    if (sizes == "small") {
+        return small(random);
+    } else if (sizes == "large") {
+        return large(random);
+    }
+    std::uniform_int_distribution<int> percent(0, 99);
+    int kind = percent(random);
+    return kind < 70 ? small(random) : (kind < 95 ? medium(random) : large(random));
+}
+
+// A record the sink counts: a header and the indented lines padded up to the size
+static std::string make_message(size_t producer, uint64_t sequence, size_t size) {
+    std::string message = (boost::format("Bench: %d %d\n") % producer % sequence).str();
+    while (message.size() < size) {
+        size_t line = std::min(size - message.size(), (size_t) 120);
+        message.push_back('\t');
+        message.append(line > 2 ? line - 2 : 0, 'x');
+        message.push_back('\n');
+    }
+    return message;
+}
+
+static Percentiles get_percentiles(std::vector<jlong> &values) {
+    Percentiles percentiles = {0, 0, 0, 0, 0};
+    if (values.empty()) {
+        return percentiles;
+    }
+    std::sort(values.begin(), values.end());
+    auto at = [&values](double quantile) {
+        return values[std::min(values.size() - 1, (size_t) (quantile * values.size()))];
+    };
+    percentiles.p50 = at(0.5);
+    percentiles.p90 = at(0.9);
+    percentiles.p99 = at(0.99);
+    percentiles.p999 = at(0.999);
+    percentiles.max = values.back();
+    return percentiles;
+}
+
+static std::string to_json(const Percentiles &percentiles) {
+    return (boost::format("{\"p50\": %d, \"p90\": %d, \"p99\": %d, \"p999\": %d, \"max\": %d}")
+            % percentiles.p50 % percentiles.p90 % percentiles.p99 % percentiles.p999 % percentiles.max).str();
+}
+
+static bool wait_for_records(const LoopbackSink &sink, uint64_t records) {
+    uint64_t seen = sink.get_records();
+    auto progress = std::chrono::steady_clock::now();
+    while (seen < records) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        uint64_t now_seen = sink.get_records();
+        if (now_seen != seen) {
+            seen = now_seen;
+            progress = std::chrono::steady_clock::now();
+        } else if (std::chrono::steady_clock::now() - progress > std::chrono::milliseconds(DELIVERY_TIMEOUT_MS)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * One run: a TcpSender connected to a fresh sink, the producers send their messages (at their rate) through
+ * Sender::send as the agent does, then the sender is flushed and the sink waited for.
+ */
+static std::string run(const Run &run, uint64_t messages) {
+    LoopbackSink sink;
+    sink.start();
+
+    SenderConfig config;
+    config.buffer_bytes = run.buffer_bytes;
+    config.event_quota_percent = 75;
+    config.spill_bytes = 0;
+    config.overflow_policy = OverflowPolicy::DROP_NEWEST;
+    config.overflow_sample_every = 10;
+    config.overflow_timeout_ms = 100;
+    config.datagram_bytes = 0;
+    std::unique_ptr<Sender> sender = Sender::create("127.0.0.1", std::to_string(sink.get_port()), config);
+    sender->start();
+
+    /* The connection is made before the clock starts */
+    sender->send(std::string("Bench: connected\n"), MessageType::REPORT);
+    if (!wait_for_records(sink, 1)) {
+        std::cerr << "The sender did not connect\n";
+    }
+    sink.take_latencies();
+
+    std::vector<std::vector<jlong>> enqueue_latencies(run.threads);
+    std::atomic<uint64_t> sent_bytes(0);
+    std::vector<std::thread> producers;
+    jlong start = TscClock::nanos();
+    for (size_t producer = 0; producer < run.threads; producer++) {
+        producers.emplace_back([&, producer]() {
+            std::minstd_rand random((unsigned int) producer + 1);
+            std::vector<jlong> &latencies = enqueue_latencies[producer];
+            latencies.reserve(messages);
+            uint64_t bytes = 0;
+            auto begin = std::chrono::steady_clock::now();
+            for (uint64_t i = 0; i < messages; i++) {
+                if (run.rate > 0) {
+                    std::this_thread::sleep_until(begin + std::chrono::nanoseconds(i * 1000000000 / run.rate));
+                }
+                std::string message = make_message(producer, i, next_size(run.sizes, random));
+                bytes += message.size();
+                jlong before = TscClock::nanos();
+                sender->send(std::move(message), MessageType::EVENT);
+                latencies.push_back(TscClock::nanos() - before);
+            }
+            sent_bytes.fetch_add(bytes);
+        });
+    }
+    for (auto &producer : producers) {
+        producer.join();
+    }
+    jlong produced = TscClock::nanos();
+
+    uint64_t sent = messages * run.threads;
+    sender->flush();
+    wait_for_records(sink, sent + 1);
+    sender->stop();
+    sink.stop();
+
+    uint64_t delivered = sink.get_records() - 1;
+    double produce_seconds = std::max(produced - start, (jlong) 1) / 1e9;
+    double delivery_seconds = std::max(sink.get_last_read() - start, (jlong) 1) / 1e9;
+    std::vector<jlong> enqueue;
+    enqueue.reserve(sent);
+    for (auto &latencies : enqueue_latencies) {
+        enqueue.insert(enqueue.end(), latencies.begin(), latencies.end());
+    }
+    std::vector<jlong> delivery = sink.take_latencies();
+
+    return (boost::format("{\"threads\": %d, \"sizes\": \"%s\", \"buffer_bytes\": %d, \"rate\": %d, "
+                                  "\"sent\": %d, \"sent_bytes\": %d, \"delivered\": %d, \"lost\": %d, "
+                                  "\"enqueue_per_s\": %.0f, \"messages_per_s\": %.0f, \"bytes_per_s\": %.0f, "
+                                  "\"enqueue_ns\": %s, \"delivery_ns\": %s}")
+            % run.threads % run.sizes % run.buffer_bytes % run.rate
+            % sent % sent_bytes.load() % delivered % (sent - std::min(sent, delivered))
+            % (sent / produce_seconds) % (delivered / delivery_seconds) % (sink.get_bytes() / delivery_seconds)
+            % to_json(get_percentiles(enqueue)) % to_json(get_percentiles(delivery))).str();
+}
+
+/**
+ * Benchmarks the TcpSender against a sink on the loopback, over every combination of the producer threads,
+ * the message size mixes, the buffer sizes and the rates, e.g.
+ *
+ *     jeff-bench --threads 1,4,16 --sizes small,mixed --rate 0,10000 --messages 200000 --output tcp.json
+ *
+ * and writes the results as JSON, one object per run: the throughput of the producers and of the delivery,
+ * the percentiles of the time spent in send() and of the time from the send to the arrival at the sink,
+ * in nanoseconds, and the messages lost to the overflow of the buffer.
+ */
+int main(int argc, char *argv[]) {
+    std::vector<size_t> threads = {1, 2, 4, 8};
+    std::vector<std::string> sizes = {"small", "mixed", "large"};
+    std::vector<size_t> buffers = {8 * 1024 * 1024};
+    std::vector<uint64_t> rates = {0};
+    uint64_t messages = 100000;
+    std::string output;
+
+    for (int i = 1; i < argc; i++) {
+        std::string option = argv[i];
+        if (i + 1 >= argc) {
+            usage();
+            return 1;
+        }
+        std::string value = argv[++i];
+        try {
+            if (option == "--threads") {
+                threads = parse_list<size_t>(value, [](const std::string &item) {
+                    return std::max((size_t) std::stoul(item), (size_t) 1);
+                });
+            } else if (option == "--sizes") {
+                sizes = parse_list<std::string>(value, [](const std::string &item) {
+                    if (!is_size_mix(item)) {
+                        throw std::invalid_argument(item);
+                    }
+                    return item;
+                });
+            } else if (option == "--buffer") {
+                buffers = parse_list<size_t>(value, [](const std::string &item) {
+                    return (size_t) std::stoull(item);
+                });
+            } else if (option == "--rate") {
+                rates = parse_list<uint64_t>(value, [](const std::string &item) {
+                    return (uint64_t) std::stoull(item);
+                });
+            } else if (option == "--messages") {
+                messages = std::max(std::stoull(value), 1ull);
+            } else if (option == "--output") {
+                output = value;
+            } else {
+                usage();
+                return 1;
+            }
+        } catch (std::exception &e) {
+            std::cerr << boost::format("Invalid value '%s' of option '%s'\n") % value % option;
+            return 1;
+        }
+    }
+
+    std::ofstream file;
+    if (!output.empty()) {
+        file.open(output);
+        if (!file) {
+            std::cerr << boost::format("Cannot write to '%s'\n") % output;
+            return 1;
+        }
+    }
+    /* The senders log the connections to the standard output, it is kept for the results */
+    std::streambuf *standard_output = std::cout.rdbuf();
+    std::ostream results(output.empty() ? standard_output : file.rdbuf());
+    std::cout.rdbuf(std::cerr.rdbuf());
+
+    TscClock::calibrate();
+    results << boost::format("{\"sender\": \"tcp\", \"tsc\": %s, \"messages_per_thread\": %d, \"runs\": [")
+               % (TscClock::is_tsc() ? "true" : "false") % messages;
+    bool first = true;
+    for (size_t thread_count : threads) {
+        for (const std::string &mix : sizes) {
+            for (size_t buffer_bytes : buffers) {
+                for (uint64_t rate : rates) {
+                    Run parameters = {thread_count, mix, buffer_bytes, rate};
+                    std::cerr << boost::format("Running %d threads, %s messages, %d bytes buffer, rate %d\n")
+                                 % thread_count % mix % buffer_bytes % rate;
+                    results << (first ? "\n  " : ",\n  ") << run(parameters, messages);
+                    results.flush();
+                    first = false;
+                }
+            }
+        }
+    }
+    results << "\n]}\n";
+    /* Before the file is closed, std::cout outlives it */
+    std::cout.rdbuf(standard_output);
+    return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef JEFF_NATIVE_AGENT_CLOCK_HPP
+#define JEFF_NATIVE_AGENT_CLOCK_HPP
+
+#include <jni.h>
+
+#if defined(_WIN32)
+#include <chrono>
+#else
+#include <time.h>
+#endif
+
+namespace jeff {
+
+    /**
+     * Monotonic time in nanoseconds.
+     *
+     * On POSIX systems this is a plain clock_gettime(CLOCK_MONOTONIC), which is async-signal-safe
+     * and does not allocate, so it can be used even in the garbage collection callbacks.
+     */
+    inline jlong monotonic_nanos() {
+#if defined(_WIN32)
+        using namespace std::chrono;
+        return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+#else
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return ((jlong) now.tv_sec) * 1000000000 + now.tv_nsec;
+#endif
+    }
+
+    inline jlong monotonic_millis() {
+        return monotonic_nanos() / 1000000;
+    }
+}
+
+#endif //JEFF_NATIVE_AGENT_CLOCK_HPP
@@ -3,6 +3,15 @@
 #include <algorithm>
 #include <locale>
 
+#if defined(_WIN32)
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/algorithm/string/replace.hpp>
+
 using namespace std;
 
 string jeff::join(list<string> entries, function<string(string, string)> join_lines) {
@@ -24,6 +33,26 @@ string jeff::join(list<bool> entries, string start, function<string(string, stri
     return join(values, start, join_values);
 }
 
+string jeff::to_signature_pattern(string class_name) {
+    boost::replace_all(class_name, ".", "/");
+    if (boost::ends_with(class_name, "*")) {
+        return "L" + class_name.substr(0, class_name.size() - 1);
+    }
+    return "L" + class_name + ";";
+}
+
+bool jeff::matches_signature_pattern(const string &signature, const string &pattern) {
+    return boost::ends_with(pattern, ";") ? signature == pattern : boost::starts_with(signature, pattern);
+}
+
+int jeff::get_process_id() {
+#if defined(_WIN32)
+    return _getpid();
+#else
+    return (int) getpid();
+#endif
+}
+
 wstring jeff::L(const string &str) {
     wstring ret;
     copy(str.begin(), str.end(), back_inserter(ret));
@@ -17,6 +17,13 @@ namespace jeff {
     std::string join(std::list<bool> entries, std::string start,
                      std::function<std::string(std::string, std::string)> join_values);
 
+    // "com.example.Type" becomes "Lcom/example/Type;", "com.example.*" becomes the "Lcom/example/" prefix
+    std::string to_signature_pattern(std::string class_name);
+
+    bool matches_signature_pattern(const std::string &signature, const std::string &pattern);
+
+    int get_process_id();
+
     std::wstring L(const std::string &str);
 
     std::string S(const std::wstring &str);
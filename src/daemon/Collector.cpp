@@ -0,0 +1,456 @@
+#include "Collector.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+#include <boost/format.hpp>
+
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
+
+using boost::asio::ip::tcp;
+using boost::asio::ip::udp;
+
+static const size_t READ_BUFFER_SIZE = 16 * 1024;
+
+/* A datagram or a seqpacket packet is read whole, a longer one is cut */
+static const size_t MAX_PACKET_SIZE = 64 * 1024;
+
+/* A connection that does not start with a greeting line is attributed to its peer address */
+static const size_t MAX_GREETING_LENGTH = 256;
+
+static int64_t get_wall_clock_millis() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static std::vector<std::pair<std::string, uint64_t>> get_top(const std::unordered_map<std::string, uint64_t> &counters,
+                                                             size_t top) {
+    std::vector<std::pair<std::string, uint64_t>> sorted(counters.begin(), counters.end());
+    std::sort(sorted.begin(), sorted.end(), [](const std::pair<std::string, uint64_t> &a,
+                                               const std::pair<std::string, uint64_t> &b) {
+        return a.second > b.second;
+    });
+    if (sorted.size() > top) {
+        sorted.resize(top);
+    }
+    return sorted;
+}
+
+static std::string get_peer(tcp::socket &socket) {
+    boost::system::error_code error;
+    tcp::endpoint endpoint = socket.remote_endpoint(error);
+    return error ? "unknown" : (boost::format("%s:%s") % endpoint.address().to_string() % endpoint.port()).str();
+}
+
+// An AF_UNIX peer has no address, the socket path of the listener stands for it
+template<typename Socket>
+static std::string get_peer(Socket &socket) {
+    boost::system::error_code error;
+    return "unix:" + socket.local_endpoint(error).path();
+}
+
+template<typename Socket, typename Handler>
+static void async_receive(Socket &socket, boost::asio::mutable_buffers_1 buffer,
+                          boost::asio::socket_base::message_flags &flags, Handler handler) {
+    socket.async_read_some(buffer, handler);
+}
+
+#if !defined(_WIN32)
+
+template<typename Protocol, typename Handler>
+static void async_receive(boost::asio::basic_seq_packet_socket<Protocol> &socket,
+                          boost::asio::mutable_buffers_1 buffer, boost::asio::socket_base::message_flags &flags,
+                          Handler handler) {
+    socket.async_receive(buffer, 0, flags, handler);
+}
+
+// Replaces the socket file a daemon that did not stop cleanly left behind
+template<typename Acceptor>
+static void listen(Acceptor &acceptor, const std::string &path) {
+    unlink(path.c_str());
+    typename Acceptor::endpoint_type endpoint(path);
+    acceptor.open(endpoint.protocol());
+    acceptor.bind(endpoint);
+    acceptor.listen(boost::asio::socket_base::max_connections);
+}
+
+#endif
+
+class Collector::Connection : public std::enable_shared_from_this<Connection> {
+public:
+    Connection(Collector &collector, size_t buffer_size)
+            : input(buffer_size),
+              collector(collector),
+              jvm(nullptr) {
+        // Empty
+    }
+
+    virtual ~Connection() {
+        // Empty
+    }
+
+    // The peer stands for the JVM of a connection without a greeting
+    void start(const std::string &peer) {
+        {
+            std::lock_guard<std::mutex> guard(collector.lock);
+            collector.connections.insert(this);
+        }
+        this->peer = peer;
+        start_read();
+    }
+
+    // At the end of the stream, or on stop() for the connections still open
+    void close() {
+        {
+            std::lock_guard<std::mutex> guard(collector.lock);
+            collector.connections.erase(this);
+        }
+        if (jvm == nullptr) { // Closed before the first line
+            attach(peer);
+            decode(head.data(), head.size());
+        }
+        std::lock_guard<std::mutex> guard(jvm->lock);
+        decoder.finish(jvm->aggregate);
+        jvm->aggregate.active_connections--;
+    }
+
+protected:
+    virtual void start_read() = 0;
+
+    void handle_read(const boost::system::error_code &error, std::size_t size) {
+        if (error || size == 0) { // A seqpacket socket reads nothing at the end
+            close();
+            return;
+        }
+
+        if (jvm != nullptr) {
+            decode(input.data(), size);
+        } else {
+            read_greeting(input.data(), size);
+        }
+        start_read();
+    }
+
+    std::vector<char> input;
+
+private:
+    void read_greeting(const char *data, std::size_t size) {
+        head.append(data, size);
+        size_t newline = head.find('\n');
+        if (newline == std::string::npos && head.size() < MAX_GREETING_LENGTH) {
+            return;
+        }
+
+        size_t prefix = std::strlen(GREETING_PREFIX);
+        if (newline != std::string::npos && head.compare(0, prefix, GREETING_PREFIX) == 0) {
+            size_t end = (newline > prefix && head[newline - 1] == '\r') ? newline - 1 : newline;
+            attach(head.substr(prefix, end - prefix));
+            head.erase(0, newline + 1);
+        } else {
+            attach(peer);
+        }
+        decode(head.data(), head.size());
+        head.clear();
+        head.shrink_to_fit();
+    }
+
+    void attach(const std::string &id) {
+        jvm = collector.get_jvm(id);
+        if (collector.store != nullptr) {
+            decoder.set_store(collector.store, collector.store->intern(id));
+        }
+        std::lock_guard<std::mutex> guard(jvm->lock);
+        jvm->aggregate.connections++;
+        jvm->aggregate.active_connections++;
+        if (jvm->aggregate.first_seen_ms == 0) {
+            jvm->aggregate.first_seen_ms = get_wall_clock_millis();
+        }
+    }
+
+    void decode(const char *data, std::size_t size) {
+        std::lock_guard<std::mutex> guard(jvm->lock);
+        decoder.decode(data, size, jvm->aggregate);
+        jvm->aggregate.last_seen_ms = get_wall_clock_millis();
+    }
+
+    Collector &collector;
+    std::string peer;
+    Jvm *jvm;
+    /* The start of the stream until the greeting line is complete */
+    std::string head;
+    EventDecoder decoder;
+};
+
+template<typename Socket>
+class Collector::SocketConnection : public Connection {
+public:
+    SocketConnection(Collector &collector, size_t buffer_size)
+            : Connection(collector, buffer_size),
+              socket(collector.io_service),
+              flags(0) {
+        // Empty
+    }
+
+    Socket socket;
+
+private:
+    void start_read() {
+        auto self = shared_from_this();
+        async_receive(socket, boost::asio::buffer(input), flags, [this, self](const boost::system::error_code &error,
+                                                                              std::size_t size) {
+            handle_read(error, size);
+        });
+    }
+
+    /* Of the last packet */
+    boost::asio::socket_base::message_flags flags;
+};
+
+Collector::Collector(const std::string address, unsigned short port, size_t threads)
+        : address(address),
+          requested_port(port),
+          threads(std::max(threads, (size_t) 1)),
+          acceptor(io_service),
+          stopped(false),
+          store(nullptr),
+          udp_enabled(false),
+#if !defined(_WIN32)
+          unix_acceptor(io_service),
+          unix_packet_acceptor(io_service),
+#endif
+          udp_socket(io_service),
+          datagram(MAX_PACKET_SIZE) {
+    // Empty
+}
+
+Collector::~Collector() {
+    stop();
+}
+
+void Collector::set_store(EventStore *store) {
+    this->store = store;
+}
+
+void Collector::set_unix_path(const std::string path) {
+    unix_path = path;
+}
+
+void Collector::set_unix_packet_path(const std::string path) {
+    unix_packet_path = path;
+}
+
+void Collector::set_udp(bool enabled) {
+    udp_enabled = enabled;
+}
+
+void Collector::start() {
+    tcp::resolver resolver(io_service);
+    tcp::endpoint endpoint = *resolver.resolve(tcp::resolver::query(address, std::to_string(requested_port)));
+    acceptor.open(endpoint.protocol());
+    acceptor.set_option(tcp::acceptor::reuse_address(true));
+    acceptor.bind(endpoint);
+    acceptor.listen(boost::asio::socket_base::max_connections);
+    start_accept<tcp::acceptor, tcp::socket>(acceptor, READ_BUFFER_SIZE);
+
+    if (!unix_path.empty() || !unix_packet_path.empty()) {
+#if defined(_WIN32)
+        BOOST_THROW_EXCEPTION(std::runtime_error("The AF_UNIX sockets are not supported on Windows"));
+#else
+        if (!unix_path.empty()) {
+            listen(unix_acceptor, unix_path);
+            start_accept<boost::asio::local::stream_protocol::acceptor, boost::asio::local::stream_protocol::socket>(
+                    unix_acceptor, READ_BUFFER_SIZE);
+        }
+        if (!unix_packet_path.empty()) {
+            listen(unix_packet_acceptor, unix_packet_path);
+            start_accept<SeqPacketProtocol::acceptor, SeqPacketProtocol::socket>(unix_packet_acceptor,
+                                                                                 MAX_PACKET_SIZE);
+        }
+#endif
+    }
+
+    if (udp_enabled) {
+        udp::endpoint udp_endpoint(endpoint.address(), acceptor.local_endpoint().port());
+        udp_socket.open(udp_endpoint.protocol());
+        udp_socket.bind(udp_endpoint);
+        start_receive();
+    }
+
+    work.reset(new boost::asio::io_service::work(io_service));
+    for (size_t i = 0; i < threads; i++) {
+        worker_threads.create_thread([this]() { io_service.run(); });
+    }
+}
+
+void Collector::stop() {
+    if (stopped.exchange(true)) {
+        return;
+    }
+    work.reset();
+    io_service.stop();
+    worker_threads.join_all();
+
+    /* Their last records are stored, no handler runs any more */
+    std::vector<Connection *> open;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        open.assign(connections.begin(), connections.end());
+    }
+    for (Connection *connection : open) {
+        connection->close();
+    }
+    for (auto &entry : peers) {
+        Peer &peer = *entry.second;
+        std::lock_guard<std::mutex> guard(peer.jvm->lock);
+        peer.decoder.finish(peer.jvm->aggregate);
+        peer.jvm->aggregate.active_connections--;
+    }
+    peers.clear();
+
+    /* The connections go with the handlers when the io_service is destroyed */
+    boost::system::error_code ignored_ec;
+    acceptor.close(ignored_ec);
+    udp_socket.close(ignored_ec);
+#if !defined(_WIN32)
+    if (unix_acceptor.is_open()) {
+        unix_acceptor.close(ignored_ec);
+        unlink(unix_path.c_str());
+    }
+    if (unix_packet_acceptor.is_open()) {
+        unix_packet_acceptor.close(ignored_ec);
+        unlink(unix_packet_path.c_str());
+    }
+#endif
+}
+
+unsigned short Collector::get_port() const {
+    boost::system::error_code ignored_ec;
+    return acceptor.local_endpoint(ignored_ec).port();
+}
+
+template<typename Acceptor, typename Socket>
+void Collector::start_accept(Acceptor &acceptor, size_t buffer_size) {
+    auto connection = std::make_shared<SocketConnection<Socket>>(*this, buffer_size);
+    acceptor.async_accept(connection->socket, [this, &acceptor, buffer_size, connection](
+            const boost::system::error_code &error) {
+        if (stopped || error == boost::asio::error::operation_aborted) {
+            return;
+        }
+        if (error) {
+            std::cerr << "Accept error: " << error.message() << "\n";
+        } else {
+            connection->start(get_peer(connection->socket));
+        }
+        start_accept<Acceptor, Socket>(acceptor, buffer_size);
+    });
+}
+
+void Collector::start_receive() {
+    udp_socket.async_receive_from(boost::asio::buffer(datagram), datagram_sender, [this](
+            const boost::system::error_code &error, std::size_t size) {
+        if (stopped || error == boost::asio::error::operation_aborted) {
+            return;
+        }
+        if (error) {
+            std::cerr << "Receive error: " << error.message() << "\n";
+        } else {
+            receive_datagram(size);
+        }
+        start_receive();
+    });
+}
+
+void Collector::receive_datagram(size_t size) {
+    std::string sender = (boost::format("%s:%s") % datagram_sender.address().to_string()
+                          % datagram_sender.port()).str();
+    std::unique_ptr<Peer> &peer = peers[sender];
+    if (peer == nullptr) {
+        peer.reset(new Peer());
+        peer->jvm = get_jvm(sender);
+        if (store != nullptr) {
+            peer->decoder.set_store(store, store->intern(sender));
+        }
+        std::lock_guard<std::mutex> guard(peer->jvm->lock);
+        peer->jvm->aggregate.connections++;
+        peer->jvm->aggregate.active_connections++;
+        if (peer->jvm->aggregate.first_seen_ms == 0) {
+            peer->jvm->aggregate.first_seen_ms = get_wall_clock_millis();
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(peer->jvm->lock);
+    peer->decoder.decode(datagram.data(), size, peer->jvm->aggregate);
+    peer->jvm->aggregate.last_seen_ms = get_wall_clock_millis();
+}
+
+Collector::Jvm *Collector::get_jvm(const std::string &id) {
+    std::lock_guard<std::mutex> guard(lock);
+    std::unique_ptr<Jvm> &jvm = jvms[id];
+    if (jvm == nullptr) {
+        jvm.reset(new Jvm());
+        jvm->aggregate.id = id;
+    }
+    return jvm.get();
+}
+
+std::vector<JvmAggregate> Collector::get_aggregates() {
+    std::vector<JvmAggregate> aggregates;
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto &entry : jvms) {
+        std::lock_guard<std::mutex> jvm_guard(entry.second->lock);
+        aggregates.push_back(entry.second->aggregate);
+    }
+    return aggregates;
+}
+
+uint64_t Collector::get_events() {
+    uint64_t events = 0;
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto &entry : jvms) {
+        std::lock_guard<std::mutex> jvm_guard(entry.second->lock);
+        events += entry.second->aggregate.events;
+    }
+    return events;
+}
+
+std::string Collector::report(size_t top) {
+    std::vector<JvmAggregate> aggregates = get_aggregates();
+    std::sort(aggregates.begin(), aggregates.end(), [](const JvmAggregate &a, const JvmAggregate &b) {
+        return a.events > b.events;
+    });
+
+    uint64_t events = 0;
+    uint64_t active_connections = 0;
+    for (const JvmAggregate &aggregate : aggregates) {
+        events += aggregate.events;
+        active_connections += aggregate.active_connections;
+    }
+    std::string ret = (boost::format("Collector: %s JVMs, %s active connections, %s events\n")
+                       % aggregates.size() % active_connections % events).str();
+
+    int64_t now_ms = get_wall_clock_millis();
+    for (const JvmAggregate &aggregate : aggregates) {
+        ret += (boost::format("\t%s: %s connections (%s active), %s events, %s lines, %s bytes, "
+                                      "last seen %s ms ago\n")
+                % aggregate.id % aggregate.connections % aggregate.active_connections % aggregate.events
+                % aggregate.lines % aggregate.bytes % (now_ms - aggregate.last_seen_ms)).str();
+        for (auto &kind : get_top(aggregate.kinds, top)) {
+            ret += (boost::format("\t\t%10s %s\n") % kind.second % kind.first).str();
+        }
+        if (aggregate.other_kinds > 0) {
+            ret += (boost::format("\t\t%10s (other kinds)\n") % aggregate.other_kinds).str();
+        }
+        for (auto &exception : get_top(aggregate.exceptions, top)) {
+            ret += (boost::format("\t\t%10s exceptions %s\n") % exception.second % exception.first).str();
+        }
+        if (aggregate.other_exceptions > 0) {
+            ret += (boost::format("\t\t%10s exceptions (other classes)\n") % aggregate.other_exceptions).str();
+        }
+    }
+    return ret;
+}
@@ -0,0 +1,160 @@
+#ifndef JEFF_NATIVE_AGENT_COLLECTOR_HPP
+#define JEFF_NATIVE_AGENT_COLLECTOR_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ip/udp.hpp>
+#if !defined(_WIN32)
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/basic_seq_packet_socket.hpp>
+#endif
+#include <boost/noncopyable.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "EventDecoder.hpp"
+#include "EventStore.hpp"
+
+//
+// The daemon side of the TcpSender and the SocketSender: accepts the agent
+// connections, decodes their event streams and aggregates the events per JVM.
+//
+// One io_service runs on a pool of threads, each connection has a single read in
+// flight, so its decoder needs no lock. A read of up to 16 KiB is decoded into the
+// aggregate of the JVM under its own lock, the JVMs do not contend with each other.
+// The JVM is the one announced by the greeting line of the connection, or the peer
+// address for an agent that does not send one.
+//
+// Besides TCP it listens on the AF_UNIX stream and seqpacket sockets and on UDP
+// when asked to (POSIX only). A seqpacket packet is read whole, up to 64 KiB, like
+// a datagram. The datagrams come without a greeting, they are attributed to the
+// address they are sent from, a UDP sender counts as a connection from its first
+// datagram until the collector stops.
+//
+// With a store, the decoded events are also written to it, see EventStore.
+//
+// Runs in the jeff-daemon executable, and in-process in the jeff-test-collector test.
+//
+class Collector : boost::noncopyable {
+public:
+    // Port 0 picks a free port, see get_port()
+    Collector(const std::string address, unsigned short port, size_t threads);
+
+    ~Collector();
+
+    // Must be set before start(), the store outlives the collector
+    void set_store(EventStore *store);
+
+    // Must be set before start(), a stale socket file is replaced; empty does not listen
+    void set_unix_path(const std::string path);
+
+    void set_unix_packet_path(const std::string path);
+
+    // Must be set before start(), the datagrams are received on the address and the port of the TCP listener
+    void set_udp(bool enabled);
+
+    // Binds and starts accepting, throws when the address can not be bound
+    void start();
+
+    void stop();
+
+    unsigned short get_port() const;
+
+    // Copies of the aggregates
+    std::vector<JvmAggregate> get_aggregates();
+
+    // Records decoded since the start, of all the JVMs
+    uint64_t get_events();
+
+    // Summary of every JVM, with its top kinds and exceptions
+    std::string report(size_t top);
+
+private:
+    class Connection;
+
+    template<typename Socket>
+    class SocketConnection;
+
+#if !defined(_WIN32)
+    // Boost.Asio has no AF_UNIX seqpacket protocol of its own
+    class SeqPacketProtocol {
+    public:
+        typedef boost::asio::local::basic_endpoint<SeqPacketProtocol> endpoint;
+        typedef boost::asio::basic_seq_packet_socket<SeqPacketProtocol> socket;
+        typedef boost::asio::basic_socket_acceptor<SeqPacketProtocol> acceptor;
+
+        int type() const {
+            return SOCK_SEQPACKET;
+        }
+
+        int protocol() const {
+            return 0;
+        }
+
+        int family() const {
+            return AF_UNIX;
+        }
+    };
+#endif
+
+    struct Jvm {
+        std::mutex lock;
+        JvmAggregate aggregate;
+    };
+
+    // The JVM of a UDP sender
+    struct Peer {
+        Jvm *jvm;
+        EventDecoder decoder;
+    };
+
+    template<typename Acceptor, typename Socket>
+    void start_accept(Acceptor &acceptor, size_t buffer_size);
+
+    void start_receive();
+
+    void receive_datagram(size_t size);
+
+    // Never removed, the connections keep the pointer
+    Jvm *get_jvm(const std::string &id);
+
+    const std::string address;
+    const unsigned short requested_port;
+    const size_t threads;
+
+    boost::asio::io_service io_service;
+    std::unique_ptr<boost::asio::io_service::work> work;
+    boost::asio::ip::tcp::acceptor acceptor;
+    boost::thread_group worker_threads;
+    std::atomic<bool> stopped;
+    EventStore *store;
+
+    std::string unix_path;
+    std::string unix_packet_path;
+    bool udp_enabled;
+#if !defined(_WIN32)
+    boost::asio::local::stream_protocol::acceptor unix_acceptor;
+    SeqPacketProtocol::acceptor unix_packet_acceptor;
+#endif
+    boost::asio::ip::udp::socket udp_socket;
+
+    /* Owned by the single receive in flight */
+    std::vector<char> datagram;
+    boost::asio::ip::udp::endpoint datagram_sender;
+    std::unordered_map<std::string, std::unique_ptr<Peer>> peers;
+
+    std::mutex lock;
+    std::unordered_map<std::string, std::unique_ptr<Jvm>> jvms;
+    /* Not closed yet, stop() closes them; the handlers of the io_service keep them alive */
+    std::unordered_set<Connection *> connections;
+};
+
+#endif //JEFF_NATIVE_AGENT_COLLECTOR_HPP
@@ -0,0 +1,237 @@
+#include "EventDecoder.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+/* Distinct kinds and exception classes counted per JVM, the rest are only totals */
+static const size_t MAX_COUNTERS = 1024;
+static const size_t MAX_KEY_LENGTH = 128;
+
+/* A longer line is not from an agent, it is cut */
+static const size_t MAX_LINE_LENGTH = 1024 * 1024;
+
+static const char *const EXCEPTION_KINDS[] = {"Uncought exception", "Cought exception"};
+
+static const char *const STACK_PREFIX = "\tStack: ";
+
+/* "\tThread: <id> <name>" */
+static const char *const THREAD_PREFIX = "\tThread: ";
+
+/* "\tTime: <ns>", the monotonic clock of the agent */
+static const char *const TIME_PREFIX = "\tTime: ";
+
+static const char *const CLOCK_KIND = "Clock";
+
+JvmAggregate::JvmAggregate(const std::string id)
+        : id(id),
+          connections(0),
+          active_connections(0),
+          bytes(0),
+          events(0),
+          lines(0),
+          other_kinds(0),
+          other_exceptions(0),
+          first_seen_ms(0),
+          last_seen_ms(0) {
+    // Empty
+}
+
+EventDecoder::EventDecoder()
+        : store(nullptr),
+          jvm(0),
+          now_ms(0),
+          clock_offset_ns(0),
+          record_open(false) {
+    key.reserve(MAX_KEY_LENGTH);
+}
+
+void EventDecoder::set_store(EventStore *store, uint32_t jvm) {
+    this->store = store;
+    this->jvm = jvm;
+}
+
+void EventDecoder::decode(const char *data, size_t size, JvmAggregate &aggregate) {
+    if (store != nullptr) {
+        now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    decode_lines(data, size, aggregate);
+
+    if (rows.size() > (record_open ? 1u : 0u)) {
+        if (record_open) {
+            StoredEvent open = rows.back();
+            rows.pop_back();
+            store->append(rows);
+            rows.assign(1, open);
+        } else {
+            store->append(rows);
+            rows.clear();
+        }
+    }
+}
+
+void EventDecoder::finish(JvmAggregate &aggregate) {
+    if (!partial.empty()) {
+        decode_line(partial.data(), partial.data() + partial.size(), aggregate);
+        partial.clear();
+    }
+    /* No more body lines, the record waiting for its stack is complete */
+    record_open = false;
+    if (!rows.empty()) {
+        store->append(rows);
+        rows.clear();
+    }
+}
+
+void EventDecoder::decode_lines(const char *data, size_t size, JvmAggregate &aggregate) {
+    aggregate.bytes += size;
+
+    const char *end = data + size;
+    const char *line = data;
+    if (!partial.empty()) {
+        const char *newline = static_cast<const char *>(std::memchr(line, '\n', size));
+        if (newline == nullptr) {
+            partial.append(line, std::min(size, MAX_LINE_LENGTH - std::min(partial.size(), MAX_LINE_LENGTH)));
+            return;
+        }
+        partial.append(line, newline);
+        decode_line(partial.data(), partial.data() + partial.size(), aggregate);
+        partial.clear();
+        line = newline + 1;
+    }
+
+    while (line < end) {
+        const char *newline = static_cast<const char *>(std::memchr(line, '\n', end - line));
+        if (newline == nullptr) {
+            partial.assign(line, std::min(end, line + MAX_LINE_LENGTH));
+            return;
+        }
+        decode_line(line, newline, aggregate);
+        line = newline + 1;
+    }
+}
+
+void EventDecoder::decode_line(const char *begin, const char *end, JvmAggregate &aggregate) {
+    if (begin < end && end[-1] == '\r') {
+        end--;
+    }
+    if (begin == end) { // Heartbeat or the end of a record
+        record_open = false;
+        return;
+    }
+
+    aggregate.lines++;
+    if (*begin == '\t' || *begin == ' ') { // The body of the current record
+        if (!record_open) {
+            return;
+        }
+        size_t prefix = std::strlen(TIME_PREFIX);
+        if ((size_t) (end - begin) > prefix && std::memcmp(begin, TIME_PREFIX, prefix) == 0) {
+            if (clock_offset_ns != 0) {
+                int64_t nanos = std::strtoll(std::string(begin + prefix, end).c_str(), nullptr, 10);
+                rows.back().timestamp = (nanos + clock_offset_ns) / 1000000;
+            }
+            return;
+        }
+        prefix = std::strlen(STACK_PREFIX);
+        if ((size_t) (end - begin) > prefix && std::memcmp(begin, STACK_PREFIX, prefix) == 0) {
+            rows.back().stack = (uint32_t) std::strtoul(std::string(begin + prefix, end).c_str(), nullptr, 10);
+            return;
+        }
+        prefix = std::strlen(THREAD_PREFIX);
+        if ((size_t) (end - begin) > prefix && std::memcmp(begin, THREAD_PREFIX, prefix) == 0) {
+            const char *space = static_cast<const char *>(std::memchr(begin + prefix, ' ', end - begin - prefix));
+            if (space != nullptr) {
+                key.assign(space + 1, std::min((size_t) (end - space - 1), MAX_KEY_LENGTH));
+                rows.back().thread = intern(thread_names, key);
+            }
+        }
+        return;
+    }
+
+    aggregate.events++;
+    const char *colon = static_cast<const char *>(std::memchr(begin, ':', end - begin));
+    const char *kind_end = (colon != nullptr) ? colon : end;
+    count(aggregate.kinds, aggregate.other_kinds, begin, kind_end);
+    size_t kind_length = (size_t) (kind_end - begin);
+    if (kind_length == std::strlen(CLOCK_KIND) && std::memcmp(begin, CLOCK_KIND, kind_length) == 0) {
+        decode_clock(kind_end, end);
+    }
+
+    if (colon == nullptr) {
+        store_record(begin, kind_end, nullptr, nullptr);
+        return;
+    }
+    const char *name = nullptr;
+    const char *name_end = nullptr;
+    for (const char *exception_kind : EXCEPTION_KINDS) {
+        size_t length = std::strlen(exception_kind);
+        if ((size_t) (kind_end - begin) == length && std::memcmp(begin, exception_kind, length) == 0) {
+            /* "Uncought exception: Ljava/lang/Exception;, message: ..." */
+            name = std::min(colon + 2, end);
+            const char *comma = static_cast<const char *>(std::memchr(name, ',', end - name));
+            name_end = (comma != nullptr) ? comma : end;
+            count(aggregate.exceptions, aggregate.other_exceptions, name, name_end);
+            break;
+        }
+    }
+    store_record(begin, kind_end, name, name_end);
+}
+
+void EventDecoder::store_record(const char *begin, const char *kind_end, const char *name, const char *name_end) {
+    if (store == nullptr) {
+        return;
+    }
+
+    /* "Cought exception Ljava/io/IOException;" */
+    fingerprint.assign(begin, std::min((size_t) (kind_end - begin), MAX_KEY_LENGTH));
+    if (name != nullptr) {
+        fingerprint.push_back(' ');
+        fingerprint.append(name, std::min((size_t) (name_end - name), MAX_KEY_LENGTH));
+    }
+
+    /* The thread and the stack follow in the body */
+    StoredEvent row = {now_ms, jvm, intern(fingerprints, fingerprint), 0, 0};
+    rows.push_back(row);
+    record_open = true;
+}
+
+void EventDecoder::decode_clock(const char *begin, const char *end) {
+    std::string line(begin, end);
+    size_t monotonic = line.find(" monotonic ");
+    size_t at = line.find(" at ", (monotonic != std::string::npos) ? monotonic : 0);
+    if (monotonic == std::string::npos || at == std::string::npos) {
+        return;
+    }
+    int64_t nanos = std::strtoll(line.c_str() + monotonic + std::strlen(" monotonic "), nullptr, 10);
+    int64_t wall_nanos = std::strtoll(line.c_str() + at + std::strlen(" at "), nullptr, 10);
+    clock_offset_ns = wall_nanos - nanos;
+}
+
+uint32_t EventDecoder::intern(std::unordered_map<std::string, uint32_t> &cache, const std::string &value) {
+    auto cached = cache.find(value);
+    if (cached != cache.end()) {
+        return cached->second;
+    }
+    uint32_t id = store->intern(value);
+    if (cache.size() < MAX_COUNTERS) {
+        cache.emplace(value, id);
+    }
+    return id;
+}
+
+void EventDecoder::count(std::unordered_map<std::string, uint64_t> &counters, uint64_t &other,
+                         const char *begin, const char *end) {
+    key.assign(begin, std::min((size_t) (end - begin), MAX_KEY_LENGTH));
+    auto counter = counters.find(key);
+    if (counter != counters.end()) {
+        counter->second++;
+    } else if (counters.size() < MAX_COUNTERS) {
+        counters.emplace(key, 1);
+    } else {
+        other++;
+    }
+}
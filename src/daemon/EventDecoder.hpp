@@ -0,0 +1,99 @@
+#ifndef JEFF_NATIVE_AGENT_EVENTDECODER_HPP
+#define JEFF_NATIVE_AGENT_EVENTDECODER_HPP
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "EventStore.hpp"
+
+// The line an agent sends first on every connection, followed by its id ("<pid>@<host>")
+static const char *const GREETING_PREFIX = "JVM ";
+
+// Totals of the events of one JVM, over all its connections
+struct JvmAggregate {
+    std::string id;
+    uint64_t connections;
+    uint64_t active_connections;
+    uint64_t bytes;
+    /* Records, a record is a header line and the indented lines that follow it */
+    uint64_t events;
+    uint64_t lines;
+    /* By the header up to the colon, e.g. "GC" or "Uncought exception" */
+    std::unordered_map<std::string, uint64_t> kinds;
+    /* By the class signature */
+    std::unordered_map<std::string, uint64_t> exceptions;
+    /* Over the limit of distinct kinds and exception classes */
+    uint64_t other_kinds;
+    uint64_t other_exceptions;
+    int64_t first_seen_ms;
+    int64_t last_seen_ms;
+
+    explicit JvmAggregate(const std::string id = "");
+};
+
+//
+// Decodes the event stream of one connection into the aggregate of its JVM.
+//
+// The agents write text records: a header line ("Kind: details") and the lines that
+// follow it indented with a tab; an empty line is a heartbeat. The stream comes in
+// arbitrary chunks, a line cut at the end of a chunk is kept for the next one. The
+// hot path is a memchr per line and a hash lookup per record, without allocations
+// once the maps and the buffers are warm.
+//
+// With a store, every record is also a row of it: the fingerprint is the kind, and
+// the class for the exceptions, and the stack is the id of a "\tStack: <id>" line
+// of the record (with the agent's stack_ids option). The fingerprint ids are cached
+// per connection and the rows of a chunk are appended in one batch, the row of a
+// record that may still get its stack waits for the end of the record.
+//
+class EventDecoder {
+public:
+    EventDecoder();
+
+    // Counts the complete lines of the chunk, the caller serializes the access to the aggregate
+    void decode(const char *data, size_t size, JvmAggregate &aggregate);
+
+    // Decodes a last line without its newline and stores the last record, at the end of the stream
+    void finish(JvmAggregate &aggregate);
+
+    // Stores the records as the rows of the JVM with the given string id
+    void set_store(EventStore *store, uint32_t jvm);
+
+private:
+    void decode_lines(const char *data, size_t size, JvmAggregate &aggregate);
+
+    void store_record(const char *begin, const char *kind_end, const char *name, const char *name_end);
+
+    void decode_line(const char *begin, const char *end, JvmAggregate &aggregate);
+
+    // "Clock: <source>, monotonic <ns> at <ns since the epoch>"
+    void decode_clock(const char *begin, const char *end);
+
+    // The dictionary id of the string, cached
+    uint32_t intern(std::unordered_map<std::string, uint32_t> &cache, const std::string &value);
+
+    void count(std::unordered_map<std::string, uint64_t> &counters, uint64_t &other,
+               const char *begin, const char *end);
+
+    /* A line cut by the end of the last chunk */
+    std::string partial;
+    /* Reused for the lookups */
+    std::string key;
+
+    EventStore *store;
+    uint32_t jvm;
+    /* Milliseconds since the epoch of the chunk being decoded */
+    int64_t now_ms;
+    /* The wall clock minus the monotonic clock of the agent from its last Clock record, 0 before one */
+    int64_t clock_offset_ns;
+    std::unordered_map<std::string, uint32_t> fingerprints;
+    std::unordered_map<std::string, uint32_t> thread_names;
+    std::string fingerprint;
+    std::vector<StoredEvent> rows;
+    /* The last row is of a record that did not end yet */
+    bool record_open;
+};
+
+#endif //JEFF_NATIVE_AGENT_EVENTDECODER_HPP
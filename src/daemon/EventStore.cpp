@@ -0,0 +1,209 @@
+#include "EventStore.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <limits>
+
+#if defined(_WIN32)
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#include <boost/format.hpp>
+
+#include "StoreFormat.hpp"
+
+using namespace jeff;
+
+/* Partitions older than the newest by more than that are closed once flushed, late events get a new file */
+static const int64_t OPEN_PARTITIONS = 2;
+
+EventStore::EventStore(const std::string directory, uint32_t block_rows)
+        : directory(directory),
+          block_rows(std::max(block_rows, 1u)),
+          rows(0),
+          blocks(0),
+          written_bytes(0) {
+#if defined(_WIN32)
+    int result = _mkdir(directory.c_str());
+#else
+    int result = mkdir(directory.c_str(), 0755);
+#endif
+    if (result != 0 && errno != EEXIST) {
+        std::cerr << boost::format("Cannot create the store directory '%s'\n") % directory;
+    }
+    load_dictionary();
+}
+
+EventStore::~EventStore() {
+    flush();
+}
+
+void EventStore::load_dictionary() {
+    std::string path = store::get_dictionary_path(directory);
+    std::vector<std::string> values;
+    bool torn = false;
+    {
+        std::ifstream input(path.c_str(), std::ios::in | std::ios::binary);
+        uint32_t length = 0;
+        while (input.read(reinterpret_cast<char *>(&length), sizeof(length))) {
+            std::string value(length, '\0');
+            if (!input.read(&value[0], length)) {
+                torn = true;
+                break;
+            }
+            values.push_back(value);
+        }
+        torn = torn || (input.gcount() > 0);
+    }
+
+    if (torn) {
+        /* A cut last record, the valid ones are written again so that new ones can follow */
+        std::cerr << boost::format("The dictionary '%s' was cut, %s strings are kept\n") % path % values.size();
+        std::string temporary = path + ".tmp";
+        std::ofstream output(temporary.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+        for (const std::string &value : values) {
+            uint32_t length = (uint32_t) value.size();
+            output.write(reinterpret_cast<const char *>(&length), sizeof(length));
+            output.write(value.data(), value.size());
+        }
+        output.close();
+        std::remove(path.c_str());
+        std::rename(temporary.c_str(), path.c_str());
+    }
+
+    for (size_t i = 0; i < values.size(); i++) {
+        strings.emplace(values[i], (uint32_t) (i + 1));
+    }
+    dictionary.open(path.c_str(), std::ios::out | std::ios::app | std::ios::binary);
+    if (!dictionary) {
+        std::cerr << boost::format("Cannot open the dictionary '%s'\n") % path;
+    }
+}
+
+uint32_t EventStore::intern(const std::string &value) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto entry = strings.find(value);
+    if (entry != strings.end()) {
+        return entry->second;
+    }
+
+    uint32_t id = (uint32_t) strings.size() + 1;
+    strings.emplace(value, id);
+    uint32_t length = (uint32_t) value.size();
+    dictionary.write(reinterpret_cast<const char *>(&length), sizeof(length));
+    dictionary.write(value.data(), value.size());
+    return id;
+}
+
+void EventStore::append(const std::vector<StoredEvent> &events) {
+    std::lock_guard<std::mutex> guard(lock);
+    for (const StoredEvent &event : events) {
+        int64_t index = store::get_partition(event.timestamp);
+        Partition &partition = partitions[index];
+        partition.timestamps.push_back(event.timestamp);
+        partition.ids[0].push_back(event.jvm);
+        partition.ids[1].push_back(event.fingerprint);
+        partition.ids[2].push_back(event.thread);
+        partition.ids[3].push_back(event.stack);
+        if (partition.timestamps.size() >= block_rows) {
+            write_block(index, partition);
+        }
+    }
+    rows += events.size();
+}
+
+void EventStore::flush() {
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto &entry : partitions) {
+        write_block(entry.first, entry.second);
+    }
+
+    /* Events arrive roughly in time order, the old partitions are done */
+    if (!partitions.empty()) {
+        int64_t newest = partitions.rbegin()->first;
+        for (auto it = partitions.begin(); it != partitions.end() && it->first < newest - OPEN_PARTITIONS + 1;) {
+            it = partitions.erase(it);
+        }
+    }
+}
+
+void EventStore::write_block(int64_t index, Partition &partition) {
+    uint32_t count = (uint32_t) partition.timestamps.size();
+    if (count == 0) {
+        return;
+    }
+
+    if (!partition.file.is_open()) {
+        uint32_t sequence = 0;
+        while (std::ifstream(store::get_partition_path(directory, index, sequence).c_str()).good()) {
+            sequence++;
+        }
+        std::string path = store::get_partition_path(directory, index, sequence);
+        partition.file.open(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!partition.file) {
+            std::cerr << boost::format("Cannot create the partition '%s'\n") % path;
+        }
+    }
+
+    store::BlockHeader header = store::BlockHeader();
+    header.magic = store::BLOCK_MAGIC;
+    header.version = store::FORMAT_VERSION;
+    header.header_bytes = sizeof(store::BlockHeader);
+    header.rows = count;
+    header.block_bytes = (uint32_t) store::get_block_bytes(count);
+    auto timestamps = std::minmax_element(partition.timestamps.begin(), partition.timestamps.end());
+    header.min_timestamp = *timestamps.first;
+    header.max_timestamp = *timestamps.second;
+    auto jvms = std::minmax_element(partition.ids[0].begin(), partition.ids[0].end());
+    header.min_jvm = *jvms.first;
+    header.max_jvm = *jvms.second;
+    auto fingerprints = std::minmax_element(partition.ids[1].begin(), partition.ids[1].end());
+    header.min_fingerprint = *fingerprints.first;
+    header.max_fingerprint = *fingerprints.second;
+    auto threads = std::minmax_element(partition.ids[2].begin(), partition.ids[2].end());
+    header.min_thread = *threads.first;
+    header.max_thread = *threads.second;
+    for (uint32_t fingerprint : partition.ids[1]) {
+        store::add_to_bloom(header, fingerprint);
+    }
+
+    /* The whole block goes out with one write, the padding is zeroed */
+    block.assign(header.block_bytes, 0);
+    std::memcpy(&block[0], &header, sizeof(header));
+    std::memcpy(&block[store::get_timestamp_offset()], partition.timestamps.data(), count * sizeof(int64_t));
+    for (size_t i = 0; i < 4; i++) {
+        std::memcpy(&block[store::get_id_column_offset(count, i)], partition.ids[i].data(), count * sizeof(uint32_t));
+    }
+
+    /* The strings of the block are durable before the block */
+    dictionary.flush();
+    partition.file.write(block.data(), block.size());
+    partition.file.flush();
+    if (!partition.file) {
+        std::cerr << boost::format("Cannot write a block of %s rows to the partition %s\n") % count % index;
+        partition.file.clear();
+    } else {
+        blocks++;
+        written_bytes += block.size();
+    }
+
+    partition.timestamps.clear();
+    for (std::vector<uint32_t> &column : partition.ids) {
+        column.clear();
+    }
+}
+
+std::string EventStore::get_statistics() {
+    std::lock_guard<std::mutex> guard(lock);
+    size_t buffered = 0;
+    for (auto &entry : partitions) {
+        buffered += entry.second.timestamps.size();
+    }
+    return (boost::format("Store '%s': %s rows, %s buffered, %s blocks, %s bytes written, %s strings\n")
+            % directory % rows % buffered % blocks % written_bytes % strings.size()).str();
+}
@@ -0,0 +1,75 @@
+#ifndef JEFF_NATIVE_AGENT_EVENTSTORE_HPP
+#define JEFF_NATIVE_AGENT_EVENTSTORE_HPP
+
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+// A row of the event store, the strings are dictionary ids
+struct StoredEvent {
+    int64_t timestamp;
+    uint32_t jvm;
+    uint32_t fingerprint;
+    uint32_t thread;
+    uint32_t stack;
+};
+
+//
+// Writes the collected events to the append-only columnar store, see StoreFormat.hpp.
+//
+// The rows are buffered in memory per hourly partition and written as one block
+// (a single large sequential write) when a partition has block_rows rows or on
+// flush(). The strings are interned into the dictionary, which is written ahead of
+// the blocks that use its ids. On start the dictionary of the directory is loaded,
+// so the ids stay stable across restarts; the partitions always get new files.
+//
+// Thread-safe, the connections append their events in batches.
+//
+class EventStore : boost::noncopyable {
+public:
+    EventStore(const std::string directory, uint32_t block_rows);
+
+    // Writes what is buffered
+    ~EventStore();
+
+    // The id of the string, added to the dictionary when new
+    uint32_t intern(const std::string &value);
+
+    void append(const std::vector<StoredEvent> &events);
+
+    // Writes the buffered rows as blocks, also of the partitions that are not full
+    void flush();
+
+    std::string get_statistics();
+
+private:
+    struct Partition {
+        std::ofstream file;
+        std::vector<int64_t> timestamps;
+        std::vector<uint32_t> ids[4];
+    };
+
+    void load_dictionary();
+
+    void write_block(int64_t index, Partition &partition);
+
+    const std::string directory;
+    const uint32_t block_rows;
+
+    std::mutex lock;
+    std::unordered_map<std::string, uint32_t> strings;
+    std::ofstream dictionary;
+    std::map<int64_t, Partition> partitions;
+    std::vector<char> block;
+    uint64_t rows;
+    uint64_t blocks;
+    uint64_t written_bytes;
+};
+
+#endif //JEFF_NATIVE_AGENT_EVENTSTORE_HPP
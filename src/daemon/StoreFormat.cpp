@@ -0,0 +1,31 @@
+#include "StoreFormat.hpp"
+
+#include <cstdlib>
+
+#include <boost/format.hpp>
+
+static const std::string PARTITION_PREFIX = "events-";
+static const std::string PARTITION_SUFFIX = ".jeff";
+
+std::string jeff::store::get_partition_path(const std::string &directory, int64_t partition, uint32_t sequence) {
+    return (boost::format("%s/%s%d.%d%s") % directory % PARTITION_PREFIX % partition % sequence % PARTITION_SUFFIX).str();
+}
+
+int64_t jeff::store::parse_partition_name(const std::string &name) {
+    if (name.size() <= PARTITION_PREFIX.size() + PARTITION_SUFFIX.size()
+        || name.compare(0, PARTITION_PREFIX.size(), PARTITION_PREFIX) != 0
+        || name.compare(name.size() - PARTITION_SUFFIX.size(), PARTITION_SUFFIX.size(), PARTITION_SUFFIX) != 0) {
+        return -1;
+    }
+    const char *start = name.c_str() + PARTITION_PREFIX.size();
+    char *end = nullptr;
+    long long partition = std::strtoll(start, &end, 10);
+    if (end == start || *end != '.') {
+        return -1;
+    }
+    return (int64_t) partition;
+}
+
+std::string jeff::store::get_dictionary_path(const std::string &directory) {
+    return directory + "/strings.dict";
+}
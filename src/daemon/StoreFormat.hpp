@@ -0,0 +1,132 @@
+#ifndef JEFF_NATIVE_AGENT_STOREFORMAT_HPP
+#define JEFF_NATIVE_AGENT_STOREFORMAT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+//
+// On-disk format of the event store, shared by the writer (EventStore) and the readers.
+//
+// The store is a directory of partition files, one or more per hour of event time,
+// named "events-<hours since the epoch>.<sequence>.jeff", and one "strings.dict" file.
+// A writer never appends to an existing partition file, it starts a new sequence,
+// so a torn write can only cut the end of a file.
+//
+// A partition file is a sequence of blocks, each a BlockHeader and the columns:
+//
+//   int64_t  timestamp[rows]     milliseconds since the epoch, as received
+//   uint32_t jvm[rows]           string ids, 0 is none
+//   uint32_t fingerprint[rows]
+//   uint32_t thread[rows]
+//   uint32_t stack[rows]         stack id of the agent, 0 is none
+//
+// Every column starts at a multiple of COLUMN_ALIGNMENT bytes from the start of the
+// block (and of the file), so a mapped column can be scanned with aligned vector
+// loads. The header has the minimum and maximum of the columns and a bloom filter
+// of the fingerprints, a reader skips the blocks that can not match without
+// touching their columns. The values are in the byte order of the writer (little
+// endian on the supported platforms).
+//
+// The dictionary is a sequence of records, a uint32_t length and the bytes, the id
+// of a string is its position starting at 1. A reader ignores a cut last record.
+//
+namespace jeff {
+namespace store {
+
+    static const uint32_t BLOCK_MAGIC = 0x4246454a; // "JEFB"
+    static const uint16_t FORMAT_VERSION = 1;
+
+    static const int64_t PARTITION_MS = 60 * 60 * 1000;
+    static const size_t COLUMN_ALIGNMENT = 32;
+    static const size_t COLUMN_COUNT = 5;
+
+    static const size_t BLOOM_WORDS = 8;
+    static const size_t BLOOM_BITS = BLOOM_WORDS * 64;
+    static const size_t BLOOM_HASHES = 3;
+
+    struct BlockHeader {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t header_bytes;
+        uint32_t rows;
+        /* The header and the columns, the next block starts right after */
+        uint32_t block_bytes;
+        int64_t min_timestamp;
+        int64_t max_timestamp;
+        uint32_t min_jvm;
+        uint32_t max_jvm;
+        uint32_t min_fingerprint;
+        uint32_t max_fingerprint;
+        uint32_t min_thread;
+        uint32_t max_thread;
+        uint32_t reserved[2];
+        uint64_t fingerprint_bloom[BLOOM_WORDS];
+    };
+
+    static_assert(sizeof(BlockHeader) == 128, "the block header is part of the file format");
+    static_assert(sizeof(BlockHeader) % COLUMN_ALIGNMENT == 0, "the columns must stay aligned");
+
+    inline size_t align_column(size_t bytes) {
+        return (bytes + COLUMN_ALIGNMENT - 1) / COLUMN_ALIGNMENT * COLUMN_ALIGNMENT;
+    }
+
+    /* Offsets from the start of the block */
+    inline size_t get_timestamp_offset() {
+        return sizeof(BlockHeader);
+    }
+
+    // Index 0 is the jvm column, then fingerprint, thread and stack
+    inline size_t get_id_column_offset(uint32_t rows, size_t index) {
+        return sizeof(BlockHeader) + align_column(rows * sizeof(int64_t)) + index * align_column(rows * sizeof(uint32_t));
+    }
+
+    // The end of the last of the COLUMN_COUNT - 1 id columns
+    inline size_t get_block_bytes(uint32_t rows) {
+        return get_id_column_offset(rows, COLUMN_COUNT - 1);
+    }
+
+    // The bits of a fingerprint in the bloom filter
+    inline size_t get_bloom_bit(uint32_t fingerprint, size_t hash) {
+        uint64_t value = ((uint64_t) fingerprint + 1) * 0x9e3779b97f4a7c15ULL;
+        value ^= value >> 29;
+        value *= 0xbf58476d1ce4e5b9ULL + 2 * hash;
+        value ^= value >> 32;
+        return (size_t) (value % BLOOM_BITS);
+    }
+
+    inline void add_to_bloom(BlockHeader &header, uint32_t fingerprint) {
+        for (size_t hash = 0; hash < BLOOM_HASHES; hash++) {
+            size_t bit = get_bloom_bit(fingerprint, hash);
+            header.fingerprint_bloom[bit / 64] |= 1ULL << (bit % 64);
+        }
+    }
+
+    // False when the block surely has no row with the fingerprint
+    inline bool may_contain(const BlockHeader &header, uint32_t fingerprint) {
+        if (fingerprint < header.min_fingerprint || fingerprint > header.max_fingerprint) {
+            return false;
+        }
+        for (size_t hash = 0; hash < BLOOM_HASHES; hash++) {
+            size_t bit = get_bloom_bit(fingerprint, hash);
+            if ((header.fingerprint_bloom[bit / 64] & (1ULL << (bit % 64))) == 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    inline int64_t get_partition(int64_t timestamp_ms) {
+        return (timestamp_ms >= 0) ? timestamp_ms / PARTITION_MS : (timestamp_ms + 1) / PARTITION_MS - 1;
+    }
+
+    std::string get_partition_path(const std::string &directory, int64_t partition, uint32_t sequence);
+
+    // -1 when the name is not a partition file
+    int64_t parse_partition_name(const std::string &name);
+
+    std::string get_dictionary_path(const std::string &directory);
+}
+}
+
+#endif //JEFF_NATIVE_AGENT_STOREFORMAT_HPP
@@ -0,0 +1,452 @@
+#include "StoreQuery.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+
+#include "StoreReader.hpp"
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define JEFF_AVX2 1
+#define JEFF_TARGET_AVX2 __attribute__((target("avx2")))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <immintrin.h>
+#include <intrin.h>
+#define JEFF_AVX2 1
+#define JEFF_TARGET_AVX2
+#endif
+
+using namespace jeff;
+
+/* Id sets up to that size are compared in registers, a larger one is looked up in a bitmap */
+static const size_t MAX_VECTOR_IDS = 8;
+
+/* The bloom filter of a block is checked for fingerprint sets up to that size */
+static const size_t MAX_BLOOM_IDS = 64;
+
+static const std::string NO_GROUP = "(none)";
+
+static inline unsigned int count_trailing_zeros(uint32_t value) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, value);
+    return (unsigned int) index;
+#else
+    return (unsigned int) __builtin_ctz(value);
+#endif
+}
+
+// Counts per group id, with linear probing; a slot with a zero count is free
+class CountTable {
+public:
+    CountTable()
+            : slots(1024),
+              used(0) {
+        // Empty
+    }
+
+    inline void add(uint32_t key, uint64_t count) {
+        size_t mask = slots.size() - 1;
+        size_t index = (key * 0x9e3779b1u) & mask;
+        while (true) {
+            Slot &slot = slots[index];
+            if (slot.count == 0) {
+                slot.key = key;
+                slot.count = count;
+                if (++used * 2 > slots.size()) {
+                    grow();
+                }
+                return;
+            }
+            if (slot.key == key) {
+                slot.count += count;
+                return;
+            }
+            index = (index + 1) & mask;
+        }
+    }
+
+    void merge_into(CountTable &other) const {
+        for (const Slot &slot : slots) {
+            if (slot.count != 0) {
+                other.add(slot.key, slot.count);
+            }
+        }
+    }
+
+    template<typename Function>
+    void for_each(Function function) const {
+        for (const Slot &slot : slots) {
+            if (slot.count != 0) {
+                function(slot.key, slot.count);
+            }
+        }
+    }
+
+private:
+    struct Slot {
+        uint32_t key;
+        uint64_t count;
+    };
+
+    void grow() {
+        std::vector<Slot> old(slots.size() * 2);
+        old.swap(slots);
+        used = 0;
+        for (const Slot &slot : old) {
+            if (slot.count != 0) {
+                add(slot.key, slot.count);
+            }
+        }
+    }
+
+    std::vector<Slot> slots;
+    size_t used;
+};
+
+// The dictionary ids of the strings that contain a pattern
+struct IdFilter {
+    bool enabled;
+    std::vector<uint32_t> ids;
+    std::vector<uint8_t> bitmap;
+
+    IdFilter(const StringDictionary &dictionary, const std::string &pattern)
+            : enabled(!pattern.empty()) {
+        if (!enabled) {
+            return;
+        }
+        bitmap.assign(dictionary.size() + 1, 0);
+        for (uint32_t id = 1; id <= dictionary.size(); id++) {
+            if (dictionary.get(id).find(pattern) != std::string::npos) {
+                ids.push_back(id);
+                bitmap[id] = 1;
+            }
+        }
+    }
+
+    inline bool matches(uint32_t id) const {
+        return !enabled || (id < bitmap.size() && bitmap[id] != 0);
+    }
+
+    bool in_range(uint32_t min, uint32_t max) const {
+        if (!enabled) {
+            return true;
+        }
+        auto first = std::lower_bound(ids.begin(), ids.end(), min);
+        return first != ids.end() && *first <= max;
+    }
+
+    bool is_vectorized() const {
+        return enabled && ids.size() <= MAX_VECTOR_IDS;
+    }
+};
+
+// What the scan of a block needs, shared read-only by the threads
+struct Scan {
+    int64_t from_ms;
+    int64_t to_ms;
+    const IdFilter *jvm;
+    const IdFilter *fingerprint;
+    /* The group of every dictionary id of the grouped column, 0 is not counted */
+    std::vector<uint32_t> groups;
+    size_t group_column;
+};
+
+struct ScanCounters {
+    CountTable counts;
+    uint64_t matched_rows;
+    uint64_t scanned_rows;
+    uint64_t scanned_blocks;
+    uint64_t skipped_blocks;
+
+    ScanCounters()
+            : matched_rows(0),
+              scanned_rows(0),
+              scanned_blocks(0),
+              skipped_blocks(0) {
+        // Empty
+    }
+};
+
+static const uint32_t *get_id_column(const StoredBlock &block, size_t index) {
+    const uint32_t *columns[] = {block.jvms, block.fingerprints, block.threads, block.stacks};
+    return columns[index];
+}
+
+static inline uint32_t get_group(const Scan &scan, uint32_t id) {
+    return (id < scan.groups.size()) ? scan.groups[id] : 0;
+}
+
+static bool can_skip(const StoredBlock &block, const Scan &scan) {
+    const store::BlockHeader &header = *block.header;
+    if (header.rows == 0 || !block.overlaps(scan.from_ms, scan.to_ms)
+        || !scan.jvm->in_range(header.min_jvm, header.max_jvm)
+        || !scan.fingerprint->in_range(header.min_fingerprint, header.max_fingerprint)) {
+        return true;
+    }
+    if (scan.fingerprint->enabled && scan.fingerprint->ids.size() <= MAX_BLOOM_IDS) {
+        for (uint32_t id : scan.fingerprint->ids) {
+            if (store::may_contain(header, id)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+static inline void count_row(const Scan &scan, const uint32_t *group_column, uint32_t row, ScanCounters &counters) {
+    uint32_t group = get_group(scan, group_column[row]);
+    if (group != 0) {
+        counters.counts.add(group, 1);
+        counters.matched_rows++;
+    }
+}
+
+static void scan_block_scalar(const StoredBlock &block, const Scan &scan, ScanCounters &counters) {
+    const uint32_t *group_column = get_id_column(block, scan.group_column);
+    for (uint32_t row = 0; row < block.header->rows; row++) {
+        int64_t timestamp = block.timestamps[row];
+        if (timestamp >= scan.from_ms && timestamp <= scan.to_ms
+            && scan.jvm->matches(block.jvms[row]) && scan.fingerprint->matches(block.fingerprints[row])) {
+            count_row(scan, group_column, row, counters);
+        }
+    }
+}
+
+#if defined(JEFF_AVX2)
+
+// Bit i is set when the id of row i of the 8 is in the filter
+JEFF_TARGET_AVX2 static inline uint32_t match_ids(const __m256i *ids, size_t count, const uint32_t *column, uint32_t row) {
+    __m256i values = _mm256_load_si256(reinterpret_cast<const __m256i *>(column + row));
+    __m256i hits = _mm256_setzero_si256();
+    for (size_t i = 0; i < count; i++) {
+        hits = _mm256_or_si256(hits, _mm256_cmpeq_epi32(values, ids[i]));
+    }
+    return (uint32_t) _mm256_movemask_ps(_mm256_castsi256_ps(hits));
+}
+
+JEFF_TARGET_AVX2 static void scan_block_avx2(const StoredBlock &block, const Scan &scan, ScanCounters &counters) {
+    const uint32_t rows = block.header->rows;
+    const uint32_t *group_column = get_id_column(block, scan.group_column);
+    const bool check_time = block.header->min_timestamp < scan.from_ms || block.header->max_timestamp > scan.to_ms;
+    const IdFilter &jvm = *scan.jvm;
+    const IdFilter &fingerprint = *scan.fingerprint;
+
+    const __m256i from = _mm256_set1_epi64x(scan.from_ms);
+    const __m256i to = _mm256_set1_epi64x(scan.to_ms);
+    __m256i jvm_ids[MAX_VECTOR_IDS];
+    __m256i fingerprint_ids[MAX_VECTOR_IDS];
+    const size_t jvm_count = jvm.is_vectorized() ? jvm.ids.size() : 0;
+    const size_t fingerprint_count = fingerprint.is_vectorized() ? fingerprint.ids.size() : 0;
+    for (size_t i = 0; i < jvm_count; i++) {
+        jvm_ids[i] = _mm256_set1_epi32((int) jvm.ids[i]);
+    }
+    for (size_t i = 0; i < fingerprint_count; i++) {
+        fingerprint_ids[i] = _mm256_set1_epi32((int) fingerprint.ids[i]);
+    }
+
+    /* The columns are 32 byte aligned, 8 rows are 2 loads of the timestamps and 1 of an id column */
+    uint32_t row = 0;
+    for (; row + 8 <= rows; row += 8) {
+        uint32_t mask = 0xff;
+        if (check_time) {
+            __m256i low = _mm256_load_si256(reinterpret_cast<const __m256i *>(block.timestamps + row));
+            __m256i high = _mm256_load_si256(reinterpret_cast<const __m256i *>(block.timestamps + row + 4));
+            __m256i low_out = _mm256_or_si256(_mm256_cmpgt_epi64(from, low), _mm256_cmpgt_epi64(low, to));
+            __m256i high_out = _mm256_or_si256(_mm256_cmpgt_epi64(from, high), _mm256_cmpgt_epi64(high, to));
+            uint32_t out = (uint32_t) _mm256_movemask_pd(_mm256_castsi256_pd(low_out))
+                           | ((uint32_t) _mm256_movemask_pd(_mm256_castsi256_pd(high_out)) << 4);
+            mask &= ~out;
+        }
+        if (mask != 0 && jvm_count > 0) {
+            mask &= match_ids(jvm_ids, jvm_count, block.jvms, row);
+        }
+        if (mask != 0 && fingerprint_count > 0) {
+            mask &= match_ids(fingerprint_ids, fingerprint_count, block.fingerprints, row);
+        }
+        while (mask != 0) {
+            uint32_t index = row + count_trailing_zeros(mask);
+            mask &= mask - 1;
+            /* The large id sets are looked up one row at a time */
+            if ((jvm_count > 0 || jvm.matches(block.jvms[index]))
+                && (fingerprint_count > 0 || fingerprint.matches(block.fingerprints[index]))) {
+                count_row(scan, group_column, index, counters);
+            }
+        }
+    }
+
+    for (; row < rows; row++) {
+        int64_t timestamp = block.timestamps[row];
+        if (timestamp >= scan.from_ms && timestamp <= scan.to_ms
+            && jvm.matches(block.jvms[row]) && fingerprint.matches(block.fingerprints[row])) {
+            count_row(scan, group_column, row, counters);
+        }
+    }
+}
+
+#endif
+
+bool StoreQuery::has_avx2() {
+#if defined(JEFF_AVX2) && defined(_MSC_VER)
+    int info[4];
+    __cpuidex(info, 7, 0);
+    /* And the OS saves the YMM registers */
+    return (info[1] & (1 << 5)) != 0 && (_xgetbv(0) & 0x6) == 0x6;
+#elif defined(JEFF_AVX2)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+#else
+    return false;
+#endif
+}
+
+// The exception class of a fingerprint "<kind> L<class>;", empty for the other events
+static std::string get_class(const std::string &fingerprint) {
+    size_t space = fingerprint.rfind(' ');
+    if (space == std::string::npos || space + 1 >= fingerprint.size()
+        || (fingerprint[space + 1] != 'L' && fingerprint[space + 1] != '[')) {
+        return "";
+    }
+    return fingerprint.substr(space + 1);
+}
+
+static std::string get_host(const std::string &jvm) {
+    size_t at = jvm.find('@');
+    return (at != std::string::npos) ? jvm.substr(at + 1) : jvm;
+}
+
+// "pool-1-thread-7" is "pool-1-thread", "main" stays "main"
+static std::string get_pool(const std::string &thread) {
+    size_t end = thread.size();
+    while (end > 0 && std::isdigit((unsigned char) thread[end - 1])) {
+        end--;
+    }
+    if (end == thread.size()) {
+        return thread;
+    }
+    while (end > 0 && (thread[end - 1] == '-' || thread[end - 1] == '_' || thread[end - 1] == '#'
+                       || thread[end - 1] == ' ')) {
+        end--;
+    }
+    return thread.substr(0, end);
+}
+
+StoreQuery::StoreQuery(const std::string directory, const Query &query)
+        : directory(directory),
+          query(query) {
+    // Empty
+}
+
+QueryResult StoreQuery::run() {
+    StringDictionary dictionary(directory);
+    IdFilter jvm(dictionary, query.jvm);
+    IdFilter fingerprint(dictionary, query.fingerprint);
+
+    Scan scan;
+    scan.from_ms = query.from_ms;
+    scan.to_ms = query.to_ms;
+    scan.jvm = &jvm;
+    scan.fingerprint = &fingerprint;
+    scan.group_column = (query.group_by == GroupBy::JVM || query.group_by == GroupBy::HOST) ? 0
+                        : (query.group_by == GroupBy::THREAD || query.group_by == GroupBy::POOL) ? 2 : 1;
+
+    /* The group names, an id of the column maps to the index of its group, 0 means none */
+    std::vector<std::string> names(1, NO_GROUP);
+    std::unordered_map<std::string, uint32_t> name_ids;
+    scan.groups.assign(dictionary.size() + 1, 0);
+    for (uint32_t id = 1; id <= dictionary.size(); id++) {
+        const std::string &value = dictionary.get(id);
+        std::string name;
+        switch (query.group_by) {
+            case GroupBy::CLASS:
+                name = get_class(value);
+                break;
+            case GroupBy::HOST:
+                name = get_host(value);
+                break;
+            case GroupBy::POOL:
+                name = get_pool(value);
+                break;
+            default:
+                name = value;
+        }
+        if (name.empty()) {
+            continue;
+        }
+        auto entry = name_ids.emplace(name, (uint32_t) names.size());
+        if (entry.second) {
+            names.push_back(name);
+        }
+        scan.groups[id] = entry.first->second;
+    }
+    if (query.group_by != GroupBy::CLASS) {
+        /* The rows without a value, e.g. the thread before the agent sends it */
+        scan.groups[0] = (uint32_t) names.size();
+        names.push_back(NO_GROUP);
+    }
+
+    QueryResult result = QueryResult();
+    result.vectorized = query.vectorized && has_avx2();
+    std::vector<std::string> paths;
+    if ((!jvm.enabled || !jvm.ids.empty()) && (!fingerprint.enabled || !fingerprint.ids.empty())) {
+        paths = list_partitions(directory, query.from_ms, query.to_ms);
+    }
+    result.partitions = paths.size();
+
+    std::atomic<size_t> next_path(0);
+    size_t thread_count = std::max<size_t>(std::min(query.threads, paths.size()), 1);
+    std::vector<std::unique_ptr<ScanCounters>> counters;
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < thread_count; i++) {
+        counters.emplace_back(new ScanCounters());
+        ScanCounters *own = counters.back().get();
+        threads.emplace_back([&, own]() {
+            for (size_t index = next_path++; index < paths.size(); index = next_path++) {
+                StoredPartition partition(paths[index]);
+                for (const StoredBlock &block : partition.get_blocks()) {
+                    if (can_skip(block, scan)) {
+                        own->skipped_blocks++;
+                        continue;
+                    }
+                    own->scanned_blocks++;
+                    own->scanned_rows += block.header->rows;
+#if defined(JEFF_AVX2)
+                    if (result.vectorized) {
+                        scan_block_avx2(block, scan, *own);
+                        continue;
+                    }
+#endif
+                    scan_block_scalar(block, scan, *own);
+                }
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    CountTable total;
+    for (const std::unique_ptr<ScanCounters> &own : counters) {
+        own->counts.merge_into(total);
+        result.matched_rows += own->matched_rows;
+        result.scanned_rows += own->scanned_rows;
+        result.scanned_blocks += own->scanned_blocks;
+        result.skipped_blocks += own->skipped_blocks;
+    }
+    total.for_each([&](uint32_t group, uint64_t count) {
+        result.groups.emplace_back(names[group], count);
+    });
+    std::sort(result.groups.begin(), result.groups.end(), [](const std::pair<std::string, uint64_t> &a,
+                                                             const std::pair<std::string, uint64_t> &b) {
+        return a.second > b.second || (a.second == b.second && a.first < b.first);
+    });
+    if (result.groups.size() > query.top) {
+        result.groups.resize(query.top);
+    }
+    return result;
+}
@@ -0,0 +1,75 @@
+#ifndef JEFF_NATIVE_AGENT_STOREQUERY_HPP
+#define JEFF_NATIVE_AGENT_STOREQUERY_HPP
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+// What the matching rows are counted by
+enum class GroupBy {
+    FINGERPRINT,
+    /* The exception class of the fingerprint, the other events are not counted */
+    CLASS,
+    JVM,
+    /* The host part of the JVM id "<pid>@<host>" */
+    HOST,
+    THREAD,
+    /* The thread name without the trailing number, e.g. "pool-1-thread" */
+    POOL
+};
+
+struct Query {
+    /* Inclusive, milliseconds since the epoch */
+    int64_t from_ms;
+    int64_t to_ms;
+    /* Substrings of the JVM id and of the fingerprint, empty matches all */
+    std::string jvm;
+    std::string fingerprint;
+    GroupBy group_by;
+    size_t top;
+    size_t threads;
+    /* The AVX2 scan when the CPU has it, false forces the scalar one */
+    bool vectorized;
+};
+
+struct QueryResult {
+    /* The largest groups first */
+    std::vector<std::pair<std::string, uint64_t>> groups;
+    uint64_t matched_rows;
+    uint64_t scanned_rows;
+    uint64_t scanned_blocks;
+    uint64_t skipped_blocks;
+    uint64_t partitions;
+    bool vectorized;
+};
+
+//
+// Counts the stored events that match a query, see StoreFormat.hpp for the layout.
+//
+// The filters are turned into sets of dictionary ids first, a block is skipped when
+// its ranges or its fingerprint bloom filter rule the sets out. The remaining blocks
+// are scanned 8 rows at a time: the timestamps and the id columns are compared with
+// aligned AVX2 loads into a row mask (or one row at a time without AVX2) and the
+// matching rows are counted in an open-addressing hash table by their group.
+//
+// The partition files are mapped and scanned in parallel, each thread takes the next
+// file and has its own table, the tables are merged at the end.
+//
+class StoreQuery : boost::noncopyable {
+public:
+    StoreQuery(const std::string directory, const Query &query);
+
+    QueryResult run();
+
+    // The CPU and the compiler support the vectorized scan
+    static bool has_avx2();
+
+private:
+    const std::string directory;
+    const Query query;
+};
+
+#endif //JEFF_NATIVE_AGENT_STOREQUERY_HPP
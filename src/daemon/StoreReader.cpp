@@ -0,0 +1,133 @@
+#include "StoreReader.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <dirent.h>
+#endif
+
+#include <boost/format.hpp>
+
+using namespace jeff;
+
+StringDictionary::StringDictionary(const std::string &directory) {
+    std::ifstream input(store::get_dictionary_path(directory).c_str(), std::ios::in | std::ios::binary);
+    uint32_t length = 0;
+    while (input.read(reinterpret_cast<char *>(&length), sizeof(length))) {
+        std::string value(length, '\0');
+        if (!input.read(&value[0], length)) {
+            break; // Cut by the writer
+        }
+        values.push_back(value);
+        ids.emplace(value, (uint32_t) values.size());
+    }
+}
+
+const std::string &StringDictionary::get(uint32_t id) const {
+    static const std::string none;
+    return (id > 0 && id <= values.size()) ? values[id - 1] : none;
+}
+
+uint32_t StringDictionary::find(const std::string &value) const {
+    auto id = ids.find(value);
+    return (id != ids.end()) ? id->second : 0;
+}
+
+size_t StringDictionary::size() const {
+    return values.size();
+}
+
+bool StoredBlock::overlaps(int64_t from_ms, int64_t to_ms) const {
+    return header->max_timestamp >= from_ms && header->min_timestamp <= to_ms;
+}
+
+StoredPartition::StoredPartition(const std::string &path)
+        : path(path),
+          rows(0) {
+    try {
+        file = boost::interprocess::file_mapping(path.c_str(), boost::interprocess::read_only);
+        region = boost::interprocess::mapped_region(file, boost::interprocess::read_only);
+        region.advise(boost::interprocess::mapped_region::advice_sequential);
+    } catch (std::exception &e) {
+        /* Also an empty file, it can not be mapped */
+        std::cerr << boost::format("Cannot map the partition '%s': %s\n") % path % e.what();
+        return;
+    }
+
+    const char *data = static_cast<const char *>(region.get_address());
+    size_t size = region.get_size();
+    size_t offset = 0;
+    while (offset + sizeof(store::BlockHeader) <= size) {
+        const store::BlockHeader *header = reinterpret_cast<const store::BlockHeader *>(data + offset);
+        if (header->magic != store::BLOCK_MAGIC || header->version != store::FORMAT_VERSION
+            || header->header_bytes != sizeof(store::BlockHeader)
+            || header->block_bytes != store::get_block_bytes(header->rows)
+            || offset + header->block_bytes > size) {
+            std::cerr << boost::format("Ignoring the partition '%s' from the offset %s\n") % path % offset;
+            break;
+        }
+
+        const char *block = data + offset;
+        StoredBlock view = {
+                header,
+                reinterpret_cast<const int64_t *>(block + store::get_timestamp_offset()),
+                reinterpret_cast<const uint32_t *>(block + store::get_id_column_offset(header->rows, 0)),
+                reinterpret_cast<const uint32_t *>(block + store::get_id_column_offset(header->rows, 1)),
+                reinterpret_cast<const uint32_t *>(block + store::get_id_column_offset(header->rows, 2)),
+                reinterpret_cast<const uint32_t *>(block + store::get_id_column_offset(header->rows, 3))
+        };
+        blocks.push_back(view);
+        rows += header->rows;
+        offset += header->block_bytes;
+    }
+}
+
+const std::string &StoredPartition::get_path() const {
+    return path;
+}
+
+const std::vector<StoredBlock> &StoredPartition::get_blocks() const {
+    return blocks;
+}
+
+uint64_t StoredPartition::get_rows() const {
+    return rows;
+}
+
+std::vector<std::string> list_partitions(const std::string &directory, int64_t from_ms, int64_t to_ms) {
+    std::vector<std::string> names;
+#if defined(_WIN32)
+    WIN32_FIND_DATAA entry;
+    HANDLE find = FindFirstFileA((directory + "\\*").c_str(), &entry);
+    if (find != INVALID_HANDLE_VALUE) {
+        do {
+            names.push_back(entry.cFileName);
+        } while (FindNextFileA(find, &entry));
+        FindClose(find);
+    }
+#else
+    DIR *dir = opendir(directory.c_str());
+    if (dir != nullptr) {
+        while (struct dirent *entry = readdir(dir)) {
+            names.push_back(entry->d_name);
+        }
+        closedir(dir);
+    }
+#endif
+
+    int64_t first = store::get_partition(from_ms);
+    int64_t last = store::get_partition(to_ms);
+    std::vector<std::string> paths;
+    for (const std::string &name : names) {
+        int64_t partition = store::parse_partition_name(name);
+        if (partition >= 0 && partition >= first && partition <= last) {
+            paths.push_back(directory + "/" + name);
+        }
+    }
+    std::sort(paths.begin(), paths.end());
+    return paths;
+}
@@ -0,0 +1,73 @@
+#ifndef JEFF_NATIVE_AGENT_STOREREADER_HPP
+#define JEFF_NATIVE_AGENT_STOREREADER_HPP
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "StoreFormat.hpp"
+
+// The strings of the store by their ids, loaded once
+class StringDictionary {
+public:
+    explicit StringDictionary(const std::string &directory);
+
+    // Empty for 0 and the unknown ids
+    const std::string &get(uint32_t id) const;
+
+    // 0 when the string is not in the dictionary
+    uint32_t find(const std::string &value) const;
+
+    size_t size() const;
+
+private:
+    std::vector<std::string> values;
+    std::unordered_map<std::string, uint32_t> ids;
+};
+
+// The columns of a block, pointing into the mapped file
+struct StoredBlock {
+    const jeff::store::BlockHeader *header;
+    const int64_t *timestamps;
+    const uint32_t *jvms;
+    const uint32_t *fingerprints;
+    const uint32_t *threads;
+    const uint32_t *stacks;
+
+    // False when no row of the block is in [from_ms, to_ms]
+    bool overlaps(int64_t from_ms, int64_t to_ms) const;
+};
+
+//
+// A partition file mapped read-only. The blocks are checked when it is opened, a
+// block with a bad header and everything after it (e.g. the torn end of a file the
+// writer did not finish) are ignored. The views stay valid as long as the partition.
+//
+class StoredPartition : boost::noncopyable {
+public:
+    // A file that can not be mapped has no blocks, the reason is printed
+    explicit StoredPartition(const std::string &path);
+
+    const std::string &get_path() const;
+
+    const std::vector<StoredBlock> &get_blocks() const;
+
+    uint64_t get_rows() const;
+
+private:
+    const std::string path;
+    boost::interprocess::file_mapping file;
+    boost::interprocess::mapped_region region;
+    std::vector<StoredBlock> blocks;
+    uint64_t rows;
+};
+
+// The partition files of the directory that can have events in [from_ms, to_ms], sorted
+std::vector<std::string> list_partitions(const std::string &directory, int64_t from_ms, int64_t to_ms);
+
+#endif //JEFF_NATIVE_AGENT_STOREREADER_HPP
@@ -0,0 +1,128 @@
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include <boost/asio/deadline_timer.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/signal_set.hpp>
+#include <boost/format.hpp>
+
+#include "Collector.hpp"
+#include "EventStore.hpp"
+
+static void usage() {
+    std::cerr << "Usage: jeff-daemon [--address 0.0.0.0] [--port 9999] [--threads n] [--report-interval seconds]"
+            " [--top n] [--store directory] [--block-rows n] [--unix path] [--unixpacket path] [--udp true]\n";
+}
+
+/**
+ * The collector daemon, aggregates the events of the agents per JVM and prints a summary periodically.
+ */
+int main(int argc, char *argv[]) {
+    std::string address = "0.0.0.0";
+    unsigned short port = 9999;
+    size_t threads = std::max(std::thread::hardware_concurrency(), 1u);
+    long report_interval_s = 60;
+    size_t top = 10;
+    std::string store_directory;
+    uint32_t block_rows = 65536;
+    std::string unix_path;
+    std::string unix_packet_path;
+    bool udp = false;
+
+    for (int i = 1; i < argc; i++) {
+        std::string option = argv[i];
+        if (i + 1 >= argc) {
+            usage();
+            return 1;
+        }
+        std::string value = argv[++i];
+        try {
+            if (option == "--address") {
+                address = value;
+            } else if (option == "--port") {
+                port = (unsigned short) std::stoi(value);
+            } else if (option == "--threads") {
+                threads = std::stoul(value);
+            } else if (option == "--report-interval") {
+                report_interval_s = std::stol(value);
+            } else if (option == "--top") {
+                top = std::stoul(value);
+            } else if (option == "--store") {
+                store_directory = value;
+            } else if (option == "--block-rows") {
+                block_rows = (uint32_t) std::stoul(value);
+            } else if (option == "--unix") {
+                unix_path = value;
+            } else if (option == "--unixpacket") {
+                unix_packet_path = value;
+            } else if (option == "--udp") {
+                udp = (value == "true");
+            } else {
+                usage();
+                return 1;
+            }
+        } catch (std::exception &e) {
+            std::cerr << boost::format("Invalid value '%s' of option '%s'\n") % value % option;
+            return 1;
+        }
+    }
+
+    std::unique_ptr<EventStore> store;
+    if (!store_directory.empty()) {
+        store.reset(new EventStore(store_directory, block_rows));
+    }
+
+    Collector collector(address, port, threads);
+    collector.set_store(store.get());
+    collector.set_unix_path(unix_path);
+    collector.set_unix_packet_path(unix_packet_path);
+    collector.set_udp(udp);
+    try {
+        collector.start();
+    } catch (std::exception &e) {
+        std::cerr << boost::format("Cannot listen on %s:%s: %s\n") % address % port % e.what();
+        return 1;
+    }
+    std::cout << boost::format("Listening on %s:%s%s with %s threads\n") % address % collector.get_port()
+                 % (udp ? " (TCP and UDP)" : "") % threads;
+    for (const std::string &path : {unix_path, unix_packet_path}) {
+        if (!path.empty()) {
+            std::cout << boost::format("Listening on '%s'\n") % path;
+        }
+    }
+
+    /* The main thread only prints the reports and waits for a signal */
+    boost::asio::io_service io_service;
+    boost::asio::signal_set signals(io_service, SIGINT, SIGTERM);
+    signals.async_wait([&io_service](const boost::system::error_code &error, int signal) {
+        io_service.stop();
+    });
+
+    boost::asio::deadline_timer timer(io_service);
+    std::function<void()> schedule_report = [&]() {
+        timer.expires_from_now(boost::posix_time::seconds(std::max(report_interval_s, 1l)));
+        timer.async_wait([&](const boost::system::error_code &error) {
+            if (!error) {
+                std::cout << collector.report(top) << std::flush;
+                if (store) {
+                    /* The partitions that are not full are written too, so the queries see them */
+                    store->flush();
+                    std::cout << store->get_statistics() << std::flush;
+                }
+                schedule_report();
+            }
+        });
+    };
+    schedule_report();
+    io_service.run();
+
+    collector.stop();
+    std::cout << collector.report(top);
+    if (store) {
+        store->flush();
+        std::cout << store->get_statistics();
+    }
+    return 0;
+}
@@ -143,6 +143,25 @@ void jeff::delete_local_ref(JNIEnv &jni, jclass type) {
     ASSERT_MSG(!jni.ExceptionCheck(), "Unable to delete local reference");
 }
 
+/**
+ * Creates a new, not yet started java.lang.Thread, e.g. for jvmti.RunAgentThread.
+ * Remember to use jni.DeleteLocalRef
+ */
+jobject jeff::new_thread(JNIEnv &jni, const string name) {
+    jclass type = find_class(jni, "java/lang/Thread");
+    jmethodID constructor = get_method_id(jni, type, "<init>", "(Ljava/lang/String;)V");
+
+    jstring thread_name = jni.NewStringUTF(name.c_str());
+    ASSERT_MSG(!jni.ExceptionCheck(), "Unable to create thread name");
+
+    jobject thread = jni.NewObject(type, constructor, thread_name);
+    ASSERT_MSG(!jni.ExceptionCheck(), "Unable to create thread");
+
+    jni.DeleteLocalRef(thread_name);
+    delete_local_ref(jni, type);
+    return thread;
+}
+
 void jeff::throw_by_name(JNIEnv &jni, const string exceptionType, const string exceptionMessage) {
     jclass type = find_class(jni, exceptionType);
     /* if type is NULL, an exception has already been thrown by JVM */
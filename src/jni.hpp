@@ -46,6 +46,8 @@ namespace jeff {
 
     void delete_local_ref(JNIEnv &jni, jclass type);
 
+    jobject new_thread(JNIEnv &jni, const std::string name);
+
     JNIEnv *get_current_jni();
 
     void throw_by_name(JNIEnv &jni, const std::string exceptionType, const std::string exceptionMessage);
@@ -343,6 +343,66 @@ list<string> jeff::get_stack_trace(jvmtiEnv &jvmti, JNIEnv &jni, jthread thread,
     return lines;
 }
 
+string jeff::get_thread_state(jint state) {
+    if (state & JVMTI_THREAD_STATE_TERMINATED) {
+        return "TERMINATED";
+    }
+    if (!(state & JVMTI_THREAD_STATE_ALIVE)) {
+        return "NEW";
+    }
+    string ret;
+    if (state & JVMTI_THREAD_STATE_BLOCKED_ON_MONITOR_ENTER) {
+        ret = "BLOCKED";
+    } else if (state & JVMTI_THREAD_STATE_SLEEPING) {
+        ret = "SLEEPING";
+    } else if (state & JVMTI_THREAD_STATE_IN_OBJECT_WAIT) {
+        ret = "WAITING (on object monitor)";
+    } else if (state & JVMTI_THREAD_STATE_PARKED) {
+        ret = "WAITING (parking)";
+    } else if (state & JVMTI_THREAD_STATE_WAITING) {
+        ret = "WAITING";
+    } else {
+        ret = "RUNNABLE";
+    }
+    if (state & JVMTI_THREAD_STATE_SUSPENDED) {
+        ret += ", suspended";
+    }
+    if (state & JVMTI_THREAD_STATE_IN_NATIVE) {
+        ret += ", in native";
+    }
+    return ret;
+}
+
+/* All the stacks are taken at one safepoint, so they are consistent with each other */
+string jeff::get_thread_dump(jvmtiEnv &jvmti, JNIEnv &jni, jint max_depth) {
+    jvmtiStackInfo *stacks;
+    jint count;
+    auto error = jvmti.GetAllStackTraces(max_depth, &stacks, &count);
+    if (is_jvmti_error(jvmti, error, "Unable to get all stack traces")) {
+        return "Thread dump: unable to get all stack traces\n";
+    }
+
+    string ret = (format("Thread dump: %s threads\n") % count).str();
+    for (jint i = 0; i < count; i++) {
+        const jvmtiStackInfo &stack = stacks[i];
+        ret += (format("\"%s\" %s\n") % get_thread_name(jvmti, jni, stack.thread) % get_thread_state(stack.state)).str();
+        for (jint j = 0; j < stack.frame_count; j++) {
+            const jvmtiFrameInfo &frame = stack.frame_buffer[j];
+            /* Native frames have no line number table */
+            string location = frame.location < 0 ? "native" : get_location(jvmti, frame.method, frame.location);
+            ret += (format("\tat %s [%s]\n") % get_method_name(jvmti, frame.method) % location).str();
+        }
+        ret += "\n";
+    }
+
+    /* The stack infos and the frame buffers are one allocation, the threads are local references */
+    for (jint i = 0; i < count; i++) {
+        jni.DeleteLocalRef(stacks[i].thread);
+    }
+    deallocate(jvmti, stacks);
+    return ret;
+}
+
 string jeff::get_error_name(jvmtiEnv &jvmti, jvmtiError error, const string message) {
     char *error_name = NULL;
     jvmtiError error_ = jvmti.GetErrorName(error, &error_name);
@@ -47,6 +47,10 @@ namespace jeff {
 
     std::list<std::string> get_stack_trace(jvmtiEnv &jvmti, JNIEnv &jni, jthread thread, int depth);
 
+    std::string get_thread_state(jint state);
+
+    std::string get_thread_dump(jvmtiEnv &jvmti, JNIEnv &jni, jint max_depth);
+
     std::string get_error_name(jvmtiEnv &jvmti, jvmtiError error, const std::string message = "");
 
     void deallocate(jvmtiEnv &jvmti, void *ptr);
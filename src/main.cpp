@@ -1,13 +1,21 @@
 #include "main.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+
+#include <boost/asio/ip/host_name.hpp>
 #include <boost/format.hpp>
 
+#include "clock.hpp"
 #include "common.hpp"
 #include "jni.hpp"
 #include "jvmti.hpp"
+#include "tags.hpp"
 
 #include "GlobalAgentData.hpp"
 #include "Object.hpp"
+#include "TscClock.hpp"
 #include "Type.hpp"
 
 using namespace std;
@@ -20,8 +28,28 @@ Agent_OnLoad(JavaVM *jvm, char *options, void *reserved) {
 
 JNIEXPORT jint JNICALL
 Agent_OnAttach(JavaVM *jvm, char *options, void *reserved) {
-    std::cerr << "Not supported" << std::endl;
-    return JNI_ERR;
+    if (options != nullptr && string(options) == "detach") {
+        return detach(jvm);
+    }
+
+    if (gdata.jvmti == nullptr) {
+        jint result = init(jvm, options);
+        if (result != JNI_OK) {
+            return result;
+        }
+    } else if (gdata.agent_is_active) {
+        std::cerr << "The agent is already attached\n";
+        return JNI_ERR;
+    } else {
+        /* Attached again after a detach, the agent resumes with the configuration of the first attach */
+        if (options != nullptr && *options != '\0') {
+            std::cerr << boost::format("The agent was attached before, ignoring options '%s'\n") % options;
+        }
+        if (add_capabilities(*gdata.jvmti) != JNI_OK) {
+            return JNI_ERR;
+        }
+    }
+    return attach(jvm);
 }
 
 JNIEXPORT void JNICALL
@@ -43,28 +71,269 @@ jint get_jvmti(JavaVM *jvm, jvmtiEnv **jvmti) {
     return JNI_OK;
 }
 
+/**
+ * Options are comma separated key=value pairs, e.g.:
+ *
+ *   -agentpath:libjeff-native-agent.so=daemon=localhost:9999,alloc_sampling=524288,report_interval=60000
+ *
+ * - daemon: [tcp:]host:port, unix:path, unixpacket:path or udp:host:port of the daemon,
+ *   the standard output is used when absent (and there is no log_file); it is connected to in
+ *   the background, the messages wait in the buffer meanwhile
+ * - log_file: path of a local file the messages are appended to, along with the daemon when both are set
+ * - buffer_size: bytes of messages kept in memory while the daemon is not reachable
+ * - spill_dir: directory the messages overflowing the buffer are written to, shared by the agents on the host;
+ *   each user gets <spill_dir>-<uid>, which must be private to it (0700), otherwise spilling is disabled;
+ *   what an agent leaves there is replayed by the next one
+ * - spill_size: maximum bytes of the messages in spill_dir, 0 disables spilling
+ * - event_quota: percent of buffer_size the detail events can take, the rest is kept for the reports
+ * - overflow: drop_newest/drop_oldest/sample/block, what happens to a message that fits neither the buffer
+ *   nor spill_dir; block is only available in the debug builds
+ * - overflow_sample: with overflow=sample, one of that many overflowing messages is kept
+ * - overflow_timeout: with overflow=block, milliseconds to wait for room in the buffer
+ * - datagram_size: maximum bytes of the datagrams with udp and unixpacket
+ * - shutdown_timeout: milliseconds the VM death waits for the agent threads and for the queued messages, what is left
+ *   goes to spill_dir
+ * - alloc_sampling: average number of bytes between allocation samples, 0 disables allocation profiling
+ * - gc: true/false, monitoring of the garbage collection pauses (enabled by default)
+ * - heap_histogram: milliseconds between the heap class histograms, 0 means on demand only (SIGQUIT)
+ * - heap_histogram_top: number of classes in the heap histogram
+ * - track: semicolon separated classes (or "package.*") whose live instances are tracked, not along with
+ *   alloc_sampling (both tag the objects)
+ * - track_interval: milliseconds between the heap walks that tag new tracked instances
+ * - monitors: true/false, monitor contention profiling (disabled by default)
+ * - monitor_owners: true/false, capture the stack of the monitor owner on contention (enabled by default)
+ * - exceptions: true/false, report the exceptions with their stack traces (enabled by default)
+ * - exception_filter: semicolon separated exception classes (or "package.*") to report, all when empty
+ * - exception_budget: maximum number of exceptions reported per second, 0 means no limit
+ * - exception_catch_frames: an exception caught by one of that many callers of the throwing method is caught near
+ * - exception_near_depth: stack depth captured for the exceptions caught locally or near, 0 only counts them,
+ *   -1 captures the whole stack (the default)
+ * - exception_depth: semicolon separated class:depth (or "package.*:depth") stack depths per exception class,
+ *   ahead of exception_near_depth, e.g. java.lang.NumberFormatException:0 only counts them
+ * - stack_ids: true/false, the exceptions carry the id of their stack instead of the rendered stack trace,
+ *   the stacks are sent as the new nodes of the call tree (disabled by default); a stack id keeps the innermost
+ *   64 frames, whatever the depth, and a stack that does not fit the full call tree is rendered
+ * - threads: true/false, thread lifecycle and per-thread CPU accounting (enabled by default)
+ * - perf_map: true/false, write the JIT-compiled code to /tmp/perf-<pid>.map for Linux perf (disabled by default)
+ * - perf_map_inline: true/false, split the compiled methods into the ranges of their inlined methods
+ * - record: path of a trace of what the exception callbacks read from the VM, replayed by jeff-replay
+ * - emergency: true/false, capture the thread stacks and a heap histogram to emergency_file when the VM runs out
+ *   of memory or threads (disabled by default)
+ * - emergency_file: path of the emergency capture, /tmp/jeff-emergency-<pid>.log when empty; never the log_file,
+ *   whose sender writes to it at the same time
+ * - emergency_reserve: bytes set aside up front for formatting the emergency capture
+ * - report_interval: milliseconds between the periodic reports
+ */
 void parse_options(GlobalAgentData &data, char *options) {
-    // TODO
-//    gdata.enable_daemon_connection = true;
-    gdata.enable_daemon_connection = false;
-    gdata.daemon_host = "localhost";
-    gdata.daemon_port = "9999";
+    data.enable_daemon_connection = false;
+    data.daemon_host = "localhost";
+    data.daemon_port = "9999";
+    data.daemon_transport = "tcp";
+    data.log_file.clear();
+    data.sender_config.buffer_bytes = 8 * 1024 * 1024;
+    data.sender_config.spill_directory = "/tmp/jeff-spill";
+    data.sender_config.spill_bytes = 64 * 1024 * 1024;
+    data.sender_config.event_quota_percent = 75;
+    data.sender_config.overflow_policy = OverflowPolicy::DROP_NEWEST;
+    data.sender_config.overflow_sample_every = 10;
+    data.sender_config.overflow_timeout_ms = 100;
+    data.sender_config.datagram_bytes = 0;
+    data.shutdown_timeout_ms = 5000;
+    data.report_interval_ms = 60000;
+    data.alloc_sampling_interval = 0;
+    data.enable_gc_monitor = true;
+    data.heap_histogram_interval_ms = 0;
+    data.heap_histogram_top = 20;
+    data.tracked_classes.clear();
+    data.track_interval_ms = 60000;
+    data.enable_monitor_profiler = false;
+    data.enable_monitor_owners = true;
+    data.enable_thread_registry = true;
+    data.enable_perf_map = false;
+    data.enable_perf_map_inlining = false;
+    data.record_file.clear();
+    data.enable_emergency_capture = false;
+    data.emergency_reserve_bytes = 4 * 1024 * 1024;
+    data.emergency_file.clear();
+    data.enable_exceptions = true;
+    data.exception_budget = 0;
+    data.exception_catch_frames = 3;
+    data.exception_near_depth = ExceptionClassifier::FULL_DEPTH;
+    data.exception_depths.clear();
+    data.enable_stack_ids = false;
+    data.exception_filter = std::make_shared<const std::vector<string>>();
+
+    if (options == nullptr) {
+        return;
+    }
+
+    std::stringstream stream(options);
+    string option;
+    while (std::getline(stream, option, ',')) {
+        size_t separator = option.find('=');
+        string key = option.substr(0, separator);
+        string value = (separator == string::npos) ? "" : option.substr(separator + 1);
+
+        try {
+            if (key == "daemon") {
+                /* An optional transport prefix, e.g. "unix:/run/jeff.sock" or "udp:localhost:9999" */
+                data.enable_daemon_connection = true;
+                for (const char *transport : {"tcp", "unix", "unixpacket", "udp"}) {
+                    string prefix = string(transport) + ":";
+                    if (value.compare(0, prefix.size(), prefix) == 0) {
+                        data.daemon_transport = transport;
+                        value = value.substr(prefix.size());
+                    }
+                }
+                if (data.daemon_transport == "unix" || data.daemon_transport == "unixpacket") {
+                    data.daemon_host = value;
+                    continue;
+                }
+                size_t port_separator = value.rfind(':');
+                data.daemon_host = value.substr(0, port_separator);
+                if (port_separator != string::npos) {
+                    data.daemon_port = value.substr(port_separator + 1);
+                }
+            } else if (key == "log_file") {
+                data.log_file = value;
+            } else if (key == "buffer_size") {
+                data.sender_config.buffer_bytes = std::stoul(value);
+            } else if (key == "spill_dir") {
+                data.sender_config.spill_directory = value;
+            } else if (key == "spill_size") {
+                data.sender_config.spill_bytes = std::stoul(value);
+            } else if (key == "event_quota") {
+                data.sender_config.event_quota_percent = (unsigned int) std::stoul(value);
+            } else if (key == "overflow") {
+                if (value == "drop_newest") {
+                    data.sender_config.overflow_policy = OverflowPolicy::DROP_NEWEST;
+                } else if (value == "drop_oldest") {
+                    data.sender_config.overflow_policy = OverflowPolicy::DROP_OLDEST;
+                } else if (value == "sample") {
+                    data.sender_config.overflow_policy = OverflowPolicy::SAMPLE;
+                } else if (value == "block") {
+#ifdef NDEBUG
+                    std::cerr << "The overflow policy 'block' is only available in the debug builds\n";
+#else
+                    data.sender_config.overflow_policy = OverflowPolicy::BLOCK;
+#endif
+                } else {
+                    std::cerr << boost::format("Invalid value '%s' of option '%s'\n") % value % key;
+                }
+            } else if (key == "overflow_sample") {
+                data.sender_config.overflow_sample_every = std::max(1u, (unsigned int) std::stoul(value));
+            } else if (key == "overflow_timeout") {
+                data.sender_config.overflow_timeout_ms = std::stol(value);
+            } else if (key == "datagram_size") {
+                data.sender_config.datagram_bytes = std::stoul(value);
+            } else if (key == "shutdown_timeout") {
+                data.shutdown_timeout_ms = std::stol(value);
+            } else if (key == "alloc_sampling") {
+                data.alloc_sampling_interval = std::stoi(value);
+            } else if (key == "gc") {
+                data.enable_gc_monitor = (value == "true" || value == "1");
+            } else if (key == "heap_histogram") {
+                data.heap_histogram_interval_ms = std::stol(value);
+            } else if (key == "heap_histogram_top") {
+                data.heap_histogram_top = std::stoi(value);
+            } else if (key == "track") {
+                std::stringstream classes(value);
+                string name;
+                while (std::getline(classes, name, ';')) {
+                    if (!name.empty()) {
+                        data.tracked_classes.push_back(name);
+                    }
+                }
+            } else if (key == "track_interval") {
+                data.track_interval_ms = std::stol(value);
+            } else if (key == "monitors") {
+                data.enable_monitor_profiler = (value == "true" || value == "1");
+            } else if (key == "monitor_owners") {
+                data.enable_monitor_owners = (value == "true" || value == "1");
+            } else if (key == "exceptions") {
+                data.enable_exceptions = (value == "true" || value == "1");
+            } else if (key == "exception_filter") {
+                data.exception_filter = parse_exception_filter(value);
+            } else if (key == "exception_budget") {
+                data.exception_budget = std::stol(value);
+            } else if (key == "exception_catch_frames") {
+                data.exception_catch_frames = std::stoi(value);
+            } else if (key == "exception_near_depth") {
+                data.exception_near_depth = std::stoi(value);
+            } else if (key == "exception_depth") {
+                data.exception_depths = parse_exception_depths(value);
+            } else if (key == "stack_ids") {
+                data.enable_stack_ids = (value == "true" || value == "1");
+            } else if (key == "threads") {
+                data.enable_thread_registry = (value == "true" || value == "1");
+            } else if (key == "perf_map") {
+                data.enable_perf_map = (value == "true" || value == "1");
+            } else if (key == "perf_map_inline") {
+                data.enable_perf_map_inlining = (value == "true" || value == "1");
+            } else if (key == "record") {
+                data.record_file = value;
+            } else if (key == "emergency") {
+                data.enable_emergency_capture = (value == "true" || value == "1");
+            } else if (key == "emergency_file") {
+                data.emergency_file = value;
+            } else if (key == "emergency_reserve") {
+                data.emergency_reserve_bytes = std::stoul(value);
+            } else if (key == "report_interval") {
+                data.report_interval_ms = std::stol(value);
+            } else if (!key.empty()) {
+                std::cerr << boost::format("Unknown option '%s'\n") % key;
+            }
+        } catch (std::exception &e) {
+            std::cerr << boost::format("Invalid value '%s' of option '%s'\n") % value % key;
+        }
+    }
 }
 
-jint init(JavaVM *jvm, char *options) {
-    jvmtiEnv *jvmti;
-    jint result = get_jvmti(jvm, &jvmti);
-    if (result == JNI_ERR) {
-        return JNI_ERR;
+/* Semicolon separated class names or "package.*" prefixes, to JVM signature patterns */
+std::shared_ptr<const std::vector<string>> parse_exception_filter(const string &value) {
+    std::shared_ptr<std::vector<string>> patterns = std::make_shared<std::vector<string>>();
+    std::stringstream classes(value);
+    string name;
+    while (std::getline(classes, name, ';')) {
+        if (!name.empty()) {
+            patterns->push_back(to_signature_pattern(name));
+        }
     }
-    parse_options(gdata, options);
+    return patterns;
+}
 
-    /* Setup initial global agent data area */
-    gdata.jvm = jvm;
-    gdata.jvmti = jvmti;
+/* Semicolon separated class:depth rules, the classes as in the exception filter */
+std::vector<ExceptionClassifier::Rule> parse_exception_depths(const string &value) {
+    std::vector<ExceptionClassifier::Rule> rules;
+    std::stringstream classes(value);
+    string rule;
+    while (std::getline(classes, rule, ';')) {
+        size_t separator = rule.rfind(':');
+        if (separator == string::npos || separator == 0) {
+            std::cerr << boost::format("Invalid exception depth '%s', expected class:depth\n") % rule;
+            continue;
+        }
+        ExceptionClassifier::Rule parsed = {to_signature_pattern(rule.substr(0, separator)),
+                                            (jint) std::stoi(rule.substr(separator + 1))};
+        rules.push_back(parsed);
+    }
+    return rules;
+}
 
-    //print_possible_capabilities(*jvmti);
+/* Keeps only the capabilities that are also present in the mask */
+void intersect_capabilities(jvmtiCapabilities &capabilities, const jvmtiCapabilities &mask) {
+    unsigned char *bytes = reinterpret_cast<unsigned char *>(&capabilities);
+    const unsigned char *mask_bytes = reinterpret_cast<const unsigned char *>(&mask);
+    for (size_t i = 0; i < sizeof(jvmtiCapabilities); i++) {
+        bytes[i] &= mask_bytes[i];
+    }
+}
 
+/**
+ * Adds the capabilities needed by the enabled features, in the OnLoad or in the live phase.
+ * The features that need a capability the VM can not give are disabled.
+ */
+jint add_capabilities(jvmtiEnv &jvmti) {
     /* Immediately after getting the jvmti* we need to ask for the
      *   capabilities this agent will need. In this case we need to make
      *   sure that we can get all class load hooks.
@@ -89,8 +358,185 @@ jint init(JavaVM *jvm, char *options) {
 
     jvmtiError error;
 
-    error = jvmti->AddCapabilities(&capabilities);
-    if (is_jvmti_error(*jvmti, error, "Unable to get necessary JVMTI capabilities")) return JNI_ERR;
+    jvmtiCapabilities potentialCapabilities = {0};
+    error = jvmti.GetPotentialCapabilities(&potentialCapabilities);
+    if (is_jvmti_error(jvmti, error, "Unable to get potential JVMTI capabilities")) return JNI_ERR;
+
+    /* Some of them are only available in the OnLoad phase, the features that need them are not used */
+    intersect_capabilities(capabilities, potentialCapabilities);
+
+    if (gdata.alloc_sampling_interval > 0 && !gdata.tracked_classes.empty()) {
+        /* An object has a single tag, a sampled instance of a tracked class would not be counted */
+        std::cerr << "Allocation sampling is not available along with track, both tag the objects\n";
+        gdata.alloc_sampling_interval = 0;
+    }
+    if (gdata.alloc_sampling_interval > 0) {
+#ifdef JEFF_HAVE_SAMPLED_OBJECT_ALLOC
+        if (potentialCapabilities.can_generate_sampled_object_alloc_events) {
+            capabilities.can_generate_sampled_object_alloc_events = 1;
+            capabilities.can_generate_object_free_events = 1;
+        } else {
+            std::cerr << "Allocation sampling is not supported by this JVM, JDK 11 or newer is required\n";
+            gdata.alloc_sampling_interval = 0;
+        }
+#else
+        std::cerr << "Allocation sampling is not supported by this build of the agent\n";
+        gdata.alloc_sampling_interval = 0;
+#endif
+    }
+
+    if (!gdata.tracked_classes.empty()) {
+        if (potentialCapabilities.can_generate_object_free_events) {
+            capabilities.can_generate_object_free_events = 1;
+        } else {
+            std::cerr << "Object free events are not supported by this JVM, instances are not tracked\n";
+            gdata.tracked_classes.clear();
+        }
+    }
+
+    if (gdata.enable_monitor_profiler) {
+        if (potentialCapabilities.can_generate_monitor_events) {
+            capabilities.can_generate_monitor_events = 1;
+        } else {
+            std::cerr << "Monitor events are not supported by this JVM\n";
+            gdata.enable_monitor_profiler = false;
+        }
+        if (gdata.enable_monitor_owners && potentialCapabilities.can_get_monitor_info) {
+            capabilities.can_get_monitor_info = 1;
+        } else {
+            gdata.enable_monitor_owners = false;
+        }
+    }
+
+    if (gdata.enable_thread_registry) {
+        /* The lifecycle is still recorded without the CPU times */
+        if (potentialCapabilities.can_get_thread_cpu_time && potentialCapabilities.can_get_current_thread_cpu_time) {
+            capabilities.can_get_thread_cpu_time = 1;
+            capabilities.can_get_current_thread_cpu_time = 1;
+        } else {
+            std::cerr << "Thread CPU time is not supported by this JVM\n";
+        }
+    }
+
+    if (gdata.enable_perf_map) {
+        if (potentialCapabilities.can_generate_compiled_method_load_events) {
+            capabilities.can_generate_compiled_method_load_events = 1;
+        } else {
+            std::cerr << "Compiled method events are not supported by this JVM, there is no perf map\n";
+            gdata.enable_perf_map = false;
+        }
+    }
+
+    if (gdata.enable_gc_monitor) {
+        if (potentialCapabilities.can_generate_garbage_collection_events) {
+            capabilities.can_generate_garbage_collection_events = 1;
+        } else {
+            std::cerr << "Garbage collection events are not supported by this JVM\n";
+            gdata.enable_gc_monitor = false;
+        }
+    }
+
+    error = jvmti.AddCapabilities(&capabilities);
+    if (is_jvmti_error(jvmti, error, "Unable to get necessary JVMTI capabilities")) return JNI_ERR;
+
+    gdata.capabilities = capabilities;
+    return JNI_OK;
+}
+
+
+/**
+ * Creates the components of the enabled features that do not exist yet, with their periodic reports.
+ * The components are never destroyed, a disabled feature only stops its events and reports.
+ */
+void create_components() {
+    if (gdata.alloc_sampling_interval > 0 && gdata.allocation_sampler == nullptr) {
+        gdata.allocation_sampler.reset(
+                new AllocationSampler(*gdata.classes, *gdata.stacks, gdata.alloc_sampling_interval));
+        gdata.reporter->schedule("allocation profile", gdata.report_interval_ms, [](jvmtiEnv &jvmti, JNIEnv &jni) {
+            if (gdata.alloc_sampling_interval > 0) {
+                gdata.sender->send(gdata.allocation_sampler->report(jvmti), MessageType::REPORT);
+            }
+        });
+    }
+
+    if (gdata.enable_gc_monitor && gdata.gc_monitor == nullptr) {
+        gdata.gc_monitor.reset(new GcMonitor());
+        gdata.reporter->schedule("gc", gdata.report_interval_ms, [](jvmtiEnv &jvmti, JNIEnv &jni) {
+            if (gdata.enable_gc_monitor) {
+                gdata.sender->send(gdata.gc_monitor->report(jni), MessageType::REPORT);
+            }
+        });
+    }
+
+    if (!gdata.tracked_classes.empty() && gdata.instance_tracker == nullptr) {
+        gdata.instance_tracker.reset(new InstanceTracker(*gdata.classes, gdata.tracked_classes));
+        gdata.reporter->schedule("tracked instances", gdata.track_interval_ms, [](jvmtiEnv &jvmti, JNIEnv &jni) {
+            gdata.sender->send(gdata.instance_tracker->report(jvmti, jni), MessageType::REPORT);
+        });
+    }
+
+    if (gdata.enable_monitor_profiler && gdata.monitor_profiler == nullptr) {
+        gdata.monitor_profiler.reset(new MonitorProfiler(*gdata.classes, *gdata.stacks, gdata.enable_monitor_owners, 10));
+        gdata.reporter->schedule("monitor contention", gdata.report_interval_ms, [](jvmtiEnv &jvmti, JNIEnv &jni) {
+            if (gdata.enable_monitor_profiler) {
+                gdata.sender->send(gdata.monitor_profiler->report(jvmti), MessageType::REPORT);
+            }
+        });
+    }
+
+    if (gdata.enable_perf_map && gdata.perf_map == nullptr) {
+        string path = (boost::format("/tmp/perf-%d.map") % get_process_id()).str();
+        gdata.perf_map.reset(new PerfMap(path, gdata.enable_perf_map_inlining));
+        gdata.reporter->schedule("perf map", gdata.report_interval_ms, [](jvmtiEnv &jvmti, JNIEnv &jni) {
+            gdata.sender->send(gdata.perf_map->report(), MessageType::REPORT);
+        });
+    }
+
+    if (gdata.enable_emergency_capture && gdata.emergency_capture == nullptr) {
+        string path = gdata.emergency_file;
+        if (!path.empty() && path == gdata.log_file) {
+            std::cerr << boost::format("The emergency capture can not share the log file '%s'\n") % path;
+            path.clear();
+        }
+        if (path.empty()) {
+            path = (boost::format("/tmp/jeff-emergency-%d.log") % get_process_id()).str();
+        }
+        gdata.emergency_capture.reset(new EmergencyCapture(path, gdata.emergency_reserve_bytes, *gdata.classes,
+                                                           (size_t) gdata.heap_histogram_top));
+    }
+
+    if (gdata.enable_thread_registry && gdata.thread_registry == nullptr) {
+        gdata.thread_registry.reset(new ThreadRegistry(4096, 10));
+        gdata.reporter->schedule("threads", gdata.report_interval_ms, [](jvmtiEnv &jvmti, JNIEnv &jni) {
+            if (gdata.enable_thread_registry) {
+                gdata.sender->send(gdata.thread_registry->report(jvmti, jni), MessageType::REPORT);
+            }
+        });
+    }
+}
+
+/* How often the TSC clock is anchored again, along with a Clock record for the collector */
+static const jlong CLOCK_ANCHOR_MS = 10000;
+
+jint init(JavaVM *jvm, char *options) {
+    jvmtiEnv *jvmti;
+    jint result = get_jvmti(jvm, &jvmti);
+    if (result == JNI_ERR) {
+        return JNI_ERR;
+    }
+    parse_options(gdata, options);
+
+    /* Setup initial global agent data area */
+    gdata.jvm = jvm;
+    gdata.jvmti = jvmti;
+
+    //print_possible_capabilities(*jvmti);
+
+    if (add_capabilities(*jvmti) != JNI_OK) {
+        return JNI_ERR;
+    }
+
+    jvmtiError error;
 
     /* Next we need to provide the pointers to the callback functions to this jvmti */
     error = jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_VM_START, (jthread) NULL);
@@ -119,6 +565,25 @@ jint init(JavaVM *jvm, char *options) {
 
     callbacks.ResourceExhausted = &ResourceExhaustedCallback; /* JVMTI_EVENT_RESOURCE_EXHAUSTED */
 
+    callbacks.ObjectFree = &ObjectFreeCallback; /* JVMTI_EVENT_OBJECT_FREE */
+
+    callbacks.GarbageCollectionStart = &GarbageCollectionStartCallback;   /* JVMTI_EVENT_GARBAGE_COLLECTION_START */
+    callbacks.GarbageCollectionFinish = &GarbageCollectionFinishCallback; /* JVMTI_EVENT_GARBAGE_COLLECTION_FINISH */
+
+    callbacks.DataDumpRequest = &DataDumpRequestCallback; /* JVMTI_EVENT_DATA_DUMP_REQUEST */
+
+    callbacks.MonitorContendedEnter = &MonitorContendedEnterCallback;     /* JVMTI_EVENT_MONITOR_CONTENDED_ENTER */
+    callbacks.MonitorContendedEntered = &MonitorContendedEnteredCallback; /* JVMTI_EVENT_MONITOR_CONTENDED_ENTERED */
+    callbacks.MonitorWait = &MonitorWaitCallback;                         /* JVMTI_EVENT_MONITOR_WAIT */
+    callbacks.MonitorWaited = &MonitorWaitedCallback;                     /* JVMTI_EVENT_MONITOR_WAITED */
+#ifdef JEFF_HAVE_SAMPLED_OBJECT_ALLOC
+    callbacks.SampledObjectAlloc = &SampledObjectAllocCallback; /* JVMTI_EVENT_SAMPLED_OBJECT_ALLOC */
+#endif
+
+    callbacks.CompiledMethodLoad = &CompiledMethodLoadCallback;     /* JVMTI_EVENT_COMPILED_METHOD_LOAD */
+    callbacks.CompiledMethodUnload = &CompiledMethodUnloadCallback; /* JVMTI_EVENT_COMPILED_METHOD_UNLOAD */
+    callbacks.DynamicCodeGenerated = &DynamicCodeGeneratedCallback; /* JVMTI_EVENT_DYNAMIC_CODE_GENERATED */
+
     error = jvmti->SetEventCallbacks(&callbacks, (jint) sizeof(callbacks));
     if (is_jvmti_error(*jvmti, error, "Cannot set jvmti callbacks")) return JNI_ERR;
 
@@ -127,15 +592,72 @@ jint init(JavaVM *jvm, char *options) {
     error = jvmti->CreateRawMonitor("agent data", &(gdata.lock));
     if (is_jvmti_error(*jvmti, error, "Cannot create raw monitor")) return JNI_ERR;
 
+    gdata.classes.reset(new ClassRegistry(*jvmti, 16 * 1024));
+    gdata.stacks.reset(new StackRegistry(128 * 1024));
+    gdata.reporter.reset(new Reporter());
+
+    TscClock::calibrate();
+    gdata.reporter->schedule("clock", CLOCK_ANCHOR_MS, [](jvmtiEnv &jvmti, JNIEnv &jni) {
+        TscClock::anchor();
+        gdata.sender->send(TscClock::get_record(), MessageType::REPORT);
+    });
+
+    gdata.heap_histogram.reset(new HeapHistogram(*gdata.classes, (size_t) gdata.heap_histogram_top));
+    gdata.reporter->schedule("heap histogram", gdata.heap_histogram_interval_ms, [](jvmtiEnv &jvmti, JNIEnv &jni) {
+        gdata.sender->send(gdata.heap_histogram->capture(jvmti, jni), MessageType::REPORT);
+    });
+    gdata.reporter->schedule("stacks", gdata.report_interval_ms, [](jvmtiEnv &jvmti, JNIEnv &jni) {
+        send_stack_nodes(jvmti);
+        if (gdata.enable_stack_ids) {
+            gdata.sender->send(gdata.stacks->get_statistics(), MessageType::REPORT);
+        }
+    });
+    gdata.reporter->schedule("sender", gdata.report_interval_ms, [](jvmtiEnv &jvmti, JNIEnv &jni) {
+        string statistics = gdata.sender->get_statistics();
+        if (!statistics.empty()) {
+            gdata.sender->send(statistics, MessageType::REPORT);
+        }
+    });
+    gdata.exception_limiter.reset(new RateLimiter(gdata.exception_budget));
+    gdata.exception_classifier.reset(new ExceptionClassifier(*gdata.classes, 16 * 1024, gdata.exception_catch_frames,
+                                                             gdata.exception_near_depth, gdata.exception_depths));
+    gdata.reporter->schedule("exception counts", gdata.report_interval_ms, [](jvmtiEnv &jvmti, JNIEnv &jni) {
+        string counts = gdata.exception_classifier->report();
+        if (!counts.empty()) {
+            gdata.sender->send(counts, MessageType::REPORT);
+        }
+    });
+
+    if (!gdata.record_file.empty()) {
+        gdata.trace_recorder.reset(new TraceRecorder(gdata.record_file));
+        if (gdata.trace_recorder->start(*jvmti)) {
+            gdata.reporter->schedule("trace", gdata.report_interval_ms, [](jvmtiEnv &jvmti, JNIEnv &jni) {
+                gdata.sender->send(gdata.trace_recorder->report(), MessageType::REPORT);
+            });
+        } else {
+            gdata.trace_recorder.reset();
+        }
+    }
+
+    create_components();
+
+    /* Already in the OnLoad phase, the interpreter and the stubs are generated before the VM starts */
+    if (gdata.perf_map != nullptr && gdata.perf_map->start(*jvmti) != JVMTI_ERROR_NONE) {
+        return JNI_ERR;
+    }
+
     std::cout << "The agent init phase successful\n";
     return JNI_OK;
 }
 
-jint live(jvmtiEnv &jvmti) {
+jint live(jvmtiEnv &jvmti, JNIEnv &jni) {
     jvmtiError error;
 
-    error = jvmti.SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_EXCEPTION, (jthread) NULL);
-    if (is_jvmti_error(jvmti, error, "Cannot set event notification: JVMTI_EVENT_EXCEPTION")) return error;
+    /* Not available when attached in the live phase */
+    if (gdata.enable_exceptions && gdata.capabilities.can_generate_exception_events) {
+        error = jvmti.SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_EXCEPTION, (jthread) NULL);
+        if (is_jvmti_error(jvmti, error, "Cannot set event notification: JVMTI_EVENT_EXCEPTION")) return error;
+    }
 
 //    error = jvmti.SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_EXCEPTION_CATCH, (jthread) NULL);
 //    if (is_jvmti_error(jvmti, error, "Cannot set event notification: JVMTI_EVENT_EXCEPTION_CATCH")) return error;
@@ -146,40 +668,491 @@ jint live(jvmtiEnv &jvmti) {
 //    error = jvmti.SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_METHOD_EXIT, (jthread) NULL);
 //    if (is_jvmti_error(jvmti, error, "Cannot set event notification: JVMTI_EVENT_METHOD_EXIT")) return error;
 
-//    error = jvmti.SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_THREAD_START, (jthread) NULL);
-//    if (is_jvmti_error(jvmti, error, "Cannot set event notification: JVMTI_EVENT_THREAD_START")) return error;
-
-//    error = jvmti.SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_THREAD_END, (jthread) NULL);
-//    if (is_jvmti_error(jvmti, error, "Cannot set event notification: JVMTI_EVENT_THREAD_END")) return error;
-
 //    error = jvmti.SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_RESOURCE_EXHAUSTED, (jthread) NULL);
 //    if (is_jvmti_error(jvmti, error, "Cannot set event notification: JVMTI_EVENT_RESOURCE_EXHAUSTED")) return JNI_ERR;
 
+    if (gdata.allocation_sampler != nullptr && gdata.alloc_sampling_interval > 0) {
+        error = gdata.allocation_sampler->start(jvmti);
+        if (error != JVMTI_ERROR_NONE) return error;
+    }
+
+    if (gdata.gc_monitor != nullptr && gdata.enable_gc_monitor) {
+        error = gdata.gc_monitor->start(jvmti);
+        if (error != JVMTI_ERROR_NONE) return error;
+    }
+
+    if (gdata.instance_tracker != nullptr) {
+        error = gdata.instance_tracker->start(jvmti);
+        if (error != JVMTI_ERROR_NONE) return error;
+    }
+
+    if (gdata.monitor_profiler != nullptr && gdata.enable_monitor_profiler) {
+        error = gdata.monitor_profiler->start(jvmti);
+        if (error != JVMTI_ERROR_NONE) return error;
+    }
+
+    if (gdata.thread_registry != nullptr && gdata.enable_thread_registry) {
+        error = gdata.thread_registry->start(jvmti, jni);
+        if (error != JVMTI_ERROR_NONE) return error;
+    }
+
+    error = jvmti.SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_DATA_DUMP_REQUEST, (jthread) NULL);
+    if (is_jvmti_error(jvmti, error, "Cannot set event notification: JVMTI_EVENT_DATA_DUMP_REQUEST")) return error;
+
     std::cout << "The JEFF agent is live.\n";
     return JNI_OK;
 }
 
-/* Callback for JVMTI_EVENT_VM_START */
-void JNICALL VMStartCallback(jvmtiEnv *jvmti, JNIEnv *env) {
+/* Disables the events enabled by live(), the callbacks already in progress may still finish */
+void stop_events(jvmtiEnv &jvmti) {
+    if (gdata.allocation_sampler != nullptr) {
+        gdata.allocation_sampler->stop(jvmti);
+    }
+    if (gdata.gc_monitor != nullptr) {
+        gdata.gc_monitor->stop(jvmti);
+    }
+    if (gdata.instance_tracker != nullptr) {
+        gdata.instance_tracker->stop(jvmti);
+    }
+    if (gdata.monitor_profiler != nullptr) {
+        gdata.monitor_profiler->stop(jvmti);
+    }
+    if (gdata.thread_registry != nullptr) {
+        gdata.thread_registry->stop(jvmti);
+    }
+    if (gdata.perf_map != nullptr) {
+        gdata.perf_map->stop(jvmti);
+    }
+    if (gdata.capabilities.can_generate_exception_events) {
+        jvmti.SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_EXCEPTION, (jthread) NULL);
+    }
+    jvmti.SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_DATA_DUMP_REQUEST, (jthread) NULL);
+}
+
+/* The call tree nodes of the stacks that were not sent yet, "<id> <parent id> <method> [<location>]" */
+void send_stack_nodes(jvmtiEnv &jvmti) {
+    string nodes = gdata.stacks->get_new_nodes(jvmti);
+    if (!nodes.empty()) {
+        gdata.sender->send((boost::format("Stack nodes: %d in total\n%s") % gdata.stacks->size() % nodes).str(),
+                           MessageType::REPORT);
+    }
+}
+
+/**
+ * Creates and starts the sender without waiting for the daemon: the resolve and the connect run on
+ * the sender threads, the messages sent meanwhile wait in the sender buffer (see buffer_size).
+ * Never fails the VM start, a sink that can not be created is left out, and without any the messages
+ * go to the standard output.
+ */
+void start_sender() {
+    boost::system::error_code error;
+    string host_name = boost::asio::ip::host_name(error);
+    gdata.sender_config.greeting = (boost::format("JVM %d@%s\n") % get_process_id() % host_name).str();
+
+    std::vector<std::unique_ptr<Sender>> sinks;
+    try {
+        if (gdata.enable_daemon_connection && gdata.daemon_transport == "tcp") {
+            sinks.push_back(Sender::create(gdata.daemon_host, gdata.daemon_port, gdata.sender_config));
+        } else if (gdata.enable_daemon_connection) {
+            SocketTransport transport = (gdata.daemon_transport == "udp") ? SocketTransport::UDP
+                                      : (gdata.daemon_transport == "unixpacket") ? SocketTransport::UNIX_SEQPACKET
+                                      : SocketTransport::UNIX_STREAM;
+            sinks.push_back(Sender::create(transport, gdata.daemon_host, gdata.daemon_port, gdata.sender_config));
+        }
+    } catch (std::exception &e) {
+        std::cerr << boost::format("Cannot create the sender to the daemon %s:%s: %s\n")
+                     % gdata.daemon_host % gdata.daemon_port % e.what();
+    }
+    if (!gdata.log_file.empty()) {
+        sinks.push_back(Sender::create_file(gdata.log_file, gdata.sender_config));
+    }
+    gdata.sender = sinks.empty() ? Sender::create() : Sender::create(std::move(sinks));
+    gdata.sender->set_command_handler([](const string &command) {
+        /* JVMTI can not be used on the sender thread, the commands are applied on the reporter thread */
+        bool accepted = gdata.reporter->submit(*gdata.jvmti, "command", [command](jvmtiEnv &jvmti, JNIEnv &jni) {
+            gdata.sender->send(execute_command(jvmti, jni, command), MessageType::REPORT);
+        });
+        if (!accepted) {
+            gdata.sender->send((boost::format("error: %s: the agent is not running\n") % command).str(),
+                               MessageType::REPORT);
+        }
+    });
+    try {
+        gdata.sender->start();
+    } catch (std::exception &e) {
+        /* E.g. out of threads, the sinks that started are stopped along with the sender */
+        std::cerr << boost::format("Cannot start the sender, using the standard output: %s\n") % e.what();
+        gdata.sender = Sender::create();
+        gdata.sender->start();
+    }
+    /* The wall clock of the timestamps before the first anchor */
+    gdata.sender->send(TscClock::get_record(), MessageType::REPORT);
+}
+
+/* Clears the tags of the sampled and tracked objects, the class tags are kept */
+jint JNICALL untag_object(jlong class_tag, jlong size, jlong *tag_ptr, jint length, void *user_data) {
+    TagKind kind = get_tag_kind(*tag_ptr);
+    if (kind == TagKind::Sample || kind == TagKind::Instance) {
+        *tag_ptr = 0;
+    }
+    return JVMTI_VISIT_OBJECTS;
+}
+
+/* Drops the object tags and the state of the sampled, tracked and registered objects, the reporter is stopped */
+void clear_state(jvmtiEnv &jvmti, JNIEnv &jni) {
+    if (gdata.allocation_sampler != nullptr || gdata.instance_tracker != nullptr) {
+        jvmtiHeapCallbacks callbacks = {0};
+        callbacks.heap_iteration_callback = &untag_object;
+        jvmtiError error = jvmti.IterateThroughHeap(JVMTI_HEAP_FILTER_UNTAGGED, nullptr, &callbacks, nullptr);
+        is_jvmti_error(jvmti, error, "Unable to clear the object tags");
+
+        if (gdata.allocation_sampler != nullptr) {
+            gdata.allocation_sampler->clear();
+        }
+        if (gdata.instance_tracker != nullptr) {
+            gdata.instance_tracker->clear();
+        }
+    }
+    if (gdata.thread_registry != nullptr) {
+        gdata.thread_registry->clear(jvmti, jni);
+    }
+}
+
+/**
+ * Makes the agent live in an already running VM: does the work of VMStart and VMInit,
+ * which are never sent to an agent attached in the live phase.
+ */
+jint attach(JavaVM *jvm) {
+    jvmtiEnv *jvmti = gdata.jvmti;
+    JNIEnv *jni;
+    if (jvm->GetEnv((void **) &jni, JNI_VERSION_1_6) != JNI_OK) {
+        std::cerr << "Unable to access JNI in Agent_OnAttach\n";
+        return JNI_ERR;
+    }
+
+    /* The reporter that outlived the detach may still use the sender and the state */
+    if (gdata.detach_is_pending) {
+        if (gdata.reporter->is_running(*jvmti)) {
+            std::cerr << "The reporter of the previous attach is still running, the agent is not attached again\n";
+            return JNI_ERR;
+        }
+        clear_state(*jvmti, *jni);
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(gdata.shutdown_timeout_ms);
+        std::cout << gdata.sender->drain(deadline);
+        gdata.detach_is_pending = false;
+    }
+
+    jint result = JNI_OK;
     enter_critical_section(jvmti);
     {
-        /* The VM has started. */
         gdata.vm_is_started = JNI_TRUE;
+        gdata.vm_is_initialized = JNI_TRUE;
+
+        /* Disabled by the previous detach */
+        jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_VM_DEATH, (jthread) NULL);
+
+        start_sender();
+
+        if (live(*jvmti, *jni) != JNI_OK) {
+            result = JNI_ERR;
+        }
+        /* The code compiled before the attach, and again after a detach */
+        if (result == JNI_OK && gdata.perf_map != nullptr
+            && (gdata.perf_map->start(*jvmti) != JVMTI_ERROR_NONE
+                || gdata.perf_map->generate_events(*jvmti) != JVMTI_ERROR_NONE)) {
+            result = JNI_ERR;
+        }
+        if (result == JNI_OK && gdata.reporter->start(*jvmti, *jni) != JVMTI_ERROR_NONE) {
+            result = JNI_ERR;
+        }
+        /* Not worth failing the attach for */
+        if (result == JNI_OK && gdata.emergency_capture != nullptr) {
+            gdata.emergency_capture->start(*jvmti, *jni);
+        }
+
+        if (result == JNI_OK) {
+            gdata.agent_is_active = true;
+            gdata.sender->send("Agent attached (Agent_OnAttach)\n", MessageType::REPORT);
+        } else {
+            stop_events(*jvmti);
+            jvmti->RelinquishCapabilities(&gdata.capabilities);
+        }
+    }
+    exit_critical_section(jvmti);
+    return result;
+}
+
+/**
+ * Returns the VM to the state before the attach, when the agent is loaded again with the "detach" option:
+ * disables the events, reports what is still buffered, drops the object tags that would otherwise
+ * be processed by every GC, and relinquishes the capabilities, so the agent costs nothing until
+ * it is attached again. A reporter task that does not finish in time keeps the state, the sender and
+ * the capabilities until the next attach, which is refused while the task still runs.
+ */
+jint detach(JavaVM *jvm) {
+    jvmtiEnv *jvmti = gdata.jvmti;
+    if (jvmti == nullptr || !gdata.agent_is_active) {
+        std::cerr << "The agent is not attached\n";
+        return JNI_ERR;
+    }
+    JNIEnv *jni;
+    if (jvm->GetEnv((void **) &jni, JNI_VERSION_1_6) != JNI_OK) {
+        std::cerr << "Unable to access JNI in Agent_OnAttach\n";
+        return JNI_ERR;
+    }
+
+    enter_critical_section(jvmti);
+    {
+        gdata.agent_is_active = false;
+        stop_events(*jvmti);
+        jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_VM_DEATH, (jthread) NULL);
+    }
+    exit_critical_section(jvmti);
+
+    jlong deadline_ms = monotonic_millis() + gdata.shutdown_timeout_ms;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(gdata.shutdown_timeout_ms);
+
+    /* The reporter is stopped first, so its state can be drained and cleared from this thread */
+    bool stopped = gdata.reporter->stop(*jvmti, deadline_ms);
+    if (gdata.emergency_capture != nullptr) {
+        gdata.emergency_capture->stop(*jvmti, deadline_ms);
+    }
+    if (!stopped) {
+        /* Its task still uses the state, the sender and the capabilities; they are left to the next attach */
+        gdata.detach_is_pending = true;
+        gdata.sender->send("Agent detached, the reporter did not stop\n", MessageType::REPORT);
+        std::cout << "The JEFF agent is detached, its state is cleared when it is attached again.\n";
+        return JNI_OK;
+    }
+
+    gdata.reporter->flush(*jvmti, *jni);
+    clear_state(*jvmti, *jni);
+    if (gdata.sender != nullptr) {
+        gdata.sender->send("Agent detached\n", MessageType::REPORT);
+        /* What the daemon did not take in time is spilled to the disk, as at the VM death */
+        std::cout << gdata.sender->drain(deadline);
+    }
+
+    jvmtiError error = jvmti->RelinquishCapabilities(&gdata.capabilities);
+    is_jvmti_error(*jvmti, error, "Unable to relinquish the JVMTI capabilities");
 
-        if (gdata.enable_daemon_connection) {
+    std::cout << "The JEFF agent is detached.\n";
+    return JNI_OK;
+}
+
+/* Used when allocation sampling is enabled by a command without an interval */
+static const jint DEFAULT_ALLOC_SAMPLING_INTERVAL = 512 * 1024;
+
+/* Stack depth of the thread dumps */
+static const jint THREAD_DUMP_DEPTH = 128;
+
+/* The report tasks that follow the report_interval option */
+static const char *const REPORT_TASKS[] = {"allocation profile", "gc", "monitor contention", "threads", "perf map",
+                                           "stacks", "exception counts", "sender", "trace"};
+
+/* The features that can be enabled and disabled by the daemon */
+static const char *const FEATURES[] = {"alloc_sampling", "gc", "monitors", "threads", "exceptions"};
+
+/* Checks that the VM can give the capabilities a feature needs, before anything is changed */
+bool is_feature_available(jvmtiEnv &jvmti, const string &feature) {
+    jvmtiCapabilities potential = {0};
+    if (jvmti.GetPotentialCapabilities(&potential) != JVMTI_ERROR_NONE) {
+        return false;
+    }
+    if (feature == "exceptions") {
+        return potential.can_generate_exception_events == 1;
+    } else if (feature == "alloc_sampling") {
+#ifdef JEFF_HAVE_SAMPLED_OBJECT_ALLOC
+        return potential.can_generate_sampled_object_alloc_events == 1 && gdata.tracked_classes.empty();
+#else
+        return false;
+#endif
+    } else if (feature == "gc") {
+        return potential.can_generate_garbage_collection_events == 1;
+    } else if (feature == "monitors") {
+        return potential.can_generate_monitor_events == 1;
+    }
+    return true;
+}
+
+/**
+ * Enables or disables a feature in the live phase. Enabling adds the capabilities and creates
+ * the component the first time, disabling only turns off the events and the periodic report.
+ */
+jvmtiError set_feature_enabled(jvmtiEnv &jvmti, JNIEnv &jni, const string &feature, bool enable) {
+    jvmtiEventMode mode = enable ? JVMTI_ENABLE : JVMTI_DISABLE;
+    if (feature == "exceptions") {
+        gdata.enable_exceptions = enable;
+        return jvmti.SetEventNotificationMode(mode, JVMTI_EVENT_EXCEPTION, (jthread) NULL);
+    }
+
+    if (feature == "alloc_sampling") {
+        gdata.alloc_sampling_interval = !enable ? 0 : (gdata.alloc_sampling_interval > 0)
+                                                      ? gdata.alloc_sampling_interval : DEFAULT_ALLOC_SAMPLING_INTERVAL;
+    } else if (feature == "gc") {
+        gdata.enable_gc_monitor = enable;
+    } else if (feature == "monitors") {
+        gdata.enable_monitor_profiler = enable;
+    } else if (feature == "threads") {
+        gdata.enable_thread_registry = enable;
+    }
+    if (enable) {
+        if (add_capabilities(jvmti) != JNI_OK) {
+            return JVMTI_ERROR_NOT_AVAILABLE;
+        }
+        create_components();
+    }
+
+    if (feature == "alloc_sampling" && gdata.allocation_sampler != nullptr) {
+        if (enable) {
+            gdata.allocation_sampler->set_sampling_interval(gdata.alloc_sampling_interval);
+        }
+        return enable ? gdata.allocation_sampler->start(jvmti) : gdata.allocation_sampler->stop(jvmti);
+    } else if (feature == "gc" && gdata.gc_monitor != nullptr) {
+        return enable ? gdata.gc_monitor->start(jvmti) : gdata.gc_monitor->stop(jvmti);
+    } else if (feature == "monitors" && gdata.monitor_profiler != nullptr) {
+        return enable ? gdata.monitor_profiler->start(jvmti) : gdata.monitor_profiler->stop(jvmti);
+    } else if (feature == "threads" && gdata.thread_registry != nullptr) {
+        return enable ? gdata.thread_registry->start(jvmti, jni) : gdata.thread_registry->stop(jvmti);
+    }
+    return enable ? JVMTI_ERROR_NOT_AVAILABLE : JVMTI_ERROR_NONE;
+}
+
+/**
+ * Executes a command sent by the daemon, one per line:
+ *
+ *   enable|disable alloc_sampling|gc|monitors|threads|exceptions
+ *   set key=value[,key=value...]   alloc_sampling, heap_histogram_top, exception_filter, exception_budget,
+ *                                  report_interval, with the meaning of the agent options
+ *   dump threads|heap
+ *
+ * Runs on the reporter thread. The whole command is parsed and checked before any of it is applied,
+ * and it is applied in the critical section, so the other callbacks and the reports see either none
+ * or all of it. Returns "ok: <command>" or "error: <command>: <reason>" for the daemon.
+ */
+string execute_command(jvmtiEnv &jvmti, JNIEnv &jni, const string &command) {
+    std::stringstream stream(command);
+    string verb;
+    string argument;
+    stream >> verb >> argument;
+    auto error = [&command](const string &reason) {
+        return (boost::format("error: %s: %s\n") % command % reason).str();
+    };
+
+    if (verb == "dump") {
+        if (argument == "threads") {
+            gdata.sender->send(get_thread_dump(jvmti, jni, THREAD_DUMP_DEPTH), MessageType::REPORT);
+        } else if (argument == "heap") {
+            gdata.sender->send(gdata.heap_histogram->capture(jvmti, jni), MessageType::REPORT);
+        } else {
+            return error("expected 'dump threads' or 'dump heap'");
+        }
+        return (boost::format("ok: %s\n") % command).str();
+    }
+
+    std::vector<std::function<jvmtiError()>> actions;
+    if (verb == "enable" || verb == "disable") {
+        bool enable = (verb == "enable");
+        if (std::find(std::begin(FEATURES), std::end(FEATURES), argument) == std::end(FEATURES)) {
+            return error("unknown feature '" + argument + "'");
+        }
+        if (enable && !is_feature_available(jvmti, argument)) {
+            return error("feature '" + argument + "' is not available in this JVM");
+        }
+        actions.push_back([&jvmti, &jni, argument, enable]() {
+            return set_feature_enabled(jvmti, jni, argument, enable);
+        });
+    } else if (verb == "set") {
+        std::stringstream pairs(argument);
+        string pair;
+        while (std::getline(pairs, pair, ',')) {
+            size_t separator = pair.find('=');
+            string key = pair.substr(0, separator);
+            string value = (separator == string::npos) ? "" : pair.substr(separator + 1);
             try {
-                gdata.sender = Sender::create(gdata.daemon_host, gdata.daemon_port);
+                if (key == "alloc_sampling") {
+                    jint interval = std::stoi(value);
+                    if (interval < 0 || (interval > 0 && !is_feature_available(jvmti, key))) {
+                        return error("allocation sampling is not available");
+                    }
+                    actions.push_back([&jvmti, &jni, interval]() {
+                        gdata.alloc_sampling_interval = interval;
+                        return set_feature_enabled(jvmti, jni, "alloc_sampling", interval > 0);
+                    });
+                } else if (key == "heap_histogram_top") {
+                    jint top = std::stoi(value);
+                    if (top <= 0) {
+                        return error("heap_histogram_top must be positive");
+                    }
+                    actions.push_back([top]() {
+                        gdata.heap_histogram->set_top((size_t) top);
+                        return JVMTI_ERROR_NONE;
+                    });
+                } else if (key == "exception_filter") {
+                    std::shared_ptr<const std::vector<string>> filter = parse_exception_filter(value);
+                    actions.push_back([filter]() {
+                        std::atomic_store(&gdata.exception_filter, filter);
+                        return JVMTI_ERROR_NONE;
+                    });
+                } else if (key == "exception_budget") {
+                    jlong budget = std::stol(value);
+                    actions.push_back([budget]() {
+                        gdata.exception_limiter->set_rate(budget);
+                        return JVMTI_ERROR_NONE;
+                    });
+                } else if (key == "report_interval") {
+                    jlong interval_ms = std::stol(value);
+                    if (interval_ms <= 0) {
+                        return error("report_interval must be positive");
+                    }
+                    actions.push_back([&jvmti, interval_ms]() {
+                        gdata.report_interval_ms = interval_ms;
+                        for (const char *task : REPORT_TASKS) {
+                            gdata.reporter->reschedule(jvmti, task, interval_ms);
+                        }
+                        return JVMTI_ERROR_NONE;
+                    });
+                } else {
+                    return error("unknown key '" + key + "'");
+                }
             } catch (std::exception &e) {
-                std::cerr << "Exception: " << e.what() << "\n";
-                THROW_JAVA_EXCEPTION(e.what(), AssertionError);
+                return error("invalid value '" + value + "' of '" + key + "'");
             }
-        } else {
-            gdata.sender = Sender::create();
         }
-        gdata.sender->start();
+    } else {
+        return error("unknown command");
+    }
+
+    jvmtiError result = JVMTI_ERROR_NONE;
+    enter_critical_section(&jvmti);
+    {
+        if (!gdata.agent_is_active || gdata.vm_is_dead) {
+            result = JVMTI_ERROR_WRONG_PHASE;
+        }
+        for (size_t i = 0; i < actions.size() && result == JVMTI_ERROR_NONE; i++) {
+            result = actions[i]();
+        }
+    }
+    exit_critical_section(&jvmti);
 
-        std::string message = "VM Started (JVMTI_EVENT_VM_START)";
-        gdata.sender->send(message);
+    if (result != JVMTI_ERROR_NONE) {
+        return error(get_error_name(jvmti, result));
+    }
+    return (boost::format("ok: %s\n") % command).str();
+}
+
+/* Callback for JVMTI_EVENT_VM_START */
+void JNICALL VMStartCallback(jvmtiEnv *jvmti, JNIEnv *env) {
+    enter_critical_section(jvmti);
+    {
+        /* The VM has started. */
+        gdata.vm_is_started = JNI_TRUE;
+
+        /* Does not wait for the daemon, the JVM start is never held up by the connection */
+        start_sender();
+
+        std::string message = "VM Started (JVMTI_EVENT_VM_START)\n";
+        gdata.sender->send(message, MessageType::REPORT);
     }
     exit_critical_section(jvmti);
 }
@@ -192,18 +1165,30 @@ void JNICALL VMInitCallback(jvmtiEnv *jvmti, JNIEnv *env, jthread thread) {
         gdata.vm_is_initialized = JNI_TRUE;
 
         /* The VM is now initialized, at this time we make our requests for additional events. */
-        jint err = live(*jvmti);
+        jint err = live(*jvmti, *env);
         ASSERT_MSG(err == JVMTI_ERROR_NONE, (boost::format("live() returned an error '%s'") % err).str().c_str());
 
+        err = gdata.reporter->start(*jvmti, *env);
+        ASSERT_MSG(err == JVMTI_ERROR_NONE, (boost::format("Reporter returned an error '%s'") % err).str().c_str());
+        /* Without it the exhaustion is only reported, not worth failing the VM start for */
+        if (gdata.emergency_capture != nullptr) {
+            gdata.emergency_capture->start(*jvmti, *env);
+        }
+        gdata.agent_is_active = true;
+
         string threadName = get_thread_name(*jvmti, *env, thread);
         std::string message = (boost::format("VMInit thread '%s' (JVMTI_EVENT_VM_INIT)\n") % threadName).str();
-        gdata.sender->send(message);
+        gdata.sender->send(message, MessageType::REPORT);
     }
     exit_critical_section(jvmti);
 }
 
 /* Callback for JVMTI_EVENT_VM_DEATH */
 void JNICALL VMDeathCallback(jvmtiEnv *jvmti, JNIEnv *env) {
+    /* One deadline for the whole shutdown: the reporter, the emergency capture and the delivery */
+    jlong deadline_ms = monotonic_millis() + gdata.shutdown_timeout_ms;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(gdata.shutdown_timeout_ms);
+
     enter_critical_section(jvmti);
     {
         /* The VM has died. */
@@ -221,16 +1206,28 @@ void JNICALL VMDeathCallback(jvmtiEnv *jvmti, JNIEnv *env) {
          */
         gdata.vm_is_dead = JNI_TRUE;
 
-        std::string message = "VM Died (JVMTI_EVENT_VM_DEATH)\n";
-        if (gdata.sender != nullptr) {
-            gdata.sender->send(message);
-            gdata.sender->flush();
-            gdata.sender->stop();
-        } else {
-            std::cout << message;
+        if (gdata.agent_is_active) {
+            stop_events(*jvmti);
+            gdata.reporter->stop(*jvmti, deadline_ms);
+            if (gdata.emergency_capture != nullptr) {
+                gdata.emergency_capture->stop(*jvmti, deadline_ms);
+            }
+        }
+        if (gdata.trace_recorder != nullptr) {
+            gdata.trace_recorder->stop();
         }
     }
     exit_critical_section(jvmti);
+
+    /* Outside of the critical section, the other callbacks see vm_is_dead and do not wait for the delivery */
+    std::string message = "VM Died (JVMTI_EVENT_VM_DEATH)\n";
+    if (gdata.sender != nullptr) {
+        gdata.sender->send(message, MessageType::FATAL);
+        /* A slow daemon does not hold up the shutdown, the rest is spilled to the disk */
+        std::cout << gdata.sender->drain(deadline);
+    } else {
+        std::cout << message;
+    }
 }
 
 void JNICALL MethodEntryCallback(jvmtiEnv *jvmti,
@@ -261,6 +1258,39 @@ void JNICALL ExceptionCallback(jvmtiEnv *jvmti,
                                jmethodID catch_method,
                                jlocation catch_location) {
 
+    if (gdata.trace_recorder != nullptr) {
+        /* Thrown by the toString() of an argument being recorded, not by the application */
+        if (TraceRecorder::is_recording()) {
+            return;
+        }
+        gdata.trace_recorder->record(*jvmti, *jni, thread, method, location, exception, catch_method, catch_location);
+    }
+
+    /* Classified and counted before anything else, many exceptions are only counted */
+    CatchSite site = gdata.exception_classifier->classify(*jvmti, thread, method, catch_method);
+    jclass type = jni->GetObjectClass(exception);
+    jint class_id = gdata.classes->get_id(*jvmti, type);
+    jni->DeleteLocalRef(type);
+    jint depth = gdata.exception_classifier->count(class_id, site);
+    if (depth == 0) {
+        return;
+    }
+
+    /* The cheap checks first, the stack trace below is the expensive part */
+    std::shared_ptr<const std::vector<string>> filter = std::atomic_load(&gdata.exception_filter);
+    if (!filter->empty()) {
+        string signature = gdata.classes->get_signature(class_id);
+        bool matches = std::any_of(filter->begin(), filter->end(), [&signature](const string &pattern) {
+            return matches_signature_pattern(signature, pattern);
+        });
+        if (!matches) {
+            return;
+        }
+    }
+    if (!gdata.exception_limiter->try_acquire()) {
+        return;
+    }
+
     string methodName = get_method_name(*jvmti, method);
 
     unique_ptr<Object> object = Object::from(*jvmti, *jni, exception);
@@ -273,14 +1303,52 @@ void JNICALL ExceptionCallback(jvmtiEnv *jvmti,
 
     string line = get_location(*jvmti, method, location);
 
-    auto join_lines = [](string a, string b) { return "\t" + a + "\n\t" + b; };
-    string stack_trace = join(get_stack_trace(*jvmti, *jni, thread), join_lines);
+    string stack_trace;
+    /* A stack id keeps the innermost MAX_DEPTH frames, also when the whole stack is asked for */
+    jlong stack_id = gdata.enable_stack_ids
+                     ? gdata.stacks->get_id(*jvmti, thread, (depth < 0) ? StackRegistry::MAX_DEPTH : depth) : 0;
+    if (stack_id != 0) {
+        /* The new nodes go first, so the daemon knows the stack when the event comes */
+        send_stack_nodes(*jvmti);
+        stack_trace = (boost::format("\tStack: %d\n") % stack_id).str();
+    } else {
+        /* Also when the stack registry is full */
+        auto join_lines = [](string a, string b) { return "\t" + a + "\n\t" + b; };
+        list<string> frames = (depth < 0) ? get_stack_trace(*jvmti, *jni, thread)
+                                          : get_stack_trace(*jvmti, *jni, thread, depth);
+        stack_trace = "\tStack trace:" + join(frames, join_lines) + "\n";
+    }
+
+    string caught;
+    if (site == CatchSite::NEAR) {
+        caught = (boost::format("\tcaught within %d frames in: %s [%s]\n")
+                  % gdata.exception_classifier->get_catch_frames() % get_method_name(*jvmti, catch_method)
+                  % get_location(*jvmti, catch_method, catch_location)).str();
+    } else if (site != CatchSite::UNCAUGHT) {
+        caught = (boost::format("\tcaught %s in: %s [%s]\n")
+                  % ((site == CatchSite::LOCAL) ? "locally" : "further up") % get_method_name(*jvmti, catch_method)
+                  % get_location(*jvmti, catch_method, catch_location)).str();
+    }
+
+    /* Cached by the thread registry, read without JVMTI calls */
+    string thread_line;
+    ThreadRegistry::Metadata metadata;
+    if (gdata.thread_registry != nullptr && gdata.thread_registry->get_current(*jvmti, *jni, thread, metadata)) {
+        thread_line = (boost::format("\tThread: %d %s\n") % metadata.id % metadata.name).str();
+    }
+
+    string last_gc;
+    if (gdata.gc_monitor != nullptr) {
+        jlong millis = gdata.gc_monitor->get_millis_since_last_gc();
+        last_gc = (millis < 0) ? "\tno GC yet\n" : (boost::format("\tlast GC ended %s ms ago\n") % millis).str();
+    }
 
     std::string the_message =
-            (boost::format("Uncought exception: %s, message: '%s'\n\tin method: %s [%s]\nStack trace:%s\n\n")
-             % exceptionSignature % message % methodName % line % stack_trace).str();
+            (boost::format("%s: %s, message: '%s'\n\tin method: %s [%s]\n%s%s%s%s\n")
+             % ((site == CatchSite::UNCAUGHT) ? "Uncought exception" : "Cought exception")
+             % exceptionSignature % message % methodName % line % thread_line % caught % last_gc % stack_trace).str();
 
-    gdata.sender->send(the_message);
+    gdata.sender->send(the_message, MessageType::EVENT);
 }
 
 void JNICALL ExceptionCatchCallback(jvmtiEnv *jvmti,
@@ -305,35 +1373,24 @@ void JNICALL ExceptionCatchCallback(jvmtiEnv *jvmti,
             (boost::format("Cought exception: %s, message: '%s'\n\tin method: %s [%s]\n")
              % exceptionSignature % message % methodName % line).str();
 
-    gdata.sender->send(the_message);
+    gdata.sender->send(the_message, MessageType::EVENT);
 }
 
 void JNICALL ThreadStartCallback(jvmtiEnv *jvmti,
                                  JNIEnv *env,
                                  jthread thread) {
-    enter_critical_section(jvmti);
-    {
-        /* It's possible we get here right after VmDeath event, be careful */
-        if (!gdata.vm_is_dead) {
-            string threadName = get_thread_name(*jvmti, *env, thread);
-            std::cout << boost::format("ThreadStart: %s\n") % threadName;
-        }
+    /* No global lock, the registry is lock-free */
+    if (!gdata.vm_is_dead && gdata.thread_registry != nullptr) {
+        gdata.thread_registry->thread_started(*jvmti, *env, thread);
     }
-    exit_critical_section(jvmti);
 }
 
 void JNICALL ThreadEndCallback(jvmtiEnv *jvmti,
                                JNIEnv *jni,
                                jthread thread) {
-    enter_critical_section(jvmti);
-    {
-        /* It's possible we get here right after VmDeath event, be careful */
-        if (!gdata.vm_is_dead) {
-            string threadName = get_thread_name(*jvmti, *jni, thread);
-            std::cout << boost::format("ThreadEnd: %s\n") % threadName;
-        }
+    if (!gdata.vm_is_dead && gdata.thread_registry != nullptr) {
+        gdata.thread_registry->thread_ended(*jvmti, thread);
     }
-    exit_critical_section(jvmti);
 }
 
 void JNICALL ResourceExhaustedCallback(jvmtiEnv *jvmti,
@@ -341,10 +1398,15 @@ void JNICALL ResourceExhaustedCallback(jvmtiEnv *jvmti,
                                        jint flags,
                                        const void *reserved,
                                        const char *description) {
+    /* First, before anything here asks for the memory that is not there */
+    if (gdata.emergency_capture != nullptr && !gdata.vm_is_dead) {
+        gdata.emergency_capture->capture(*jvmti, flags, description);
+    }
+
     enter_critical_section(jvmti);
-    {
-        /* It's possible we get here right after VmDeath event, be careful */
-        if (!gdata.vm_is_dead) {
+    /* It's possible we get here right after VmDeath event, be careful */
+    if (!gdata.vm_is_dead) {
+        try {
             std::string message;
             switch (flags) {
                 case JVMTI_RESOURCE_EXHAUSTED_OOM_ERROR: {
@@ -364,12 +1426,119 @@ void JNICALL ResourceExhaustedCallback(jvmtiEnv *jvmti,
                     break;
                 }
             }
-            gdata.sender->send(message);
+            gdata.sender->send(message, MessageType::FATAL);
+        } catch (std::exception &e) {
+            /* Out of the native memory, the emergency capture has what there is */
         }
     }
     exit_critical_section(jvmti);
 }
 
+/* Callback for JVMTI_EVENT_SAMPLED_OBJECT_ALLOC */
+void JNICALL SampledObjectAllocCallback(jvmtiEnv *jvmti,
+                                        JNIEnv *jni,
+                                        jthread thread,
+                                        jobject object,
+                                        jclass object_klass,
+                                        jlong size) {
+    if (gdata.allocation_sampler != nullptr && !gdata.vm_is_dead) {
+        gdata.allocation_sampler->object_allocated(*jvmti, thread, object, object_klass, size);
+    }
+}
+
+/* Callback for JVMTI_EVENT_OBJECT_FREE, no JNI nor most of JVMTI functions are allowed here */
+void JNICALL ObjectFreeCallback(jvmtiEnv *jvmti, jlong tag) {
+    switch (get_tag_kind(tag)) {
+        case TagKind::Sample: {
+            if (gdata.allocation_sampler != nullptr) {
+                gdata.allocation_sampler->object_freed(tag);
+            }
+            break;
+        }
+        case TagKind::Instance: {
+            if (gdata.instance_tracker != nullptr) {
+                gdata.instance_tracker->object_freed(tag);
+            }
+            break;
+        }
+        default: {
+            break;
+        }
+    }
+}
+
+/* Callback for JVMTI_EVENT_GARBAGE_COLLECTION_START, no JNI nor JVMTI functions are allowed here */
+void JNICALL GarbageCollectionStartCallback(jvmtiEnv *jvmti) {
+    if (gdata.gc_monitor != nullptr) {
+        gdata.gc_monitor->gc_started();
+    }
+}
+
+/* Callback for JVMTI_EVENT_GARBAGE_COLLECTION_FINISH, no JNI nor JVMTI functions are allowed here */
+void JNICALL GarbageCollectionFinishCallback(jvmtiEnv *jvmti) {
+    if (gdata.gc_monitor != nullptr) {
+        gdata.gc_monitor->gc_finished();
+    }
+}
+
+/* Callback for JVMTI_EVENT_DATA_DUMP_REQUEST, e.g. on SIGQUIT (kill -3) */
+void JNICALL DataDumpRequestCallback(jvmtiEnv *jvmti) {
+    if (gdata.heap_histogram != nullptr && !gdata.vm_is_dead) {
+        gdata.reporter->run_now(*jvmti, "heap histogram");
+    }
+}
+
+/* Callback for JVMTI_EVENT_MONITOR_CONTENDED_ENTER */
+void JNICALL MonitorContendedEnterCallback(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread, jobject object) {
+    if (gdata.monitor_profiler != nullptr && !gdata.vm_is_dead) {
+        gdata.monitor_profiler->blocking(*jvmti, *jni, thread, object, false);
+    }
+}
+
+/* Callback for JVMTI_EVENT_MONITOR_CONTENDED_ENTERED */
+void JNICALL MonitorContendedEnteredCallback(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread, jobject object) {
+    if (gdata.monitor_profiler != nullptr) {
+        gdata.monitor_profiler->unblocked(false);
+    }
+}
+
+/* Callback for JVMTI_EVENT_MONITOR_WAIT */
+void JNICALL MonitorWaitCallback(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread, jobject object, jlong timeout) {
+    if (gdata.monitor_profiler != nullptr && !gdata.vm_is_dead) {
+        gdata.monitor_profiler->blocking(*jvmti, *jni, thread, object, true);
+    }
+}
+
+/* Callback for JVMTI_EVENT_MONITOR_WAITED */
+void JNICALL MonitorWaitedCallback(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread, jobject object,
+                                   jboolean timed_out) {
+    if (gdata.monitor_profiler != nullptr) {
+        gdata.monitor_profiler->unblocked(true);
+    }
+}
+
+/* Callback for JVMTI_EVENT_COMPILED_METHOD_LOAD, on a compiler thread */
+void JNICALL CompiledMethodLoadCallback(jvmtiEnv *jvmti, jmethodID method, jint code_size, const void *code_addr,
+                                        jint map_length, const jvmtiAddrLocationMap *map, const void *compile_info) {
+    if (gdata.perf_map != nullptr && !gdata.vm_is_dead) {
+        gdata.perf_map->method_loaded(*jvmti, method, code_size, code_addr, compile_info);
+    }
+}
+
+/* Callback for JVMTI_EVENT_COMPILED_METHOD_UNLOAD */
+void JNICALL CompiledMethodUnloadCallback(jvmtiEnv *jvmti, jmethodID method, const void *code_addr) {
+    if (gdata.perf_map != nullptr) {
+        gdata.perf_map->method_unloaded();
+    }
+}
+
+/* Callback for JVMTI_EVENT_DYNAMIC_CODE_GENERATED, also sent in the primordial phase */
+void JNICALL DynamicCodeGeneratedCallback(jvmtiEnv *jvmti, const char *name, const void *address, jint length) {
+    if (gdata.perf_map != nullptr && !gdata.vm_is_dead) {
+        gdata.perf_map->code_generated(name, address, length);
+    }
+}
+
 /* ------------------------------------------------------------------- */
 /* Generic JVMTI utility functions */
 
@@ -2,6 +2,11 @@
 #define JEFF_NATIVE_AGENT_MAIN_H
 
 #include "jvmti.h"
+#include "ExceptionClassifier.hpp"
+
+#include <memory>
+#include <string>
+#include <vector>
 
 namespace jeff {
     struct GlobalAgentData;
@@ -30,7 +35,13 @@ JNIEXPORT void JNICALL Agent_OnUnload(JavaVM *jvm);
 
 static jint init(JavaVM *jvm, char *options);
 
-static jint live(jvmtiEnv &jvmti);
+static jint live(jvmtiEnv &jvmti, JNIEnv &jni);
+
+static jint attach(JavaVM *jvm);
+
+static jint detach(JavaVM *jvm);
+
+static std::string execute_command(jvmtiEnv &jvmti, JNIEnv &jni, const std::string &command);
 
 /**
  * JVMTI calback functions
@@ -61,12 +72,63 @@ static void JNICALL ThreadEndCallback(jvmtiEnv *jvmti, JNIEnv *jni, jthread thre
 static void JNICALL ResourceExhaustedCallback(jvmtiEnv *jvmti, JNIEnv *env, jint flags,
                                               const void *reserved, const char *description);
 
+static void JNICALL SampledObjectAllocCallback(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread, jobject object,
+                                               jclass object_klass, jlong size);
+
+static void JNICALL ObjectFreeCallback(jvmtiEnv *jvmti, jlong tag);
+
+static void JNICALL GarbageCollectionStartCallback(jvmtiEnv *jvmti);
+
+static void JNICALL GarbageCollectionFinishCallback(jvmtiEnv *jvmti);
+
+static void JNICALL DataDumpRequestCallback(jvmtiEnv *jvmti);
+
+static void JNICALL MonitorContendedEnterCallback(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread, jobject object);
+
+static void JNICALL MonitorContendedEnteredCallback(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread, jobject object);
+
+static void JNICALL MonitorWaitCallback(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread, jobject object, jlong timeout);
+
+static void JNICALL MonitorWaitedCallback(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread, jobject object,
+                                          jboolean timed_out);
+
+static void JNICALL CompiledMethodLoadCallback(jvmtiEnv *jvmti, jmethodID method, jint code_size,
+                                               const void *code_addr, jint map_length,
+                                               const jvmtiAddrLocationMap *map, const void *compile_info);
+
+static void JNICALL CompiledMethodUnloadCallback(jvmtiEnv *jvmti, jmethodID method, const void *code_addr);
+
+static void JNICALL DynamicCodeGeneratedCallback(jvmtiEnv *jvmti, const char *name, const void *address,
+                                                 jint length);
+
 /* Special utility functions  */
 
 jint get_jvmti(JavaVM *jvm, jvmtiEnv **jvmti);
 
 void parse_options(jeff::GlobalAgentData &data, char *options);
 
+static void intersect_capabilities(jvmtiCapabilities &capabilities, const jvmtiCapabilities &mask);
+
+static jint add_capabilities(jvmtiEnv &jvmti);
+
+static std::shared_ptr<const std::vector<std::string>> parse_exception_filter(const std::string &value);
+
+static std::vector<ExceptionClassifier::Rule> parse_exception_depths(const std::string &value);
+
+static void create_components();
+
+static bool is_feature_available(jvmtiEnv &jvmti, const std::string &feature);
+
+static jvmtiError set_feature_enabled(jvmtiEnv &jvmti, JNIEnv &jni, const std::string &feature, bool enable);
+
+static void start_sender();
+
+static void send_stack_nodes(jvmtiEnv &jvmti);
+
+static void stop_events(jvmtiEnv &jvmti);
+
+static jint JNICALL untag_object(jlong class_tag, jlong size, jlong *tag_ptr, jint length, void *user_data);
+
 /* Generic JVMTI utility functions */
 
 static void enter_critical_section(jvmtiEnv *jvmti);
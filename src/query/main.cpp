@@ -0,0 +1,127 @@
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <thread>
+
+#include <boost/format.hpp>
+
+#include "../daemon/StoreQuery.hpp"
+
+static void usage() {
+    std::cerr << "Usage: jeff-query --store directory [--last 1h | --from ms] [--to ms] [--jvm text]"
+            " [--fingerprint text] [--group-by fingerprint|class|jvm|host|thread|pool] [--top n] [--threads n]"
+            " [--scalar true]\n";
+}
+
+// "90s", "15m", "1h", "2d" or milliseconds
+static int64_t parse_duration_ms(const std::string &value) {
+    size_t end = 0;
+    int64_t amount = std::stoll(value, &end);
+    std::string unit = value.substr(end);
+    if (unit.empty() || unit == "ms") {
+        return amount;
+    } else if (unit == "s") {
+        return amount * 1000;
+    } else if (unit == "m") {
+        return amount * 60 * 1000;
+    } else if (unit == "h") {
+        return amount * 60 * 60 * 1000;
+    } else if (unit == "d") {
+        return amount * 24 * 60 * 60 * 1000;
+    }
+    throw std::invalid_argument("unknown unit " + unit);
+}
+
+static GroupBy parse_group_by(const std::string &value) {
+    if (value == "fingerprint") {
+        return GroupBy::FINGERPRINT;
+    } else if (value == "class") {
+        return GroupBy::CLASS;
+    } else if (value == "jvm") {
+        return GroupBy::JVM;
+    } else if (value == "host") {
+        return GroupBy::HOST;
+    } else if (value == "thread") {
+        return GroupBy::THREAD;
+    } else if (value == "pool") {
+        return GroupBy::POOL;
+    }
+    throw std::invalid_argument("unknown group " + value);
+}
+
+/**
+ * Queries the event store of the daemon, e.g. the top exceptions of a host in the last hour:
+ *
+ *     jeff-query --store /var/lib/jeff --last 1h --jvm @host-x --fingerprint exception --group-by class
+ */
+int main(int argc, char *argv[]) {
+    std::string directory;
+    int64_t now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+
+    Query query;
+    query.from_ms = std::numeric_limits<int64_t>::min();
+    query.to_ms = std::numeric_limits<int64_t>::max();
+    query.group_by = GroupBy::FINGERPRINT;
+    query.top = 20;
+    query.threads = std::max(std::thread::hardware_concurrency(), 1u);
+    query.vectorized = true;
+
+    for (int i = 1; i < argc; i++) {
+        std::string option = argv[i];
+        if (i + 1 >= argc) {
+            usage();
+            return 1;
+        }
+        std::string value = argv[++i];
+        try {
+            if (option == "--store") {
+                directory = value;
+            } else if (option == "--last") {
+                query.from_ms = now_ms - parse_duration_ms(value);
+            } else if (option == "--from") {
+                query.from_ms = std::stoll(value);
+            } else if (option == "--to") {
+                query.to_ms = std::stoll(value);
+            } else if (option == "--jvm") {
+                query.jvm = value;
+            } else if (option == "--fingerprint") {
+                query.fingerprint = value;
+            } else if (option == "--group-by") {
+                query.group_by = parse_group_by(value);
+            } else if (option == "--top") {
+                query.top = std::stoul(value);
+            } else if (option == "--threads") {
+                query.threads = std::max(std::stoul(value), 1ul);
+            } else if (option == "--scalar") {
+                query.vectorized = (value != "true");
+            } else {
+                usage();
+                return 1;
+            }
+        } catch (std::exception &e) {
+            std::cerr << boost::format("Invalid value '%s' of option '%s'\n") % value % option;
+            return 1;
+        }
+    }
+    if (directory.empty()) {
+        usage();
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    QueryResult result = StoreQuery(directory, query).run();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    for (const std::pair<std::string, uint64_t> &group : result.groups) {
+        std::cout << boost::format("%12d  %s\n") % group.second % group.first;
+    }
+    std::cerr << boost::format("%s rows matched, %s rows in %s blocks scanned, %s blocks skipped, %s partitions"
+                                       " in %.3f s (%.0f rows/s, %s scan)\n")
+                 % result.matched_rows % result.scanned_rows % result.scanned_blocks % result.skipped_blocks
+                 % result.partitions % seconds % (result.scanned_rows / std::max(seconds, 1e-9))
+                 % (result.vectorized ? "avx2" : "scalar");
+    return 0;
+}
@@ -0,0 +1,836 @@
+#include "ReplayJvm.hpp"
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+#include <boost/format.hpp>
+
+#include "../TraceFormat.hpp"
+
+using namespace std;
+
+/* The functions of the tables, all of them pointers of the same size */
+typedef void (*Slot)();
+
+static const char *const TABLE_NAMES[] = {"JVMTI", "JNI", "JNI invocation"};
+
+template<int Table, size_t Index>
+static void JNICALL unsupported() {
+    fprintf(stderr, "jeff-replay: the %s function #%d is not supported\n", TABLE_NAMES[Table], (int) Index);
+    abort();
+}
+
+template<int Table, size_t Count>
+struct Traps {
+    static void fill(Slot *slots) {
+        slots[Count - 1] = &unsupported<Table, Count - 1>;
+        Traps<Table, Count - 1>::fill(slots);
+    }
+};
+
+template<int Table>
+struct Traps<Table, 0> {
+    static void fill(Slot *slots) {
+        // Empty
+    }
+};
+
+/* Every function of the table aborts until it is replaced */
+template<int Table, typename Functions>
+static void fill_traps(Functions &functions) {
+    Traps<Table, sizeof(Functions) / sizeof(Slot)>::fill(reinterpret_cast<Slot *>(&functions));
+}
+
+/* The ids of the JNI methods and fields the agent uses, the rest is the other one */
+static char TO_STRING_METHOD;
+static char GET_MESSAGE_METHOD;
+static char OTHER_METHOD;
+static char NAME_FIELD;
+static char ID_FIELD;
+
+ReplayJvm *ReplayJvm::instance = nullptr;
+
+ReplayJvm::ReplayJvm(const std::string &path)
+        : callbacks(),
+          capabilities(),
+          location_format(JVMTI_JLOCATION_JVMBCI),
+          jvmti_allocations(0),
+          current(nullptr),
+          pending_exception(false),
+          thrown(0) {
+    if (instance != nullptr) {
+        throw runtime_error("there can be one replayed VM only");
+    }
+
+    fill_traps<0>(jvmti_functions);
+    jvmti_functions.GetPotentialCapabilities = &GetPotentialCapabilities;
+    jvmti_functions.AddCapabilities = &AddCapabilities;
+    jvmti_functions.SetEventNotificationMode = &SetEventNotificationMode;
+    jvmti_functions.SetEventCallbacks = &SetEventCallbacks;
+    jvmti_functions.CreateRawMonitor = &CreateRawMonitor;
+    jvmti_functions.RawMonitorEnter = &RawMonitorEnter;
+    jvmti_functions.RawMonitorExit = &RawMonitorExit;
+    jvmti_functions.Allocate = &Allocate;
+    jvmti_functions.Deallocate = &Deallocate;
+    jvmti_functions.GetErrorName = &GetErrorName;
+    jvmti_functions.GetJLocationFormat = &GetJLocationFormat;
+    jvmti_functions.GetTag = &GetTag;
+    jvmti_functions.SetTag = &SetTag;
+    jvmti_functions.GetClassSignature = &GetClassSignature;
+    jvmti_functions.GetClassStatus = &GetClassStatus;
+    jvmti_functions.GetMethodName = &GetMethodName;
+    jvmti_functions.GetMethodDeclaringClass = &GetMethodDeclaringClass;
+    jvmti_functions.GetLineNumberTable = &GetLineNumberTable;
+    jvmti_functions.GetArgumentsSize = &GetArgumentsSize;
+    jvmti_functions.GetLocalVariableTable = &GetLocalVariableTable;
+    jvmti_functions.GetFrameCount = &GetFrameCount;
+    jvmti_functions.GetStackTrace = &GetStackTrace;
+    jvmti_functions.GetLocalInt = &GetLocalInt;
+    jvmti_functions.GetLocalLong = &GetLocalLong;
+    jvmti_functions.GetLocalFloat = &GetLocalFloat;
+    jvmti_functions.GetLocalDouble = &GetLocalDouble;
+    jvmti_functions.GetLocalObject = &GetLocalObject;
+    jvmti_functions.GetThreadInfo = &GetThreadInfo;
+    jvmti_functions.GetThreadGroupInfo = &GetThreadGroupInfo;
+    jvmti_functions.GetThreadLocalStorage = &GetThreadLocalStorage;
+    jvmti_functions.SetThreadLocalStorage = &SetThreadLocalStorage;
+    jvmti_functions.GetCurrentThreadCpuTime = &GetCurrentThreadCpuTime;
+    jvmti.functions = &jvmti_functions;
+
+    fill_traps<1>(jni_functions);
+    jni_functions.FindClass = &FindClass;
+    jni_functions.ThrowNew = &ThrowNew;
+    jni_functions.ExceptionCheck = &ExceptionCheck;
+    jni_functions.ExceptionClear = &ExceptionClear;
+    jni_functions.NewGlobalRef = &NewGlobalRef;
+    jni_functions.DeleteGlobalRef = &DeleteRef;
+    jni_functions.DeleteLocalRef = &DeleteRef;
+    jni_functions.NewWeakGlobalRef = &NewGlobalRef;
+    jni_functions.DeleteWeakGlobalRef = &DeleteRef;
+    jni_functions.IsSameObject = &IsSameObject;
+    jni_functions.GetObjectClass = &GetObjectClass;
+    jni_functions.GetMethodID = &GetMethodID;
+    jni_functions.CallObjectMethodV = &CallObjectMethodV;
+    jni_functions.GetFieldID = &GetFieldID;
+    jni_functions.GetObjectField = &GetObjectField;
+    jni_functions.GetLongField = &GetLongField;
+    jni_functions.GetStringLength = &GetStringLength;
+    jni_functions.GetStringUTFLength = &GetStringLength;
+    jni_functions.GetStringUTFChars = &GetStringUTFChars;
+    jni_functions.ReleaseStringUTFChars = &ReleaseStringUTFChars;
+    jni_functions.GetArrayLength = &GetArrayLength;
+    jni_functions.GetBooleanArrayElements = &GetBooleanArrayElements;
+    jni_functions.ReleaseBooleanArrayElements = &ReleaseBooleanArrayElements;
+    jni.functions = &jni_functions;
+
+    fill_traps<2>(vm_functions);
+    vm_functions.GetEnv = &GetEnv;
+    vm_functions.AttachCurrentThread = &AttachCurrentThread;
+    vm.functions = &vm_functions;
+
+    thread_class = Object{Kind::CLASS, 0, "Ljava/lang/Thread;", nullptr, {}, 0, nullptr};
+    other_class = Object{Kind::CLASS, 0, "Ljava/lang/Object;", nullptr, {}, 0, nullptr};
+
+    read(path);
+    instance = this;
+}
+
+ReplayJvm::~ReplayJvm() {
+    instance = nullptr;
+}
+
+void ReplayJvm::read(const std::string &path) {
+    ifstream file(path.c_str(), ios::in | ios::binary);
+    if (!file) {
+        throw runtime_error("cannot open " + path);
+    }
+    string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    if (data.size() < trace::MAGIC_LENGTH || data.compare(0, trace::MAGIC_LENGTH, trace::MAGIC) != 0) {
+        throw runtime_error(path + " is not a trace");
+    }
+
+    trace::Reader reader(data.data() + trace::MAGIC_LENGTH, data.data() + data.size());
+    location_format = (jvmtiJlocationFormat) reader.get_varint();
+
+    vector<Method *> method_ids(1, nullptr);
+    vector<Thread *> thread_ids(1, nullptr);
+    classes.assign(1, nullptr);
+
+    auto get_string = [&reader]() -> unique_ptr<string> {
+        unique_ptr<string> value(new string());
+        return reader.get_string(*value) ? std::move(value) : unique_ptr<string>();
+    };
+    auto get_string_object = [this, &reader]() -> const Object * {
+        string value;
+        if (!reader.get_string(value)) {
+            return nullptr;
+        }
+        objects.push_back(Object{Kind::STRING, 0, value, nullptr, {}, 0, nullptr});
+        return &objects.back();
+    };
+    auto get_method = [&reader, &method_ids](bool optional) -> Method * {
+        uint64_t id = reader.get_varint();
+        if (optional && id == 0) {
+            return nullptr;
+        }
+        if (id >= method_ids.size() || method_ids[id] == nullptr) {
+            throw runtime_error("unknown method in the trace");
+        }
+        return method_ids[id];
+    };
+
+    while (!reader.at_end()) {
+        uint8_t tag = reader.get_byte();
+        switch (tag) {
+            case trace::CLASS: {
+                uint64_t id = reader.get_varint();
+                string signature;
+                reader.get_string(signature);
+                objects.push_back(Object{Kind::CLASS, (jint) id, signature, nullptr, {}, 0, nullptr});
+                if (id >= classes.size()) {
+                    classes.resize(id + 1, nullptr);
+                }
+                classes[id] = &objects.back();
+                break;
+            }
+            case trace::METHOD: {
+                uint64_t id = reader.get_varint();
+                methods.emplace_back();
+                Method &method = methods.back();
+                uint64_t class_id = reader.get_varint();
+                method.type = (class_id == 0) ? nullptr : classes.at(class_id);
+                method.name = get_string();
+                method.signature = get_string();
+                method.generic_signature = get_string();
+
+                method.lines_error = (jvmtiError) reader.get_varint();
+                if (method.lines_error == JVMTI_ERROR_NONE) {
+                    method.lines.resize(reader.get_varint());
+                    for (jvmtiLineNumberEntry &line : method.lines) {
+                        line.start_location = reader.get_signed();
+                        line.line_number = (jint) reader.get_signed();
+                    }
+                }
+                method.arguments_error = (jvmtiError) reader.get_varint();
+                method.arguments_size = (method.arguments_error == JVMTI_ERROR_NONE) ? (jint) reader.get_varint() : 0;
+                method.variables_error = (jvmtiError) reader.get_varint();
+                if (method.variables_error == JVMTI_ERROR_NONE) {
+                    method.variables.resize(reader.get_varint());
+                    for (LocalVariable &variable : method.variables) {
+                        reader.get_string(variable.name);
+                        reader.get_string(variable.signature);
+                        variable.slot = (jint) reader.get_varint();
+                    }
+                }
+                method.argument_count = (method.arguments_error == JVMTI_ERROR_NONE)
+                                        ? min(method.variables.size(), (size_t) method.arguments_size) : 0;
+
+                if (id >= method_ids.size()) {
+                    method_ids.resize(id + 1, nullptr);
+                }
+                method_ids[id] = &method;
+                break;
+            }
+            case trace::THREAD: {
+                uint64_t id = reader.get_varint();
+                if (id >= thread_ids.size()) {
+                    thread_ids.resize(id + 1, nullptr);
+                }
+                if (thread_ids[id] == nullptr) {
+                    threads.emplace_back();
+                    Thread &created = threads.back();
+                    created.object = Object{Kind::THREAD, 0, "", nullptr, {}, 0, &created};
+                    created.local_storage = nullptr;
+                    thread_ids[id] = &created;
+                }
+                Thread &thread = *thread_ids[id];
+                const Object *name = get_string_object();
+                string group_name;
+                const Object *group = nullptr;
+                if (reader.get_string(group_name)) {
+                    objects.push_back(Object{Kind::THREAD_GROUP, 0, group_name, nullptr, {}, 0, nullptr});
+                    group = &objects.back();
+                }
+                bool daemon = reader.get_byte() != 0;
+                thread.java_id = reader.get_signed();
+                thread_states.push_back(ThreadState{&thread, name, group, daemon});
+                thread.state = &thread_states.back();
+                break;
+            }
+            case trace::EVENT: {
+                events.emplace_back();
+                Event &event = events.back();
+                uint64_t thread_id = reader.get_varint();
+                if (thread_id >= thread_ids.size() || thread_ids[thread_id] == nullptr) {
+                    throw runtime_error("unknown thread in the trace");
+                }
+                event.state = thread_ids[thread_id]->state;
+                event.method = get_method(false);
+                event.location = reader.get_signed();
+                event.catch_method = get_method(true);
+                event.catch_location = reader.get_signed();
+
+                /* The class id, then the toString() or the boolean elements */
+                auto read_object = [&](const string &signature) -> Object * {
+                    uint64_t class_id = reader.get_varint();
+                    if (class_id == 0) {
+                        return nullptr;
+                    }
+                    if (class_id >= classes.size() || classes[class_id] == nullptr) {
+                        throw runtime_error("unknown class in the trace");
+                    }
+                    objects.push_back(Object{Kind::INSTANCE, (jint) class_id, "", nullptr, {}, 0, nullptr});
+                    Object &object = objects.back();
+                    if (signature == "[Z") {
+                        object.elements.resize(reader.get_varint());
+                        for (jboolean &element : object.elements) {
+                            element = reader.get_byte();
+                        }
+                    } else if (signature[0] != '[') {
+                        object.to_string = get_string_object();
+                    }
+                    return &object;
+                };
+
+                event.exception = read_object("Ljava/lang/Throwable;");
+                event.message = get_string_object();
+
+                event.frames.resize(reader.get_varint());
+                for (Frame &frame : event.frames) {
+                    frame.method = get_method(false);
+                    frame.location = reader.get_signed();
+                    for (size_t i = 0; i < frame.method->argument_count; i++) {
+                        const string &signature = frame.method->variables[i].signature;
+                        if (signature.empty() || strchr("ZCBSIJFDL[", signature[0]) == nullptr) {
+                            continue;
+                        }
+                        Value value = {(jvmtiError) reader.get_varint(), jvalue()};
+                        if (value.error == JVMTI_ERROR_NONE) {
+                            switch (signature[0]) {
+                                case 'J':
+                                    value.value.j = reader.get_signed();
+                                    break;
+                                case 'F': {
+                                    uint32_t bits = (uint32_t) reader.get_varint();
+                                    memcpy(&value.value.f, &bits, sizeof(bits));
+                                    break;
+                                }
+                                case 'D': {
+                                    uint64_t bits = reader.get_varint();
+                                    memcpy(&value.value.d, &bits, sizeof(bits));
+                                    break;
+                                }
+                                case 'L':
+                                case '[':
+                                    value.value.l = (jobject) read_object(signature);
+                                    break;
+                                default:
+                                    value.value.i = (jint) reader.get_signed();
+                            }
+                        }
+                        frame.values.push_back(value);
+                    }
+                }
+                break;
+            }
+            default: {
+                throw runtime_error((boost::format("unknown record '%c' in the trace") % (char) tag).str());
+            }
+        }
+    }
+}
+
+void ReplayJvm::start() {
+    if (callbacks.VMStart != nullptr) {
+        callbacks.VMStart(&jvmti, &jni);
+    }
+}
+
+void ReplayJvm::stop() {
+    if (callbacks.VMDeath != nullptr) {
+        callbacks.VMDeath(&jvmti, &jni);
+    }
+}
+
+void ReplayJvm::replay(size_t index) {
+    const Event &event = events[index];
+    Thread *thread = event.state->thread;
+    thread->state = event.state;
+    current = &event;
+    if (callbacks.Exception != nullptr) {
+        callbacks.Exception(&jvmti, &jni, (jthread) &thread->object, (jmethodID) event.method, event.location,
+                            (jobject) event.exception, (jmethodID) event.catch_method, event.catch_location);
+    }
+    /* A pending exception is thrown once the callback returns */
+    if (pending_exception) {
+        pending_exception = false;
+        thrown++;
+    }
+    current = nullptr;
+}
+
+ReplayJvm &ReplayJvm::get() {
+    return *instance;
+}
+
+char *ReplayJvm::copy(const std::string *value) {
+    if (value == nullptr) {
+        return nullptr;
+    }
+    unsigned char *memory;
+    Allocate(nullptr, (jlong) value->size() + 1, &memory);
+    memcpy(memory, value->c_str(), value->size() + 1);
+    return (char *) memory;
+}
+
+const ReplayJvm::Frame *ReplayJvm::get_frame(jint depth) {
+    const Event *event = get().current;
+    if (event == nullptr || depth < 0 || (size_t) depth >= event->frames.size()) {
+        return nullptr;
+    }
+    return &event->frames[depth];
+}
+
+jvmtiError ReplayJvm::get_value(jint depth, jint slot, const Value **value) {
+    const Frame *frame = get_frame(depth);
+    if (frame == nullptr) {
+        return JVMTI_ERROR_NO_MORE_FRAMES;
+    }
+    for (size_t i = 0; i < frame->values.size(); i++) {
+        if (frame->method->variables[i].slot == slot) {
+            *value = &frame->values[i];
+            return frame->values[i].error;
+        }
+    }
+    return JVMTI_ERROR_INVALID_SLOT;
+}
+
+/* JVMTI */
+
+jvmtiError ReplayJvm::GetPotentialCapabilities(jvmtiEnv *env, jvmtiCapabilities *capabilities) {
+    memset(capabilities, 0xff, sizeof(jvmtiCapabilities));
+    return JVMTI_ERROR_NONE;
+}
+
+jvmtiError ReplayJvm::AddCapabilities(jvmtiEnv *env, const jvmtiCapabilities *capabilities) {
+    get().capabilities = *capabilities;
+    return JVMTI_ERROR_NONE;
+}
+
+jvmtiError ReplayJvm::SetEventNotificationMode(jvmtiEnv *env, jvmtiEventMode mode, jvmtiEvent event_type,
+                                               jthread event_thread, ...) {
+    /* The trace has the exception events only, the others never come */
+    return JVMTI_ERROR_NONE;
+}
+
+jvmtiError ReplayJvm::SetEventCallbacks(jvmtiEnv *env, const jvmtiEventCallbacks *callbacks, jint size) {
+    ReplayJvm &jvm = get();
+    jvm.callbacks = jvmtiEventCallbacks();
+    if (callbacks != nullptr) {
+        memcpy(&jvm.callbacks, callbacks, min((size_t) size, sizeof(jvmtiEventCallbacks)));
+    }
+    return JVMTI_ERROR_NONE;
+}
+
+jvmtiError ReplayJvm::CreateRawMonitor(jvmtiEnv *env, const char *name, jrawMonitorID *monitor) {
+    ReplayJvm &jvm = get();
+    lock_guard<mutex> guard(jvm.monitors_lock);
+    jvm.monitors.emplace_back();
+    *monitor = (jrawMonitorID) &jvm.monitors.back();
+    return JVMTI_ERROR_NONE;
+}
+
+jvmtiError ReplayJvm::RawMonitorEnter(jvmtiEnv *env, jrawMonitorID monitor) {
+    ((Monitor *) monitor)->mutex.lock();
+    return JVMTI_ERROR_NONE;
+}
+
+jvmtiError ReplayJvm::RawMonitorExit(jvmtiEnv *env, jrawMonitorID monitor) {
+    ((Monitor *) monitor)->mutex.unlock();
+    return JVMTI_ERROR_NONE;
+}
+
+jvmtiError ReplayJvm::Allocate(jvmtiEnv *env, jlong size, unsigned char **memory) {
+    *memory = (unsigned char *) malloc((size_t) max(size, (jlong) 1));
+    get().jvmti_allocations.fetch_add(1, memory_order_relaxed);
+    return (*memory == nullptr) ? JVMTI_ERROR_OUT_OF_MEMORY : JVMTI_ERROR_NONE;
+}
+
+jvmtiError ReplayJvm::Deallocate(jvmtiEnv *env, unsigned char *memory) {
+    free(memory);
+    return JVMTI_ERROR_NONE;
+}
+
+jvmtiError ReplayJvm::GetErrorName(jvmtiEnv *env, jvmtiError error, char **name) {
+    string value = (boost::format("JVMTI_ERROR_%d") % (int) error).str();
+    *name = copy(&value);
+    return JVMTI_ERROR_NONE;
+}
+
+jvmtiError ReplayJvm::GetJLocationFormat(jvmtiEnv *env, jvmtiJlocationFormat *format) {
+    *format = get().location_format;
+    return JVMTI_ERROR_NONE;
+}
+
+jvmtiError ReplayJvm::GetTag(jvmtiEnv *env, jobject object, jlong *tag) {
+    if (object == nullptr) {
+        return JVMTI_ERROR_INVALID_OBJECT;
+    }
+    *tag = ((Object *) object)->tag;
+    return JVMTI_ERROR_NONE;
+}
+
+jvmtiError ReplayJvm::SetTag(jvmtiEnv *env, jobject object, jlong tag) {
+    if (object == nullptr) {
+        return JVMTI_ERROR_INVALID_OBJECT;
+    }
+    ((Object *) object)->tag = tag;
+    return JVMTI_ERROR_NONE;
+}
+
+jvmtiError ReplayJvm::GetClassSignature(jvmtiEnv *env, jclass type, char **signature, char **generic) {
+    const Object *object = (const Object *) type;
+    if (object == nullptr || object->kind != Kind::CLASS) {
+        return JVMTI_ERROR_INVALID_CLASS;
+    }
+    if (signature != nullptr) {
+        *signature = copy(&object->text);
+    }
+    if (generic != nullptr) {
+        *generic = nullptr;
+    }
+    return JVMTI_ERROR_NONE;
+}
+
+jvmtiError ReplayJvm::GetClassStatus(jvmtiEnv *env, jclass type, jint *status) {
+    *status = JVMTI_CLASS_STATUS_VERIFIED | JVMTI_CLASS_STATUS_PREPARED | JVMTI_CLASS_STATUS_INITIALIZED;
+    return JVMTI_ERROR_NONE;
+}
+
+jvmtiError ReplayJvm::GetMethodName(jvmtiEnv *env, jmethodID method, char **name, char **signature,
+                                    char **generic) {
+    const Method &entry = *(const Method *) method;
+    if (name != nullptr) {
+        *name = copy(entry.name.get());
+    }
+    if (signature != nullptr) {
+        *signature = copy(entry.signature.get());
+    }
+    if (generic != nullptr) {
+        *generic = copy(entry.generic_signature.get());
+    }
+    return (entry.name == nullptr) ? JVMTI_ERROR_INVALID_METHODID : JVMTI_ERROR_NONE;
+}
+
+jvmtiError ReplayJvm::GetMethodDeclaringClass(jvmtiEnv *env, jmethodID method, jclass *type) {
+    const Method &entry = *(const Method *) method;
+    *type = (jclass) entry.type;
+    return (entry.type == nullptr) ? JVMTI_ERROR_INVALID_METHODID : JVMTI_ERROR_NONE;
+}
+
+jvmtiError ReplayJvm::GetLineNumberTable(jvmtiEnv *env, jmethodID method, jint *count,
+                                         jvmtiLineNumberEntry **table) {
+    const Method &entry = *(const Method *) method;
+    /* One entry at least, the agent reads the first one of an empty table */
+    size_t size = max(entry.lines.size(), (size_t) 1) * sizeof(jvmtiLineNumberEntry);
+    Allocate(env, (jlong) size, (unsigned char **) table);
+    memset(*table, 0, size);
+    if (!entry.lines.empty()) {
+        memcpy(*table, entry.lines.data(), entry.lines.size() * sizeof(jvmtiLineNumberEntry));
+    }
+    *count = (jint) entry.lines.size();
+    return entry.lines_error;
+}
+
+jvmtiError ReplayJvm::GetArgumentsSize(jvmtiEnv *env, jmethodID method, jint *size) {
+    const Method &entry = *(const Method *) method;
+    *size = entry.arguments_size;
+    return entry.arguments_error;
+}
+
+jvmtiError ReplayJvm::GetLocalVariableTable(jvmtiEnv *env, jmethodID method, jint *count,
+                                            jvmtiLocalVariableEntry **table) {
+    const Method &entry = *(const Method *) method;
+    *count = 0;
+    *table = nullptr;
+    if (entry.variables_error != JVMTI_ERROR_NONE) {
+        return entry.variables_error;
+    }
+    Allocate(env, (jlong) (entry.variables.size() * sizeof(jvmtiLocalVariableEntry)), (unsigned char **) table);
+    for (size_t i = 0; i < entry.variables.size(); i++) {
+        const LocalVariable &variable = entry.variables[i];
+        jvmtiLocalVariableEntry &result = (*table)[i];
+        result.start_location = 0;
+        result.length = 0;
+        result.name = copy(&variable.name);
+        result.signature = copy(&variable.signature);
+        result.generic_signature = nullptr;
+        result.slot = variable.slot;
+    }
+    *count = (jint) entry.variables.size();
+    return JVMTI_ERROR_NONE;
+}
+
+jvmtiError ReplayJvm::GetFrameCount(jvmtiEnv *env, jthread thread, jint *count) {
+    const Event *event = get().current;
+    *count = (event == nullptr) ? 0 : (jint) event->frames.size();
+    return JVMTI_ERROR_NONE;
+}
+
+jvmtiError ReplayJvm::GetStackTrace(jvmtiEnv *env, jthread thread, jint start_depth, jint max_frame_count,
+                                    jvmtiFrameInfo *frames, jint *count) {
+    *count = 0;
+    for (jint depth = max(start_depth, 0); *count < max_frame_count; depth++) {
+        const Frame *frame = get_frame(depth);
+        if (frame == nullptr) {
+            break;
+        }
+        frames[*count].method = (jmethodID) frame->method;
+        frames[*count].location = frame->location;
+        (*count)++;
+    }
+    return JVMTI_ERROR_NONE;
+}
+
+jvmtiError ReplayJvm::GetLocalInt(jvmtiEnv *env, jthread thread, jint depth, jint slot, jint *value) {
+    const Value *local = nullptr;
+    jvmtiError error = get_value(depth, slot, &local);
+    *value = (error == JVMTI_ERROR_NONE) ? local->value.i : 0;
+    return error;
+}
+
+jvmtiError ReplayJvm::GetLocalLong(jvmtiEnv *env, jthread thread, jint depth, jint slot, jlong *value) {
+    const Value *local = nullptr;
+    jvmtiError error = get_value(depth, slot, &local);
+    *value = (error == JVMTI_ERROR_NONE) ? local->value.j : 0;
+    return error;
+}
+
+jvmtiError ReplayJvm::GetLocalFloat(jvmtiEnv *env, jthread thread, jint depth, jint slot, jfloat *value) {
+    const Value *local = nullptr;
+    jvmtiError error = get_value(depth, slot, &local);
+    *value = (error == JVMTI_ERROR_NONE) ? local->value.f : 0;
+    return error;
+}
+
+jvmtiError ReplayJvm::GetLocalDouble(jvmtiEnv *env, jthread thread, jint depth, jint slot, jdouble *value) {
+    const Value *local = nullptr;
+    jvmtiError error = get_value(depth, slot, &local);
+    *value = (error == JVMTI_ERROR_NONE) ? local->value.d : 0;
+    return error;
+}
+
+jvmtiError ReplayJvm::GetLocalObject(jvmtiEnv *env, jthread thread, jint depth, jint slot, jobject *value) {
+    const Value *local = nullptr;
+    jvmtiError error = get_value(depth, slot, &local);
+    *value = (error == JVMTI_ERROR_NONE) ? local->value.l : nullptr;
+    return error;
+}
+
+jvmtiError ReplayJvm::GetThreadInfo(jvmtiEnv *env, jthread thread, jvmtiThreadInfo *info) {
+    const Object *object = (const Object *) thread;
+    if (object == nullptr || object->kind != Kind::THREAD) {
+        return JVMTI_ERROR_INVALID_THREAD;
+    }
+    const ThreadState &state = *object->thread->state;
+    info->name = (state.name == nullptr) ? nullptr : copy(&state.name->text);
+    info->priority = 5;
+    info->is_daemon = state.daemon ? JNI_TRUE : JNI_FALSE;
+    info->thread_group = (jthreadGroup) state.group;
+    info->context_class_loader = nullptr;
+    return JVMTI_ERROR_NONE;
+}
+
+jvmtiError ReplayJvm::GetThreadGroupInfo(jvmtiEnv *env, jthreadGroup group, jvmtiThreadGroupInfo *info) {
+    const Object *object = (const Object *) group;
+    if (object == nullptr || object->kind != Kind::THREAD_GROUP) {
+        return JVMTI_ERROR_INVALID_THREAD_GROUP;
+    }
+    info->parent = nullptr;
+    info->name = copy(&object->text);
+    info->max_priority = 10;
+    info->is_daemon = JNI_FALSE;
+    return JVMTI_ERROR_NONE;
+}
+
+jvmtiError ReplayJvm::GetThreadLocalStorage(jvmtiEnv *env, jthread thread, void **data) {
+    const Event *event = get().current;
+    Thread *target = (thread != nullptr) ? ((Object *) thread)->thread
+                                         : (event != nullptr) ? event->state->thread : nullptr;
+    if (target == nullptr) {
+        return JVMTI_ERROR_UNATTACHED_THREAD;
+    }
+    *data = target->local_storage;
+    return JVMTI_ERROR_NONE;
+}
+
+jvmtiError ReplayJvm::SetThreadLocalStorage(jvmtiEnv *env, jthread thread, const void *data) {
+    const Event *event = get().current;
+    Thread *target = (thread != nullptr) ? ((Object *) thread)->thread
+                                         : (event != nullptr) ? event->state->thread : nullptr;
+    if (target == nullptr) {
+        return JVMTI_ERROR_UNATTACHED_THREAD;
+    }
+    target->local_storage = const_cast<void *>(data);
+    return JVMTI_ERROR_NONE;
+}
+
+jvmtiError ReplayJvm::GetCurrentThreadCpuTime(jvmtiEnv *env, jlong *nanos) {
+    *nanos = 0;
+    return JVMTI_ERROR_NONE;
+}
+
+/* JNI */
+
+jclass ReplayJvm::FindClass(JNIEnv *env, const char *name) {
+    ReplayJvm &jvm = get();
+    return (jclass) ((strcmp(name, "java/lang/Thread") == 0) ? &jvm.thread_class : &jvm.other_class);
+}
+
+jint ReplayJvm::ThrowNew(JNIEnv *env, jclass type, const char *message) {
+    get().pending_exception = true;
+    return JNI_OK;
+}
+
+jboolean ReplayJvm::ExceptionCheck(JNIEnv *env) {
+    return get().pending_exception ? JNI_TRUE : JNI_FALSE;
+}
+
+void ReplayJvm::ExceptionClear(JNIEnv *env) {
+    get().pending_exception = false;
+}
+
+jobject ReplayJvm::NewGlobalRef(JNIEnv *env, jobject object) {
+    return object;
+}
+
+void ReplayJvm::DeleteRef(JNIEnv *env, jobject object) {
+    // Empty
+}
+
+jboolean ReplayJvm::IsSameObject(JNIEnv *env, jobject object1, jobject object2) {
+    return (object1 == object2) ? JNI_TRUE : JNI_FALSE;
+}
+
+jclass ReplayJvm::GetObjectClass(JNIEnv *env, jobject object) {
+    ReplayJvm &jvm = get();
+    const Object *instance = (const Object *) object;
+    if (instance == nullptr) {
+        return nullptr;
+    }
+    switch (instance->kind) {
+        case Kind::INSTANCE:
+            return (jclass) jvm.classes[instance->class_id];
+        case Kind::THREAD:
+            return (jclass) &jvm.thread_class;
+        default:
+            return (jclass) &jvm.other_class;
+    }
+}
+
+jmethodID ReplayJvm::GetMethodID(JNIEnv *env, jclass type, const char *name, const char *signature) {
+    if (strcmp(name, "toString") == 0) {
+        return (jmethodID) &TO_STRING_METHOD;
+    } else if (strcmp(name, "getMessage") == 0) {
+        return (jmethodID) &GET_MESSAGE_METHOD;
+    }
+    return (jmethodID) &OTHER_METHOD;
+}
+
+jobject ReplayJvm::CallObjectMethodV(JNIEnv *env, jobject object, jmethodID method, va_list args) {
+    const Event *event = get().current;
+    const Object *instance = (const Object *) object;
+    if (instance == nullptr) {
+        return nullptr;
+    }
+    if (method == (jmethodID) &TO_STRING_METHOD) {
+        return (jobject) instance->to_string;
+    }
+    if (method == (jmethodID) &GET_MESSAGE_METHOD && event != nullptr && instance == event->exception) {
+        return (jobject) event->message;
+    }
+    return nullptr;
+}
+
+jfieldID ReplayJvm::GetFieldID(JNIEnv *env, jclass type, const char *name, const char *signature) {
+    ReplayJvm &jvm = get();
+    if (type == (jclass) &jvm.thread_class) {
+        if (strcmp(name, "name") == 0 && strcmp(signature, "Ljava/lang/String;") == 0) {
+            return (jfieldID) &NAME_FIELD;
+        } else if (strcmp(name, "tid") == 0 && strcmp(signature, "J") == 0) {
+            return (jfieldID) &ID_FIELD;
+        }
+    }
+    /* NoSuchFieldError */
+    jvm.pending_exception = true;
+    return nullptr;
+}
+
+jobject ReplayJvm::GetObjectField(JNIEnv *env, jobject object, jfieldID field) {
+    const Object *instance = (const Object *) object;
+    if (instance != nullptr && instance->kind == Kind::THREAD && field == (jfieldID) &NAME_FIELD) {
+        return (jobject) instance->thread->state->name;
+    }
+    return nullptr;
+}
+
+jlong ReplayJvm::GetLongField(JNIEnv *env, jobject object, jfieldID field) {
+    const Object *instance = (const Object *) object;
+    if (instance != nullptr && instance->kind == Kind::THREAD && field == (jfieldID) &ID_FIELD) {
+        return instance->thread->java_id;
+    }
+    return 0;
+}
+
+jsize ReplayJvm::GetStringLength(JNIEnv *env, jstring string) {
+    return (jsize) ((const Object *) string)->text.size();
+}
+
+const char *ReplayJvm::GetStringUTFChars(JNIEnv *env, jstring string, jboolean *is_copy) {
+    if (is_copy != nullptr) {
+        *is_copy = JNI_FALSE;
+    }
+    return ((const Object *) string)->text.c_str();
+}
+
+void ReplayJvm::ReleaseStringUTFChars(JNIEnv *env, jstring string, const char *chars) {
+    // Empty
+}
+
+jsize ReplayJvm::GetArrayLength(JNIEnv *env, jarray array) {
+    return (array == nullptr) ? 0 : (jsize) ((const Object *) array)->elements.size();
+}
+
+jboolean *ReplayJvm::GetBooleanArrayElements(JNIEnv *env, jbooleanArray array, jboolean *is_copy) {
+    if (is_copy != nullptr) {
+        *is_copy = JNI_FALSE;
+    }
+    return (array == nullptr) ? nullptr : ((Object *) array)->elements.data();
+}
+
+void ReplayJvm::ReleaseBooleanArrayElements(JNIEnv *env, jbooleanArray array, jboolean *elements, jint mode) {
+    // Empty
+}
+
+/* The invocation interface */
+
+jint ReplayJvm::GetEnv(JavaVM *vm, void **env, jint version) {
+    ReplayJvm &jvm = get();
+    if ((version & JVMTI_VERSION_MASK_INTERFACE_TYPE) == JVMTI_VERSION_INTERFACE_JVMTI) {
+        *env = &jvm.jvmti;
+    } else {
+        *env = &jvm.jni;
+    }
+    return JNI_OK;
+}
+
+jint ReplayJvm::AttachCurrentThread(JavaVM *vm, void **env, void *args) {
+    *env = &get().jni;
+    return JNI_OK;
+}
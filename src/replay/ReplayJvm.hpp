@@ -0,0 +1,303 @@
+#ifndef JEFF_NATIVE_AGENT_REPLAYJVM_HPP
+#define JEFF_NATIVE_AGENT_REPLAYJVM_HPP
+
+#include <jni.h>
+#include <jvmti.h>
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+//
+// A VM made of a recorded trace (see TraceFormat.hpp): the JavaVM, jvmtiEnv and JNIEnv the agent
+// is loaded with answer from the trace whatever the exception callback asks about the current
+// event - its stack, the methods and their tables, the local values, the thread - so the agent
+// runs its capture and formatting code unchanged.
+//
+// Everything is read up front, answering a call allocates nothing but what JVMTI would allocate
+// (and the agent deallocates), counted on its own. The functions the exception callback does not
+// use abort with their index in the function table. There is one instance, the events are replayed
+// on one thread.
+//
+class ReplayJvm : boost::noncopyable {
+public:
+    // Reads the trace, throws std::runtime_error when it is not a valid one
+    explicit ReplayJvm(const std::string &path);
+
+    ~ReplayJvm();
+
+    JavaVM *get_vm() {
+        return &vm;
+    }
+
+    size_t get_event_count() const {
+        return events.size();
+    }
+
+    // Sends JVMTI_EVENT_VM_START or JVMTI_EVENT_VM_DEATH to the agent
+    void start();
+
+    void stop();
+
+    // Calls the exception callback of the agent with the recorded event
+    void replay(size_t index);
+
+    // Memory allocated by the agent through JVMTI Allocate
+    uint64_t get_jvmti_allocations() const {
+        return jvmti_allocations.load(std::memory_order_relaxed);
+    }
+
+    // Java exceptions the agent threw through JNI, e.g. on a JVMTI error
+    uint64_t get_thrown() const {
+        return thrown;
+    }
+
+private:
+    enum class Kind {
+        CLASS, INSTANCE, STRING, THREAD, THREAD_GROUP
+    };
+
+    struct Thread;
+
+    /* Stands in for every jobject, the class and string ones have their text */
+    struct Object {
+        Kind kind;
+        jint class_id;
+        std::string text;
+        /* The result of toString() */
+        const Object *to_string;
+        std::vector<jboolean> elements;
+        jlong tag;
+        Thread *thread;
+    };
+
+    struct LocalVariable {
+        std::string name;
+        std::string signature;
+        jint slot;
+    };
+
+    /* A jmethodID points to one */
+    struct Method {
+        const Object *type;
+        std::unique_ptr<std::string> name;
+        std::unique_ptr<std::string> signature;
+        std::unique_ptr<std::string> generic_signature;
+        jvmtiError lines_error;
+        std::vector<jvmtiLineNumberEntry> lines;
+        jvmtiError arguments_error;
+        jint arguments_size;
+        jvmtiError variables_error;
+        std::vector<LocalVariable> variables;
+        /* The leading local variables with recorded values */
+        size_t argument_count;
+    };
+
+    /* A thread as of an event, renaming a thread gives it a new state */
+    struct ThreadState {
+        Thread *thread;
+        const Object *name;
+        const Object *group;
+        bool daemon;
+    };
+
+    struct Thread {
+        Object object;
+        jlong java_id;
+        const ThreadState *state;
+        void *local_storage;
+    };
+
+    struct Value {
+        jvmtiError error;
+        jvalue value;
+    };
+
+    struct Frame {
+        Method *method;
+        jlocation location;
+        std::vector<Value> values;
+    };
+
+    struct Event {
+        const ThreadState *state;
+        Method *method;
+        jlocation location;
+        Method *catch_method;
+        jlocation catch_location;
+        Object *exception;
+        const Object *message;
+        std::vector<Frame> frames;
+    };
+
+    struct Monitor {
+        std::recursive_mutex mutex;
+    };
+
+    void read(const std::string &path);
+
+    static ReplayJvm &get();
+
+    static char *copy(const std::string *value);
+
+    static const Frame *get_frame(jint depth);
+
+    static jvmtiError get_value(jint depth, jint slot, const Value **value);
+
+    /* The JVMTI functions */
+
+    static jvmtiError JNICALL GetPotentialCapabilities(jvmtiEnv *env, jvmtiCapabilities *capabilities);
+
+    static jvmtiError JNICALL AddCapabilities(jvmtiEnv *env, const jvmtiCapabilities *capabilities);
+
+    static jvmtiError JNICALL SetEventNotificationMode(jvmtiEnv *env, jvmtiEventMode mode, jvmtiEvent event_type,
+                                                       jthread event_thread, ...);
+
+    static jvmtiError JNICALL SetEventCallbacks(jvmtiEnv *env, const jvmtiEventCallbacks *callbacks, jint size);
+
+    static jvmtiError JNICALL CreateRawMonitor(jvmtiEnv *env, const char *name, jrawMonitorID *monitor);
+
+    static jvmtiError JNICALL RawMonitorEnter(jvmtiEnv *env, jrawMonitorID monitor);
+
+    static jvmtiError JNICALL RawMonitorExit(jvmtiEnv *env, jrawMonitorID monitor);
+
+    static jvmtiError JNICALL Allocate(jvmtiEnv *env, jlong size, unsigned char **memory);
+
+    static jvmtiError JNICALL Deallocate(jvmtiEnv *env, unsigned char *memory);
+
+    static jvmtiError JNICALL GetErrorName(jvmtiEnv *env, jvmtiError error, char **name);
+
+    static jvmtiError JNICALL GetJLocationFormat(jvmtiEnv *env, jvmtiJlocationFormat *format);
+
+    static jvmtiError JNICALL GetTag(jvmtiEnv *env, jobject object, jlong *tag);
+
+    static jvmtiError JNICALL SetTag(jvmtiEnv *env, jobject object, jlong tag);
+
+    static jvmtiError JNICALL GetClassSignature(jvmtiEnv *env, jclass type, char **signature, char **generic);
+
+    static jvmtiError JNICALL GetClassStatus(jvmtiEnv *env, jclass type, jint *status);
+
+    static jvmtiError JNICALL GetMethodName(jvmtiEnv *env, jmethodID method, char **name, char **signature,
+                                            char **generic);
+
+    static jvmtiError JNICALL GetMethodDeclaringClass(jvmtiEnv *env, jmethodID method, jclass *type);
+
+    static jvmtiError JNICALL GetLineNumberTable(jvmtiEnv *env, jmethodID method, jint *count,
+                                                 jvmtiLineNumberEntry **table);
+
+    static jvmtiError JNICALL GetArgumentsSize(jvmtiEnv *env, jmethodID method, jint *size);
+
+    static jvmtiError JNICALL GetLocalVariableTable(jvmtiEnv *env, jmethodID method, jint *count,
+                                                    jvmtiLocalVariableEntry **table);
+
+    static jvmtiError JNICALL GetFrameCount(jvmtiEnv *env, jthread thread, jint *count);
+
+    static jvmtiError JNICALL GetStackTrace(jvmtiEnv *env, jthread thread, jint start_depth, jint max_frame_count,
+                                            jvmtiFrameInfo *frames, jint *count);
+
+    static jvmtiError JNICALL GetLocalInt(jvmtiEnv *env, jthread thread, jint depth, jint slot, jint *value);
+
+    static jvmtiError JNICALL GetLocalLong(jvmtiEnv *env, jthread thread, jint depth, jint slot, jlong *value);
+
+    static jvmtiError JNICALL GetLocalFloat(jvmtiEnv *env, jthread thread, jint depth, jint slot, jfloat *value);
+
+    static jvmtiError JNICALL GetLocalDouble(jvmtiEnv *env, jthread thread, jint depth, jint slot, jdouble *value);
+
+    static jvmtiError JNICALL GetLocalObject(jvmtiEnv *env, jthread thread, jint depth, jint slot, jobject *value);
+
+    static jvmtiError JNICALL GetThreadInfo(jvmtiEnv *env, jthread thread, jvmtiThreadInfo *info);
+
+    static jvmtiError JNICALL GetThreadGroupInfo(jvmtiEnv *env, jthreadGroup group, jvmtiThreadGroupInfo *info);
+
+    static jvmtiError JNICALL GetThreadLocalStorage(jvmtiEnv *env, jthread thread, void **data);
+
+    static jvmtiError JNICALL SetThreadLocalStorage(jvmtiEnv *env, jthread thread, const void *data);
+
+    static jvmtiError JNICALL GetCurrentThreadCpuTime(jvmtiEnv *env, jlong *nanos);
+
+    /* The JNI functions */
+
+    static jclass JNICALL FindClass(JNIEnv *env, const char *name);
+
+    static jint JNICALL ThrowNew(JNIEnv *env, jclass type, const char *message);
+
+    static jboolean JNICALL ExceptionCheck(JNIEnv *env);
+
+    static void JNICALL ExceptionClear(JNIEnv *env);
+
+    static jobject JNICALL NewGlobalRef(JNIEnv *env, jobject object);
+
+    static void JNICALL DeleteRef(JNIEnv *env, jobject object);
+
+    static jboolean JNICALL IsSameObject(JNIEnv *env, jobject object1, jobject object2);
+
+    static jclass JNICALL GetObjectClass(JNIEnv *env, jobject object);
+
+    static jmethodID JNICALL GetMethodID(JNIEnv *env, jclass type, const char *name, const char *signature);
+
+    static jobject JNICALL CallObjectMethodV(JNIEnv *env, jobject object, jmethodID method, va_list args);
+
+    static jfieldID JNICALL GetFieldID(JNIEnv *env, jclass type, const char *name, const char *signature);
+
+    static jobject JNICALL GetObjectField(JNIEnv *env, jobject object, jfieldID field);
+
+    static jlong JNICALL GetLongField(JNIEnv *env, jobject object, jfieldID field);
+
+    static jsize JNICALL GetStringLength(JNIEnv *env, jstring string);
+
+    static const char *JNICALL GetStringUTFChars(JNIEnv *env, jstring string, jboolean *is_copy);
+
+    static void JNICALL ReleaseStringUTFChars(JNIEnv *env, jstring string, const char *chars);
+
+    static jsize JNICALL GetArrayLength(JNIEnv *env, jarray array);
+
+    static jboolean *JNICALL GetBooleanArrayElements(JNIEnv *env, jbooleanArray array, jboolean *is_copy);
+
+    static void JNICALL ReleaseBooleanArrayElements(JNIEnv *env, jbooleanArray array, jboolean *elements, jint mode);
+
+    /* The invocation functions */
+
+    static jint JNICALL GetEnv(JavaVM *vm, void **env, jint version);
+
+    static jint JNICALL AttachCurrentThread(JavaVM *vm, void **env, void *args);
+
+    static ReplayJvm *instance;
+
+    jvmtiInterface_1_ jvmti_functions;
+    JNINativeInterface_ jni_functions;
+    JNIInvokeInterface_ vm_functions;
+    jvmtiEnv jvmti;
+    JNIEnv jni;
+    JavaVM vm;
+
+    jvmtiEventCallbacks callbacks;
+    jvmtiCapabilities capabilities;
+    jvmtiJlocationFormat location_format;
+    std::deque<Monitor> monitors;
+    std::mutex monitors_lock;
+    std::atomic<uint64_t> jvmti_allocations;
+
+    /* The trace, the objects and the methods never move */
+    std::deque<Object> objects;
+    std::deque<Method> methods;
+    std::deque<Thread> threads;
+    std::deque<ThreadState> thread_states;
+    std::vector<Object *> classes;
+    std::vector<Event> events;
+    /* What java/lang/Thread resolves to, and every other class looked up by name */
+    Object thread_class;
+    Object other_class;
+
+    /* The event in the exception callback, and the Java exception it threw, if any */
+    const Event *current;
+    bool pending_exception;
+    uint64_t thrown;
+};
+
+#endif //JEFF_NATIVE_AGENT_REPLAYJVM_HPP
@@ -0,0 +1,191 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <boost/format.hpp>
+
+#include "../GlobalAgentData.hpp"
+#include "ReplayJvm.hpp"
+
+/* Every allocation of the process, of the agent's threads too */
+static std::atomic<uint64_t> allocations(0);
+static std::atomic<uint64_t> allocated_bytes(0);
+
+static void *allocate(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    return malloc(size == 0 ? 1 : size);
+}
+
+// Frees the memory of allocate(). GCC 11+ sees the free() inlined into the operator delete of a new expression
+// and warns of a mismatch, which it is not: the replacement operator new allocates with malloc()
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+static void release(void *memory) {
+    free(memory);
+}
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+void *operator new(size_t size) {
+    void *memory = allocate(size);
+    if (memory == nullptr) {
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+    return allocate(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+    return allocate(size);
+}
+
+void operator delete(void *memory) noexcept {
+    release(memory);
+}
+
+void operator delete[](void *memory) noexcept {
+    release(memory);
+}
+
+void operator delete(void *memory, const std::nothrow_t &) noexcept {
+    release(memory);
+}
+
+void operator delete[](void *memory, const std::nothrow_t &) noexcept {
+    release(memory);
+}
+
+#if defined(__cpp_sized_deallocation)
+void operator delete(void *memory, size_t) noexcept {
+    release(memory);
+}
+
+void operator delete[](void *memory, size_t) noexcept {
+    release(memory);
+}
+#endif
+
+static void usage() {
+    std::cerr << "Usage: jeff-replay --trace file [--options agent-options] [--iterations n] [--warmup n]\n";
+}
+
+/**
+ * Replays a trace recorded by the agent (the record option) through the agent's exception callback,
+ * as fast as it goes, and prints the throughput and the allocations per event, e.g.
+ *
+ *     jeff-replay --trace /tmp/jeff.trace --options log_file=/dev/null,stack_ids=true --iterations 10
+ *
+ * The first (warm-up) iterations fill the caches of the agent and are not measured.
+ */
+int main(int argc, char *argv[]) {
+    std::string trace_path;
+    std::string options = "log_file=/dev/null";
+    uint64_t iterations = 1;
+    uint64_t warmup = 1;
+
+    for (int i = 1; i < argc; i++) {
+        std::string option = argv[i];
+        if (i + 1 >= argc) {
+            usage();
+            return 1;
+        }
+        std::string value = argv[++i];
+        try {
+            if (option == "--trace") {
+                trace_path = value;
+            } else if (option == "--options") {
+                options = value;
+            } else if (option == "--iterations") {
+                iterations = std::max(std::stoull(value), 1ull);
+            } else if (option == "--warmup") {
+                warmup = std::stoull(value);
+            } else {
+                usage();
+                return 1;
+            }
+        } catch (std::exception &e) {
+            std::cerr << boost::format("Invalid value '%s' of option '%s'\n") % value % option;
+            return 1;
+        }
+    }
+    if (trace_path.empty()) {
+        usage();
+        return 1;
+    }
+
+    std::unique_ptr<ReplayJvm> jvm;
+    try {
+        jvm.reset(new ReplayJvm(trace_path));
+    } catch (std::exception &e) {
+        std::cerr << boost::format("Cannot read the trace: %s\n") % e.what();
+        return 1;
+    }
+    size_t event_count = jvm->get_event_count();
+    if (event_count == 0) {
+        std::cerr << "The trace has no events\n";
+        return 1;
+    }
+
+    std::vector<char> agent_options(options.begin(), options.end());
+    agent_options.push_back('\0');
+    if (Agent_OnLoad(jvm->get_vm(), agent_options.data(), nullptr) != JNI_OK) {
+        std::cerr << "The agent failed to load\n";
+        return 1;
+    }
+    jvm->start();
+
+    for (uint64_t iteration = 0; iteration < warmup; iteration++) {
+        for (size_t i = 0; i < event_count; i++) {
+            jvm->replay(i);
+        }
+    }
+
+    uint64_t start_allocations = allocations.load();
+    uint64_t start_bytes = allocated_bytes.load();
+    uint64_t start_jvmti_allocations = jvm->get_jvmti_allocations();
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t iteration = 0; iteration < iterations; iteration++) {
+        for (size_t i = 0; i < event_count; i++) {
+            jvm->replay(i);
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double events = (double) (iterations * event_count);
+    double event_allocations = (allocations.load() - start_allocations) / events;
+    double event_bytes = (allocated_bytes.load() - start_bytes) / events;
+    double event_jvmti_allocations = (jvm->get_jvmti_allocations() - start_jvmti_allocations) / events;
+    std::string statistics = jeff::gdata.sender->get_statistics();
+
+    /* Until everything is written */
+    jvm->stop();
+    double total_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << boost::format("%d events (%d x %d) in %.3f s: %.0f events/s, %.0f events/s with the flush\n")
+                 % (uint64_t) events % iterations % event_count % seconds % (events / std::max(seconds, 1e-9))
+                 % (events / std::max(total_seconds, 1e-9));
+    std::cout << boost::format("%.2f allocations/event (%.0f bytes/event), %.2f JVMTI allocations/event\n")
+                 % event_allocations % event_bytes % event_jvmti_allocations;
+    if (jvm->get_thrown() > 0) {
+        std::cout << boost::format("%d Java exceptions thrown by the agent\n") % jvm->get_thrown();
+    }
+    std::cout << statistics;
+    return 0;
+}
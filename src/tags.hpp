@@ -0,0 +1,38 @@
+#ifndef JEFF_NATIVE_AGENT_TAGS_HPP
+#define JEFF_NATIVE_AGENT_TAGS_HPP
+
+#include <jvmti.h>
+
+/**
+ * Object tags are shared by everything in the agent that uses can_tag_objects,
+ * so the top bits of every tag say who owns it and the rest is owner specific.
+ */
+namespace jeff {
+
+    enum class TagKind : jlong {
+        None = 0,
+        /* java.lang.Class instances, the value is an index into the ClassRegistry */
+        Class = 1,
+        /* Objects picked by the allocation sampler, the value is a sample sequence number */
+        Sample = 2,
+        /* Instances of the tracked classes, the value is encoded by the InstanceTracker */
+        Instance = 3
+    };
+
+    constexpr int TAG_KIND_SHIFT = 60;
+    constexpr jlong TAG_VALUE_MASK = (((jlong) 1) << TAG_KIND_SHIFT) - 1;
+
+    inline jlong make_tag(TagKind kind, jlong value) {
+        return (((jlong) kind) << TAG_KIND_SHIFT) | (value & TAG_VALUE_MASK);
+    }
+
+    inline TagKind get_tag_kind(jlong tag) {
+        return (TagKind) ((tag >> TAG_KIND_SHIFT) & 0xF);
+    }
+
+    inline jlong get_tag_value(jlong tag) {
+        return tag & TAG_VALUE_MASK;
+    }
+}
+
+#endif //JEFF_NATIVE_AGENT_TAGS_HPP
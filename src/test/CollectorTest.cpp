@@ -0,0 +1,135 @@
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <unistd.h>
+
+#include <boost/format.hpp>
+
+#include "../Sender.hpp"
+#include "../daemon/Collector.hpp"
+#include "check.hpp"
+
+/* Records sent over every transport */
+static const size_t RECORDS = 1000;
+
+/* How long the records may take to arrive */
+static const long DELIVERY_TIMEOUT_MS = 5000;
+
+static SenderConfig make_config(const std::string &id) {
+    SenderConfig config;
+    config.buffer_bytes = 16 * 1024 * 1024;
+    config.event_quota_percent = 75;
+    config.spill_bytes = 0;
+    config.overflow_policy = OverflowPolicy::DROP_NEWEST;
+    config.overflow_sample_every = 10;
+    config.overflow_timeout_ms = 100;
+    config.datagram_bytes = 0;
+    config.greeting = "JVM " + id + "\n";
+    return config;
+}
+
+// Records as the agent sends them, the last one is only complete when the connection ends
+static void send_records(Sender &sender) {
+    for (size_t i = 0; i < RECORDS; i++) {
+        if (i % 10 == 0) {
+            sender.send((boost::format("Cought exception: Ljava/io/IOException;, message: %s\n"
+                                               "\tat Test.run(Test.java:%s)\n\n") % i % i).str(),
+                        MessageType::EVENT);
+        } else {
+            sender.send((boost::format("Test: %s\n\tValue: %s\n") % i % i).str(), MessageType::EVENT);
+        }
+    }
+    std::string drained = sender.drain(std::chrono::steady_clock::now()
+                                       + std::chrono::milliseconds(DELIVERY_TIMEOUT_MS));
+    std::cout << drained;
+}
+
+static const JvmAggregate *find(const std::vector<JvmAggregate> &aggregates, const std::string &prefix) {
+    for (const JvmAggregate &aggregate : aggregates) {
+        if (aggregate.id.compare(0, prefix.size(), prefix) == 0) {
+            return &aggregate;
+        }
+    }
+    return nullptr;
+}
+
+static uint64_t get(const std::unordered_map<std::string, uint64_t> &counters, const std::string &key) {
+    auto counter = counters.find(key);
+    return (counter != counters.end()) ? counter->second : 0;
+}
+
+static void check_aggregate(const std::vector<JvmAggregate> &aggregates, const std::string &id) {
+    const JvmAggregate *aggregate = find(aggregates, id);
+    if (aggregate == nullptr) {
+        std::cerr << boost::format("No events of '%s'\n") % id;
+        jeff::test::failures++;
+        return;
+    }
+    CHECK_EQUAL(RECORDS, aggregate->events);
+    CHECK_EQUAL(RECORDS - RECORDS / 10, get(aggregate->kinds, "Test"));
+    CHECK_EQUAL(RECORDS / 10, get(aggregate->exceptions, "Ljava/io/IOException;"));
+    CHECK_EQUAL(0, aggregate->active_connections);
+}
+
+/**
+ * Runs the collector in-process and sends the same records to it over TCP, the AF_UNIX stream and seqpacket
+ * sockets and UDP, every transport as a JVM of its own; all the records are expected to be counted.
+ */
+int main(int argc, char *argv[]) {
+    std::string prefix = (boost::format("/tmp/jeff-test-collector-%s") % getpid()).str();
+    std::string unix_path = prefix + ".sock";
+    std::string unix_packet_path = prefix + ".packet.sock";
+
+    Collector collector("127.0.0.1", 0, 2);
+    collector.set_unix_path(unix_path);
+    collector.set_unix_packet_path(unix_packet_path);
+    collector.set_udp(true);
+    collector.start();
+    std::string port = std::to_string(collector.get_port());
+
+    std::vector<std::unique_ptr<Sender>> senders;
+    senders.push_back(Sender::create("127.0.0.1", port, make_config("1@tcp")));
+    senders.push_back(Sender::create(SocketTransport::UNIX_STREAM, unix_path, "", make_config("2@unix")));
+    senders.push_back(Sender::create(SocketTransport::UNIX_SEQPACKET, unix_packet_path, "",
+                                     make_config("3@unixpacket")));
+    senders.push_back(Sender::create(SocketTransport::UDP, "127.0.0.1", port, make_config("")));
+
+    std::vector<std::thread> threads;
+    for (auto &sender : senders) {
+        sender->start();
+        Sender *target = sender.get();
+        threads.push_back(std::thread([target]() { send_records(*target); }));
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    senders.clear();
+
+    /* The last records are complete when the connections end */
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(DELIVERY_TIMEOUT_MS);
+    while (collector.get_events() < 4 * RECORDS && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    collector.stop();
+    std::cout << collector.report(10);
+
+    std::vector<JvmAggregate> aggregates = collector.get_aggregates();
+    CHECK_EQUAL(4, aggregates.size());
+    check_aggregate(aggregates, "1@tcp");
+    check_aggregate(aggregates, "2@unix");
+    check_aggregate(aggregates, "3@unixpacket");
+    /* Without a greeting, by the address of the sender */
+    check_aggregate(aggregates, "127.0.0.1:");
+
+    /* The socket files are removed on the stop */
+    CHECK(access(unix_path.c_str(), F_OK) != 0);
+    CHECK(access(unix_packet_path.c_str(), F_OK) != 0);
+
+    return jeff::test::finish();
+}
@@ -0,0 +1,479 @@
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include <boost/format.hpp>
+
+#include "../daemon/EventDecoder.hpp"
+#include "../daemon/EventStore.hpp"
+#include "../daemon/StoreQuery.hpp"
+#include "../daemon/StoreReader.hpp"
+#include "check.hpp"
+
+using namespace jeff;
+
+static const int64_t FIRST_MS = 472222 * store::PARTITION_MS;
+static const int64_t LAST_MS = std::numeric_limits<int64_t>::max();
+
+static std::string make_directory(const std::string &name) {
+    return (boost::format("/tmp/jeff-test-store-%s-%s") % getpid() % name).str();
+}
+
+static void remove_store(const std::string &directory) {
+    for (const std::string &path : list_partitions(directory, 0, LAST_MS)) {
+        std::remove(path.c_str());
+    }
+    std::remove(store::get_dictionary_path(directory).c_str());
+    rmdir(directory.c_str());
+}
+
+// The rows of all the partitions, in the order of the files and the blocks
+static std::vector<StoredEvent> read_rows(const std::string &directory) {
+    std::vector<StoredEvent> rows;
+    for (const std::string &path : list_partitions(directory, 0, LAST_MS)) {
+        StoredPartition partition(path);
+        for (const StoredBlock &block : partition.get_blocks()) {
+            for (uint32_t row = 0; row < block.header->rows; row++) {
+                StoredEvent event = {block.timestamps[row], block.jvms[row], block.fingerprints[row],
+                                     block.threads[row], block.stacks[row]};
+                rows.push_back(event);
+            }
+        }
+    }
+    return rows;
+}
+
+static Query make_query() {
+    Query query = Query();
+    query.from_ms = 0;
+    query.to_ms = LAST_MS;
+    query.group_by = GroupBy::FINGERPRINT;
+    query.top = 1000;
+    query.threads = 2;
+    query.vectorized = false;
+    return query;
+}
+
+static uint64_t get_count(const QueryResult &result, const std::string &group) {
+    for (auto &entry : result.groups) {
+        if (entry.first == group) {
+            return entry.second;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Rows written in blocks come back column by column, the dictionary ids survive a restart and a torn end of
+ * a partition or of the dictionary is ignored.
+ */
+static void test_round_trip() {
+    std::string directory = make_directory("round-trip");
+    std::vector<StoredEvent> written;
+    uint32_t fingerprints[3];
+    uint32_t main_thread;
+    {
+        EventStore store(directory, 1000);
+        uint32_t jvms[2] = {store.intern("1@host-a"), store.intern("2@host-b")};
+        fingerprints[0] = store.intern("GC");
+        fingerprints[1] = store.intern("Cought exception Ljava/io/IOException;");
+        fingerprints[2] = store.intern("Uncought exception Ljava/lang/NullPointerException;");
+        main_thread = store.intern("main");
+        uint32_t pool_thread = store.intern("pool-1-thread-1");
+
+        std::vector<StoredEvent> batch;
+        for (uint32_t i = 0; i < 2500; i++) {
+            StoredEvent event = {FIRST_MS + i, jvms[i % 2], fingerprints[i % 3],
+                                 (i % 5 == 0) ? 0 : (i % 2 == 0 ? main_thread : pool_thread), i};
+            batch.push_back(event);
+            written.push_back(event);
+            if (batch.size() == 100) {
+                store.append(batch);
+                batch.clear();
+            }
+        }
+    }
+
+    std::vector<StoredEvent> read = read_rows(directory);
+    CHECK_EQUAL(written.size(), read.size());
+    for (size_t i = 0; i < std::min(written.size(), read.size()); i++) {
+        if (read[i].timestamp != written[i].timestamp || read[i].jvm != written[i].jvm
+            || read[i].fingerprint != written[i].fingerprint || read[i].thread != written[i].thread
+            || read[i].stack != written[i].stack) {
+            CHECK_EQUAL(i, read.size());
+            break;
+        }
+    }
+
+    std::vector<std::string> paths = list_partitions(directory, FIRST_MS, FIRST_MS + store::PARTITION_MS - 1);
+    CHECK_EQUAL(1, paths.size());
+    CHECK_EQUAL(0, list_partitions(directory, FIRST_MS + store::PARTITION_MS, LAST_MS).size());
+    if (paths.size() != 1) {
+        return;
+    }
+    {
+        StoredPartition partition(paths[0]);
+        CHECK_EQUAL(3, partition.get_blocks().size());
+        CHECK_EQUAL(2500, partition.get_rows());
+    }
+
+    {
+        StringDictionary dictionary(directory);
+        CHECK_EQUAL(7, dictionary.size());
+        CHECK_EQUAL("GC", dictionary.get(fingerprints[0]));
+        CHECK_EQUAL(main_thread, dictionary.find("main"));
+        CHECK_EQUAL(0, dictionary.find("missing"));
+    }
+    {
+        /* A new writer keeps the ids and starts a partition file of its own */
+        EventStore store(directory, 1000);
+        CHECK_EQUAL(fingerprints[1], store.intern("Cought exception Ljava/io/IOException;"));
+        CHECK_EQUAL(8, store.intern("Thread started"));
+    }
+
+    /* A torn last block: the complete ones are read */
+    if (truncate(paths[0].c_str(), store::get_block_bytes(1000) * 2 + store::get_block_bytes(500) - 100) == 0) {
+        StoredPartition partition(paths[0]);
+        CHECK_EQUAL(2, partition.get_blocks().size());
+        CHECK_EQUAL(2000, partition.get_rows());
+    }
+    /* Whatever follows a block that is not one is ignored */
+    CHECK_EQUAL(0, truncate(paths[0].c_str(), store::get_block_bytes(1000) * 2));
+    {
+        std::ofstream output(paths[0].c_str(), std::ios::out | std::ios::binary | std::ios::app);
+        output << std::string(sizeof(store::BlockHeader) + 64, 'x');
+    }
+    {
+        StoredPartition partition(paths[0]);
+        CHECK_EQUAL(2, partition.get_blocks().size());
+        CHECK_EQUAL(2000, partition.get_rows());
+    }
+
+    /* A cut dictionary record is not read, and it is cut off by the next writer */
+    {
+        std::ofstream output(store::get_dictionary_path(directory).c_str(),
+                             std::ios::out | std::ios::binary | std::ios::app);
+        uint32_t length = 100;
+        output.write(reinterpret_cast<const char *>(&length), sizeof(length));
+        output << "cut";
+    }
+    CHECK_EQUAL(8, StringDictionary(directory).size());
+    {
+        EventStore store(directory, 1000);
+        CHECK_EQUAL(9, store.intern("Monitor contended"));
+    }
+    {
+        StringDictionary dictionary(directory);
+        CHECK_EQUAL(9, dictionary.size());
+        CHECK_EQUAL("Monitor contended", dictionary.get(9));
+    }
+    remove_store(directory);
+}
+
+/**
+ * The blocks that can not match are skipped by the time, JVM and fingerprint ranges of their headers and by
+ * the bloom filter of their fingerprints.
+ */
+static void test_block_skipping() {
+    std::string directory = make_directory("skipping");
+    uint32_t gc;
+    uint32_t monitor;
+    {
+        EventStore store(directory, 1000);
+        uint32_t jvm_a = store.intern("1@host-a");
+        uint32_t jvm_b = store.intern("2@host-b");
+        gc = store.intern("GC");
+        uint32_t exception = store.intern("Cought exception Ljava/io/IOException;");
+        monitor = store.intern("Monitor contended");
+        uint32_t thread_started = store.intern("Thread started");
+
+        /* Block k has the timestamps from FIRST_MS + k * 1000, the last one has GC and Thread started only */
+        uint32_t block_fingerprints[3] = {gc, exception, monitor};
+        std::vector<StoredEvent> rows;
+        for (uint32_t k = 0; k < 4; k++) {
+            for (uint32_t i = 0; i < 1000; i++) {
+                uint32_t fingerprint = (k < 3) ? block_fingerprints[k] : (i % 2 == 0 ? gc : thread_started);
+                StoredEvent event = {FIRST_MS + k * 1000 + i, (k < 2) ? jvm_a : jvm_b, fingerprint, 0, 0};
+                rows.push_back(event);
+            }
+        }
+        store.append(rows);
+    }
+
+    Query query = make_query();
+    query.fingerprint = "Monitor";
+    QueryResult result = StoreQuery(directory, query).run();
+    CHECK_EQUAL(1000, result.matched_rows);
+    CHECK_EQUAL(1, result.scanned_blocks);
+    CHECK_EQUAL(3, result.skipped_blocks);
+
+    /* The last block has the fingerprint in its range, only the bloom filter rules it out */
+    std::vector<std::string> paths = list_partitions(directory, 0, LAST_MS);
+    CHECK_EQUAL(1, paths.size());
+    if (paths.size() == 1) {
+        StoredPartition partition(paths[0]);
+        CHECK_EQUAL(4, partition.get_blocks().size());
+        if (partition.get_blocks().size() == 4) {
+            const store::BlockHeader &last = *partition.get_blocks()[3].header;
+            CHECK(last.min_fingerprint <= monitor && monitor <= last.max_fingerprint);
+            CHECK(!store::may_contain(last, monitor));
+            CHECK(store::may_contain(last, gc));
+        }
+    }
+
+    query = make_query();
+    query.fingerprint = "GC";
+    result = StoreQuery(directory, query).run();
+    CHECK_EQUAL(1500, result.matched_rows);
+    CHECK_EQUAL(2, result.scanned_blocks);
+    CHECK_EQUAL(2, result.skipped_blocks);
+
+    query = make_query();
+    query.from_ms = FIRST_MS + 1000;
+    query.to_ms = FIRST_MS + 1999;
+    result = StoreQuery(directory, query).run();
+    CHECK_EQUAL(1000, result.matched_rows);
+    CHECK_EQUAL(1, result.scanned_blocks);
+    CHECK_EQUAL(3, result.skipped_blocks);
+
+    /* Half of a block */
+    query.from_ms = FIRST_MS + 1500;
+    result = StoreQuery(directory, query).run();
+    CHECK_EQUAL(500, result.matched_rows);
+
+    query = make_query();
+    query.jvm = "host-b";
+    query.group_by = GroupBy::HOST;
+    result = StoreQuery(directory, query).run();
+    CHECK_EQUAL(2000, result.matched_rows);
+    CHECK_EQUAL(2, result.skipped_blocks);
+    CHECK_EQUAL(2000, get_count(result, "host-b"));
+
+    query.jvm = "no such JVM";
+    result = StoreQuery(directory, query).run();
+    CHECK_EQUAL(0, result.matched_rows);
+    remove_store(directory);
+}
+
+/**
+ * The AVX2 scan counts what the scalar one does, for every grouping and filter, with blocks whose row counts
+ * are not multiples of 8; the scalar one counts what a plain loop over the rows does.
+ */
+static void test_scan_parity() {
+    std::string directory = make_directory("parity");
+    std::vector<StoredEvent> written;
+    std::vector<std::string> fingerprint_names = {"GC", "Cought exception Ljava/io/IOException;",
+                                                  "Uncought exception Ljava/lang/IllegalStateException;",
+                                                  "Cought exception Ljava/lang/InterruptedException;",
+                                                  "Monitor contended", "Thread started", "Thread ended",
+                                                  "Class loaded", "Compiled method", "VM Died"};
+    std::vector<uint32_t> fingerprints;
+    {
+        EventStore store(directory, 1003);
+        std::vector<uint32_t> jvms;
+        for (int i = 0; i < 12; i++) {
+            jvms.push_back(store.intern((boost::format("%s@host-%s") % (1000 + i) % (i % 3)).str()));
+        }
+        for (const std::string &name : fingerprint_names) {
+            fingerprints.push_back(store.intern(name));
+        }
+        std::vector<uint32_t> threads = {0, store.intern("main"), store.intern("pool-1-thread-1"),
+                                         store.intern("pool-1-thread-2"), store.intern("worker#3")};
+
+        std::minstd_rand random(42);
+        for (uint32_t i = 0; i < 10007; i++) {
+            /* Two partitions, the second one starts at the row 6000 */
+            int64_t timestamp = FIRST_MS + (i < 6000 ? i : store::PARTITION_MS + i);
+            StoredEvent event = {timestamp, jvms[random() % jvms.size()],
+                                 fingerprints[random() % fingerprints.size()], threads[random() % threads.size()],
+                                 (uint32_t) (random() % 100)};
+            written.push_back(event);
+        }
+        store.append(written);
+    }
+
+    Query query = make_query();
+    QueryResult result = StoreQuery(directory, query).run();
+    CHECK_EQUAL(written.size(), result.matched_rows);
+    CHECK_EQUAL(2, result.partitions);
+    for (size_t i = 0; i < fingerprints.size(); i++) {
+        uint64_t expected = 0;
+        for (const StoredEvent &event : written) {
+            expected += (event.fingerprint == fingerprints[i]) ? 1 : 0;
+        }
+        CHECK_EQUAL(expected, get_count(result, fingerprint_names[i]));
+    }
+
+    if (!StoreQuery::has_avx2()) {
+        std::cout << "No AVX2, the vectorized scan is the scalar one\n";
+    }
+    GroupBy groupings[] = {GroupBy::FINGERPRINT, GroupBy::CLASS, GroupBy::JVM, GroupBy::HOST, GroupBy::THREAD,
+                           GroupBy::POOL};
+    const char *jvm_filters[] = {"", "host-1", "1003@"};
+    const char *fingerprint_filters[] = {"", "exception", "GC", "Thread", "Ljava/lang/"};
+    std::pair<int64_t, int64_t> ranges[] = {{0, LAST_MS}, {FIRST_MS + 13, FIRST_MS + 4099},
+                                            {FIRST_MS + 5990, FIRST_MS + store::PARTITION_MS + 6100}};
+    for (GroupBy group_by : groupings) {
+        for (const char *jvm : jvm_filters) {
+            for (const char *fingerprint : fingerprint_filters) {
+                for (auto &range : ranges) {
+                    query = make_query();
+                    query.group_by = group_by;
+                    query.jvm = jvm;
+                    query.fingerprint = fingerprint;
+                    query.from_ms = range.first;
+                    query.to_ms = range.second;
+                    QueryResult scalar = StoreQuery(directory, query).run();
+                    query.vectorized = true;
+                    QueryResult vectorized = StoreQuery(directory, query).run();
+
+                    CHECK_EQUAL(scalar.matched_rows, vectorized.matched_rows);
+                    CHECK_EQUAL(scalar.skipped_blocks, vectorized.skipped_blocks);
+                    CHECK_EQUAL(scalar.groups.size(), vectorized.groups.size());
+                    for (size_t i = 0; i < std::min(scalar.groups.size(), vectorized.groups.size()); i++) {
+                        CHECK_EQUAL(scalar.groups[i].first, vectorized.groups[i].first);
+                        CHECK_EQUAL(scalar.groups[i].second, vectorized.groups[i].second);
+                    }
+                }
+            }
+        }
+    }
+    remove_store(directory);
+}
+
+// A stream of an agent: a clock, records with their bodies, a heartbeat, CRLF lines and a last line without its newline
+static const std::string STREAM =
+        "Clock: tsc, monotonic 1000000000 at 1700000000000000000\n"
+                "GC: young\n\tTime: 2000000000\n\tThread: 7 main\n\n"
+                "Cought exception: Ljava/io/IOException;, message: x\n\tTime: 3000000000\n"
+                "\tThread: 8 pool-1-thread-1\n\tStack: 42\n\tat A.b(A.java:1)\n\n"
+                "\n"
+                "Uncought exception: Ljava/lang/NullPointerException;, message: y\r\n\tTime: 4000000000\r\n"
+                "\tStack: 7\r\n"
+                "VM Died (JVMTI_EVENT_VM_DEATH)\n\tTime: 5000000000";
+
+static void decode_chunks(EventDecoder &decoder, JvmAggregate &aggregate, const std::vector<size_t> &splits) {
+    size_t begin = 0;
+    for (size_t split : splits) {
+        decoder.decode(STREAM.data() + begin, split - begin, aggregate);
+        begin = split;
+    }
+    decoder.decode(STREAM.data() + begin, STREAM.size() - begin, aggregate);
+    decoder.finish(aggregate);
+}
+
+static void check_same(const JvmAggregate &expected, const JvmAggregate &actual) {
+    CHECK_EQUAL(expected.bytes, actual.bytes);
+    CHECK_EQUAL(expected.events, actual.events);
+    CHECK_EQUAL(expected.lines, actual.lines);
+    CHECK(expected.kinds == actual.kinds);
+    CHECK(expected.exceptions == actual.exceptions);
+}
+
+/**
+ * A stream decodes to the same records and rows however it is cut into chunks: split at every byte, and a
+ * byte at a time. The last record is stored when the stream ends.
+ */
+static void test_decoder_chunks() {
+    std::string directory = make_directory("decoder");
+    std::vector<uint32_t> jvms;
+    JvmAggregate whole("whole");
+    {
+        EventStore store(directory, 1000);
+        EventDecoder decoder;
+        jvms.push_back(store.intern("whole"));
+        decoder.set_store(&store, jvms.back());
+        decode_chunks(decoder, whole, {});
+
+        for (size_t split = 1; split < STREAM.size(); split++) {
+            EventDecoder split_decoder;
+            jvms.push_back(store.intern((boost::format("split-%s") % split).str()));
+            split_decoder.set_store(&store, jvms.back());
+            JvmAggregate aggregate;
+            decode_chunks(split_decoder, aggregate, {split});
+            check_same(whole, aggregate);
+        }
+
+        EventDecoder byte_decoder;
+        jvms.push_back(store.intern("bytes"));
+        byte_decoder.set_store(&store, jvms.back());
+        std::vector<size_t> splits;
+        for (size_t split = 1; split < STREAM.size(); split++) {
+            splits.push_back(split);
+        }
+        JvmAggregate bytes;
+        decode_chunks(byte_decoder, bytes, splits);
+        check_same(whole, bytes);
+    }
+
+    CHECK_EQUAL(5, whole.events);
+    CHECK_EQUAL(1, whole.kinds["GC"]);
+    CHECK_EQUAL(1, whole.kinds["VM Died (JVMTI_EVENT_VM_DEATH)"]);
+    CHECK_EQUAL(1, whole.exceptions["Ljava/io/IOException;"]);
+    CHECK_EQUAL(1, whole.exceptions["Ljava/lang/NullPointerException;"]);
+
+    /*
+     * The rows of every JVM in the order they were appended. The Clock record has no time of the agent, it is
+     * stamped with the time it was received and lands in a partition of its own, it is only counted.
+     */
+    StringDictionary dictionary(directory);
+    uint32_t clock = dictionary.find("Clock");
+    std::vector<std::vector<StoredEvent>> rows(jvms.back() + 1);
+    std::vector<uint64_t> clocks(jvms.back() + 1);
+    for (const StoredEvent &event : read_rows(directory)) {
+        if (event.jvm >= rows.size()) {
+            continue;
+        }
+        if (event.fingerprint == clock) {
+            clocks[event.jvm]++;
+        } else {
+            rows[event.jvm].push_back(event);
+        }
+    }
+    const std::vector<StoredEvent> &expected = rows[jvms[0]];
+    CHECK_EQUAL(4, expected.size());
+    if (expected.size() == 4) {
+        CHECK_EQUAL("GC", dictionary.get(expected[0].fingerprint));
+        CHECK_EQUAL("main", dictionary.get(expected[0].thread));
+        /* The agent clock converted with the Clock record */
+        CHECK_EQUAL(1700000001000, expected[0].timestamp);
+        CHECK_EQUAL("Cought exception Ljava/io/IOException;", dictionary.get(expected[1].fingerprint));
+        CHECK_EQUAL("pool-1-thread-1", dictionary.get(expected[1].thread));
+        CHECK_EQUAL(42, expected[1].stack);
+        CHECK_EQUAL("Uncought exception Ljava/lang/NullPointerException;", dictionary.get(expected[2].fingerprint));
+        CHECK_EQUAL(7, expected[2].stack);
+        CHECK_EQUAL(1700000003000, expected[2].timestamp);
+        CHECK_EQUAL("VM Died (JVMTI_EVENT_VM_DEATH)", dictionary.get(expected[3].fingerprint));
+        CHECK_EQUAL(1700000004000, expected[3].timestamp);
+    }
+    for (size_t i = 0; i < jvms.size(); i++) {
+        const std::vector<StoredEvent> &actual = rows[jvms[i]];
+        CHECK_EQUAL(1, clocks[jvms[i]]);
+        CHECK_EQUAL(expected.size(), actual.size());
+        for (size_t row = 0; row < std::min(expected.size(), actual.size()); row++) {
+            CHECK_EQUAL(expected[row].timestamp, actual[row].timestamp);
+            CHECK_EQUAL(expected[row].fingerprint, actual[row].fingerprint);
+            CHECK_EQUAL(expected[row].thread, actual[row].thread);
+            CHECK_EQUAL(expected[row].stack, actual[row].stack);
+        }
+    }
+    remove_store(directory);
+}
+
+/**
+ * The store, its reader and the query of the daemon, and the decoder of the agent streams.
+ */
+int main(int argc, char *argv[]) {
+    test_round_trip();
+    test_block_skipping();
+    test_scan_parity();
+    test_decoder_chunks();
+    return jeff::test::finish();
+}
@@ -0,0 +1,53 @@
+#ifndef JEFF_NATIVE_AGENT_CHECK_HPP
+#define JEFF_NATIVE_AGENT_CHECK_HPP
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+#include <boost/format.hpp>
+
+//
+// The checks of the test executables, a failed one is printed and counted and the test
+// goes on; main() returns the result of finish().
+//
+namespace jeff {
+namespace test {
+
+    static int failures = 0;
+
+    inline void check(bool condition, const char *expression, int line) {
+        if (!condition) {
+            std::cerr << boost::format("Line %s: %s is false\n") % line % expression;
+            failures++;
+        }
+    }
+
+    inline void check_equal(uint64_t expected, uint64_t actual, const char *expression, int line) {
+        if (expected != actual) {
+            std::cerr << boost::format("Line %s: %s is %s, expected %s\n") % line % expression % actual % expected;
+            failures++;
+        }
+    }
+
+    inline void check_equal(const std::string &expected, const std::string &actual, const char *expression,
+                            int line) {
+        if (expected != actual) {
+            std::cerr << boost::format("Line %s: %s is '%s', expected '%s'\n") % line % expression % actual
+                         % expected;
+            failures++;
+        }
+    }
+
+    inline int finish() {
+        std::cout << (failures == 0 ? "Passed\n" : (boost::format("Failed %s checks\n") % failures).str());
+        return failures == 0 ? 0 : 1;
+    }
+}
+}
+
+#define CHECK(condition) jeff::test::check((condition), #condition, __LINE__)
+
+#define CHECK_EQUAL(expected, actual) jeff::test::check_equal((expected), (actual), #actual, __LINE__)
+
+#endif //JEFF_NATIVE_AGENT_CHECK_HPP